@@ -160,9 +160,8 @@ buf_align_test_draw(struct buf_align_test *test)
     vk->CmdSetEvent(cmd1, test->gpu_done->event, VK_PIPELINE_STAGE_TRANSFER_BIT);
     vk->CmdWaitEvents(cmd1, 1, &test->cpu_done->event, VK_PIPELINE_STAGE_TRANSFER_BIT,
                       VK_PIPELINE_STAGE_HOST_BIT, 0, NULL, 1, &barrier, 0, NULL);
-    vk_end_cmd(vk);
-    while (vk->GetEventStatus(vk->dev, test->gpu_done->event) != VK_EVENT_SET)
-        vk_sleep(1);
+    const uint64_t point1 = vk_end_cmd(vk);
+    vk_wait_event(vk, test->gpu_done);
 
     vk_log("disturb: after CmdFillBuffer but before VkBufferMemoryBarrier");
     vk_log("disturb = %u", *test->disturb_ptr);
@@ -179,7 +178,7 @@ buf_align_test_draw(struct buf_align_test *test)
 
     /* step 4: execute the gpu barrier to flush the gpu cache for disturb */
     vk->SetEvent(vk->dev, test->cpu_done->event);
-    vk_wait(vk);
+    vk_wait_point(vk, point1);
 
     vk_log("disturb: after VkBufferMemoryBarrier");
     vk_log("disturb = %u", *test->disturb_ptr);
@@ -214,8 +213,8 @@ buf_align_test_draw(struct buf_align_test *test)
     };
     vk->CmdPipelineBarrier(cmd2, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0,
                            NULL, 1, &dst_buf_barrier, 0, NULL);
-    vk_end_cmd(vk);
-    vk_wait(vk);
+    const uint64_t point2 = vk_end_cmd(vk);
+    vk_wait_point(vk, point2);
 
     /* step 6: check dst_buf blit result */
     vk_log("dst_buf: after vkCmdCopyBuffer");
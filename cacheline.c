@@ -89,10 +89,9 @@ cacheline_test_draw(struct cacheline_test *test)
                       VK_PIPELINE_STAGE_HOST_BIT, 0, NULL, 1, &barrier, 0, NULL);
 
     /* step 2: submit */
-    vk_end_cmd(vk);
+    const uint64_t point = vk_end_cmd(vk);
     /* step 2: wait */
-    while (vk->GetEventStatus(vk->dev, test->gpu_done->event) != VK_EVENT_SET)
-        vk_sleep(1);
+    vk_wait_event(vk, test->gpu_done);
 
     vk_log("after CmdFillBuffer but before VkBufferMemoryBarrier");
     for (uint32_t i = 0; i < 4; i++)
@@ -109,7 +108,7 @@ cacheline_test_draw(struct cacheline_test *test)
 
     /* step 4: execute the gpu barrier to flush the gpu cache */
     vk->SetEvent(vk->dev, test->cpu_done->event);
-    vk_wait(vk);
+    vk_wait_point(vk, point);
 
     vk_log("after VkBufferMemoryBarrier");
     for (uint32_t i = 0; i < 4; i++)
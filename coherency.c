@@ -0,0 +1,343 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test finds the smallest safe alignment for densely packed buffers.
+ *
+ * It generalizes cacheline and buf_align.  For each host-visible memory
+ * type, buffer size, alignment, and base offset, a disturb buffer and a
+ * victim buffer are suballocated back to back, with the victim at the next
+ * aligned offset after the disturb.  Then
+ *
+ *   1. the gpu fills the disturb buffer
+ *   2. the cpu writes a pattern to the victim buffer
+ *   3. the gpu flushes its cache for the disturb buffer
+ *   4. the gpu copies both buffers to a separate buffer
+ *
+ * and the copies are checked.  When the gpu flush writes back a stale line
+ * that covers the victim, the host write is lost.  Each case is repeated
+ * because losing a write is timing-dependent.
+ */
+
+#include "vkutil.h"
+
+#define COHERENCY_TEST_MEM_SIZE 8192
+#define COHERENCY_TEST_MAX_SIZE 256
+
+struct coherency_test {
+    uint32_t repeat;
+
+    struct vk vk;
+    struct vk_buffer *check;
+    struct vk_event *gpu_done;
+    struct vk_event *cpu_done;
+
+    VkDeviceMemory mem;
+    uint8_t *mem_ptr;
+    bool mem_coherent;
+};
+
+static const VkDeviceSize coherency_test_sizes[] = { 4, 16, 64, 256 };
+static const VkDeviceSize coherency_test_alignments[] = { 4, 8, 16, 32, 64, 128, 256 };
+static const VkDeviceSize coherency_test_offsets[] = { 0, 256, 4096 - 256 };
+
+static VkDeviceSize
+coherency_test_align(VkDeviceSize offset, VkDeviceSize align)
+{
+    return (offset + align - 1) & ~(align - 1);
+}
+
+static void
+coherency_test_init(struct coherency_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_init(vk, NULL);
+
+    test->check = vk_create_buffer(vk, COHERENCY_TEST_MAX_SIZE * 2,
+                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    test->gpu_done = vk_create_event(vk);
+    test->cpu_done = vk_create_event(vk);
+}
+
+static void
+coherency_test_cleanup(struct coherency_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_destroy_event(vk, test->cpu_done);
+    vk_destroy_event(vk, test->gpu_done);
+    vk_destroy_buffer(vk, test->check);
+
+    vk_cleanup(vk);
+}
+
+static void
+coherency_test_flush(struct coherency_test *test, VkDeviceSize offset, VkDeviceSize size)
+{
+    struct vk *vk = &test->vk;
+
+    if (test->mem_coherent)
+        return;
+
+    /* the range must be aligned to nonCoherentAtomSize */
+    const VkDeviceSize atom = vk->props.properties.limits.nonCoherentAtomSize;
+    const VkDeviceSize begin = offset & ~(atom - 1);
+    VkDeviceSize end = coherency_test_align(offset + size, atom);
+    if (end > COHERENCY_TEST_MEM_SIZE)
+        end = COHERENCY_TEST_MEM_SIZE;
+
+    const VkMappedMemoryRange range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = test->mem,
+        .offset = begin,
+        .size = end - begin,
+    };
+    vk->result = vk->FlushMappedMemoryRanges(vk->dev, 1, &range);
+    vk_check(vk, "failed to flush memory");
+}
+
+static VkBuffer
+coherency_test_create_buffer(struct coherency_test *test,
+                             VkDeviceSize size,
+                             VkMemoryRequirements *reqs)
+{
+    struct vk *vk = &test->vk;
+
+    const VkBufferCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    };
+
+    VkBuffer buf;
+    vk->result = vk->CreateBuffer(vk->dev, &info, NULL, &buf);
+    vk_check(vk, "failed to create buffer");
+
+    vk->GetBufferMemoryRequirements(vk->dev, buf, reqs);
+
+    return buf;
+}
+
+/* Returns true when neither the gpu write nor the host write is lost. */
+static bool
+coherency_test_run_case(struct coherency_test *test,
+                        VkBuffer disturb,
+                        VkBuffer victim,
+                        VkDeviceSize victim_offset,
+                        VkDeviceSize size)
+{
+    struct vk *vk = &test->vk;
+    const uint8_t gpu_val = 0x01;
+    const uint8_t cpu_val = 0xa5;
+
+    vk->ResetEvent(vk->dev, test->gpu_done->event);
+    vk->ResetEvent(vk->dev, test->cpu_done->event);
+
+    memset(test->mem_ptr, 0, COHERENCY_TEST_MEM_SIZE);
+    coherency_test_flush(test, 0, COHERENCY_TEST_MEM_SIZE);
+    memset(test->check->mem_ptr, 0, test->check->mem_size);
+
+    /* step 1 and 3 */
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+    const VkBufferMemoryBarrier disturb_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .buffer = disturb,
+        .size = VK_WHOLE_SIZE,
+    };
+    vk->CmdFillBuffer(cmd, disturb, 0, VK_WHOLE_SIZE, gpu_val * 0x01010101u);
+    vk->CmdSetEvent(cmd, test->gpu_done->event, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    vk->CmdWaitEvents(cmd, 1, &test->cpu_done->event,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+                      VK_PIPELINE_STAGE_HOST_BIT, 0, NULL, 1, &disturb_barrier, 0, NULL);
+    uint64_t point = vk_end_cmd(vk);
+    vk_wait_event(vk, test->gpu_done);
+
+    /* step 2 */
+    memset(test->mem_ptr + victim_offset, cpu_val, size);
+    coherency_test_flush(test, victim_offset, size);
+
+    vk->SetEvent(vk->dev, test->cpu_done->event);
+    vk_wait_point(vk, point);
+
+    /* step 4 */
+    cmd = vk_begin_cmd(vk);
+    const VkMemoryBarrier host_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+                           &host_barrier, 0, NULL, 0, NULL);
+    const VkBufferCopy disturb_copy = {
+        .size = size,
+    };
+    const VkBufferCopy victim_copy = {
+        .dstOffset = size,
+        .size = size,
+    };
+    vk->CmdCopyBuffer(cmd, disturb, test->check->buf, 1, &disturb_copy);
+    vk->CmdCopyBuffer(cmd, victim, test->check->buf, 1, &victim_copy);
+    const VkMemoryBarrier check_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+    };
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+                           &check_barrier, 0, NULL, 0, NULL);
+    point = vk_end_cmd(vk);
+    vk_wait_point(vk, point);
+
+    const volatile uint8_t *check = test->check->mem_ptr;
+    for (VkDeviceSize i = 0; i < size; i++) {
+        if (check[i] != gpu_val || check[size + i] != cpu_val)
+            return false;
+    }
+
+    return true;
+}
+
+/* Returns true when all repetitions at all offsets pass. */
+static bool
+coherency_test_run_alignment(struct coherency_test *test,
+                             VkDeviceSize size,
+                             VkDeviceSize alignment)
+{
+    struct vk *vk = &test->vk;
+    bool pass = true;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(coherency_test_offsets) && pass; i++) {
+        VkMemoryRequirements disturb_reqs;
+        VkMemoryRequirements victim_reqs;
+        VkBuffer disturb = coherency_test_create_buffer(test, size, &disturb_reqs);
+        VkBuffer victim = coherency_test_create_buffer(test, size, &victim_reqs);
+
+        const VkDeviceSize disturb_offset =
+            coherency_test_align(coherency_test_offsets[i], disturb_reqs.alignment);
+        const VkDeviceSize victim_offset =
+            coherency_test_align(disturb_offset + disturb_reqs.size, alignment);
+        if (victim_offset + victim_reqs.size > COHERENCY_TEST_MEM_SIZE)
+            vk_die("suballocation out of range");
+
+        vk->result = vk->BindBufferMemory(vk->dev, disturb, test->mem, disturb_offset);
+        vk_check(vk, "failed to bind buffer memory");
+        vk->result = vk->BindBufferMemory(vk->dev, victim, test->mem, victim_offset);
+        vk_check(vk, "failed to bind buffer memory");
+
+        for (uint32_t j = 0; j < test->repeat && pass; j++) {
+            pass = coherency_test_run_case(test, disturb, victim, victim_offset, size);
+        }
+
+        vk->DestroyBuffer(vk->dev, victim, NULL);
+        vk->DestroyBuffer(vk->dev, disturb, NULL);
+    }
+
+    return pass;
+}
+
+static void
+coherency_test_run_memory_type(struct coherency_test *test, uint32_t mt_index)
+{
+    struct vk *vk = &test->vk;
+    const VkMemoryType *mt = &vk->mem_props.memoryTypes[mt_index];
+
+    /* the AMD types require deviceCoherentMemory, which is not enabled */
+    const VkMemoryPropertyFlags skipped_flags = VK_MEMORY_PROPERTY_PROTECTED_BIT |
+                                                VK_MEMORY_PROPERTY_DEVICE_COHERENT_BIT_AMD |
+                                                VK_MEMORY_PROPERTY_DEVICE_UNCACHED_BIT_AMD;
+    if (!(mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+        (mt->propertyFlags & skipped_flags))
+        return;
+
+    VkMemoryRequirements reqs;
+    VkBuffer buf = coherency_test_create_buffer(test, 4, &reqs);
+    vk->DestroyBuffer(vk->dev, buf, NULL);
+    if (!(reqs.memoryTypeBits & (1u << mt_index)))
+        return;
+
+    test->mem_coherent = mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    test->mem = vk_alloc_memory(vk, COHERENCY_TEST_MEM_SIZE, mt_index);
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, test->mem, 0, COHERENCY_TEST_MEM_SIZE, 0, &ptr);
+    vk_check(vk, "failed to map memory");
+    test->mem_ptr = ptr;
+
+    vk_log("memory type %u: %s %s %s %s", mt_index,
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? "Lo" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? "Vi" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) ? "Co" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) ? "Ca" : "-");
+    vk_log("  required alignment %" PRIu64 ", nonCoherentAtomSize %" PRIu64, reqs.alignment,
+           vk->props.properties.limits.nonCoherentAtomSize);
+
+    /* the smallest alignment such that it and all larger ones pass for all sizes */
+    VkDeviceSize safe_alignment = 0;
+    bool safe = true;
+    for (uint32_t i = 0; i < ARRAY_SIZE(coherency_test_sizes); i++) {
+        const VkDeviceSize size = coherency_test_sizes[i];
+
+        char line[256];
+        int len = snprintf(line, sizeof(line), "  size %4" PRIu64 ":", size);
+
+        VkDeviceSize size_safe_alignment = 0;
+        for (uint32_t j = 0; j < ARRAY_SIZE(coherency_test_alignments); j++) {
+            const VkDeviceSize alignment = coherency_test_alignments[j];
+            if (alignment < reqs.alignment)
+                continue;
+
+            const bool pass = coherency_test_run_alignment(test, size, alignment);
+            len += snprintf(line + len, sizeof(line) - len, " %" PRIu64 "=%s", alignment,
+                            pass ? "ok" : "LOST");
+
+            if (!pass)
+                size_safe_alignment = 0;
+            else if (!size_safe_alignment)
+                size_safe_alignment = alignment;
+        }
+        vk_log("%s", line);
+
+        if (!size_safe_alignment)
+            safe = false;
+        else if (safe_alignment < size_safe_alignment)
+            safe_alignment = size_safe_alignment;
+    }
+
+    if (safe && safe_alignment) {
+        vk_log("  minimum safe alignment for dense packing: %" PRIu64, safe_alignment);
+    } else {
+        vk_log("  no alignment up to %" PRIu64 " is safe for dense packing",
+               coherency_test_alignments[ARRAY_SIZE(coherency_test_alignments) - 1]);
+    }
+
+    vk->UnmapMemory(vk->dev, test->mem);
+    vk->FreeMemory(vk->dev, test->mem, NULL);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct coherency_test test = {
+        .repeat = 4,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "repeat=", 7)) {
+            test.repeat = atoi(argv[i] + 7);
+            if (!test.repeat)
+                vk_die("invalid repeat count %s", argv[i] + 7);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    coherency_test_init(&test);
+    for (uint32_t i = 0; i < test.vk.mem_props.memoryTypeCount; i++)
+        coherency_test_run_memory_type(&test, i);
+    coherency_test_cleanup(&test);
+
+    return 0;
+}
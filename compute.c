@@ -5,6 +5,11 @@
 
 /* This allocates an SSBO that is close to maxStorageBufferRange and verifies
  * that it can be written to.
+ *
+ * The SSBO is cleared on the transfer queue and written on the compute queue.
+ * The compute submission waits for the clear with a semaphore, and the
+ * ownership of the SSBO is transferred when the queues are from different
+ * families.
  */
 
 #include "vkutil.h"
@@ -19,6 +24,7 @@ struct compute_test {
     struct vk vk;
     uint32_t grid_size;
     struct vk_buffer *ssbo;
+    uint64_t clear_point;
 
     struct vk_pipeline *pipeline;
     struct vk_descriptor_set *set;
@@ -60,8 +66,8 @@ compute_test_init_ssbo(struct compute_test *test)
     test->grid_size = (uint32_t)sqrt((double)(limits->maxStorageBufferRange / sizeof(uint32_t)));
 
     VkDeviceSize size = test->grid_size * test->grid_size * sizeof(uint32_t);
-    test->ssbo = vk_create_buffer(vk, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-    memset(test->ssbo->mem_ptr, 0, size);
+    test->ssbo = vk_create_buffer(
+        vk, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 }
 
 static void
@@ -89,11 +95,28 @@ compute_test_cleanup(struct compute_test *test)
     vk_cleanup(vk);
 }
 
+static void
+compute_test_clear_ssbo(struct compute_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    VkCommandBuffer cmd = vk_begin_queue_cmd(vk, vk->transfer_queue);
+
+    vk->CmdFillBuffer(cmd, test->ssbo->buf, 0, VK_WHOLE_SIZE, 0);
+    vk_cmd_release_buffer(vk, cmd, test->ssbo, vk->transfer_queue, vk->compute_queue,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+    test->clear_point = vk_end_queue_cmd(vk, vk->transfer_queue, NULL, 0, 0);
+}
+
 static void
 compute_test_dispatch_ssbo(struct compute_test *test, VkCommandBuffer cmd)
 {
     struct vk *vk = &test->vk;
 
+    vk_cmd_acquire_buffer(vk, cmd, test->ssbo, vk->transfer_queue, vk->compute_queue,
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+
     const VkBufferMemoryBarrier barrier = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
         .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
@@ -119,12 +142,16 @@ compute_test_dispatch(struct compute_test *test)
 {
     struct vk *vk = &test->vk;
 
-    VkCommandBuffer cmd = vk_begin_cmd(vk);
+    compute_test_clear_ssbo(test);
+
+    VkCommandBuffer cmd = vk_begin_queue_cmd(vk, vk->compute_queue);
 
     compute_test_dispatch_ssbo(test, cmd);
 
-    vk_end_cmd(vk);
-    vk_wait(vk);
+    const uint64_t point =
+        vk_end_queue_cmd(vk, vk->compute_queue, vk->transfer_queue, test->clear_point,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    vk_wait_queue_point(vk, vk->compute_queue, point);
 
     vk_log("checking %ux%u", test->grid_size, test->grid_size);
     for (uint32_t y = 0; y < test->grid_size; y++) {
@@ -0,0 +1,453 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks draw call throughput.
+ *
+ * As in tri, each triangle has its own vertices, but there are many small
+ * triangles on a grid.  They are drawn with
+ *
+ *   - draw: a CmdDraw per triangle
+ *   - draw_pipeline: a CmdDraw per triangle, switching between two identical
+ *     pipelines before each draw
+ *   - draw_set: a CmdDraw per triangle, switching between two identical
+ *     descriptor sets before each draw
+ *   - instanced: a single CmdDraw, where each instance is offset by a cell
+ *   - multi_draw: CmdDrawMultiEXT, which requires VK_EXT_multi_draw and is
+ *     only run when requested
+ *   - indirect: multi-draw CmdDrawIndirects of at most maxDrawIndirectCount
+ *     draws each
+ *
+ * Draws per second of cpu time to record and submit, and gpu time per draw,
+ * are reported for each.
+ */
+
+#include "vkutil.h"
+
+static const uint32_t draw_calls_test_vs[] = {
+#include "draw_calls_test.vert.inc"
+};
+
+static const uint32_t draw_calls_test_fs[] = {
+#include "draw_calls_test.frag.inc"
+};
+
+enum draw_calls_test_mode {
+    DRAW_CALLS_TEST_DRAW,
+    DRAW_CALLS_TEST_DRAW_PIPELINE,
+    DRAW_CALLS_TEST_DRAW_SET,
+    DRAW_CALLS_TEST_INSTANCED,
+    DRAW_CALLS_TEST_MULTI_DRAW,
+    DRAW_CALLS_TEST_INDIRECT,
+    DRAW_CALLS_TEST_MODE_COUNT,
+};
+
+static const char *const draw_calls_test_mode_names[] = {
+    [DRAW_CALLS_TEST_DRAW] = "draw",
+    [DRAW_CALLS_TEST_DRAW_PIPELINE] = "draw_pipeline",
+    [DRAW_CALLS_TEST_DRAW_SET] = "draw_set",
+    [DRAW_CALLS_TEST_INSTANCED] = "instanced",
+    [DRAW_CALLS_TEST_MULTI_DRAW] = "multi_draw",
+    [DRAW_CALLS_TEST_INDIRECT] = "indirect",
+};
+
+struct draw_calls_test_vertex {
+    float x;
+    float y;
+    float r;
+    float g;
+    float b;
+};
+
+struct draw_calls_test_ubo {
+    uint32_t grid_size;
+    float spacing;
+};
+
+struct draw_calls_test {
+    VkFormat color_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t draw_count;
+    uint32_t iterations;
+    uint32_t modes;
+
+    struct vk vk;
+    struct vk_buffer *vb;
+    struct vk_buffer *ubos[2];
+
+    VkMultiDrawInfoEXT *multi_draw_infos;
+    struct vk_indirect *indirect;
+
+    struct vk_image *rt;
+    struct vk_framebuffer *fb;
+
+    struct vk_pipeline *pipelines[2];
+    struct vk_descriptor_set *sets[2];
+
+    bool regressed;
+};
+
+static void
+draw_calls_test_init_vb(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    uint32_t grid_size = 1;
+    while (grid_size * grid_size < test->draw_count)
+        grid_size++;
+    const float spacing = 2.0f / (float)grid_size;
+
+    const VkDeviceSize size = sizeof(struct draw_calls_test_vertex) * 3 * test->draw_count;
+    struct draw_calls_test_vertex *vertices = malloc(size);
+    if (!vertices)
+        vk_die("failed to alloc vertices");
+
+    for (uint32_t i = 0; i < test->draw_count; i++) {
+        const float x = -1.0f + (float)(i % grid_size) * spacing;
+        const float y = -1.0f + (float)(i / grid_size) * spacing;
+        const float shade = (float)i / (float)test->draw_count;
+        struct draw_calls_test_vertex *v = &vertices[3 * i];
+
+        v[0] = (struct draw_calls_test_vertex){ x, y, 1.0f, shade, 0.0f };
+        v[1] = (struct draw_calls_test_vertex){ x, y + spacing, 0.0f, 1.0f, shade };
+        v[2] = (struct draw_calls_test_vertex){ x + spacing, y, shade, 0.0f, 1.0f };
+    }
+
+    test->vb = vk_create_buffer(vk, size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    vk_write_buffer(vk, test->vb, 0, vertices, size);
+    free(vertices);
+
+    /* the ubos are identical such that draw_set only measures the switches */
+    const struct draw_calls_test_ubo ubo = {
+        .grid_size = grid_size,
+        .spacing = spacing,
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->ubos); i++) {
+        test->ubos[i] = vk_create_buffer(vk, sizeof(ubo), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+        vk_write_buffer(vk, test->ubos[i], 0, &ubo, sizeof(ubo));
+    }
+}
+
+static void
+draw_calls_test_init_draws(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->multi_draw_infos = malloc(sizeof(*test->multi_draw_infos) * test->draw_count);
+    VkDrawIndirectCommand *cmds = malloc(sizeof(*cmds) * test->draw_count);
+    if (!test->multi_draw_infos || !cmds)
+        vk_die("failed to alloc draws");
+
+    for (uint32_t i = 0; i < test->draw_count; i++) {
+        test->multi_draw_infos[i] = (VkMultiDrawInfoEXT){
+            .firstVertex = 3 * i,
+            .vertexCount = 3,
+        };
+        cmds[i] = (VkDrawIndirectCommand){
+            .vertexCount = 3,
+            .instanceCount = 1,
+            .firstVertex = 3 * i,
+        };
+    }
+
+    test->indirect = vk_create_indirect(vk, sizeof(*cmds), test->draw_count);
+    vk_write_indirect(vk, test->indirect, 0, cmds, test->draw_count);
+    free(cmds);
+}
+
+static void
+draw_calls_test_init_framebuffer(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->rt =
+        vk_create_image(vk, test->color_format, test->width, test->height, VK_SAMPLE_COUNT_1_BIT,
+                        VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    vk_create_image_render_view(vk, test->rt, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    test->fb = vk_create_framebuffer(vk, test->rt, NULL, NULL, VK_ATTACHMENT_LOAD_OP_CLEAR,
+                                     VK_ATTACHMENT_STORE_OP_STORE);
+}
+
+static struct vk_pipeline *
+draw_calls_test_create_pipeline(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    struct vk_pipeline *pipeline = vk_create_pipeline(vk);
+
+    vk_add_pipeline_shader(vk, pipeline, VK_SHADER_STAGE_VERTEX_BIT, draw_calls_test_vs,
+                           sizeof(draw_calls_test_vs));
+    vk_add_pipeline_shader(vk, pipeline, VK_SHADER_STAGE_FRAGMENT_BIT, draw_calls_test_fs,
+                           sizeof(draw_calls_test_fs));
+
+    const uint32_t comp_counts[2] = { 2, 3 };
+    vk_set_pipeline_vertices(vk, pipeline, comp_counts, ARRAY_SIZE(comp_counts));
+    vk_set_pipeline_topology(vk, pipeline, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+
+    vk_set_pipeline_viewport(vk, pipeline, test->fb->width, test->fb->height);
+    vk_set_pipeline_rasterization(vk, pipeline, VK_POLYGON_MODE_FILL);
+
+    vk_set_pipeline_sample_count(vk, pipeline, test->fb->samples);
+
+    vk_add_pipeline_set_layout(vk, pipeline, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+                               VK_SHADER_STAGE_VERTEX_BIT, NULL);
+
+    vk_setup_pipeline(vk, pipeline, test->fb);
+    vk_compile_pipeline(vk, pipeline);
+
+    return pipeline;
+}
+
+static void
+draw_calls_test_init_pipelines(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    /* the pipelines are identical such that draw_pipeline only measures the
+     * switches
+     */
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->pipelines); i++)
+        test->pipelines[i] = draw_calls_test_create_pipeline(test);
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->sets); i++) {
+        test->sets[i] = vk_create_descriptor_set(vk, test->pipelines[0]->set_layouts[0]);
+        vk_write_descriptor_set_buffer(vk, test->sets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                       test->ubos[i], VK_WHOLE_SIZE);
+    }
+}
+
+static void
+draw_calls_test_init(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    const char *dev_exts[] = {
+        VK_EXT_MULTI_DRAW_EXTENSION_NAME,
+    };
+    const bool multi_draw = test->modes & (1u << DRAW_CALLS_TEST_MULTI_DRAW);
+    const struct vk_init_params params = {
+        .dev_exts = dev_exts,
+        .dev_ext_count = multi_draw ? ARRAY_SIZE(dev_exts) : 0,
+    };
+    vk_init(vk, &params);
+
+    draw_calls_test_init_vb(test);
+    draw_calls_test_init_draws(test);
+
+    draw_calls_test_init_framebuffer(test);
+    draw_calls_test_init_pipelines(test);
+}
+
+static void
+draw_calls_test_cleanup(struct draw_calls_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->sets); i++)
+        vk_destroy_descriptor_set(vk, test->sets[i]);
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->pipelines); i++)
+        vk_destroy_pipeline(vk, test->pipelines[i]);
+
+    vk_destroy_image(vk, test->rt);
+    vk_destroy_framebuffer(vk, test->fb);
+
+    vk_destroy_indirect(vk, test->indirect);
+    free(test->multi_draw_infos);
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(test->ubos); i++)
+        vk_destroy_buffer(vk, test->ubos[i]);
+    vk_destroy_buffer(vk, test->vb);
+
+    vk_cleanup(vk);
+}
+
+static void
+draw_calls_test_draw_multi(struct draw_calls_test *test, VkCommandBuffer cmd)
+{
+    struct vk *vk = &test->vk;
+    const uint32_t max_count = vk->multi_draw_props.maxMultiDrawCount;
+
+    for (uint32_t i = 0; i < test->draw_count; i += max_count) {
+        const uint32_t count =
+            test->draw_count - i < max_count ? test->draw_count - i : max_count;
+        vk->CmdDrawMultiEXT(cmd, count, &test->multi_draw_infos[i], 1, 0,
+                            sizeof(*test->multi_draw_infos));
+    }
+}
+
+static void
+draw_calls_test_draw(struct draw_calls_test *test,
+                     VkCommandBuffer cmd,
+                     enum draw_calls_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+    const VkPipelineLayout pipeline_layout = test->pipelines[0]->pipeline_layout;
+
+    struct vk_transition transition = {
+        .img = test->rt,
+        .discard = true,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+    };
+    vk_cmd_transition(vk, cmd, &transition, 1);
+
+    const VkRenderPassBeginInfo pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = test->fb->pass,
+        .framebuffer = test->fb->fb,
+        .renderArea = {
+            .extent = {
+                .width = test->width,
+                .height = test->height,
+            },
+        },
+        .clearValueCount = 1,
+        .pClearValues = &(VkClearValue){
+            .color = {
+                .float32 = { 0.2f, 0.2f, 0.2f, 1.0f },
+            },
+        },
+    };
+    vk->CmdBeginRenderPass(cmd, &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+
+    vk->CmdBindVertexBuffers(cmd, 0, 1, &test->vb->buf, &(VkDeviceSize){ 0 });
+    vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, test->pipelines[0]->pipeline);
+    vk->CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1,
+                              &test->sets[0]->set, 0, NULL);
+
+    switch (mode) {
+    case DRAW_CALLS_TEST_DRAW:
+        for (uint32_t i = 0; i < test->draw_count; i++)
+            vk->CmdDraw(cmd, 3, 1, 3 * i, 0);
+        break;
+    case DRAW_CALLS_TEST_DRAW_PIPELINE:
+        for (uint32_t i = 0; i < test->draw_count; i++) {
+            vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                test->pipelines[i & 1]->pipeline);
+            vk->CmdDraw(cmd, 3, 1, 3 * i, 0);
+        }
+        break;
+    case DRAW_CALLS_TEST_DRAW_SET:
+        for (uint32_t i = 0; i < test->draw_count; i++) {
+            vk->CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0,
+                                      1, &test->sets[i & 1]->set, 0, NULL);
+            vk->CmdDraw(cmd, 3, 1, 3 * i, 0);
+        }
+        break;
+    case DRAW_CALLS_TEST_INSTANCED:
+        vk->CmdDraw(cmd, 3, test->draw_count, 0, 0);
+        break;
+    case DRAW_CALLS_TEST_MULTI_DRAW:
+        draw_calls_test_draw_multi(test, cmd);
+        break;
+    case DRAW_CALLS_TEST_INDIRECT:
+        vk_cmd_draw_indirect(vk, cmd, test->indirect, test->draw_count, false);
+        break;
+    default:
+        vk_die("bad mode");
+        break;
+    }
+
+    vk->CmdEndRenderPass(cmd);
+
+    transition.discard = false;
+    transition.layout = VK_IMAGE_LAYOUT_GENERAL;
+    transition.stage = VK_PIPELINE_STAGE_2_HOST_BIT;
+    transition.access = VK_ACCESS_2_HOST_READ_BIT;
+    vk_cmd_transition(vk, cmd, &transition, 1);
+}
+
+static void
+draw_calls_test_run(struct draw_calls_test *test, enum draw_calls_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+
+    char name[64];
+    snprintf(name, sizeof(name), "draw_calls.%s.%u", draw_calls_test_mode_names[mode],
+             test->draw_count);
+
+    const struct vk_bench_params params = {
+        .name = name,
+        .warmup_iterations = 2,
+        .iterations = test->iterations,
+        .gpu = true,
+    };
+    struct vk_bench *bench = vk_create_bench(vk, &params);
+    while (vk_bench_next(vk, bench)) {
+        /* the cpu time covers recording and submission */
+        vk_wait(vk);
+        VkCommandBuffer cmd = vk_begin_cmd(vk);
+        vk_bench_cpu_begin(bench);
+
+        vk_bench_cmd_begin(vk, bench, cmd);
+        draw_calls_test_draw(test, cmd, mode);
+        vk_bench_cmd_end(vk, bench, cmd);
+        vk_end_cmd(vk);
+    }
+    vk_wait(vk);
+
+    if (!vk_bench_report(vk, bench))
+        test->regressed = true;
+
+    vk_log("  %.0f draws/s of cpu time, %.1f ns of gpu time per draw",
+           (double)test->draw_count * 1000000000.0 / bench->cpu.median,
+           bench->gpu.median / (double)test->draw_count);
+
+    vk_destroy_bench(vk, bench);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct draw_calls_test test = {
+        .color_format = VK_FORMAT_B8G8R8A8_UNORM,
+        .width = 300,
+        .height = 300,
+        .draw_count = 10000,
+        .iterations = 20,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        bool found = false;
+        for (uint32_t j = 0; j < DRAW_CALLS_TEST_MODE_COUNT; j++) {
+            if (!strcmp(argv[i], draw_calls_test_mode_names[j])) {
+                test.modes |= 1u << j;
+                found = true;
+            }
+        }
+        if (found)
+            continue;
+
+        if (!strncmp(argv[i], "draws=", 6)) {
+            test.draw_count = atoi(argv[i] + 6);
+            if (!test.draw_count)
+                vk_die("invalid draw count %s", argv[i] + 6);
+        } else if (!strncmp(argv[i], "iterations=", 11)) {
+            test.iterations = atoi(argv[i] + 11);
+            if (!test.iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+    /* multi_draw enables VK_EXT_multi_draw and must be requested */
+    if (!test.modes) {
+        test.modes =
+            ((1u << DRAW_CALLS_TEST_MODE_COUNT) - 1) & ~(1u << DRAW_CALLS_TEST_MULTI_DRAW);
+    }
+
+    draw_calls_test_init(&test);
+    for (uint32_t i = 0; i < DRAW_CALLS_TEST_MODE_COUNT; i++) {
+        if (test.modes & (1u << i))
+            draw_calls_test_run(&test, i);
+    }
+    vk_dump_image(&test.vk, test.rt, VK_IMAGE_ASPECT_COLOR_BIT, "rt.ppm");
+
+    draw_calls_test_cleanup(&test);
+
+    return test.regressed;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+#version 460 core
+
+layout(location = 0) in vec2 in_position;
+layout(location = 1) in vec3 in_color;
+layout(location = 0) out vec3 out_color;
+
+/* instances are offset by grid cells */
+layout(set = 0, binding = 0) uniform UBO {
+    uint grid_size;
+    float spacing;
+} ubo;
+
+out gl_PerVertex {
+    vec4 gl_Position;
+};
+
+void main()
+{
+    const uint instance = uint(gl_InstanceIndex);
+    const vec2 cell = vec2(instance % ubo.grid_size, instance / ubo.grid_size);
+
+    gl_Position = vec4(in_position + cell * ubo.spacing, 0.0, 1.0);
+    out_color = in_color;
+}
@@ -17,6 +17,17 @@ struct formats_test_name {
     const char *name;
 };
 
+struct formats_test_keys {
+    struct vk_image_format_key *keys;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct formats_test_dump_data {
+    struct vk *vk;
+    struct vk_format_caps *caps;
+};
+
 static const struct formats_test_format formats_test_formats[] = {
 #define FMT(fmt) { VK_FORMAT_##fmt, "VK_FORMAT_" #fmt },
 #include "vkutil_formats.inc"
@@ -103,166 +114,168 @@ formats_get_feature_str(VkFormatFeatureFlags features, char *str, size_t size)
 
 static void
 formats_test_dump_image_format(struct vk *vk,
-                               VkFormat format,
-                               VkExternalMemoryHandleTypeFlagBits handle,
-                               VkImageTiling tiling,
-                               uint64_t drm_modifier,
-                               VkImageUsageFlags usage)
+                               struct vk_format_caps *caps,
+                               const struct vk_image_format_key *key)
 {
-    const VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {
-        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
-        .drmFormatModifier = drm_modifier,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-    };
-    const VkPhysicalDeviceExternalImageFormatInfo external_info = {
-        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
-        .pNext = tiling == VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT ? &mod_info : NULL,
-        .handleType = handle,
-    };
-    const VkPhysicalDeviceImageFormatInfo2 info = {
-        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
-        .pNext = &external_info,
-        .format = format,
-        .type = VK_IMAGE_TYPE_2D,
-        .tiling = tiling,
-        .usage = usage,
-    };
+    const struct vk_image_format_caps *img_caps = vk_get_image_format_caps(vk, caps, key);
+    if (img_caps->result == VK_SUCCESS) {
+        vk_log("    supported: true (desc count %d)", img_caps->ycbcr_desc_count);
 
-    VkAndroidHardwareBufferUsageANDROID ahb_props = {
-        .sType = VK_STRUCTURE_TYPE_ANDROID_HARDWARE_BUFFER_USAGE_ANDROID,
-    };
-    VkExternalImageFormatProperties external_props = {
-        .sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
-        .pNext = &ahb_props,
-    };
-    VkSamplerYcbcrConversionImageFormatProperties ycbcr_props = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_IMAGE_FORMAT_PROPERTIES,
-        .pNext = &external_props,
-    };
-    VkImageFormatProperties2 props = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
-        .pNext = &ycbcr_props,
-    };
+        if (key->handle)
+            vk_log("    externalMemoryFeatures: 0x%x", img_caps->external_features);
 
-    const VkResult result =
-        vk->GetPhysicalDeviceImageFormatProperties2(vk->physical_dev, &info, &props);
-    if (result == VK_SUCCESS) {
-        vk_log("    supported: true (desc count %d)",
-               ycbcr_props.combinedImageSamplerDescriptorCount);
+        if (key->handle == VK_EXTERNAL_MEMORY_HANDLE_TYPE_ANDROID_HARDWARE_BUFFER_BIT_ANDROID)
+            vk_log("    androidHardwareBufferUsage: 0x%" PRIx64, img_caps->ahb_usage);
+    } else {
+        vk_log("    supported: false");
+    }
+}
 
-        if (handle) {
-            const VkExternalMemoryProperties *mem_props =
-                &external_props.externalMemoryProperties;
-            vk_log("    externalMemoryFeatures: 0x%x", mem_props->externalMemoryFeatures);
-        }
+static bool
+formats_test_can_img(const struct vk_format_caps_format *fmt)
+{
+    return fmt->props.linearTilingFeatures || fmt->props.optimalTilingFeatures ||
+           fmt->modifier_count;
+}
+
+/* Calls func for each image format to dump, in order.  The keys are collected
+ * first such that they can be queried in parallel.
+ */
+static void
+formats_test_for_each_image_format(
+    struct vk_format_caps *caps,
+    const struct vk_format_caps_format *fmt,
+    void (*func)(const struct vk_image_format_key *key, void *data),
+    void *data)
+{
+    if (!formats_test_can_img(fmt))
+        return;
+
+    const VkDrmFormatModifierPropertiesEXT *mods = vk_get_format_modifiers(caps, fmt);
+    for (uint32_t h = 0; h < ARRAY_SIZE(formats_test_handles); h++) {
+        for (uint32_t t = 0; t < ARRAY_SIZE(formats_test_tilings); t++) {
+            for (uint32_t u = 0; u < ARRAY_SIZE(formats_test_usages); u++) {
+                struct vk_image_format_key key = {
+                    .format = fmt->format,
+                    .tiling = formats_test_tilings[t],
+                    .usage = formats_test_usages[u],
+                    .handle = formats_test_handles[h],
+                    .modifier = DRM_FORMAT_MOD_INVALID,
+                };
+
+                if (key.tiling != VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT) {
+                    func(&key, data);
+                    continue;
+                }
 
-        if (handle == VK_EXTERNAL_MEMORY_HANDLE_TYPE_ANDROID_HARDWARE_BUFFER_BIT_ANDROID) {
-            vk_log("    androidHardwareBufferUsage: 0x%" PRIx64,
-                   ahb_props.androidHardwareBufferUsage);
+                for (uint32_t i = 0; i < fmt->modifier_count; i++) {
+                    key.modifier = mods[i].drmFormatModifier;
+                    func(&key, data);
+                }
+            }
         }
-    } else {
-        vk_log("    supported: false");
     }
 }
 
 static void
-formats_test_dump_format(struct vk *vk, VkFormat format)
+formats_test_add_key(const struct vk_image_format_key *key, void *data)
 {
-    VkDrmFormatModifierPropertiesListEXT mod_props = {
-        .sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT,
-    };
-    VkFormatProperties2 props = {
-        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
-        .pNext = &mod_props,
-    };
-    vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, format, &props);
-
-    if (mod_props.drmFormatModifierCount) {
-        mod_props.pDrmFormatModifierProperties = malloc(
-            sizeof(*mod_props.pDrmFormatModifierProperties) * mod_props.drmFormatModifierCount);
-        if (!mod_props.pDrmFormatModifierProperties)
-            vk_die("failed to alloc VkDrmFormatModifierPropertiesEXT");
-        vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, format, &props);
+    struct formats_test_keys *keys = data;
+
+    if (keys->count == keys->capacity) {
+        keys->capacity = keys->capacity ? keys->capacity * 2 : 1024;
+        keys->keys = realloc(keys->keys, sizeof(*keys->keys) * keys->capacity);
+        if (!keys->keys)
+            vk_die("failed to alloc keys");
+    }
+
+    keys->keys[keys->count++] = *key;
+}
+
+static void
+formats_test_dump_key(const struct vk_image_format_key *key, void *data)
+{
+    struct formats_test_dump_data *dump = data;
+
+    char usage_str[128];
+    formats_get_usage_str(key->usage, usage_str, ARRAY_SIZE(usage_str));
+
+    if (key->tiling == VK_IMAGE_TILING_OPTIMAL || key->tiling == VK_IMAGE_TILING_LINEAR) {
+        vk_log("  external handle 0x%x, image tiling %s, usage %s", key->handle,
+               key->tiling == VK_IMAGE_TILING_OPTIMAL ? "optimal" : "linear", usage_str);
+    } else {
+        vk_log("  external handle 0x%x, image modifier 0x%016" PRIx64 ", usage %s", key->handle,
+               key->modifier, usage_str);
     }
 
-    const bool can_buffer = props.formatProperties.bufferFeatures;
-    const bool can_img = props.formatProperties.linearTilingFeatures ||
-                         props.formatProperties.optimalTilingFeatures ||
-                         mod_props.drmFormatModifierCount;
+    formats_test_dump_image_format(dump->vk, dump->caps, key);
+}
+
+static void
+formats_test_dump_format(struct vk *vk,
+                         struct vk_format_caps *caps,
+                         const struct vk_format_caps_format *fmt)
+{
+    const bool can_buffer = fmt->props.bufferFeatures;
+    const bool can_img = formats_test_can_img(fmt);
     vk_log("  supported: %s", can_buffer || can_img ? "true" : "false");
 
     char features_str[128];
     if (can_buffer) {
-        formats_get_feature_str(props.formatProperties.bufferFeatures, features_str,
+        formats_get_feature_str(fmt->props.bufferFeatures, features_str,
                                 ARRAY_SIZE(features_str));
         vk_log("  bufferFeatures: %s", features_str);
     }
 
-    if (!can_img) {
-        if (!can_buffer)
-            free(mod_props.pDrmFormatModifierProperties);
+    if (!can_img)
         return;
-    }
 
-    formats_get_feature_str(props.formatProperties.linearTilingFeatures, features_str,
+    formats_get_feature_str(fmt->props.linearTilingFeatures, features_str,
                             ARRAY_SIZE(features_str));
     vk_log("  linearTilingFeatures: %s", features_str);
 
-    formats_get_feature_str(props.formatProperties.optimalTilingFeatures, features_str,
+    formats_get_feature_str(fmt->props.optimalTilingFeatures, features_str,
                             ARRAY_SIZE(features_str));
     vk_log("  optimalTilingFeatures: %s", features_str);
 
-    for (uint32_t i = 0; i < mod_props.drmFormatModifierCount; i++) {
-        const VkDrmFormatModifierPropertiesEXT *p = &mod_props.pDrmFormatModifierProperties[i];
+    const VkDrmFormatModifierPropertiesEXT *mods = vk_get_format_modifiers(caps, fmt);
+    for (uint32_t i = 0; i < fmt->modifier_count; i++) {
+        const VkDrmFormatModifierPropertiesEXT *p = &mods[i];
         formats_get_feature_str(p->drmFormatModifierTilingFeatures, features_str,
                                 ARRAY_SIZE(features_str));
         vk_log("  modifier 0x%016" PRIx64 ": %s plane count %d", p->drmFormatModifier,
                features_str, p->drmFormatModifierPlaneCount);
     }
 
-    for (uint32_t h = 0; h < ARRAY_SIZE(formats_test_handles); h++) {
-        for (uint32_t t = 0; t < ARRAY_SIZE(formats_test_tilings); t++) {
-            for (uint32_t u = 0; u < ARRAY_SIZE(formats_test_usages); u++) {
-                const VkExternalMemoryHandleTypeFlagBits handle = formats_test_handles[h];
-                const VkImageTiling tiling = formats_test_tilings[t];
-                const VkImageUsageFlags usage = formats_test_usages[u];
-
-                char usage_str[128];
-                formats_get_usage_str(usage, usage_str, ARRAY_SIZE(usage_str));
-
-                if (tiling == VK_IMAGE_TILING_OPTIMAL || tiling == VK_IMAGE_TILING_LINEAR) {
-                    vk_log("  external handle 0x%x, image tiling %s, usage %s", handle,
-                           tiling == VK_IMAGE_TILING_OPTIMAL ? "optimal" : "linear", usage_str);
-                    formats_test_dump_image_format(vk, format, handle, tiling,
-                                                   DRM_FORMAT_MOD_INVALID, usage);
-                } else {
-                    for (uint32_t i = 0; i < mod_props.drmFormatModifierCount; i++) {
-                        const VkDrmFormatModifierPropertiesEXT *p =
-                            &mod_props.pDrmFormatModifierProperties[i];
-                        vk_log("  external handle 0x%x, image modifier 0x%016" PRIx64
-                               ", usage %s",
-                               handle, p->drmFormatModifier, usage_str);
-                        formats_test_dump_image_format(vk, format, handle,
-                                                       VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
-                                                       p->drmFormatModifier, usage);
-                    }
-                }
-            }
-        }
-    }
-
-    free(mod_props.pDrmFormatModifierProperties);
+    struct formats_test_dump_data dump = {
+        .vk = vk,
+        .caps = caps,
+    };
+    formats_test_for_each_image_format(caps, fmt, formats_test_dump_key, &dump);
 }
 
 static void
 formats_test_dump(struct vk *vk)
 {
+    struct vk_format_caps *caps = vk_create_format_caps(vk);
+
+    struct formats_test_keys keys = { 0 };
+    for (uint32_t i = 0; i < ARRAY_SIZE(formats_test_formats); i++) {
+        const struct vk_format_caps_format *fmt =
+            vk_get_format_caps(caps, formats_test_formats[i].format);
+        formats_test_for_each_image_format(caps, fmt, formats_test_add_key, &keys);
+    }
+    vk_fill_image_format_caps(vk, caps, keys.keys, keys.count);
+    free(keys.keys);
+
     for (uint32_t i = 0; i < ARRAY_SIZE(formats_test_formats); i++) {
         const struct formats_test_format *fmt = &formats_test_formats[i];
 
         vk_log("%s", fmt->name);
-        formats_test_dump_format(vk, fmt->format);
+        formats_test_dump_format(vk, caps, vk_get_format_caps(caps, fmt->format));
     }
+
+    vk_destroy_format_caps(vk, caps);
 }
 
 int
@@ -0,0 +1,312 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test hashes and diffs a large image on the GPU such that verifying it
+ * reads back a few bytes rather than the whole image.
+ *
+ * Two images are cleared to the same color and a small patch of the first
+ * image is overwritten.  vk_hash_image computes a hash of each tile, a hash of
+ * the whole image, and the number of pixels that differ from the second image.
+ * Both images are then hashed alone, without the diff.  The hashes are checked
+ * against ones computed on the CPU.
+ */
+
+#include "vkutil.h"
+
+struct image_hash_test {
+    VkFormat color_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t color;
+
+    uint32_t patch_x;
+    uint32_t patch_y;
+    uint32_t patch_width;
+    uint32_t patch_height;
+    uint32_t patch_color;
+
+    struct vk vk;
+    struct vk_image *img;
+    struct vk_image *ref;
+    struct vk_buffer *patch;
+
+    struct vk_image_hash *hash;
+};
+
+static void
+image_hash_test_init_images(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    const VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+    test->img = vk_create_image(vk, test->color_format, test->width, test->height,
+                                VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, usage);
+    vk_create_image_sample_view(vk, test->img, VK_IMAGE_ASPECT_COLOR_BIT, VK_FILTER_NEAREST);
+
+    test->ref = vk_create_image(vk, test->color_format, test->width, test->height,
+                                VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, usage);
+    vk_create_image_sample_view(vk, test->ref, VK_IMAGE_ASPECT_COLOR_BIT, VK_FILTER_NEAREST);
+
+    const uint32_t patch_size = test->patch_width * test->patch_height;
+    test->patch =
+        vk_create_buffer(vk, sizeof(uint32_t) * patch_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    uint32_t *patch = test->patch->mem_ptr;
+    for (uint32_t i = 0; i < patch_size; i++)
+        patch[i] = test->patch_color;
+}
+
+static void
+image_hash_test_init(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_init(vk, NULL);
+
+    image_hash_test_init_images(test);
+    test->hash = vk_create_image_hash(vk, test->width, test->height);
+}
+
+static void
+image_hash_test_cleanup(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_destroy_image_hash(vk, test->hash);
+
+    vk_destroy_buffer(vk, test->patch);
+    vk_destroy_image(vk, test->ref);
+    vk_destroy_image(vk, test->img);
+
+    vk_cleanup(vk);
+}
+
+static uint32_t
+image_hash_test_mix(uint32_t x)
+{
+    /* must match mix32 in the shader */
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* the patch is included only when patched is set */
+static uint32_t
+image_hash_test_compute_hash(const struct image_hash_test *test, bool patched)
+{
+    const uint32_t tile_size = VKUTIL_IMAGE_HASH_TILE_SIZE;
+    const uint32_t tiles_x = test->hash->tiles_x;
+
+    uint32_t hash = 0;
+    for (uint32_t ty = 0; ty < test->hash->tiles_y; ty++) {
+        for (uint32_t tx = 0; tx < tiles_x; tx++) {
+            const uint32_t x_end = (tx + 1) * tile_size;
+            const uint32_t y_end = (ty + 1) * tile_size;
+
+            uint32_t tile_hash = 0;
+            for (uint32_t y = ty * tile_size; y < y_end && y < test->height; y++) {
+                for (uint32_t x = tx * tile_size; x < x_end && x < test->width; x++) {
+                    const bool in_patch = patched && x >= test->patch_x &&
+                                          y >= test->patch_y &&
+                                          x < test->patch_x + test->patch_width &&
+                                          y < test->patch_y + test->patch_height;
+                    const uint32_t texel = in_patch ? test->patch_color : test->color;
+                    tile_hash +=
+                        image_hash_test_mix(texel ^ image_hash_test_mix(test->width * y + x));
+                }
+            }
+
+            hash += image_hash_test_mix(tile_hash ^ (tiles_x * ty + tx));
+        }
+    }
+
+    return hash;
+}
+
+static void
+image_hash_test_prep_images(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+
+    const struct vk_transition transitions[2] = {
+        [0] = {
+            .img = test->img,
+            .discard = true,
+            .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .stage = VK_PIPELINE_STAGE_2_CLEAR_BIT | VK_PIPELINE_STAGE_2_COPY_BIT,
+            .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        },
+        [1] = {
+            .img = test->ref,
+            .discard = true,
+            .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .stage = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+            .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        },
+    };
+    vk_cmd_transition(vk, cmd, transitions, ARRAY_SIZE(transitions));
+
+    VkClearColorValue clear_val;
+    for (uint32_t i = 0; i < 4; i++)
+        clear_val.float32[i] = (float)((test->color >> (8 * i)) & 0xff) / 255.0f;
+    const VkImageSubresourceRange clear_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    vk->CmdClearColorImage(cmd, test->img->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           &clear_val, 1, &clear_range);
+    vk->CmdClearColorImage(cmd, test->ref->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           &clear_val, 1, &clear_range);
+
+    /* the clear and the copy both write img */
+    const VkMemoryBarrier2 mem_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+        .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+    };
+    vk_cmd_barriers(vk, cmd, &mem_barrier, NULL, 0);
+
+    const VkBufferImageCopy copy = {
+        .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .layerCount = 1,
+        },
+        .imageOffset = {
+            .x = test->patch_x,
+            .y = test->patch_y,
+        },
+        .imageExtent = {
+            .width = test->patch_width,
+            .height = test->patch_height,
+            .depth = 1,
+        },
+    };
+    vk->CmdCopyBufferToImage(cmd, test->patch->buf, test->img->img,
+                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+    /* vk_hash_image transitions the images for the compute shader */
+    vk_end_cmd(vk);
+    vk_wait(vk);
+}
+
+static void
+image_hash_test_check_tiles(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    const uint32_t tile_size = VKUTIL_IMAGE_HASH_TILE_SIZE;
+    const uint32_t tiles_x = test->hash->tiles_x;
+    const uint32_t tile_count = tiles_x * test->hash->tiles_y;
+
+    uint32_t(*tiles)[2] = malloc(sizeof(*tiles) * tile_count);
+    if (!tiles)
+        vk_die("failed to alloc tiles");
+    vk_read_image_hash_tiles(vk, test->hash, tiles);
+
+    for (uint32_t i = 0; i < tile_count; i++) {
+        if (!tiles[i][1])
+            continue;
+
+        const uint32_t x = i % tiles_x * tile_size;
+        const uint32_t y = i / tiles_x * tile_size;
+        vk_log("tile at (%u, %u) has %u mismatches", x, y, tiles[i][1]);
+
+        if (x + tile_size <= test->patch_x || x >= test->patch_x + test->patch_width ||
+            y + tile_size <= test->patch_y || y >= test->patch_y + test->patch_height)
+            vk_die("tile at (%u, %u) should not have mismatches", x, y);
+    }
+
+    free(tiles);
+}
+
+static void
+image_hash_test_diff(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    uint32_t hash;
+    uint32_t mismatch_count;
+    vk_hash_image(vk, test->hash, test->img, test->ref, &hash, &mismatch_count);
+
+    vk_log("hashed and diffed %ux%u in %.3f ms of GPU time: hash 0x%08x, %u mismatches",
+           test->width, test->height, (double)test->hash->duration / 1000000.0, hash,
+           mismatch_count);
+
+    const uint32_t expected_hash = image_hash_test_compute_hash(test, true);
+    if (hash != expected_hash)
+        vk_die("image hash is 0x%08x, not 0x%08x", hash, expected_hash);
+
+    const uint32_t expected_count = test->patch_width * test->patch_height;
+    if (mismatch_count != expected_count)
+        vk_die("mismatch count is %u, not %u", mismatch_count, expected_count);
+
+    /* tiles are only read back to locate mismatches */
+    if (mismatch_count)
+        image_hash_test_check_tiles(test);
+}
+
+static void
+image_hash_test_hash(struct image_hash_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    uint32_t img_hash;
+    vk_hash_image(vk, test->hash, test->img, NULL, &img_hash, NULL);
+    vk_log("hashed %ux%u in %.3f ms of GPU time: hash 0x%08x", test->width, test->height,
+           (double)test->hash->duration / 1000000.0, img_hash);
+
+    uint32_t ref_hash;
+    vk_hash_image(vk, test->hash, test->ref, NULL, &ref_hash, NULL);
+
+    const uint32_t expected_img_hash = image_hash_test_compute_hash(test, true);
+    if (img_hash != expected_img_hash)
+        vk_die("image hash is 0x%08x, not 0x%08x", img_hash, expected_img_hash);
+
+    const uint32_t expected_ref_hash = image_hash_test_compute_hash(test, false);
+    if (ref_hash != expected_ref_hash)
+        vk_die("reference hash is 0x%08x, not 0x%08x", ref_hash, expected_ref_hash);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct image_hash_test test = {
+        .color_format = VK_FORMAT_R8G8B8A8_UNORM,
+        .width = 3840,
+        .height = 2160,
+        .color = 0xff204080,
+
+        .patch_x = 1000,
+        .patch_y = 500,
+        .patch_width = 20,
+        .patch_height = 3,
+        .patch_color = 0xff0000ff,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "8k")) {
+            test.width = 7680;
+            test.height = 4320;
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    image_hash_test_init(&test);
+    image_hash_test_prep_images(&test);
+    image_hash_test_diff(&test);
+    image_hash_test_hash(&test);
+    image_hash_test_cleanup(&test);
+
+    return 0;
+}
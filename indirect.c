@@ -0,0 +1,489 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test draws a grid of circles, some of which are off-screen, to a
+ * linear color image and dumps it to a file.
+ *
+ * As in gs, each circle is a point that a geometry shader turns into a
+ * circle.  Off-screen circles are culled and the rest are drawn with
+ *
+ *   - direct: the cpu culls and records a draw per circle
+ *   - indirect: the cpu culls and writes indirect commands for a single
+ *     multi-draw
+ *   - gpu: a compute shader culls and appends indirect commands, which are
+ *     drawn with drawIndirectCount
+ *
+ * The cpu time to cull, record, and submit and the gpu time are benchmarked
+ * for each mode to show how much submission cost moves to the gpu.
+ */
+
+#include "vkutil.h"
+
+static const uint32_t indirect_test_vs[] = {
+#include "indirect_test.vert.inc"
+};
+
+static const uint32_t indirect_test_gs[] = {
+#include "indirect_test.geom.inc"
+};
+
+static const uint32_t indirect_test_fs[] = {
+#include "indirect_test.frag.inc"
+};
+
+static const uint32_t indirect_test_cs[] = {
+#include "indirect_test.comp.inc"
+};
+
+enum indirect_test_mode {
+    INDIRECT_TEST_DIRECT,
+    INDIRECT_TEST_INDIRECT,
+    INDIRECT_TEST_GPU,
+    INDIRECT_TEST_MODE_COUNT,
+};
+
+static const char *const indirect_test_mode_names[] = {
+    [INDIRECT_TEST_DIRECT] = "direct",
+    [INDIRECT_TEST_INDIRECT] = "indirect",
+    [INDIRECT_TEST_GPU] = "gpu",
+};
+
+struct indirect_test_circle {
+    float x;
+    float y;
+    float r;
+    float g;
+    float b;
+    float radius;
+};
+
+struct indirect_test {
+    VkFormat color_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t circle_count;
+    uint32_t iterations;
+    uint32_t modes;
+
+    struct vk vk;
+    struct indirect_test_circle *circles;
+    uint32_t visible_count;
+    struct vk_buffer *vb;
+
+    VkDrawIndirectCommand *cmds;
+    struct vk_indirect *indirect;
+
+    struct vk_image *rt;
+    struct vk_framebuffer *fb;
+
+    struct vk_pipeline *pipeline;
+
+    struct vk_pipeline *cull_pipeline;
+    struct vk_descriptor_set *circle_set;
+    struct vk_descriptor_set *draw_set;
+
+    bool regressed;
+};
+
+static void
+indirect_test_init_circles(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->circles = malloc(sizeof(*test->circles) * test->circle_count);
+    test->cmds = malloc(sizeof(*test->cmds) * test->circle_count);
+    if (!test->circles || !test->cmds)
+        vk_die("failed to alloc circles");
+
+    /* the grid extends past the viewport such that about half of the
+     * circles are culled, and the circles do not overlap such that the
+     * order of gpu-generated draws does not matter
+     */
+    uint32_t grid_size = 1;
+    while (grid_size * grid_size < test->circle_count)
+        grid_size++;
+    const float spacing = 3.0f / (float)grid_size;
+
+    for (uint32_t i = 0; i < test->circle_count; i++) {
+        const uint32_t col = i % grid_size;
+        const uint32_t row = i / grid_size;
+
+        test->circles[i] = (struct indirect_test_circle){
+            .x = -1.5f + ((float)col + 0.5f) * spacing,
+            .y = -1.5f + ((float)row + 0.5f) * spacing,
+            .r = (float)col / (float)grid_size,
+            .g = (float)row / (float)grid_size,
+            .b = 1.0f - (float)col / (float)grid_size,
+            .radius = spacing * 0.4f,
+        };
+    }
+
+    const VkDeviceSize size = sizeof(*test->circles) * test->circle_count;
+    test->vb = vk_create_buffer(vk, size,
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    vk_write_buffer(vk, test->vb, 0, test->circles, size);
+
+    test->indirect = vk_create_indirect(vk, sizeof(VkDrawIndirectCommand), test->circle_count);
+}
+
+static void
+indirect_test_init_framebuffer(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->rt =
+        vk_create_image(vk, test->color_format, test->width, test->height, VK_SAMPLE_COUNT_1_BIT,
+                        VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    vk_create_image_render_view(vk, test->rt, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    test->fb = vk_create_framebuffer(vk, test->rt, NULL, NULL, VK_ATTACHMENT_LOAD_OP_CLEAR,
+                                     VK_ATTACHMENT_STORE_OP_STORE);
+}
+
+static void
+indirect_test_init_pipeline(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->pipeline = vk_create_pipeline(vk);
+
+    vk_add_pipeline_shader(vk, test->pipeline, VK_SHADER_STAGE_VERTEX_BIT, indirect_test_vs,
+                           sizeof(indirect_test_vs));
+    vk_add_pipeline_shader(vk, test->pipeline, VK_SHADER_STAGE_GEOMETRY_BIT, indirect_test_gs,
+                           sizeof(indirect_test_gs));
+    vk_add_pipeline_shader(vk, test->pipeline, VK_SHADER_STAGE_FRAGMENT_BIT, indirect_test_fs,
+                           sizeof(indirect_test_fs));
+
+    const uint32_t comp_counts[3] = { 2, 3, 1 };
+    vk_set_pipeline_vertices(vk, test->pipeline, comp_counts, ARRAY_SIZE(comp_counts));
+    vk_set_pipeline_topology(vk, test->pipeline, VK_PRIMITIVE_TOPOLOGY_POINT_LIST);
+
+    vk_set_pipeline_viewport(vk, test->pipeline, test->fb->width, test->fb->height);
+    vk_set_pipeline_rasterization(vk, test->pipeline, VK_POLYGON_MODE_FILL);
+
+    vk_set_pipeline_sample_count(vk, test->pipeline, test->fb->samples);
+
+    vk_setup_pipeline(vk, test->pipeline, test->fb);
+    vk_compile_pipeline(vk, test->pipeline);
+}
+
+static void
+indirect_test_init_cull_pipeline(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    test->cull_pipeline = vk_create_pipeline(vk);
+
+    vk_add_pipeline_shader(vk, test->cull_pipeline, VK_SHADER_STAGE_COMPUTE_BIT,
+                           indirect_test_cs, sizeof(indirect_test_cs));
+
+    vk_add_pipeline_set_layout(vk, test->cull_pipeline, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                               VK_SHADER_STAGE_COMPUTE_BIT, NULL);
+    vk_add_pipeline_set_layout(vk, test->cull_pipeline, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                               VK_SHADER_STAGE_COMPUTE_BIT, NULL);
+    vk_set_pipeline_push_const(vk, test->cull_pipeline, VK_SHADER_STAGE_COMPUTE_BIT,
+                               sizeof(uint32_t));
+
+    vk_setup_pipeline(vk, test->cull_pipeline, NULL);
+    vk_compile_pipeline(vk, test->cull_pipeline);
+
+    test->circle_set = vk_create_descriptor_set(vk, test->cull_pipeline->set_layouts[0]);
+    vk_write_descriptor_set_buffer(vk, test->circle_set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                   test->vb, VK_WHOLE_SIZE);
+
+    test->draw_set = vk_create_descriptor_set(vk, test->cull_pipeline->set_layouts[1]);
+    vk_write_descriptor_set_buffer(vk, test->draw_set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                   test->indirect->buf, VK_WHOLE_SIZE);
+}
+
+static void
+indirect_test_init(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_init(vk, NULL);
+    indirect_test_init_circles(test);
+
+    indirect_test_init_framebuffer(test);
+    indirect_test_init_pipeline(test);
+    indirect_test_init_cull_pipeline(test);
+}
+
+static void
+indirect_test_cleanup(struct indirect_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_destroy_descriptor_set(vk, test->draw_set);
+    vk_destroy_descriptor_set(vk, test->circle_set);
+    vk_destroy_pipeline(vk, test->cull_pipeline);
+    vk_destroy_pipeline(vk, test->pipeline);
+
+    vk_destroy_image(vk, test->rt);
+    vk_destroy_framebuffer(vk, test->fb);
+
+    vk_destroy_indirect(vk, test->indirect);
+    vk_destroy_buffer(vk, test->vb);
+    free(test->cmds);
+    free(test->circles);
+
+    vk_cleanup(vk);
+}
+
+static bool
+indirect_test_is_visible(const struct indirect_test_circle *circle)
+{
+    /* matches the compute shader */
+    return fabsf(circle->x) - circle->radius <= 1.0f && fabsf(circle->y) - circle->radius <= 1.0f;
+}
+
+static uint32_t
+indirect_test_cull(struct indirect_test *test)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < test->circle_count; i++) {
+        if (!indirect_test_is_visible(&test->circles[i]))
+            continue;
+
+        test->cmds[count++] = (VkDrawIndirectCommand){
+            .vertexCount = 1,
+            .instanceCount = 1,
+            .firstVertex = i,
+        };
+    }
+
+    return count;
+}
+
+static void
+indirect_test_dispatch_cull(struct indirect_test *test, VkCommandBuffer cmd)
+{
+    struct vk *vk = &test->vk;
+    struct vk_pipeline *pipeline = test->cull_pipeline;
+
+    vk_cmd_reset_indirect(vk, cmd, test->indirect, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                          VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+    vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
+    const VkDescriptorSet sets[] = { test->circle_set->set, test->draw_set->set };
+    vk->CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline_layout, 0,
+                              ARRAY_SIZE(sets), sets, 0, NULL);
+    vk->CmdPushConstants(cmd, pipeline->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(test->circle_count), &test->circle_count);
+
+    const uint32_t local_size = 64;
+    vk->CmdDispatch(cmd, (test->circle_count + local_size - 1) / local_size, 1, 1);
+
+    vk_cmd_indirect_barrier(vk, cmd, test->indirect, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            VK_ACCESS_SHADER_WRITE_BIT);
+}
+
+static void
+indirect_test_draw_circles(struct indirect_test *test,
+                           VkCommandBuffer cmd,
+                           enum indirect_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+
+    const VkImageSubresourceRange subres_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    const VkImageMemoryBarrier barrier1 = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .image = test->rt->img,
+        .subresourceRange = subres_range,
+    };
+    const VkImageMemoryBarrier barrier2 = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .image = test->rt->img,
+        .subresourceRange = subres_range,
+    };
+
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, NULL, 0, NULL, 1,
+                           &barrier1);
+
+    const VkRenderPassBeginInfo pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = test->fb->pass,
+        .framebuffer = test->fb->fb,
+        .renderArea = {
+            .extent = {
+                .width = test->width,
+                .height = test->height,
+            },
+        },
+        .clearValueCount = 1,
+        .pClearValues = &(VkClearValue){
+            .color = {
+                .float32 = { 0.2f, 0.2f, 0.2f, 1.0f },
+            },
+        },
+    };
+    vk->CmdBeginRenderPass(cmd, &pass_info, VK_SUBPASS_CONTENTS_INLINE);
+
+    vk->CmdBindVertexBuffers(cmd, 0, 1, &test->vb->buf, &(VkDeviceSize){ 0 });
+    vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, test->pipeline->pipeline);
+
+    switch (mode) {
+    case INDIRECT_TEST_DIRECT: {
+        const uint32_t count = indirect_test_cull(test);
+        for (uint32_t i = 0; i < count; i++)
+            vk->CmdDraw(cmd, 1, 1, test->cmds[i].firstVertex, 0);
+    } break;
+    case INDIRECT_TEST_INDIRECT: {
+        const uint32_t count = indirect_test_cull(test);
+        vk_write_indirect(vk, test->indirect, 0, test->cmds, count);
+        vk_cmd_draw_indirect(vk, cmd, test->indirect, count, false);
+    } break;
+    case INDIRECT_TEST_GPU:
+        vk_cmd_draw_indirect_count(vk, cmd, test->indirect, false);
+        break;
+    default:
+        vk_die("bad mode");
+        break;
+    }
+
+    vk->CmdEndRenderPass(cmd);
+
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                           VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 0, NULL, 1, &barrier2);
+}
+
+static void
+indirect_test_draw(struct indirect_test *test, VkCommandBuffer cmd, enum indirect_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+
+    if (mode == INDIRECT_TEST_GPU)
+        indirect_test_dispatch_cull(test, cmd);
+
+    indirect_test_draw_circles(test, cmd, mode);
+
+    /* for the draw count check */
+    if (mode == INDIRECT_TEST_GPU) {
+        const VkMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        };
+        vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                               VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+    }
+}
+
+static void
+indirect_test_run(struct indirect_test *test, enum indirect_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+    const char *mode_name = indirect_test_mode_names[mode];
+
+    /* vk_cmd_draw_indirect_count cannot split the draws */
+    if (mode == INDIRECT_TEST_GPU &&
+        (!vk->vulkan_12_features.drawIndirectCount ||
+         test->circle_count > vk->props.properties.limits.maxDrawIndirectCount)) {
+        vk_log("%s: unsupported", mode_name);
+        return;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "indirect.%s", mode_name);
+
+    const struct vk_bench_params params = {
+        .name = name,
+        .warmup_iterations = 2,
+        .iterations = test->iterations,
+        .gpu = true,
+    };
+    struct vk_bench *bench = vk_create_bench(vk, &params);
+    while (vk_bench_next(vk, bench)) {
+        /* the cpu time covers culling, recording, and submission */
+        vk_wait(vk);
+        vk_bench_cpu_begin(bench);
+
+        VkCommandBuffer cmd = vk_begin_cmd(vk);
+        vk_bench_cmd_begin(vk, bench, cmd);
+        indirect_test_draw(test, cmd, mode);
+        vk_bench_cmd_end(vk, bench, cmd);
+        vk_end_cmd(vk);
+    }
+    vk_wait(vk);
+
+    if (!vk_bench_report(vk, bench))
+        test->regressed = true;
+
+    if (mode == INDIRECT_TEST_GPU) {
+        const uint32_t count = vk_read_indirect_count(test->indirect);
+        if (count != test->visible_count)
+            vk_die("gpu drew %u circles, not %u", count, test->visible_count);
+    }
+
+    vk_log("  %u of %u circles, %.1f us cpu, %.1f us gpu", test->visible_count,
+           test->circle_count, bench->cpu.median / 1000.0, bench->gpu.median / 1000.0);
+
+    vk_destroy_bench(vk, bench);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct indirect_test test = {
+        .color_format = VK_FORMAT_B8G8R8A8_UNORM,
+        .width = 300,
+        .height = 300,
+        .circle_count = 4096,
+        .iterations = 50,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        bool found = false;
+        for (uint32_t j = 0; j < INDIRECT_TEST_MODE_COUNT; j++) {
+            if (!strcmp(argv[i], indirect_test_mode_names[j])) {
+                test.modes |= 1u << j;
+                found = true;
+            }
+        }
+        if (found)
+            continue;
+
+        if (!strncmp(argv[i], "circles=", 8)) {
+            test.circle_count = atoi(argv[i] + 8);
+            if (!test.circle_count)
+                vk_die("invalid circle count %s", argv[i] + 8);
+        } else if (!strncmp(argv[i], "iterations=", 11)) {
+            test.iterations = atoi(argv[i] + 11);
+            if (!test.iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+    if (!test.modes)
+        test.modes = (1u << INDIRECT_TEST_MODE_COUNT) - 1;
+
+    indirect_test_init(&test);
+    test.visible_count = indirect_test_cull(&test);
+
+    for (uint32_t i = 0; i < INDIRECT_TEST_MODE_COUNT; i++) {
+        if (test.modes & (1u << i))
+            indirect_test_run(&test, i);
+    }
+    vk_dump_image(&test.vk, test.rt, VK_IMAGE_ASPECT_COLOR_BIT, "rt.ppm");
+
+    indirect_test_cleanup(&test);
+
+    return test.regressed;
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+#version 460 core
+
+layout(location = 0) in vec3 in_color;
+layout(location = 0) out vec4 out_color;
+
+void main()
+{
+    out_color = vec4(in_color, 1.0);
+}
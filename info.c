@@ -47,6 +47,13 @@ info_physical_device(struct vk *vk)
                (mt->propertyFlags & VK_MEMORY_PROPERTY_PROTECTED_BIT) ? "Pr" : "-");
     }
 
+    vk_log("  queues:");
+    vk_log("    graphics: family %d", vk->graphics_queue->family_index);
+    vk_log("    compute: family %d%s", vk->compute_queue->family_index,
+           vk->compute_queue == vk->graphics_queue ? " (aliased)" : "");
+    vk_log("    transfer: family %d%s", vk->transfer_queue->family_index,
+           vk->transfer_queue == vk->graphics_queue ? " (aliased)" : "");
+
     free(exts);
 }
 
@@ -6,7 +6,8 @@
 /* This test draws an RGB triangle to a tiled MSAA color image, resolves it to
  * a linear image, and dumps the linear image to a file.
  *
- * A render pass is used to clear, draw, and resolve the MSAA image.
+ * A render pass is used to clear, draw, and resolve the MSAA image.  The MSAA
+ * image is a transient attachment and is lazily allocated when possible.
  */
 
 #include "vkutil.h"
@@ -88,9 +89,11 @@ msaa_test_init_framebuffer(struct msaa_test *test)
 {
     struct vk *vk = &test->vk;
 
-    test->rt =
-        vk_create_image(vk, test->color_format, test->width, test->height, VK_SAMPLE_COUNT_4_BIT,
-                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    /* the msaa image is discarded after resolve */
+    test->rt = vk_create_image(
+        vk, test->color_format, test->width, test->height, VK_SAMPLE_COUNT_4_BIT,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT);
     vk_create_image_render_view(vk, test->rt, VK_IMAGE_ASPECT_COLOR_BIT);
 
     test->resolved =
@@ -109,7 +112,7 @@ msaa_test_init_vb(struct msaa_test *test)
 
     test->vb =
         vk_create_buffer(vk, sizeof(msaa_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, msaa_test_vertices, sizeof(msaa_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, msaa_test_vertices, sizeof(msaa_test_vertices));
 }
 
 static void
@@ -141,48 +144,9 @@ msaa_test_cleanup(struct msaa_test *test)
 }
 
 static void
-msaa_test_draw_triangle(struct msaa_test *test, VkCommandBuffer cmd)
+msaa_test_draw_triangle(struct vk *vk, VkCommandBuffer cmd, void *data)
 {
-    struct vk *vk = &test->vk;
-
-    const VkImageSubresourceRange subres_range = {
-        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .levelCount = 1,
-        .layerCount = 1,
-    };
-    const VkImageMemoryBarrier barriers1[2] = {
-        [0] = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .srcAccessMask = 0,
-            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .image = test->rt->img,
-            .subresourceRange = subres_range,
-        },
-        [1] = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .srcAccessMask = 0,
-            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .image = test->resolved->img,
-            .subresourceRange = subres_range,
-        },
-    };
-    const VkImageMemoryBarrier barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .image = test->resolved->img,
-        .subresourceRange = subres_range,
-    };
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, NULL, 0, NULL, 2,
-                           barriers1);
+    struct msaa_test *test = data;
 
     const VkRenderPassBeginInfo pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -209,23 +173,57 @@ msaa_test_draw_triangle(struct msaa_test *test, VkCommandBuffer cmd)
     vk->CmdDraw(cmd, 3, 1, 0, 0);
 
     vk->CmdEndRenderPass(cmd);
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                           VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 0, NULL, 1, &barrier2);
 }
 
 static void
 msaa_test_draw(struct msaa_test *test)
 {
     struct vk *vk = &test->vk;
+    struct vk_graph *graph = vk_create_graph(vk);
+
+    /* the render pass clears, draws, and resolves */
+    struct vk_graph_pass *pass = vk_add_graph_pass(vk, graph, msaa_test_draw_triangle, test);
+    vk_add_graph_pass_image(vk, pass,
+                            &(struct vk_transition){
+                                .img = test->rt,
+                                .discard = true,
+                                .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                            });
+    vk_add_graph_pass_image(vk, pass,
+                            &(struct vk_transition){
+                                .img = test->resolved,
+                                .discard = true,
+                                .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                            });
+    vk_add_graph_pass_buffer(vk, pass, test->vb, VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+                             VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT);
+
+    vk_add_graph_image_output(vk, graph,
+                              &(struct vk_transition){
+                                  .img = test->resolved,
+                                  .layout = VK_IMAGE_LAYOUT_GENERAL,
+                                  .stage = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                  .access = VK_ACCESS_2_HOST_READ_BIT,
+                              });
 
     VkCommandBuffer cmd = vk_begin_cmd(vk);
-
-    msaa_test_draw_triangle(test, cmd);
-
+    vk_record_graph(vk, graph, cmd);
     vk_end_cmd(vk);
     vk_wait(vk);
 
+    vk_destroy_graph(vk, graph);
+
+    if (test->rt->mem_lazy) {
+        VkDeviceSize committed;
+        vk->GetDeviceMemoryCommitment(vk->dev, test->rt->mem, &committed);
+        vk_log("msaa image committed %" PRIu64 " of %" PRIu64 " bytes", committed,
+               test->rt->mem_size);
+    }
+
     vk_dump_image(vk, test->resolved, VK_IMAGE_ASPECT_COLOR_BIT, "rt.ppm");
 }
 
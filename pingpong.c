@@ -0,0 +1,241 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks the host/GPU round-trip latency.
+ *
+ * With events, the GPU sets a ready event, waits for an event set by the
+ * host, and sets a done event.  The round trip is from the host setting its
+ * event to the host observing the done event, which is polled with a 1ms
+ * sleep in the "sleep" mode and with vk_backoff in the "spin" mode.
+ *
+ * With timeline semaphores, a submission waits for a host-signaled value.
+ * The round trip is from the host signaling the value to the host observing
+ * the completion of the submission, which is waited for with WaitSemaphores
+ * in the "timeline" mode and polled with vk_backoff in the "timeline_spin"
+ * mode.
+ *
+ * A latency histogram is reported for each mode.
+ */
+
+#include "vkutil.h"
+
+enum pingpong_test_mode {
+    PINGPONG_TEST_SLEEP,
+    PINGPONG_TEST_SPIN,
+    PINGPONG_TEST_TIMELINE,
+    PINGPONG_TEST_TIMELINE_SPIN,
+    PINGPONG_TEST_MODE_COUNT,
+};
+
+static const char *const pingpong_test_mode_names[] = {
+    [PINGPONG_TEST_SLEEP] = "sleep",
+    [PINGPONG_TEST_SPIN] = "spin",
+    [PINGPONG_TEST_TIMELINE] = "timeline",
+    [PINGPONG_TEST_TIMELINE_SPIN] = "timeline_spin",
+};
+
+struct pingpong_test {
+    uint32_t iterations;
+    uint32_t modes;
+
+    struct vk vk;
+    struct vk_event *gpu_ready;
+    struct vk_event *cpu_done;
+    struct vk_event *gpu_done;
+    VkSemaphore host_timeline;
+    uint64_t host_point;
+    /* the submission of the previous event round */
+    uint64_t event_point;
+
+    bool regressed;
+};
+
+static void
+pingpong_test_init(struct pingpong_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_init(vk, NULL);
+
+    test->gpu_ready = vk_create_event(vk);
+    test->cpu_done = vk_create_event(vk);
+    test->gpu_done = vk_create_event(vk);
+    test->host_timeline = vk_create_timeline_semaphore(vk, 0);
+}
+
+static void
+pingpong_test_cleanup(struct pingpong_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk->DestroySemaphore(vk->dev, test->host_timeline, NULL);
+    vk_destroy_event(vk, test->gpu_done);
+    vk_destroy_event(vk, test->cpu_done);
+    vk_destroy_event(vk, test->gpu_ready);
+
+    vk_cleanup(vk);
+}
+
+static void
+pingpong_test_round_event(struct pingpong_test *test, struct vk_bench *bench, bool spin)
+{
+    struct vk *vk = &test->vk;
+
+    /* the events and the command buffer are reused; wait outside of the sample */
+    vk_wait_point(vk, test->event_point);
+
+    vk->ResetEvent(vk->dev, test->gpu_ready->event);
+    vk->ResetEvent(vk->dev, test->cpu_done->event);
+    vk->ResetEvent(vk->dev, test->gpu_done->event);
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+    vk->CmdSetEvent(cmd, test->gpu_ready->event, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+    vk->CmdWaitEvents(cmd, 1, &test->cpu_done->event, VK_PIPELINE_STAGE_HOST_BIT,
+                      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, NULL, 0, NULL, 0, NULL);
+    vk->CmdSetEvent(cmd, test->gpu_done->event, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    test->event_point = vk_end_cmd(vk);
+
+    /* exclude the submission */
+    vk_wait_event(vk, test->gpu_ready);
+    vk_bench_cpu_begin(bench);
+
+    vk->SetEvent(vk->dev, test->cpu_done->event);
+    if (spin) {
+        vk_wait_event(vk, test->gpu_done);
+    } else {
+        while (vk->GetEventStatus(vk->dev, test->gpu_done->event) != VK_EVENT_SET)
+            vk_sleep(1);
+    }
+}
+
+static void
+pingpong_test_round_timeline(struct pingpong_test *test, struct vk_bench *bench, bool spin)
+{
+    struct vk *vk = &test->vk;
+    const uint64_t host_point = ++test->host_point;
+    const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    vk_begin_cmd(vk);
+    const uint64_t point = vk_submit_queue_cmd(vk, vk->graphics_queue, &test->host_timeline,
+                                               &host_point, &wait_stage, 1, VK_NULL_HANDLE);
+
+    vk_bench_cpu_begin(bench);
+
+    vk_signal_timeline_semaphore(vk, test->host_timeline, host_point);
+    vk_wait_timeline_semaphore(vk, vk->graphics_queue->submit.timeline, point, spin);
+}
+
+/* Each bucket is twice as wide as the previous one. */
+static void
+pingpong_test_dump_histogram(const struct vk_bench *bench)
+{
+    /* sorted by vk_bench_next */
+    const double *samples = bench->cpu_samples;
+    const uint32_t count = bench->sample_count;
+    if (!count)
+        return;
+
+    uint32_t begin = 0;
+    double bucket_max = 1000.0;
+    while (begin < count) {
+        uint32_t end = begin;
+        while (end < count && samples[end] < bucket_max)
+            end++;
+
+        if (end > begin) {
+            char bar[41];
+            const uint32_t len = (uint32_t)((uint64_t)(end - begin) * (sizeof(bar) - 1) / count);
+            memset(bar, '#', len);
+            bar[len] = '\0';
+
+            vk_log("  < %8.0f us: %6u %s", bucket_max / 1000.0, end - begin, bar);
+        }
+
+        begin = end;
+        bucket_max *= 2.0;
+    }
+}
+
+static void
+pingpong_test_run(struct pingpong_test *test, enum pingpong_test_mode mode)
+{
+    struct vk *vk = &test->vk;
+
+    char name[64];
+    snprintf(name, sizeof(name), "pingpong.%s", pingpong_test_mode_names[mode]);
+
+    const struct vk_bench_params params = {
+        .name = name,
+        .warmup_iterations = 10,
+        .iterations = test->iterations,
+        .keep_outliers = true,
+    };
+    struct vk_bench *bench = vk_create_bench(vk, &params);
+    while (vk_bench_next(vk, bench)) {
+        switch (mode) {
+        case PINGPONG_TEST_SLEEP:
+            pingpong_test_round_event(test, bench, false);
+            break;
+        case PINGPONG_TEST_SPIN:
+            pingpong_test_round_event(test, bench, true);
+            break;
+        case PINGPONG_TEST_TIMELINE:
+            pingpong_test_round_timeline(test, bench, false);
+            break;
+        case PINGPONG_TEST_TIMELINE_SPIN:
+            pingpong_test_round_timeline(test, bench, true);
+            break;
+        default:
+            vk_die("bad mode");
+            break;
+        }
+    }
+    vk_wait(vk);
+
+    if (!vk_bench_report(vk, bench))
+        test->regressed = true;
+    pingpong_test_dump_histogram(bench);
+
+    vk_destroy_bench(vk, bench);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct pingpong_test test = {
+        .iterations = 200,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        bool found = false;
+        for (uint32_t j = 0; j < PINGPONG_TEST_MODE_COUNT; j++) {
+            if (!strcmp(argv[i], pingpong_test_mode_names[j])) {
+                test.modes |= 1u << j;
+                found = true;
+            }
+        }
+        if (found)
+            continue;
+
+        if (!strncmp(argv[i], "iterations=", 11)) {
+            test.iterations = atoi(argv[i] + 11);
+            if (!test.iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+    if (!test.modes)
+        test.modes = (1u << PINGPONG_TEST_MODE_COUNT) - 1;
+
+    pingpong_test_init(&test);
+    for (uint32_t i = 0; i < PINGPONG_TEST_MODE_COUNT; i++) {
+        if (test.modes & (1u << i))
+            pingpong_test_run(&test, i);
+    }
+    pingpong_test_cleanup(&test);
+
+    return test.regressed;
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks the present loop on a headless surface.
+ *
+ * A swapchain is created for each supported present mode.  Each frame
+ * acquires an image, clears it, and presents it, with up to frames_in_flight
+ * frames in flight.  Frames per second, acquire latency, and present latency are
+ * reported.  No display is needed.
+ */
+
+#include "vkutil.h"
+
+struct present_test_stats {
+    uint64_t acquire_total;
+    uint64_t acquire_max;
+    uint64_t present_total;
+    uint64_t present_max;
+    uint32_t out_of_date_count;
+};
+
+struct present_test {
+    VkFormat color_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frame_count;
+    uint32_t frames_in_flight;
+    VkPresentModeKHR mode;
+    bool all_modes;
+
+    struct vk vk;
+    VkSurfaceKHR surf;
+};
+
+static void
+present_test_init(struct present_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    const char *instance_exts[] = {
+        VK_KHR_SURFACE_EXTENSION_NAME,
+        VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+    };
+    const char *dev_exts[] = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    };
+
+    const struct vk_init_params params = {
+        .instance_exts = instance_exts,
+        .instance_ext_count = ARRAY_SIZE(instance_exts),
+        .dev_exts = dev_exts,
+        .dev_ext_count = ARRAY_SIZE(dev_exts),
+    };
+    vk_init(vk, &params);
+
+    test->surf = vk_create_headless_surface(vk);
+}
+
+static void
+present_test_cleanup(struct present_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk->DestroySurfaceKHR(vk->instance, test->surf, NULL);
+    vk_cleanup(vk);
+}
+
+static const char *
+present_test_mode_name(VkPresentModeKHR mode)
+{
+    switch (mode) {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+        return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+        return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR:
+        return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+        return "FIFO_RELAXED";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static bool
+present_test_mode_supported(struct present_test *test, VkPresentModeKHR mode)
+{
+    struct vk *vk = &test->vk;
+
+    VkPresentModeKHR modes[8];
+    uint32_t count = ARRAY_SIZE(modes);
+    vk->result =
+        vk->GetPhysicalDeviceSurfacePresentModesKHR(vk->physical_dev, test->surf, &count, modes);
+    if (vk->result < VK_SUCCESS)
+        vk_check(vk, "failed to get surface present modes");
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (modes[i] == mode)
+            return true;
+    }
+
+    return false;
+}
+
+static void
+present_test_draw(struct present_test *test,
+                  struct vk_swapchain *swapchain,
+                  struct vk_image *img,
+                  uint32_t frame)
+{
+    struct vk *vk = &test->vk;
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+
+    struct vk_transition transition = {
+        .img = img,
+        .discard = true,
+        .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .stage = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+        .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+    };
+    vk_cmd_transition(vk, cmd, &transition, 1);
+
+    const VkClearColorValue clear_val = {
+        .float32 = { (float)(frame % 256) / 255.0f, 0.5f, 0.5f, 1.0f },
+    };
+    const VkImageSubresourceRange subres_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    vk->CmdClearColorImage(cmd, img->img, transition.layout, &clear_val, 1, &subres_range);
+
+    transition.discard = false;
+    transition.layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    transition.stage = VK_PIPELINE_STAGE_2_NONE;
+    transition.access = VK_ACCESS_2_NONE;
+    vk_cmd_transition(vk, cmd, &transition, 1);
+
+    vk_end_swapchain_cmd(vk, swapchain);
+}
+
+static void
+present_test_loop(struct present_test *test, VkPresentModeKHR mode)
+{
+    struct vk *vk = &test->vk;
+
+    if (!present_test_mode_supported(test, mode)) {
+        vk_log("%s: unsupported", present_test_mode_name(mode));
+        return;
+    }
+
+    struct vk_swapchain *swapchain =
+        vk_create_swapchain(vk, test->surf, test->color_format, test->width, test->height, mode,
+                            VK_IMAGE_USAGE_TRANSFER_DST_BIT, test->frames_in_flight);
+
+    struct present_test_stats stats = { 0 };
+    const uint64_t begin = vk_now();
+    for (uint32_t i = 0; i < test->frame_count; i++) {
+        const uint64_t acquire_begin = vk_now();
+        struct vk_image *img = vk_acquire_swapchain_image(vk, swapchain);
+        const uint64_t acquire_end = vk_now();
+
+        if (!img) {
+            stats.out_of_date_count++;
+            vk_recreate_swapchain(vk, swapchain, test->width, test->height);
+            continue;
+        }
+
+        present_test_draw(test, swapchain, img, i);
+
+        const uint64_t present_begin = vk_now();
+        if (vk_present_swapchain_image(vk, swapchain) == VK_ERROR_OUT_OF_DATE_KHR)
+            stats.out_of_date_count++;
+        const uint64_t present_end = vk_now();
+
+        const uint64_t acquire_dur = acquire_end - acquire_begin;
+        const uint64_t present_dur = present_end - present_begin;
+        stats.acquire_total += acquire_dur;
+        stats.present_total += present_dur;
+        if (stats.acquire_max < acquire_dur)
+            stats.acquire_max = acquire_dur;
+        if (stats.present_max < present_dur)
+            stats.present_max = present_dur;
+    }
+    vk_wait(vk);
+    const uint64_t end = vk_now();
+
+    vk_destroy_swapchain(vk, swapchain);
+
+    const double secs = (double)(end - begin) / 1000000000.0;
+    vk_log("%s: %u frames, %u in flight, %.1f fps", present_test_mode_name(mode),
+           test->frame_count, test->frames_in_flight, (double)test->frame_count / secs);
+    vk_log("  acquire: avg %.1f us, max %.1f us",
+           (double)stats.acquire_total / test->frame_count / 1000.0,
+           (double)stats.acquire_max / 1000.0);
+    vk_log("  present: avg %.1f us, max %.1f us",
+           (double)stats.present_total / test->frame_count / 1000.0,
+           (double)stats.present_max / 1000.0);
+    if (stats.out_of_date_count)
+        vk_log("  out of date: %u", stats.out_of_date_count);
+}
+
+static void
+present_test_run(struct present_test *test)
+{
+    if (!test->all_modes) {
+        present_test_loop(test, test->mode);
+        return;
+    }
+
+    const VkPresentModeKHR modes[] = {
+        VK_PRESENT_MODE_FIFO_KHR,
+        VK_PRESENT_MODE_MAILBOX_KHR,
+        VK_PRESENT_MODE_IMMEDIATE_KHR,
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(modes); i++)
+        present_test_loop(test, modes[i]);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct present_test test = {
+        .color_format = VK_FORMAT_B8G8R8A8_UNORM,
+        .width = 1920,
+        .height = 1080,
+        .frame_count = 300,
+        .frames_in_flight = 2,
+        .all_modes = true,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "fifo")) {
+            test.mode = VK_PRESENT_MODE_FIFO_KHR;
+            test.all_modes = false;
+        } else if (!strcmp(argv[i], "mailbox")) {
+            test.mode = VK_PRESENT_MODE_MAILBOX_KHR;
+            test.all_modes = false;
+        } else if (!strcmp(argv[i], "immediate")) {
+            test.mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            test.all_modes = false;
+        } else if (!strncmp(argv[i], "frames=", 7)) {
+            test.frame_count = atoi(argv[i] + 7);
+            if (!test.frame_count)
+                vk_die("invalid frame count %s", argv[i] + 7);
+        } else if (!strncmp(argv[i], "frames_in_flight=", 17)) {
+            test.frames_in_flight = atoi(argv[i] + 17);
+        } else if (!strncmp(argv[i], "size=", 5)) {
+            if (sscanf(argv[i] + 5, "%ux%u", &test.width, &test.height) != 2)
+                vk_die("invalid size %s", argv[i] + 5);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    present_test_init(&test);
+    present_test_run(&test);
+    present_test_cleanup(&test);
+
+    return 0;
+}
@@ -106,7 +106,7 @@ push_const_test_init_ubo(struct push_const_test *test)
     };
 
     test->ubo = vk_create_buffer(vk, sizeof(color), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
-    memcpy(test->ubo->mem_ptr, color, sizeof(color));
+    vk_write_buffer(vk, test->ubo, 0, color, sizeof(color));
 }
 
 static void
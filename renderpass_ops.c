@@ -40,7 +40,7 @@ struct renderpass_ops_test_format {
     bool ycbcr;
     uint32_t plane_count;
 
-    VkFormatProperties2 props;
+    VkFormatProperties props;
 };
 
 static struct renderpass_ops_test_format renderpass_ops_test_formats[] = {
@@ -109,12 +109,12 @@ renderpass_ops_test_init_formats(struct renderpass_ops_test *test)
 {
     struct vk *vk = &test->vk;
 
+    struct vk_format_caps *caps = vk_create_format_caps(vk);
     for (uint32_t i = 0; i < ARRAY_SIZE(renderpass_ops_test_formats); i++) {
         struct renderpass_ops_test_format *fmt = &renderpass_ops_test_formats[i];
-
-        fmt->props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, fmt->format, &fmt->props);
+        fmt->props = vk_get_format_caps(caps, fmt->format)->props;
     }
+    vk_destroy_format_caps(vk, caps);
 }
 
 static void
@@ -451,8 +451,8 @@ renderpass_ops_test_draw(struct renderpass_ops_test *test)
 {
     for (uint32_t i = 0; i < ARRAY_SIZE(renderpass_ops_test_formats); i++) {
         const struct renderpass_ops_test_format *fmt = &renderpass_ops_test_formats[i];
-        const VkFormatFeatureFlags linear = fmt->props.formatProperties.linearTilingFeatures;
-        const VkFormatFeatureFlags optimal = fmt->props.formatProperties.optimalTilingFeatures;
+        const VkFormatFeatureFlags linear = fmt->props.linearTilingFeatures;
+        const VkFormatFeatureFlags optimal = fmt->props.optimalTilingFeatures;
 
         if (fmt->color) {
             if (linear & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks the RGB to BGRA and RGB to NV12 conversions used by
+ * vk_create_image_from_ppm.
+ *
+ * The per-pixel scalar loops, the scalar row converters, the SIMD row
+ * converters, and the threaded SIMD row converters are timed and their
+ * outputs are compared.
+ */
+
+#include "vkutil.h"
+
+struct rgb_convert_test {
+    uint32_t width;
+    uint32_t height;
+    uint32_t loop;
+
+    uint8_t *rgb;
+    uint8_t *ref;
+    uint8_t *dst;
+};
+
+static void
+rgb_convert_test_init(struct rgb_convert_test *test)
+{
+    const size_t pixel_count = (size_t)test->width * test->height;
+
+    test->rgb = malloc(pixel_count * 3);
+    test->ref = malloc(pixel_count * 4);
+    test->dst = malloc(pixel_count * 4);
+    if (!test->rgb || !test->ref || !test->dst)
+        vk_die("failed to alloc buffers");
+
+    srand(1);
+    for (size_t i = 0; i < pixel_count * 3; i++)
+        test->rgb[i] = rand();
+}
+
+static void
+rgb_convert_test_cleanup(struct rgb_convert_test *test)
+{
+    free(test->rgb);
+    free(test->ref);
+    free(test->dst);
+}
+
+static void
+rgb_convert_test_per_pixel(struct rgb_convert_test *test, bool planar)
+{
+    const uint8_t *rgb_data = test->rgb;
+
+    for (uint32_t y = 0; y < test->height; y++) {
+        if (planar) {
+            uint8_t *y_dst = test->ref + test->width * y;
+            uint8_t *uv_dst = test->ref + test->width * test->height + test->width * y / 2;
+
+            for (uint32_t x = 0; x < test->width; x++) {
+                uint8_t yuv[3];
+                vk_rgb_to_yuv(rgb_data, yuv);
+                rgb_data += 3;
+
+                y_dst[0] = yuv[0];
+                y_dst++;
+                if (!((x | y) & 1)) {
+                    uv_dst[0] = yuv[1];
+                    uv_dst[1] = yuv[2];
+                    uv_dst += 2;
+                }
+            }
+        } else {
+            uint8_t *dst = test->ref + test->width * 4 * y;
+            for (uint32_t x = 0; x < test->width; x++) {
+                dst[0] = rgb_data[2];
+                dst[1] = rgb_data[1];
+                dst[2] = rgb_data[0];
+                dst[3] = 0xff;
+
+                rgb_data += 3;
+                dst += 4;
+            }
+        }
+    }
+}
+
+static void
+rgb_convert_test_rows(struct rgb_convert_test *test,
+                      bool planar,
+                      bool simd,
+                      uint32_t thread_count)
+{
+    vk_rgb_convert(&(struct vk_rgb_convert){
+        .rgb = test->rgb,
+        .width = test->width,
+        .height = test->height,
+        .dst = test->dst,
+        .dst_pitch = planar ? test->width : test->width * 4,
+        .uv = planar ? test->dst + test->width * test->height : NULL,
+        .uv_pitch = test->width,
+        .simd = simd,
+        .thread_count = thread_count,
+    });
+}
+
+static void
+rgb_convert_test_report(struct rgb_convert_test *test, const char *name, uint64_t ns)
+{
+    const double mpixels = (double)test->width * test->height * test->loop / 1000000.0;
+    vk_log("%-24s: %8.1f MP/s", name, mpixels / ((double)ns / 1000000000.0));
+}
+
+static void
+rgb_convert_test_draw(struct rgb_convert_test *test, bool planar)
+{
+    const struct {
+        const char *name;
+        bool simd;
+        uint32_t thread_count;
+    } variants[] = {
+        { "rows", false, 1 },
+        { "rows/simd", true, 1 },
+        { "rows/simd/threads", true, 0 },
+    };
+    const size_t size = planar ? (size_t)test->width * test->height * 3 / 2
+                               : (size_t)test->width * test->height * 4;
+
+    vk_log("%s %ux%u", planar ? "nv12" : "bgra", test->width, test->height);
+
+    uint64_t begin = vk_now();
+    for (uint32_t i = 0; i < test->loop; i++)
+        rgb_convert_test_per_pixel(test, planar);
+    rgb_convert_test_report(test, "per-pixel", vk_now() - begin);
+
+    for (uint32_t v = 0; v < ARRAY_SIZE(variants); v++) {
+        memset(test->dst, 0, size);
+
+        begin = vk_now();
+        for (uint32_t i = 0; i < test->loop; i++)
+            rgb_convert_test_rows(test, planar, variants[v].simd, variants[v].thread_count);
+        rgb_convert_test_report(test, variants[v].name, vk_now() - begin);
+
+        if (memcmp(test->ref, test->dst, size))
+            vk_die("%s does not match per-pixel", variants[v].name);
+    }
+}
+
+int
+main(void)
+{
+    struct rgb_convert_test test = {
+        .width = 1920,
+        .height = 1080,
+        .loop = 20,
+    };
+
+    rgb_convert_test_init(&test);
+    rgb_convert_test_draw(&test, false);
+    rgb_convert_test_draw(&test, true);
+    rgb_convert_test_cleanup(&test);
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This runs the tests in one process such that they share one instance and
+ * one device.
+ *
+ * Each test is built with its main renamed to <test>_test_main.  The tests run
+ * in sequence, or concurrently with the concurrent option, and the time of
+ * each test is reported.  Tests can be selected by names.  Tests whose params
+ * are incompatible with the shared device create their own device.
+ *
+ * A test fails when it returns non-zero or calls vk_die.  vk_die returns to
+ * the runner, which leaks the resources of the test but reports it and runs
+ * the remaining tests.
+ */
+
+#include "vkutil.h"
+
+#define RUNNER_TEST_MAIN_false(name)                                                             \
+    int name##_test_main(void);                                                                  \
+    static int name##_runner_main(int argc, const char **argv)                                   \
+    {                                                                                            \
+        return name##_test_main();                                                               \
+    }
+#define RUNNER_TEST_MAIN_true(name)                                                              \
+    int name##_test_main(int argc, const char **argv);                                           \
+    static int name##_runner_main(int argc, const char **argv)                                   \
+    {                                                                                            \
+        return name##_test_main(argc, argv);                                                     \
+    }
+#define VK_RUNNER_TEST(name, has_args) RUNNER_TEST_MAIN_##has_args(name)
+#include "runner_tests.inc"
+
+struct runner_test {
+    const char *name;
+    int (*main)(int argc, const char **argv);
+
+    bool selected;
+    pthread_t thread;
+    int ret;
+    uint64_t duration;
+};
+
+static struct runner_test runner_tests[] = {
+#define VK_RUNNER_TEST(name, has_args)                                                           \
+    {                                                                                            \
+        .name = #name,                                                                           \
+        .main = name##_runner_main,                                                              \
+    },
+#include "runner_tests.inc"
+};
+
+struct runner {
+    bool concurrent;
+
+    struct vk vk;
+};
+
+static void
+runner_init(struct runner *runner)
+{
+    struct vk *vk = &runner->vk;
+
+    const struct vk_init_params params = {
+        .enable_all_features = true,
+    };
+    vk_init(vk, &params);
+
+    vk_shared = vk;
+}
+
+static void
+runner_cleanup(struct runner *runner)
+{
+    struct vk *vk = &runner->vk;
+
+    vk_shared = NULL;
+    vk_cleanup(vk);
+}
+
+static void *
+runner_run_test(void *arg)
+{
+    struct runner_test *test = arg;
+    const char *argv[] = { test->name, NULL };
+
+    vk_test_name = test->name;
+
+    jmp_buf jmp;
+    vk_die_jmp = &jmp;
+
+    const uint64_t begin = vk_now();
+    if (setjmp(jmp))
+        test->ret = -1;
+    else
+        test->ret = test->main(1, argv);
+    test->duration = vk_now() - begin;
+
+    vk_die_jmp = NULL;
+    vk_test_name = NULL;
+
+    return NULL;
+}
+
+static int
+runner_run(struct runner *runner)
+{
+    const uint64_t begin = vk_now();
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(runner_tests); i++) {
+        struct runner_test *test = &runner_tests[i];
+        if (!test->selected)
+            continue;
+
+        if (runner->concurrent) {
+            if (pthread_create(&test->thread, NULL, runner_run_test, test))
+                vk_die("failed to create thread");
+        } else {
+            vk_log("running %s", test->name);
+            runner_run_test(test);
+        }
+    }
+
+    if (runner->concurrent) {
+        for (uint32_t i = 0; i < ARRAY_SIZE(runner_tests); i++) {
+            if (runner_tests[i].selected)
+                pthread_join(runner_tests[i].thread, NULL);
+        }
+    }
+
+    const uint64_t end = vk_now();
+
+    uint32_t fail_count = 0;
+    for (uint32_t i = 0; i < ARRAY_SIZE(runner_tests); i++) {
+        const struct runner_test *test = &runner_tests[i];
+        if (!test->selected)
+            continue;
+
+        vk_log("%-20s %s %10.3f ms", test->name, test->ret ? "FAIL" : "PASS",
+               (double)test->duration / 1000000.0);
+        if (test->ret)
+            fail_count++;
+    }
+    vk_log("%-20s %u failed %6.3f ms", "total", fail_count, (double)(end - begin) / 1000000.0);
+
+    return fail_count ? 1 : 0;
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct runner runner = {
+        .concurrent = false,
+    };
+
+    bool select_all = true;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "concurrent")) {
+            runner.concurrent = true;
+            continue;
+        }
+
+        bool found = false;
+        for (uint32_t j = 0; j < ARRAY_SIZE(runner_tests); j++) {
+            if (!strcmp(argv[i], runner_tests[j].name)) {
+                runner_tests[j].selected = true;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            vk_die("unknown test %s", argv[i]);
+
+        select_all = false;
+    }
+
+    if (select_all) {
+        for (uint32_t i = 0; i < ARRAY_SIZE(runner_tests); i++)
+            runner_tests[i].selected = true;
+    }
+
+    runner_init(&runner);
+    const int ret = runner_run(&runner);
+    runner_cleanup(&runner);
+
+    return ret;
+}
@@ -215,45 +215,32 @@ sdl_test_draw(struct sdl_test *test, struct vk_image *img)
 
     VkCommandBuffer cmd = vk_begin_cmd(vk);
 
-    const VkImageSubresourceRange subres_range = {
-        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .levelCount = 1,
-        .layerCount = 1,
+    struct vk_transition transition = {
+        .img = img,
+        .discard = true,
+        .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .stage = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+        .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
     };
-    const VkImageMemoryBarrier barrier1 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .image = img->img,
-        .subresourceRange = subres_range,
-    };
-    const VkImageMemoryBarrier barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = 0,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-        .image = img->img,
-        .subresourceRange = subres_range,
-    };
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                           0, 0, NULL, 0, NULL, 1, &barrier1);
+    vk_cmd_transition(vk, cmd, &transition, 1);
 
     const VkClearColorValue clear_val = {
         .float32 = { 1.0f, 0.5f, 0.5f, 1.0f },
     };
+    const VkImageSubresourceRange subres_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    vk->CmdClearColorImage(cmd, img->img, transition.layout, &clear_val, 1, &subres_range);
 
-    vk->CmdClearColorImage(cmd, img->img, barrier1.newLayout, &clear_val, 1, &subres_range);
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1,
-                           &barrier2);
+    transition.discard = false;
+    transition.layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    transition.stage = VK_PIPELINE_STAGE_2_NONE;
+    transition.access = VK_ACCESS_2_NONE;
+    vk_cmd_transition(vk, cmd, &transition, 1);
 
-    vk_end_cmd(vk);
-    vk_wait(vk);
+    vk_end_swapchain_cmd(vk, test->swapchain);
 }
 
 static void
@@ -350,7 +337,7 @@ sdl_test_redraw_window(struct sdl_test *test)
         vk_log("create swapchain %dx%d", test->win_width, test->win_height);
         test->swapchain = vk_create_swapchain(
             vk, test->surf, VK_FORMAT_B8G8R8A8_UNORM, test->win_width, test->win_height,
-            VK_PRESENT_MODE_FIFO_KHR, VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+            VK_PRESENT_MODE_FIFO_KHR, VK_IMAGE_USAGE_TRANSFER_DST_BIT, 2);
     }
 
     if (test->swapchain->info.imageExtent.width != test->win_width ||
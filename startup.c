@@ -0,0 +1,129 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks startup with eager and lazy entry point resolution.
+ *
+ * Each iteration initializes vk, fills a buffer, and cleans up.  The time of
+ * each step is reported, as is the time to set up the dispatch table alone.
+ * With lazy dispatch, the cost of resolving an entry point moves to its first
+ * call, which is included in the fill step.
+ */
+
+#include "vkutil.h"
+
+struct startup_test_stats {
+    uint64_t init;
+    uint64_t first_use;
+    uint64_t cleanup;
+    uint64_t dispatch;
+};
+
+struct startup_test {
+    uint32_t iterations;
+    uint32_t dispatch_iterations;
+    bool eager;
+    bool lazy;
+};
+
+static void
+startup_test_first_use(struct vk *vk)
+{
+    struct vk_buffer *buf = vk_create_buffer(vk, 4096, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+    vk->CmdFillBuffer(cmd, buf->buf, 0, VK_WHOLE_SIZE, 0);
+    vk_end_cmd(vk);
+    vk_wait(vk);
+
+    vk_destroy_buffer(vk, buf);
+}
+
+static void
+startup_test_dispatch(struct startup_test *test, struct vk *vk, struct startup_test_stats *stats)
+{
+    const uint64_t begin = vk_now();
+    for (uint32_t i = 0; i < test->dispatch_iterations; i++) {
+        vk_init_instance_dispatch(vk);
+        vk_init_device_dispatch(vk);
+    }
+    stats->dispatch += vk_now() - begin;
+}
+
+static void
+startup_test_run(struct startup_test *test, bool eager)
+{
+    const char *name = eager ? "eager" : "lazy";
+
+#ifndef VKUTIL_LAZY_DISPATCH
+    if (!eager) {
+        vk_log("%s: unsupported", name);
+        return;
+    }
+#endif
+
+    const struct vk_init_params params = {
+        .eager_dispatch = eager,
+    };
+
+    struct startup_test_stats stats = { 0 };
+    for (uint32_t i = 0; i < test->iterations; i++) {
+        struct vk vk;
+
+        const uint64_t init_begin = vk_now();
+        vk_init(&vk, &params);
+        const uint64_t init_end = vk_now();
+        startup_test_first_use(&vk);
+        const uint64_t first_use_end = vk_now();
+
+        startup_test_dispatch(test, &vk, &stats);
+
+        const uint64_t cleanup_begin = vk_now();
+        vk_cleanup(&vk);
+        const uint64_t cleanup_end = vk_now();
+
+        stats.init += init_end - init_begin;
+        stats.first_use += first_use_end - init_end;
+        stats.cleanup += cleanup_end - cleanup_begin;
+    }
+
+    vk_log("%s: %u iterations", name, test->iterations);
+    vk_log("  init: avg %.1f us", (double)stats.init / test->iterations / 1000.0);
+    vk_log("  first use: avg %.1f us", (double)stats.first_use / test->iterations / 1000.0);
+    vk_log("  cleanup: avg %.1f us", (double)stats.cleanup / test->iterations / 1000.0);
+    vk_log("  dispatch only: avg %.1f us",
+           (double)stats.dispatch / test->iterations / test->dispatch_iterations / 1000.0);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct startup_test test = {
+        .iterations = 20,
+        .dispatch_iterations = 100,
+        .eager = true,
+        .lazy = true,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "eager")) {
+            test.lazy = false;
+        } else if (!strcmp(argv[i], "lazy")) {
+            test.eager = false;
+        } else if (!strncmp(argv[i], "iterations=", 11)) {
+            test.iterations = atoi(argv[i] + 11);
+            if (!test.iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    if (test.eager)
+        startup_test_run(&test, true);
+    if (test.lazy)
+        startup_test_run(&test, false);
+
+    return 0;
+}
@@ -114,7 +114,7 @@ tess_test_init_vb(struct tess_test *test)
 
     test->vb =
         vk_create_buffer(vk, sizeof(tess_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, tess_test_vertices, sizeof(tess_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, tess_test_vertices, sizeof(tess_test_vertices));
 }
 
 static void
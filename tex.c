@@ -112,7 +112,7 @@ tex_test_init_vb(struct tex_test *test)
     struct vk *vk = &test->vk;
 
     test->vb = vk_create_buffer(vk, sizeof(tex_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, tex_test_vertices, sizeof(tex_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, tex_test_vertices, sizeof(tex_test_vertices));
 }
 
 static void
@@ -119,7 +119,7 @@ tex_depth_test_init_vb(struct tex_depth_test *test)
 
     test->vb =
         vk_create_buffer(vk, sizeof(tex_depth_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, tex_depth_test_vertices, sizeof(tex_depth_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, tex_depth_test_vertices, sizeof(tex_depth_test_vertices));
 }
 
 static void
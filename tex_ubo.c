@@ -123,7 +123,8 @@ tex_ubo_test_init_ubo(struct tex_ubo_test *test)
 
     test->ubo = vk_create_buffer(vk, sizeof(tex_ubo_test_color_scales),
                                  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
-    memcpy(test->ubo->mem_ptr, tex_ubo_test_color_scales, sizeof(tex_ubo_test_color_scales));
+    vk_write_buffer(vk, test->ubo, 0, tex_ubo_test_color_scales,
+                    sizeof(tex_ubo_test_color_scales));
 }
 
 static void
@@ -144,7 +145,7 @@ tex_ubo_test_init_vb(struct tex_ubo_test *test)
 
     test->vb =
         vk_create_buffer(vk, sizeof(tex_ubo_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, tex_ubo_test_vertices, sizeof(tex_ubo_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, tex_ubo_test_vertices, sizeof(tex_ubo_test_vertices));
 }
 
 static void
@@ -183,37 +184,9 @@ tex_ubo_test_cleanup(struct tex_ubo_test *test)
 }
 
 static void
-tex_ubo_test_draw_triangles(struct tex_ubo_test *test, VkCommandBuffer cmd)
+tex_ubo_test_draw_triangles(struct vk *vk, VkCommandBuffer cmd, void *data)
 {
-    struct vk *vk = &test->vk;
-
-    const VkImageSubresourceRange subres_range = {
-        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .levelCount = 1,
-        .layerCount = 1,
-    };
-    const VkImageMemoryBarrier barrier1 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .image = test->rt->img,
-        .subresourceRange = subres_range,
-    };
-    const VkImageMemoryBarrier barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .image = test->rt->img,
-        .subresourceRange = subres_range,
-    };
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, NULL, 0, NULL, 1,
-                           &barrier1);
+    struct tex_ubo_test *test = data;
 
     const VkRenderPassBeginInfo pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -254,64 +227,87 @@ tex_ubo_test_draw_triangles(struct tex_ubo_test *test, VkCommandBuffer cmd)
     vk->CmdDraw(cmd, 3, 1, 3, 0);
 
     vk->CmdEndRenderPass(cmd);
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                           VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 0, NULL, 1, &barrier2);
 }
 
 static void
-tex_ubo_test_draw_prep_texture(struct tex_ubo_test *test, VkCommandBuffer cmd)
+tex_ubo_test_draw_prep_texture(struct vk *vk, VkCommandBuffer cmd, void *data)
 {
-    struct vk *vk = &test->vk;
+    struct tex_ubo_test *test = data;
 
     const VkImageSubresourceRange subres_range = {
         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .levelCount = 1,
         .layerCount = 1,
     };
-    const VkImageMemoryBarrier barrier1 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .image = test->tex->img,
-        .subresourceRange = subres_range,
-    };
-    const VkImageMemoryBarrier barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .image = test->tex->img,
-        .subresourceRange = subres_range,
-    };
     const VkClearColorValue clear_val = {
         .float32 = { 0.25f, 0.50f, 0.75f, 1.00f },
     };
 
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                           0, 0, NULL, 0, NULL, 1, &barrier1);
-    vk->CmdClearColorImage(cmd, test->tex->img, barrier1.newLayout, &clear_val, 1, &subres_range);
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1,
-                           &barrier2);
+    vk->CmdClearColorImage(cmd, test->tex->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_val,
+                           1, &subres_range);
 }
 
 static void
 tex_ubo_test_draw(struct tex_ubo_test *test)
 {
     struct vk *vk = &test->vk;
+    struct vk_graph *graph = vk_create_graph(vk);
+
+    struct vk_graph_pass *prep =
+        vk_add_graph_pass(vk, graph, tex_ubo_test_draw_prep_texture, test);
+    vk_add_graph_pass_image(vk, prep,
+                            &(struct vk_transition){
+                                .img = test->tex,
+                                .discard = true,
+                                .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_CLEAR_BIT,
+                                .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                            });
+
+    struct vk_graph_pass *draw = vk_add_graph_pass(vk, graph, tex_ubo_test_draw_triangles, test);
+    vk_add_graph_pass_image(vk, draw,
+                            &(struct vk_transition){
+                                .img = test->tex,
+                                .layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                                .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                            });
+    vk_add_graph_pass_image(vk, draw,
+                            &(struct vk_transition){
+                                .img = test->rt,
+                                .discard = true,
+                                .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                            });
+    vk_add_graph_pass_buffer(vk, draw, test->vb, VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+                             VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT);
+    vk_add_graph_pass_buffer(vk, draw, test->ubo, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                             VK_ACCESS_2_UNIFORM_READ_BIT);
+
+    /* both images are dumped */
+    vk_add_graph_image_output(vk, graph,
+                              &(struct vk_transition){
+                                  .img = test->tex,
+                                  .layout = VK_IMAGE_LAYOUT_GENERAL,
+                                  .stage = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                  .access = VK_ACCESS_2_HOST_READ_BIT,
+                              });
+    vk_add_graph_image_output(vk, graph,
+                              &(struct vk_transition){
+                                  .img = test->rt,
+                                  .layout = VK_IMAGE_LAYOUT_GENERAL,
+                                  .stage = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                  .access = VK_ACCESS_2_HOST_READ_BIT,
+                              });
 
     VkCommandBuffer cmd = vk_begin_cmd(vk);
-
-    tex_ubo_test_draw_prep_texture(test, cmd);
-    tex_ubo_test_draw_triangles(test, cmd);
-
+    vk_record_graph(vk, graph, cmd);
     vk_end_cmd(vk);
     vk_wait(vk);
 
+    vk_destroy_graph(vk, graph);
+
     vk_dump_image(vk, test->tex, VK_IMAGE_ASPECT_COLOR_BIT, "tex.ppm");
     vk_dump_image(vk, test->rt, VK_IMAGE_ASPECT_COLOR_BIT, "rt.ppm");
 }
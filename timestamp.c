@@ -96,12 +96,12 @@ timestamp_test_draw_same_cmd(struct timestamp_test *test)
                       VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, NULL, 0, NULL, 0, NULL);
     vk->CmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, test->query->pool, 1);
 
-    vk_end_cmd(vk);
+    const uint64_t point = vk_end_cmd(vk);
 
     vk_sleep(test->sleep);
     vk->SetEvent(vk->dev, test->event->event);
 
-    vk_wait(vk);
+    vk_wait_point(vk, point);
 
     uint64_t ts[2];
     timestamp_test_get_query_result(test, ts, 2);
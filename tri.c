@@ -116,7 +116,7 @@ tri_test_init_vb(struct tri_test *test)
     struct vk *vk = &test->vk;
 
     test->vb = vk_create_buffer(vk, sizeof(tri_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, tri_test_vertices, sizeof(tri_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, tri_test_vertices, sizeof(tri_test_vertices));
 }
 
 static void
@@ -147,37 +147,9 @@ tri_test_cleanup(struct tri_test *test)
 }
 
 static void
-tri_test_draw_triangle(struct tri_test *test, VkCommandBuffer cmd)
+tri_test_draw_triangle(struct vk *vk, VkCommandBuffer cmd, void *data)
 {
-    struct vk *vk = &test->vk;
-
-    const VkImageSubresourceRange subres_range = {
-        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .levelCount = 1,
-        .layerCount = 1,
-    };
-    const VkImageMemoryBarrier barrier1 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .image = test->rt->img,
-        .subresourceRange = subres_range,
-    };
-    const VkImageMemoryBarrier barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .image = test->rt->img,
-        .subresourceRange = subres_range,
-    };
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, NULL, 0, NULL, 1,
-                           &barrier1);
+    struct tri_test *test = data;
 
     const VkRenderPassBeginInfo pass_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -208,23 +180,41 @@ tri_test_draw_triangle(struct tri_test *test, VkCommandBuffer cmd)
     vk->CmdDraw(cmd, 3, 1, 0, 0);
 
     vk->CmdEndRenderPass(cmd);
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                           VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 0, NULL, 1, &barrier2);
 }
 
 static void
 tri_test_draw(struct tri_test *test)
 {
     struct vk *vk = &test->vk;
+    struct vk_graph *graph = vk_create_graph(vk);
+
+    struct vk_graph_pass *pass = vk_add_graph_pass(vk, graph, tri_test_draw_triangle, test);
+    vk_add_graph_pass_image(vk, pass,
+                            &(struct vk_transition){
+                                .img = test->rt,
+                                .discard = true,
+                                .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                .stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                .access = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                            });
+    vk_add_graph_pass_buffer(vk, pass, test->vb, VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+                             VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT);
+
+    vk_add_graph_image_output(vk, graph,
+                              &(struct vk_transition){
+                                  .img = test->rt,
+                                  .layout = VK_IMAGE_LAYOUT_GENERAL,
+                                  .stage = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                  .access = VK_ACCESS_2_HOST_READ_BIT,
+                              });
 
     VkCommandBuffer cmd = vk_begin_cmd(vk);
-
-    tri_test_draw_triangle(test, cmd);
-
+    vk_record_graph(vk, graph, cmd);
     vk_end_cmd(vk);
     vk_wait(vk);
 
+    vk_destroy_graph(vk, graph);
+
     vk_dump_image(vk, test->rt, VK_IMAGE_ASPECT_COLOR_BIT, "rt.ppm");
 }
 
@@ -124,7 +124,7 @@ ubo_test_init_ubo(struct ubo_test *test)
     };
 
     test->ubo = vk_create_buffer(vk, sizeof(transform), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
-    memcpy(test->ubo->mem_ptr, transform, sizeof(transform));
+    vk_write_buffer(vk, test->ubo, 0, transform, sizeof(transform));
 }
 
 static void
@@ -133,7 +133,7 @@ ubo_test_init_vb(struct ubo_test *test)
     struct vk *vk = &test->vk;
 
     test->vb = vk_create_buffer(vk, sizeof(ubo_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, ubo_test_vertices, sizeof(ubo_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, ubo_test_vertices, sizeof(ubo_test_vertices));
 }
 
 static void
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2023 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This test benchmarks host writes to mapped memory.
+ *
+ * For each host-visible memory type, memcpy and memset are compared against
+ * the streaming copy and fill that vk_upload uses when the memory type is not
+ * host-cached.  Write-combined memory is expected to favor streaming stores.
+ */
+
+#include "vkutil.h"
+
+enum upload_test_op {
+    UPLOAD_TEST_MEMCPY,
+    UPLOAD_TEST_STREAM_COPY,
+    UPLOAD_TEST_MEMSET,
+    UPLOAD_TEST_STREAM_FILL,
+};
+
+static const char *const upload_test_op_names[] = {
+    [UPLOAD_TEST_MEMCPY] = "memcpy",
+    [UPLOAD_TEST_STREAM_COPY] = "stream_copy",
+    [UPLOAD_TEST_MEMSET] = "memset",
+    [UPLOAD_TEST_STREAM_FILL] = "stream_fill",
+};
+
+struct upload_test {
+    VkDeviceSize size;
+    uint32_t iterations;
+
+    struct vk vk;
+    uint8_t *src;
+    bool regressed;
+};
+
+static void
+upload_test_init(struct upload_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_init(vk, NULL);
+
+    test->src = malloc(test->size);
+    if (!test->src)
+        vk_die("failed to alloc src");
+    for (VkDeviceSize i = 0; i < test->size; i++)
+        test->src[i] = (uint8_t)i;
+}
+
+static void
+upload_test_cleanup(struct upload_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    free(test->src);
+    vk_cleanup(vk);
+}
+
+static void
+upload_test_run_op(struct upload_test *test,
+                   uint32_t mt_index,
+                   void *ptr,
+                   enum upload_test_op op)
+{
+    struct vk *vk = &test->vk;
+
+    char name[64];
+    snprintf(name, sizeof(name), "upload.mt%u.%s", mt_index, upload_test_op_names[op]);
+
+    const struct vk_bench_params params = {
+        .name = name,
+        .warmup_iterations = 2,
+        .iterations = test->iterations,
+    };
+    struct vk_bench *bench = vk_create_bench(vk, &params);
+    while (vk_bench_next(vk, bench)) {
+        switch (op) {
+        case UPLOAD_TEST_MEMCPY:
+            memcpy(ptr, test->src, test->size);
+            break;
+        case UPLOAD_TEST_STREAM_COPY:
+            vk_stream_copy(ptr, test->src, test->size);
+            break;
+        case UPLOAD_TEST_MEMSET:
+            memset(ptr, 0x37, test->size);
+            break;
+        case UPLOAD_TEST_STREAM_FILL:
+            vk_stream_fill(ptr, 0x37, test->size);
+            break;
+        }
+    }
+
+    if (!vk_bench_report(vk, bench))
+        test->regressed = true;
+
+    /* bytes per ns is GB/s */
+    vk_log("  %.2f GB/s", (double)test->size / bench->cpu.median);
+
+    vk_destroy_bench(vk, bench);
+}
+
+static void
+upload_test_run(struct upload_test *test, uint32_t mt_index)
+{
+    struct vk *vk = &test->vk;
+    const VkMemoryType *mt = &vk->mem_props.memoryTypes[mt_index];
+
+    /* the AMD types require deviceCoherentMemory, which is not enabled */
+    const VkMemoryPropertyFlags skipped_flags = VK_MEMORY_PROPERTY_PROTECTED_BIT |
+                                                VK_MEMORY_PROPERTY_DEVICE_COHERENT_BIT_AMD |
+                                                VK_MEMORY_PROPERTY_DEVICE_UNCACHED_BIT_AMD;
+    if (!(mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+        (mt->propertyFlags & skipped_flags))
+        return;
+
+    vk_log("memory type %u: %s %s %s %s", mt_index,
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? "Lo" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? "Vi" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) ? "Co" : "-",
+           (mt->propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) ? "Ca" : "-");
+
+    if (vk->mem_props.memoryHeaps[mt->heapIndex].size < test->size) {
+        vk_log("  heap is too small");
+        return;
+    }
+
+    VkDeviceMemory mem = vk_alloc_memory(vk, test->size, mt_index);
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, mem, 0, test->size, 0, &ptr);
+    vk_check(vk, "failed to map memory");
+
+    upload_test_run_op(test, mt_index, ptr, UPLOAD_TEST_MEMCPY);
+    upload_test_run_op(test, mt_index, ptr, UPLOAD_TEST_STREAM_COPY);
+    upload_test_run_op(test, mt_index, ptr, UPLOAD_TEST_MEMSET);
+    upload_test_run_op(test, mt_index, ptr, UPLOAD_TEST_STREAM_FILL);
+
+    vk->UnmapMemory(vk->dev, mem);
+    vk->FreeMemory(vk->dev, mem, NULL);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct upload_test test = {
+        .size = 16 * 1024 * 1024,
+        .iterations = 20,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "size=", 5)) {
+            test.size = strtoull(argv[i] + 5, NULL, 0);
+            if (!test.size)
+                vk_die("invalid size %s", argv[i] + 5);
+        } else if (!strncmp(argv[i], "iterations=", 11)) {
+            test.iterations = atoi(argv[i] + 11);
+            if (!test.iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    upload_test_init(&test);
+    for (uint32_t i = 0; i < test.vk.mem_props.memoryTypeCount; i++)
+        upload_test_run(&test, i);
+    upload_test_cleanup(&test);
+
+    return test.regressed;
+}
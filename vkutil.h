@@ -10,8 +10,13 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -19,7 +24,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_android.h>
 
@@ -29,15 +37,27 @@
 #define LIBVULKAN_NAME "libvulkan.so.1"
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VKUTIL_X86
+#endif
+
+#if defined(__x86_64__) && defined(__ELF__)
+#define VKUTIL_LAZY_DISPATCH
+#endif
+
 #define PRINTFLIKE(f, a) __attribute__((format(printf, f, a)))
 #define NORETURN __attribute__((noreturn))
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
-#define VKUTIL_MIN_API_VERSION VK_API_VERSION_1_1
+#define VKUTIL_MIN_API_VERSION VK_API_VERSION_1_2
 
 struct vk_init_params {
     uint32_t api_version;
     bool enable_all_features;
 
+    /* resolve all entry points at startup rather than on first use */
+    bool eager_dispatch;
+
     const char *const *instance_exts;
     uint32_t instance_ext_count;
 
@@ -45,6 +65,24 @@ struct vk_init_params {
     uint32_t dev_ext_count;
 };
 
+struct vk_queue {
+    VkQueue queue;
+    uint32_t family_index;
+    VkQueueFamilyProperties family_props;
+
+    VkCommandPool cmd_pool;
+    struct {
+        VkCommandBuffer cmds[4];
+        uint64_t points[4];
+        uint32_t count;
+        uint32_t next;
+
+        /* signaled with a monotonically increasing point by each submit */
+        VkSemaphore timeline;
+        uint64_t point;
+    } submit;
+};
+
 struct vk {
     struct vk_init_params params;
 
@@ -62,37 +100,41 @@ struct vk {
 
     bool KHR_swapchain;
     bool EXT_custom_border_color;
+    bool EXT_multi_draw;
 
     VkPhysicalDeviceProperties2 props;
     VkPhysicalDeviceVulkan11Properties vulkan_11_props;
     VkPhysicalDeviceVulkan12Properties vulkan_12_props;
     VkPhysicalDeviceVulkan13Properties vulkan_13_props;
+    VkPhysicalDeviceMultiDrawPropertiesEXT multi_draw_props;
 
     VkPhysicalDeviceFeatures2 features;
     VkPhysicalDeviceVulkan11Features vulkan_11_features;
     VkPhysicalDeviceVulkan12Features vulkan_12_features;
     VkPhysicalDeviceVulkan13Features vulkan_13_features;
 
-    VkPhysicalDeviceSamplerYcbcrConversionFeatures sampler_ycbcr_conversion_features;
-    VkPhysicalDeviceHostQueryResetFeatures host_query_reset_features;
     VkPhysicalDeviceCustomBorderColorFeaturesEXT custom_border_color_features;
+    VkPhysicalDeviceMultiDrawFeaturesEXT multi_draw_features;
 
     VkPhysicalDeviceMemoryProperties mem_props;
     uint32_t buf_mt_index;
 
     VkDevice dev;
-    VkQueue queue;
-    uint32_t queue_family_index;
+
+    /* the compute and transfer queues alias the graphics queue when there
+     * is no dedicated family or spare queue for them
+     */
+    struct vk_queue queues[3];
+    uint32_t queue_count;
+    struct vk_queue *graphics_queue;
+    struct vk_queue *compute_queue;
+    struct vk_queue *transfer_queue;
 
     VkDescriptorPool desc_pool;
 
-    VkCommandPool cmd_pool;
-    struct {
-        VkCommandBuffer cmds[4];
-        VkFence fences[4];
-        uint32_t count;
-        uint32_t next;
-    } submit;
+    /* the instance and the device are owned by vk_shared */
+    bool shared;
+    pthread_mutex_t *queue_mutex;
 };
 
 struct vk_buffer {
@@ -104,14 +146,33 @@ struct vk_buffer {
     void *mem_ptr;
 };
 
+struct vk_image_state {
+    VkImageLayout layout;
+
+    /* the last write, including layout transitions */
+    VkPipelineStageFlags2 write_stage;
+    VkAccessFlags2 write_access;
+    /* the reads that have been synchronized with the last write */
+    VkPipelineStageFlags2 read_stage;
+    VkAccessFlags2 read_access;
+};
+
 struct vk_image {
     VkImageCreateInfo info;
     VkFormatFeatureFlags features;
     VkImage img;
 
+    /* indexed by aspect, mip level, and array layer; depth and stencil are
+     * tracked separately while all planes share the color state
+     */
+    struct vk_image_state *states;
+    uint32_t state_aspect_count;
+
     VkDeviceMemory mem;
     VkDeviceSize mem_size;
     bool mem_mappable;
+    /* transient attachments might not be backed by physical memory */
+    bool mem_lazy;
 
     VkImageView render_view;
 
@@ -122,6 +183,18 @@ struct vk_image {
     VkSampler sampler;
 };
 
+struct vk_transition {
+    struct vk_image *img;
+    /* zero aspectMask/levelCount/layerCount select the whole image */
+    VkImageSubresourceRange range;
+    /* discard the current contents */
+    bool discard;
+
+    VkImageLayout layout;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+};
+
 struct vk_framebuffer {
     VkRenderPass pass;
     VkFramebuffer fb;
@@ -173,22 +246,248 @@ struct vk_event {
     VkEvent event;
 };
 
+struct vk_backoff {
+    uint64_t begin;
+    uint64_t sleep_ns;
+};
+
 struct vk_query {
     VkQueryPool pool;
 };
 
+/* the draw count is at offset 0 and the commands are at
+ * VKUTIL_INDIRECT_CMD_OFFSET, so that a shader can append commands with an
+ * atomic add on the count
+ */
+#define VKUTIL_INDIRECT_CMD_OFFSET 16
+
+struct vk_indirect {
+    struct vk_buffer *buf;
+    uint32_t stride;
+    uint32_t max_count;
+};
+
+/* vk_hash_image hashes and diffs images on the GPU, one workgroup per tile */
+#define VKUTIL_IMAGE_HASH_TILE_SIZE 16
+
+struct vk_image_hash {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+
+    struct vk_pipeline *pipeline;
+    struct vk_descriptor_set *img_set;
+    struct vk_descriptor_set *ref_set;
+    struct vk_descriptor_set *result_set;
+    struct vk_descriptor_set *tiles_set;
+
+    /* the hash and the mismatch count, which are all that is read back */
+    struct vk_buffer *result;
+    /* a hash and a mismatch count per tile, in device memory */
+    struct vk_buffer *tiles;
+
+    struct vk_query *query;
+    /* GPU time of the last vk_hash_image in ns */
+    uint64_t duration;
+};
+
+struct vk_swapchain_frame {
+    /* signaled by the acquisition of the frame */
+    VkSemaphore acquire_sem;
+    /* the graphics queue point that the frame submitted */
+    uint64_t point;
+};
+
+struct vk_swapchain_retired {
+    VkSwapchainKHR swapchain;
+    VkSemaphore *present_sems;
+    uint32_t present_sem_count;
+    /* destroyed once the graphics queue reaches this point */
+    uint64_t point;
+};
+
 struct vk_swapchain {
     VkSwapchainCreateInfoKHR info;
     VkSwapchainKHR swapchain;
-    VkFence fence;
+    /* queried once and refreshed only when the extent is out of bounds */
+    VkSurfaceCapabilitiesKHR caps;
+
+    /* old swapchains that pending presents might still use */
+    struct vk_swapchain_retired retired[4];
+    uint32_t retired_count;
 
     uint32_t img_count;
     VkImage *img_handles;
     struct vk_image *imgs;
+    /* signaled by the submission rendering to an image and waited by its
+     * presentation
+     */
+    VkSemaphore *present_sems;
+
+    /* the first use of an acquired image waits for the acquisition here */
+    VkPipelineStageFlags wait_stage;
+
+    struct vk_swapchain_frame frames[4];
+    uint32_t frame_count;
+    uint32_t frame_cur;
 
     uint32_t img_cur;
 };
 
+typedef void (*vk_graph_record_func)(struct vk *vk, VkCommandBuffer cmd, void *data);
+
+struct vk_graph_buffer_use {
+    struct vk_buffer *buf;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+};
+
+struct vk_graph_pass {
+    vk_graph_record_func record;
+    void *data;
+
+    struct vk_transition images[4];
+    uint32_t image_count;
+    struct vk_graph_buffer_use buffers[4];
+    uint32_t buffer_count;
+
+    bool live;
+    uint32_t level;
+};
+
+struct vk_graph {
+    struct vk_graph_pass passes[16];
+    uint32_t pass_count;
+
+    /* how the images and buffers are used after the graph */
+    struct vk_transition image_outputs[4];
+    uint32_t image_output_count;
+    struct vk_graph_buffer_use buffer_outputs[4];
+    uint32_t buffer_output_count;
+};
+
+struct vk_image_format_key {
+    VkFormat format;
+    VkImageTiling tiling;
+    VkImageUsageFlags usage;
+    VkExternalMemoryHandleTypeFlagBits handle;
+    uint64_t modifier;
+};
+
+struct vk_image_format_caps {
+    VkResult result;
+    uint32_t ycbcr_desc_count;
+    VkImageFormatProperties props;
+    VkExternalMemoryFeatureFlags external_features;
+    uint64_t ahb_usage;
+};
+
+/* The records below are also the layout of the snapshot file: a header, the
+ * formats sorted by VkFormat, the modifiers, and the image records sorted by
+ * key.
+ */
+struct vk_format_caps_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t device_uuid[VK_UUID_SIZE];
+    uint32_t driver_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t format_count;
+    /* of the formats in vkutil_formats.inc, in order */
+    uint32_t format_hash;
+    uint32_t modifier_count;
+    uint32_t image_count;
+};
+
+struct vk_format_caps_format {
+    VkFormat format;
+    VkFormatProperties props;
+    uint32_t modifier_offset;
+    uint32_t modifier_count;
+};
+
+struct vk_format_caps_image {
+    struct vk_image_format_key key;
+    struct vk_image_format_caps caps;
+};
+
+struct vk_format_caps {
+    struct vk_format_caps_header header;
+
+    const struct vk_format_caps_format *formats;
+    const VkDrmFormatModifierPropertiesEXT *modifiers;
+
+    /* point into the snapshot until the first image record is added */
+    struct vk_format_caps_image *images;
+    uint32_t image_capacity;
+    bool dirty;
+
+    void *storage;
+    const void *snapshot;
+    size_t snapshot_size;
+    const char *filename;
+};
+
+struct vk_bench_params {
+    const char *name;
+
+    uint32_t warmup_iterations;
+    /* when both are zero, 100 iterations are measured */
+    uint32_t iterations;
+    uint64_t duration_ns;
+    /* caps the sample count of a fixed-time run */
+    uint32_t max_samples;
+
+    /* measure GPU time between vk_bench_cmd_begin and vk_bench_cmd_end */
+    bool gpu;
+    bool keep_outliers;
+};
+
+struct vk_bench_stats {
+    uint32_t sample_count;
+    uint32_t rejected_count;
+
+    double min;
+    double median;
+    double mean;
+    double p95;
+    double p99;
+    double max;
+    double stddev;
+};
+
+struct vk_bench {
+    struct vk_bench_params params;
+    struct vk_query *query;
+
+    uint32_t iteration;
+    uint64_t begin;
+    uint64_t last;
+
+    double *cpu_samples;
+    double *gpu_samples;
+    uint32_t sample_count;
+
+    struct vk_bench_stats cpu;
+    struct vk_bench_stats gpu;
+};
+
+/* These are set by a test runner that runs many tests in one process.  They
+ * are weak such that all translation units see the same variables.
+ *
+ * When vk_shared is set, vk_init reuses its instance and device when the
+ * params are compatible.  Queues are shared and submissions are serialized by
+ * vk_shared_queue_mutex.  vk_test_name names the test running on the thread.
+ * When vk_die_jmp is set, vk_die returns to it instead of aborting, such that
+ * the runner can report a failing test and go on.
+ */
+__attribute__((weak)) const struct vk *vk_shared;
+__attribute__((weak)) pthread_mutex_t vk_shared_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak)) _Thread_local const char *vk_test_name;
+__attribute__((weak)) _Thread_local jmp_buf *vk_die_jmp;
+
 static inline void
 vk_logv(const char *format, va_list ap)
 {
@@ -201,6 +500,8 @@ static inline void NORETURN
 vk_diev(const char *format, va_list ap)
 {
     vk_logv(format, ap);
+    if (vk_die_jmp)
+        longjmp(*vk_die_jmp, 1);
     abort();
 }
 
@@ -247,6 +548,247 @@ vk_sleep(uint32_t ms)
         vk_die("failed to sleep");
 }
 
+static inline uint64_t
+vk_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+vk_cpu_relax(void)
+{
+#ifdef VKUTIL_X86
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/* Called by a polling loop each time the condition is not met.  The first
+ * 20us spin with a pause instruction, the next 200us yield the CPU, and the
+ * rest sleep for exponentially longer up to 1ms.  A condition that becomes
+ * true quickly is observed within microseconds rather than after a sleep.
+ * The backoff must be zero-initialized.
+ */
+static inline void
+vk_backoff(struct vk_backoff *backoff)
+{
+    const uint64_t spin_ns = 20000;
+    const uint64_t yield_ns = 200000;
+    const uint64_t max_sleep_ns = 1000000;
+
+    const uint64_t now = vk_now();
+    if (!backoff->begin)
+        backoff->begin = now;
+
+    const uint64_t elapsed = now - backoff->begin;
+    if (elapsed < spin_ns) {
+        for (uint32_t i = 0; i < 16; i++)
+            vk_cpu_relax();
+    } else if (elapsed < yield_ns) {
+        sched_yield();
+    } else {
+        backoff->sleep_ns = backoff->sleep_ns ? backoff->sleep_ns * 2 : 10000;
+        if (backoff->sleep_ns > max_sleep_ns)
+            backoff->sleep_ns = max_sleep_ns;
+
+        const struct timespec ts = {
+            .tv_nsec = (long)backoff->sleep_ns,
+        };
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    }
+}
+
+#ifdef VKUTIL_LAZY_DISPATCH
+
+/* Non-core entry points are resolved on first use when lazy dispatch is
+ * enabled.  Each such slot initially points to a per-slot trampoline.  The
+ * trampoline passes its vk_lazy_entrypoint to vk_lazy_trampoline, which calls
+ * vk_lazy_resolve on the first call and then jumps to the resolved function
+ * with the original arguments.
+ *
+ * Entry points are resolved against vk_lazy_owner, the struct vk that enabled
+ * lazy dispatch.  Copies of the struct, such as those made by vk_init_shared,
+ * share the resolved functions.
+ */
+struct vk_lazy_entrypoint {
+    /* must be the first member; read by vk_lazy_trampoline */
+    PFN_vkVoidFunction func;
+
+    const char *name;
+    size_t offset;
+    bool device;
+};
+
+__attribute__((weak)) struct vk *vk_lazy_owner;
+
+#define PFN_INSTANCE_CORE(name)
+#define PFN_DEVICE_CORE(name)
+#define PFN_INSTANCE(name)                                                                       \
+    __attribute__((weak, used, visibility("hidden"))) struct vk_lazy_entrypoint                  \
+        vk_lazy_entrypoint_##name = { NULL, "vk" #name, offsetof(struct vk, name), false };
+#define PFN_DEVICE(name)                                                                         \
+    __attribute__((weak, used, visibility("hidden"))) struct vk_lazy_entrypoint                  \
+        vk_lazy_entrypoint_##name = { NULL, "vk" #name, offsetof(struct vk, name), true };
+#include "vkutil_entrypoints.inc"
+
+__attribute__((weak, used, visibility("hidden"))) PFN_vkVoidFunction
+vk_lazy_resolve(struct vk_lazy_entrypoint *entry)
+{
+    struct vk *vk = vk_lazy_owner;
+
+    const PFN_vkVoidFunction func = entry->device
+                                        ? vk->GetDeviceProcAddr(vk->dev, entry->name)
+                                        : vk->GetInstanceProcAddr(vk->instance, entry->name);
+    if (!func)
+        vk_die("failed to resolve %s", entry->name);
+
+    /* skip the trampoline in the owner from now on */
+    __atomic_store_n(&entry->func, func, __ATOMIC_RELEASE);
+    __atomic_store_n((PFN_vkVoidFunction *)((char *)vk + entry->offset), func,
+                     __ATOMIC_RELAXED);
+
+    return func;
+}
+
+/* With -fcf-protection, the stubs are indirect branch targets and must start
+ * with endbr64.  The property note marks the asm as CET-compatible, so that
+ * it does not turn IBT or shadow stacks off for the whole link.
+ */
+#if defined(__CET__) && (__CET__ & 1)
+#define VK_LAZY_ENDBR "    endbr64\n"
+#else
+#define VK_LAZY_ENDBR ""
+#endif
+
+#ifdef __CET__
+#define VK_LAZY_CET_STR_(x) #x
+#define VK_LAZY_CET_STR(x) VK_LAZY_CET_STR_(x)
+__asm__(".pushsection .note.gnu.property, \"a\"\n"
+        ".p2align 3\n"
+        ".long 4\n"
+        ".long 16\n"
+        /* NT_GNU_PROPERTY_TYPE_0 */
+        ".long 5\n"
+        ".asciz \"GNU\"\n"
+        /* GNU_PROPERTY_X86_FEATURE_1_AND, whose IBT and SHSTK bits match __CET__ */
+        ".long 0xc0000002\n"
+        ".long 4\n"
+        ".long " VK_LAZY_CET_STR(__CET__) "\n"
+        ".p2align 3\n"
+        ".popsection\n");
+#undef VK_LAZY_CET_STR
+#undef VK_LAZY_CET_STR_
+#endif
+
+/* %rax points to the vk_lazy_entrypoint.  The argument registers are saved
+ * around vk_lazy_resolve.  No vulkan function is variadic or has a static
+ * chain, so %al and %r10 need not be preserved.
+ */
+__asm__(".pushsection .text\n"
+        ".weak vk_lazy_trampoline\n"
+        ".hidden vk_lazy_trampoline\n"
+        ".type vk_lazy_trampoline, @function\n"
+        "vk_lazy_trampoline:\n"
+        VK_LAZY_ENDBR
+        "    movq (%rax), %r11\n"
+        "    testq %r11, %r11\n"
+        "    jz 1f\n"
+        "    jmp *%r11\n"
+        "1:\n"
+        "    pushq %rbp\n"
+        "    movq %rsp, %rbp\n"
+        "    subq $176, %rsp\n"
+        "    movq %rdi, 0(%rsp)\n"
+        "    movq %rsi, 8(%rsp)\n"
+        "    movq %rdx, 16(%rsp)\n"
+        "    movq %rcx, 24(%rsp)\n"
+        "    movq %r8, 32(%rsp)\n"
+        "    movq %r9, 40(%rsp)\n"
+        "    movdqa %xmm0, 48(%rsp)\n"
+        "    movdqa %xmm1, 64(%rsp)\n"
+        "    movdqa %xmm2, 80(%rsp)\n"
+        "    movdqa %xmm3, 96(%rsp)\n"
+        "    movdqa %xmm4, 112(%rsp)\n"
+        "    movdqa %xmm5, 128(%rsp)\n"
+        "    movdqa %xmm6, 144(%rsp)\n"
+        "    movdqa %xmm7, 160(%rsp)\n"
+        "    movq %rax, %rdi\n"
+        "    call vk_lazy_resolve\n"
+        "    movq %rax, %r11\n"
+        "    movq 0(%rsp), %rdi\n"
+        "    movq 8(%rsp), %rsi\n"
+        "    movq 16(%rsp), %rdx\n"
+        "    movq 24(%rsp), %rcx\n"
+        "    movq 32(%rsp), %r8\n"
+        "    movq 40(%rsp), %r9\n"
+        "    movdqa 48(%rsp), %xmm0\n"
+        "    movdqa 64(%rsp), %xmm1\n"
+        "    movdqa 80(%rsp), %xmm2\n"
+        "    movdqa 96(%rsp), %xmm3\n"
+        "    movdqa 112(%rsp), %xmm4\n"
+        "    movdqa 128(%rsp), %xmm5\n"
+        "    movdqa 144(%rsp), %xmm6\n"
+        "    movdqa 160(%rsp), %xmm7\n"
+        "    leave\n"
+        "    jmp *%r11\n"
+        ".size vk_lazy_trampoline, .-vk_lazy_trampoline\n"
+        ".popsection\n");
+
+#define VK_LAZY_TRAMPOLINE(name)                                                                 \
+    __asm__(".pushsection .text\n"                                                               \
+            ".weak vk_lazy_" #name "\n"                                                          \
+            ".hidden vk_lazy_" #name "\n"                                                        \
+            ".type vk_lazy_" #name ", @function\n"                                               \
+            "vk_lazy_" #name ":\n"                                                               \
+            VK_LAZY_ENDBR                                                                        \
+            "    leaq vk_lazy_entrypoint_" #name "(%rip), %rax\n"                                \
+            "    jmp vk_lazy_trampoline\n"                                                       \
+            ".size vk_lazy_" #name ", .-vk_lazy_" #name "\n"                                     \
+            ".popsection\n");                                                                    \
+    void vk_lazy_##name(void);
+#define PFN_INSTANCE_CORE(name)
+#define PFN_DEVICE_CORE(name)
+#define PFN_INSTANCE(name) VK_LAZY_TRAMPOLINE(name)
+#define PFN_DEVICE(name) VK_LAZY_TRAMPOLINE(name)
+#include "vkutil_entrypoints.inc"
+#undef VK_LAZY_TRAMPOLINE
+#undef VK_LAZY_ENDBR
+
+static inline bool
+vk_init_lazy_dispatch(struct vk *vk)
+{
+    if (vk->params.eager_dispatch)
+        return false;
+
+    /* only one struct vk can own the trampolines */
+    struct vk *owner = NULL;
+    if (__atomic_compare_exchange_n(&vk_lazy_owner, &owner, vk, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+        return true;
+
+    return owner == vk;
+}
+
+static inline void
+vk_cleanup_lazy_dispatch(struct vk *vk)
+{
+    if (vk_lazy_owner != vk)
+        return;
+
+#define PFN_INSTANCE_CORE(name)
+#define PFN_DEVICE_CORE(name)
+#define PFN_INSTANCE(name) vk_lazy_entrypoint_##name.func = NULL;
+#define PFN_DEVICE(name) vk_lazy_entrypoint_##name.func = NULL;
+#include "vkutil_entrypoints.inc"
+
+    __atomic_store_n(&vk_lazy_owner, NULL, __ATOMIC_RELEASE);
+}
+
+#endif /* VKUTIL_LAZY_DISPATCH */
+
 static inline void
 vk_init_global_dispatch(struct vk *vk)
 {
@@ -254,24 +796,130 @@ vk_init_global_dispatch(struct vk *vk)
 #include "vkutil_entrypoints.inc"
 }
 
+/* Returns the library path in an ICD manifest.  A relative path with a slash
+ * is relative to the manifest, and a bare name is searched by dlopen, as the
+ * loader does.  This is not a real JSON parser.
+ */
+static inline char *
+vk_parse_icd_manifest(const char *manifest)
+{
+    FILE *fp = fopen(manifest, "r");
+    if (!fp)
+        vk_die("failed to open %s", manifest);
+
+    char buf[4096];
+    const size_t size = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[size] = '\0';
+
+    const char key[] = "\"library_path\"";
+    const char *str = strstr(buf, key);
+    if (!str)
+        vk_die("no library_path in %s", manifest);
+
+    str += sizeof(key) - 1;
+    while (isspace(*str))
+        str++;
+    if (*str++ != ':')
+        vk_die("invalid library_path in %s", manifest);
+    while (isspace(*str))
+        str++;
+    if (*str++ != '"')
+        vk_die("invalid library_path in %s", manifest);
+
+    char path[1024];
+    size_t len = 0;
+    while (*str != '"') {
+        if (*str == '\\')
+            str++;
+        if (!*str || len >= sizeof(path) - 1)
+            vk_die("invalid library_path in %s", manifest);
+        path[len++] = *str++;
+    }
+    path[len] = '\0';
+
+    const char *slash = strrchr(manifest, '/');
+    char *filename;
+    if (path[0] == '/' || !strchr(path, '/') || !slash) {
+        filename = strdup(path);
+    } else {
+        const int dir_len = (int)(slash - manifest);
+        filename = malloc(dir_len + 1 + len + 1);
+        if (filename)
+            sprintf(filename, "%.*s/%s", dir_len, manifest, path);
+    }
+    if (!filename)
+        vk_die("failed to alloc icd filename");
+
+    return filename;
+}
+
+/* Loads the ICD described by the manifest directly, bypassing the loader and
+ * thus all layers.  We act as a loader that supports interface version 5.
+ */
 static inline void
-vk_init_library(struct vk *vk)
+vk_init_library_icd(struct vk *vk, const char *manifest)
 {
-    vk->handle = dlopen(LIBVULKAN_NAME, RTLD_LOCAL | RTLD_LAZY);
+    char *filename = vk_parse_icd_manifest(manifest);
+
+    vk->handle = dlopen(filename, RTLD_LOCAL | RTLD_LAZY);
     if (!vk->handle)
-        vk_die("failed to load %s: %s", LIBVULKAN_NAME, dlerror());
+        vk_die("failed to load %s: %s", filename, dlerror());
 
-    const char gipa_name[] = "vkGetInstanceProcAddr";
+    VkResult (*negotiate)(uint32_t *) =
+        dlsym(vk->handle, "vk_icdNegotiateLoaderICDInterfaceVersion");
+    if (!negotiate)
+        vk_die("%s does not support interface negotiation", filename);
+
+    uint32_t version = 5;
+    if (negotiate(&version) != VK_SUCCESS || version < 2)
+        vk_die("%s does not support loader interface version 2+", filename);
+
+    const char gipa_name[] = "vk_icdGetInstanceProcAddr";
     vk->GetInstanceProcAddr = dlsym(vk->handle, gipa_name);
     if (!vk->GetInstanceProcAddr)
         vk_die("failed to find %s: %s", gipa_name, dlerror());
 
+    vk_log("using %s directly with interface version %u", filename, version);
+    free(filename);
+}
+
+static inline void
+vk_init_library(struct vk *vk)
+{
+    /* for measuring the loader overhead */
+    const char *manifest = getenv("VK_DIRECT_ICD");
+    if (manifest) {
+        vk_init_library_icd(vk, manifest);
+    } else {
+        vk->handle = dlopen(LIBVULKAN_NAME, RTLD_LOCAL | RTLD_LAZY);
+        if (!vk->handle)
+            vk_die("failed to load %s: %s", LIBVULKAN_NAME, dlerror());
+
+        const char gipa_name[] = "vkGetInstanceProcAddr";
+        vk->GetInstanceProcAddr = dlsym(vk->handle, gipa_name);
+        if (!vk->GetInstanceProcAddr)
+            vk_die("failed to find %s: %s", gipa_name, dlerror());
+    }
+
     vk_init_global_dispatch(vk);
+    if (!vk->EnumerateInstanceVersion)
+        vk_die("no vkEnumerateInstanceVersion");
 }
 
 static inline void
 vk_init_instance_dispatch(struct vk *vk)
 {
+#ifdef VKUTIL_LAZY_DISPATCH
+    if (vk_init_lazy_dispatch(vk)) {
+#define PFN_INSTANCE_CORE(name)                                                                  \
+    vk->name = (PFN_vk##name)vk->GetInstanceProcAddr(vk->instance, "vk" #name);
+#define PFN_INSTANCE(name) vk->name = (PFN_vk##name)vk_lazy_##name;
+#include "vkutil_entrypoints.inc"
+        return;
+    }
+#endif
+
 #define PFN_INSTANCE(name)                                                                       \
     vk->name = (PFN_vk##name)vk->GetInstanceProcAddr(vk->instance, "vk" #name);
 #include "vkutil_entrypoints.inc"
@@ -328,23 +976,14 @@ vk_init_physical_device_features(struct vk *vk)
     vk->features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
 
     void **pnext = &vk->features.pNext;
-    if (vk->params.api_version >= VK_API_VERSION_1_2) {
-        vk->vulkan_11_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
-        vk->vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
 
-        *pnext = &vk->vulkan_11_features;
-        vk->vulkan_11_features.pNext = &vk->vulkan_12_features;
-        pnext = &vk->vulkan_12_features.pNext;
-    } else {
-        vk->sampler_ycbcr_conversion_features.sType =
-            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SAMPLER_YCBCR_CONVERSION_FEATURES;
-        vk->host_query_reset_features.sType =
-            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES;
+    vk->vulkan_11_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    vk->vulkan_12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+    *pnext = &vk->vulkan_11_features;
+    vk->vulkan_11_features.pNext = &vk->vulkan_12_features;
+    pnext = &vk->vulkan_12_features.pNext;
 
-        *pnext = &vk->sampler_ycbcr_conversion_features;
-        vk->sampler_ycbcr_conversion_features.pNext = &vk->host_query_reset_features;
-        pnext = &vk->host_query_reset_features.pNext;
-    }
     if (vk->params.api_version >= VK_API_VERSION_1_3) {
         vk->vulkan_13_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
 
@@ -357,6 +996,12 @@ vk_init_physical_device_features(struct vk *vk)
     *pnext = &vk->custom_border_color_features;
     pnext = &vk->custom_border_color_features.pNext;
 
+    if (vk->EXT_multi_draw) {
+        vk->multi_draw_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTI_DRAW_FEATURES_EXT;
+        *pnext = &vk->multi_draw_features;
+        pnext = &vk->multi_draw_features.pNext;
+    }
+
     vk->GetPhysicalDeviceFeatures2(vk->physical_dev, &vk->features);
 }
 
@@ -366,14 +1011,14 @@ vk_init_physical_device_properties(struct vk *vk)
     vk->props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
 
     void **pnext = &vk->props.pNext;
-    if (vk->params.api_version >= VK_API_VERSION_1_2) {
-        vk->vulkan_11_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
-        vk->vulkan_12_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
 
-        *pnext = &vk->vulkan_11_props;
-        vk->vulkan_11_props.pNext = &vk->vulkan_12_props;
-        pnext = &vk->vulkan_12_props.pNext;
-    }
+    vk->vulkan_11_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_PROPERTIES;
+    vk->vulkan_12_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+
+    *pnext = &vk->vulkan_11_props;
+    vk->vulkan_11_props.pNext = &vk->vulkan_12_props;
+    pnext = &vk->vulkan_12_props.pNext;
+
     if (vk->params.api_version >= VK_API_VERSION_1_3) {
         vk->vulkan_13_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_PROPERTIES;
 
@@ -381,6 +1026,12 @@ vk_init_physical_device_properties(struct vk *vk)
         pnext = &vk->vulkan_13_props.pNext;
     }
 
+    if (vk->EXT_multi_draw) {
+        vk->multi_draw_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTI_DRAW_PROPERTIES_EXT;
+        *pnext = &vk->multi_draw_props;
+        pnext = &vk->multi_draw_props.pNext;
+    }
+
     vk->GetPhysicalDeviceProperties2(vk->physical_dev, &vk->props);
     if (vk->props.properties.apiVersion < vk->params.api_version) {
         vk_die("physical device api version %d < %d", vk->props.properties.apiVersion,
@@ -396,6 +1047,8 @@ vk_init_physical_device_extensions(struct vk *vk)
             vk->KHR_swapchain = true;
         else if (!strcmp(vk->params.dev_exts[i], VK_EXT_CUSTOM_BORDER_COLOR_EXTENSION_NAME))
             vk->EXT_custom_border_color = true;
+        else if (!strcmp(vk->params.dev_exts[i], VK_EXT_MULTI_DRAW_EXTENSION_NAME))
+            vk->EXT_multi_draw = true;
     }
 }
 
@@ -419,6 +1072,16 @@ vk_init_device_dispatch(struct vk *vk)
     vk->GetDeviceProcAddr =
         (PFN_vkGetDeviceProcAddr)vk->GetInstanceProcAddr(vk->instance, "vkGetDeviceProcAddr");
 
+#ifdef VKUTIL_LAZY_DISPATCH
+    if (vk_lazy_owner == vk) {
+#define PFN_DEVICE_CORE(name)                                                                    \
+    vk->name = (PFN_vk##name)vk->GetDeviceProcAddr(vk->dev, "vk" #name);
+#define PFN_DEVICE(name) vk->name = (PFN_vk##name)vk_lazy_##name;
+#include "vkutil_entrypoints.inc"
+        return;
+    }
+#endif
+
 #define PFN_DEVICE(name) vk->name = (PFN_vk##name)vk->GetDeviceProcAddr(vk->dev, "vk" #name);
 #include "vkutil_entrypoints.inc"
 }
@@ -433,15 +1096,12 @@ vk_init_device_enabled_features(struct vk *vk, VkPhysicalDeviceFeatures2 *featur
         vk_die("no geometry shader support");
     if (!vk->features.features.fillModeNonSolid)
         vk_die("no non-solid fill mode support");
-    if (vk->params.api_version >= VK_API_VERSION_1_2) {
-        if (!vk->vulkan_11_features.samplerYcbcrConversion)
-            vk_die("no ycbcr conversion support");
-        if (!vk->vulkan_12_features.hostQueryReset)
-            vk_die("no host query reset support");
-    } else {
-        if (!vk->sampler_ycbcr_conversion_features.samplerYcbcrConversion)
-            vk_die("no ycbcr conversion support");
-    }
+    if (!vk->vulkan_11_features.samplerYcbcrConversion)
+        vk_die("no ycbcr conversion support");
+    if (!vk->vulkan_12_features.hostQueryReset)
+        vk_die("no host query reset support");
+    if (!vk->vulkan_12_features.timelineSemaphore)
+        vk_die("no timeline semaphore support");
 
     if (vk->params.enable_all_features) {
         *features = vk->features;
@@ -454,18 +1114,17 @@ vk_init_device_enabled_features(struct vk *vk, VkPhysicalDeviceFeatures2 *featur
             .tessellationShader = true,
             .geometryShader = true,
             .fillModeNonSolid = true,
+            .multiDrawIndirect = vk->features.features.multiDrawIndirect,
+            .drawIndirectFirstInstance = vk->features.features.drawIndirectFirstInstance,
         },
     };
 
     void **pnext = &features->pNext;
-    if (vk->params.api_version >= VK_API_VERSION_1_2) {
-        *pnext = &vk->vulkan_11_features;
-        vk->vulkan_11_features.pNext = &vk->vulkan_12_features;
-        pnext = &vk->vulkan_12_features.pNext;
-    } else {
-        *pnext = &vk->sampler_ycbcr_conversion_features;
-        pnext = &vk->sampler_ycbcr_conversion_features.pNext;
-    }
+
+    *pnext = &vk->vulkan_11_features;
+    vk->vulkan_11_features.pNext = &vk->vulkan_12_features;
+    pnext = &vk->vulkan_12_features.pNext;
+
     if (vk->params.api_version >= VK_API_VERSION_1_3) {
         *pnext = &vk->vulkan_13_features;
         pnext = &vk->vulkan_13_features.pNext;
@@ -474,37 +1133,136 @@ vk_init_device_enabled_features(struct vk *vk, VkPhysicalDeviceFeatures2 *featur
         *pnext = &vk->custom_border_color_features;
         pnext = &vk->custom_border_color_features.pNext;
     }
+    if (vk->EXT_multi_draw) {
+        if (!vk->multi_draw_features.multiDraw)
+            vk_die("no multi draw support");
+        *pnext = &vk->multi_draw_features;
+        pnext = &vk->multi_draw_features.pNext;
+    }
 
     *pnext = NULL;
 }
 
+static inline uint32_t
+vk_init_device_pick_queue(struct vk *vk,
+                          const VkQueueFamilyProperties *props,
+                          uint32_t *used_counts,
+                          const uint32_t *families,
+                          uint32_t family_count,
+                          uint32_t *queue_index)
+{
+    for (uint32_t i = 0; i < family_count; i++) {
+        const uint32_t family = families[i];
+        if (family == UINT32_MAX)
+            continue;
+
+        if (used_counts[family] < props[family].queueCount) {
+            *queue_index = used_counts[family]++;
+            return family;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+static inline void
+vk_init_device_queues(struct vk *vk,
+                      VkDeviceQueueCreateInfo *queue_infos,
+                      uint32_t *queue_info_count,
+                      uint32_t *queue_indices)
+{
+    VkQueueFamilyProperties props[16];
+    uint32_t count = ARRAY_SIZE(props);
+    vk->GetPhysicalDeviceQueueFamilyProperties(vk->physical_dev, &count, props);
+
+    /* prefer families without the graphics (and compute) bit for the
+     * dedicated queues
+     */
+    uint32_t graphics = UINT32_MAX;
+    uint32_t compute = UINT32_MAX;
+    uint32_t transfer = UINT32_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        const VkQueueFlags flags = props[i].queueFlags;
+        if (flags & VK_QUEUE_GRAPHICS_BIT) {
+            if (graphics == UINT32_MAX)
+                graphics = i;
+        } else if (flags & VK_QUEUE_COMPUTE_BIT) {
+            if (compute == UINT32_MAX)
+                compute = i;
+        } else if (flags & VK_QUEUE_TRANSFER_BIT) {
+            if (transfer == UINT32_MAX)
+                transfer = i;
+        }
+    }
+    if (graphics == UINT32_MAX)
+        vk_die("no queue family supports graphics");
+    if (!props[graphics].timestampValidBits)
+        vk_die("queue family %u does not support timestamps", graphics);
+
+    uint32_t used_counts[ARRAY_SIZE(props)] = { 0 };
+
+    vk->queue_count = 0;
+    vk->queues[vk->queue_count].family_index =
+        vk_init_device_pick_queue(vk, props, used_counts, &graphics, 1,
+                                  &queue_indices[vk->queue_count]);
+    vk->graphics_queue = &vk->queues[vk->queue_count++];
+
+    const uint32_t compute_families[] = { compute, graphics };
+    uint32_t family = vk_init_device_pick_queue(vk, props, used_counts, compute_families,
+                                                ARRAY_SIZE(compute_families),
+                                                &queue_indices[vk->queue_count]);
+    if (family != UINT32_MAX) {
+        vk->queues[vk->queue_count].family_index = family;
+        vk->compute_queue = &vk->queues[vk->queue_count++];
+    } else {
+        vk->compute_queue = vk->graphics_queue;
+    }
+
+    const uint32_t transfer_families[] = { transfer, compute, graphics };
+    family = vk_init_device_pick_queue(vk, props, used_counts, transfer_families,
+                                       ARRAY_SIZE(transfer_families),
+                                       &queue_indices[vk->queue_count]);
+    if (family != UINT32_MAX) {
+        vk->queues[vk->queue_count].family_index = family;
+        vk->transfer_queue = &vk->queues[vk->queue_count++];
+    } else {
+        vk->transfer_queue = vk->graphics_queue;
+    }
+
+    for (uint32_t i = 0; i < vk->queue_count; i++)
+        vk->queues[i].family_props = props[vk->queues[i].family_index];
+
+    static const float priorities[ARRAY_SIZE(vk->queues)] = { 1.0f, 1.0f, 1.0f };
+    *queue_info_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!used_counts[i])
+            continue;
+
+        queue_infos[(*queue_info_count)++] = (VkDeviceQueueCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = i,
+            .queueCount = used_counts[i],
+            .pQueuePriorities = priorities,
+        };
+    }
+}
+
 static inline void
 vk_init_device(struct vk *vk)
 {
     VkPhysicalDeviceFeatures2 enabled_features;
     vk_init_device_enabled_features(vk, &enabled_features);
 
-    vk->queue_family_index = 0;
-
-    VkQueueFamilyProperties queue_props;
-    uint32_t queue_count = 1;
-    vk->GetPhysicalDeviceQueueFamilyProperties(vk->physical_dev, &queue_count, &queue_props);
-    if (!(queue_props.queueFlags & VK_QUEUE_GRAPHICS_BIT))
-        vk_die("queue family 0 does not support graphics");
-    if (!queue_props.timestampValidBits)
-        vk_die("queue family 0 does not support timestamps");
+    VkDeviceQueueCreateInfo queue_infos[ARRAY_SIZE(vk->queues)];
+    uint32_t queue_info_count;
+    uint32_t queue_indices[ARRAY_SIZE(vk->queues)];
+    vk_init_device_queues(vk, queue_infos, &queue_info_count, queue_indices);
 
     const VkDeviceCreateInfo dev_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pNext = &enabled_features,
-        .queueCreateInfoCount = 1,
-        .pQueueCreateInfos =
-            &(VkDeviceQueueCreateInfo){
-                .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                .queueFamilyIndex = vk->queue_family_index,
-                .queueCount = 1,
-                .pQueuePriorities = &(float){ 1.0f },
-            },
+        .queueCreateInfoCount = queue_info_count,
+        .pQueueCreateInfos = queue_infos,
         .enabledExtensionCount = vk->params.dev_ext_count,
         .ppEnabledExtensionNames = vk->params.dev_exts,
     };
@@ -513,7 +1271,10 @@ vk_init_device(struct vk *vk)
 
     vk_init_device_dispatch(vk);
 
-    vk->GetDeviceQueue(vk->dev, vk->queue_family_index, 0, &vk->queue);
+    for (uint32_t i = 0; i < vk->queue_count; i++) {
+        struct vk_queue *queue = &vk->queues[i];
+        vk->GetDeviceQueue(vk->dev, queue->family_index, queue_indices[i], &queue->queue);
+    }
 }
 
 static inline void
@@ -532,6 +1293,10 @@ vk_init_desc_pool(struct vk *vk)
             .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 256,
         },
+        [3] = {
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 256,
+        },
     };
     const VkDescriptorPoolCreateInfo pool_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
@@ -545,18 +1310,74 @@ vk_init_desc_pool(struct vk *vk)
 }
 
 static inline void
-vk_init_cmd_pool(struct vk *vk)
+vk_init_cmd_pool(struct vk *vk, struct vk_queue *queue)
 {
     const VkCommandPoolCreateInfo pool_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-        .queueFamilyIndex = vk->queue_family_index,
+        .queueFamilyIndex = queue->family_index,
     };
 
-    vk->result = vk->CreateCommandPool(vk->dev, &pool_info, NULL, &vk->cmd_pool);
+    vk->result = vk->CreateCommandPool(vk->dev, &pool_info, NULL, &queue->cmd_pool);
     vk_check(vk, "failed to create command pool");
 }
 
+static inline void
+vk_init_submit(struct vk *vk, struct vk_queue *queue)
+{
+    const VkSemaphoreTypeCreateInfo type_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+    const VkSemaphoreCreateInfo sem_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &type_info,
+    };
+
+    vk->result = vk->CreateSemaphore(vk->dev, &sem_info, NULL, &queue->submit.timeline);
+    vk_check(vk, "failed to create timeline semaphore");
+
+    static_assert(ARRAY_SIZE(queue->submit.cmds) == ARRAY_SIZE(queue->submit.points), "");
+    queue->submit.count = ARRAY_SIZE(queue->submit.cmds);
+}
+
+static inline bool
+vk_init_shared(struct vk *vk)
+{
+    const struct vk *shared = vk_shared;
+    if (!shared)
+        return false;
+
+    /* the shared device has no extension enabled */
+    if (vk->params.api_version > shared->params.api_version ||
+        (vk->params.enable_all_features && !shared->params.enable_all_features) ||
+        vk->params.instance_ext_count || vk->params.dev_ext_count) {
+        vk_log("cannot share the device");
+        return false;
+    }
+
+    const struct vk_init_params params = vk->params;
+    *vk = *shared;
+    vk->params = params;
+    vk->shared = true;
+    vk->queue_mutex = &vk_shared_queue_mutex;
+
+    /* the queue pointers must not point into the shared queues */
+    vk->graphics_queue = &vk->queues[shared->graphics_queue - shared->queues];
+    vk->compute_queue = &vk->queues[shared->compute_queue - shared->queues];
+    vk->transfer_queue = &vk->queues[shared->transfer_queue - shared->queues];
+
+    /* command pools and timelines are per-test */
+    for (uint32_t i = 0; i < vk->queue_count; i++) {
+        struct vk_queue *queue = &vk->queues[i];
+        queue->cmd_pool = VK_NULL_HANDLE;
+        memset(&queue->submit, 0, sizeof(queue->submit));
+    }
+
+    return true;
+}
+
 static inline void
 vk_init(struct vk *vk, const struct vk_init_params *params)
 {
@@ -566,18 +1387,21 @@ vk_init(struct vk *vk, const struct vk_init_params *params)
     if (vk->params.api_version < VKUTIL_MIN_API_VERSION)
         vk->params.api_version = VKUTIL_MIN_API_VERSION;
 
-    vk_init_library(vk);
+    if (!vk_init_shared(vk)) {
+        vk_init_library(vk);
 
-    vk_init_instance(vk);
+        vk_init_instance(vk);
 
-    vk_init_physical_device(vk);
-    vk_init_device(vk);
+        vk_init_physical_device(vk);
+        vk_init_device(vk);
+    }
 
     vk_init_desc_pool(vk);
-    vk_init_cmd_pool(vk);
 
-    static_assert(ARRAY_SIZE(vk->submit.cmds) == ARRAY_SIZE(vk->submit.fences), "");
-    vk->submit.count = ARRAY_SIZE(vk->submit.cmds);
+    for (uint32_t i = 0; i < vk->queue_count; i++) {
+        vk_init_cmd_pool(vk, &vk->queues[i]);
+        vk_init_submit(vk, &vk->queues[i]);
+    }
 
     /* avoid accessing dangling pointers */
     vk->params.instance_ext_count = 0;
@@ -587,21 +1411,40 @@ vk_init(struct vk *vk, const struct vk_init_params *params)
 static inline void
 vk_cleanup(struct vk *vk)
 {
-    vk->DeviceWaitIdle(vk->dev);
+    if (vk->shared) {
+        /* other tests might be using the device */
+        for (uint32_t i = 0; i < vk->queue_count; i++) {
+            const struct vk_queue *queue = &vk->queues[i];
+            const VkSemaphoreWaitInfo wait_info = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                .semaphoreCount = 1,
+                .pSemaphores = &queue->submit.timeline,
+                .pValues = &queue->submit.point,
+            };
+            vk->WaitSemaphores(vk->dev, &wait_info, UINT64_MAX);
+        }
+    } else {
+        vk->DeviceWaitIdle(vk->dev);
+    }
 
-    for (uint32_t i = 0; i < vk->submit.count; i++) {
-        if (vk->submit.fences[i] == VK_NULL_HANDLE)
-            break;
-        vk->DestroyFence(vk->dev, vk->submit.fences[i], NULL);
+    for (uint32_t i = 0; i < vk->queue_count; i++) {
+        vk->DestroySemaphore(vk->dev, vk->queues[i].submit.timeline, NULL);
+        vk->DestroyCommandPool(vk->dev, vk->queues[i].cmd_pool, NULL);
     }
 
     vk->DestroyDescriptorPool(vk->dev, vk->desc_pool, NULL);
-    vk->DestroyCommandPool(vk->dev, vk->cmd_pool, NULL);
+
+    if (vk->shared)
+        return;
 
     vk->DestroyDevice(vk->dev, NULL);
 
     vk->DestroyInstance(vk->instance, NULL);
 
+#ifdef VKUTIL_LAZY_DISPATCH
+    vk_cleanup_lazy_dispatch(vk);
+#endif
+
     dlclose(vk->handle);
 }
 
@@ -621,12 +1464,259 @@ vk_alloc_memory(struct vk *vk, VkDeviceSize size, uint32_t mt_index)
     return mem;
 }
 
-static inline struct vk_buffer *
-vk_create_buffer(struct vk *vk, VkDeviceSize size, VkBufferUsageFlags usage)
+/* returns the first memory type in type_bits that has all of mt_flags */
+static inline uint32_t
+vk_find_memory_type(const struct vk *vk, uint32_t type_bits, VkMemoryPropertyFlags mt_flags)
 {
-    struct vk_buffer *buf = calloc(1, sizeof(*buf));
-    if (!buf)
-        vk_die("failed to alloc buf");
+    for (uint32_t i = 0; i < vk->mem_props.memoryTypeCount; i++) {
+        const VkMemoryType *mt = &vk->mem_props.memoryTypes[i];
+        if ((type_bits & (1u << i)) && (mt->propertyFlags & mt_flags) == mt_flags)
+            return i;
+    }
+
+    vk_die("failed to find a memory type with flags 0x%x in 0x%x", mt_flags, type_bits);
+}
+
+static inline bool
+vk_is_memory_type_cached(const struct vk *vk, uint32_t mt_index)
+{
+    return vk->mem_props.memoryTypes[mt_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+}
+
+#ifdef VKUTIL_X86
+
+/* dst is aligned and size is a multiple of the vector size */
+__attribute__((target("sse2"))) static inline void
+vk_stream_copy_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        const __m128i v0 = _mm_loadu_si128((const __m128i *)src);
+        const __m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+        const __m128i v2 = _mm_loadu_si128((const __m128i *)(src + 32));
+        const __m128i v3 = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, v0);
+        _mm_stream_si128((__m128i *)(dst + 16), v1);
+        _mm_stream_si128((__m128i *)(dst + 32), v2);
+        _mm_stream_si128((__m128i *)(dst + 48), v3);
+    }
+    for (; size; size -= 16, dst += 16, src += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+
+    _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static inline void
+vk_stream_copy_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        const __m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+        const __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+        const __m256i v2 = _mm256_loadu_si256((const __m256i *)(src + 64));
+        const __m256i v3 = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)dst, v0);
+        _mm256_stream_si256((__m256i *)(dst + 32), v1);
+        _mm256_stream_si256((__m256i *)(dst + 64), v2);
+        _mm256_stream_si256((__m256i *)(dst + 96), v3);
+    }
+    for (; size; size -= 32, dst += 32, src += 32)
+        _mm256_stream_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+
+    _mm_sfence();
+}
+
+__attribute__((target("sse2"))) static inline void
+vk_stream_fill_sse2(uint8_t *dst, uint8_t val, size_t size)
+{
+    const __m128i v = _mm_set1_epi8((char)val);
+    for (; size >= 64; size -= 64, dst += 64) {
+        _mm_stream_si128((__m128i *)dst, v);
+        _mm_stream_si128((__m128i *)(dst + 16), v);
+        _mm_stream_si128((__m128i *)(dst + 32), v);
+        _mm_stream_si128((__m128i *)(dst + 48), v);
+    }
+    for (; size; size -= 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, v);
+
+    _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static inline void
+vk_stream_fill_avx2(uint8_t *dst, uint8_t val, size_t size)
+{
+    const __m256i v = _mm256_set1_epi8((char)val);
+    for (; size >= 128; size -= 128, dst += 128) {
+        _mm256_stream_si256((__m256i *)dst, v);
+        _mm256_stream_si256((__m256i *)(dst + 32), v);
+        _mm256_stream_si256((__m256i *)(dst + 64), v);
+        _mm256_stream_si256((__m256i *)(dst + 96), v);
+    }
+    for (; size; size -= 32, dst += 32)
+        _mm256_stream_si256((__m256i *)dst, v);
+
+    _mm_sfence();
+}
+
+/* Returns the vector size of the streaming kernels, or 0 when there is none. */
+static inline size_t
+vk_stream_align(void)
+{
+    if (__builtin_cpu_supports("avx2"))
+        return 32;
+    if (__builtin_cpu_supports("sse2"))
+        return 16;
+    return 0;
+}
+
+#elif defined(__aarch64__)
+
+/* STNP of a pair of q registers; dst is aligned and size is a multiple of 32 */
+static inline void
+vk_stream_copy_stnp(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __asm__ volatile("ldp q0, q1, [%1]\n"
+                         "ldp q2, q3, [%1, #32]\n"
+                         "stnp q0, q1, [%0]\n"
+                         "stnp q2, q3, [%0, #32]\n"
+                         :
+                         : "r"(dst), "r"(src)
+                         : "v0", "v1", "v2", "v3", "memory");
+    }
+    for (; size; size -= 32, dst += 32, src += 32) {
+        __asm__ volatile("ldp q0, q1, [%1]\n"
+                         "stnp q0, q1, [%0]\n"
+                         :
+                         : "r"(dst), "r"(src)
+                         : "v0", "v1", "memory");
+    }
+
+    __asm__ volatile("dmb oshst" ::: "memory");
+}
+
+static inline void
+vk_stream_fill_stnp(uint8_t *dst, uint8_t val, size_t size)
+{
+    for (; size >= 64; size -= 64, dst += 64) {
+        __asm__ volatile("dup v0.16b, %w1\n"
+                         "stnp q0, q0, [%0]\n"
+                         "stnp q0, q0, [%0, #32]\n"
+                         :
+                         : "r"(dst), "r"((uint32_t)val)
+                         : "v0", "memory");
+    }
+    for (; size; size -= 32, dst += 32) {
+        __asm__ volatile("dup v0.16b, %w1\n"
+                         "stnp q0, q0, [%0]\n"
+                         :
+                         : "r"(dst), "r"((uint32_t)val)
+                         : "v0", "memory");
+    }
+
+    __asm__ volatile("dmb oshst" ::: "memory");
+}
+
+/* AdvSIMD is mandatory on AArch64 */
+static inline size_t
+vk_stream_align(void)
+{
+    return 32;
+}
+
+#endif /* VKUTIL_X86 */
+
+/* Copies with non-temporal stores, which bypass the cache and are combined
+ * in write buffers.  The unaligned head and tail use memcpy.  It falls back
+ * to memcpy when there are no streaming kernels.
+ */
+static inline void
+vk_stream_copy(void *dst, const void *src, size_t size)
+{
+#if defined(VKUTIL_X86) || defined(__aarch64__)
+    const size_t align = vk_stream_align();
+    if (align && size >= align * 4) {
+        const size_t head = -(uintptr_t)dst & (align - 1);
+        const size_t body = (size - head) & ~(align - 1);
+        uint8_t *d = dst;
+        const uint8_t *s = src;
+
+        memcpy(d, s, head);
+#ifdef VKUTIL_X86
+        if (align == 32)
+            vk_stream_copy_avx2(d + head, s + head, body);
+        else
+            vk_stream_copy_sse2(d + head, s + head, body);
+#else
+        vk_stream_copy_stnp(d + head, s + head, body);
+#endif
+        memcpy(d + head + body, s + head + body, size - head - body);
+        return;
+    }
+#endif
+
+    memcpy(dst, src, size);
+}
+
+static inline void
+vk_stream_fill(void *dst, uint8_t val, size_t size)
+{
+#if defined(VKUTIL_X86) || defined(__aarch64__)
+    const size_t align = vk_stream_align();
+    if (align && size >= align * 4) {
+        const size_t head = -(uintptr_t)dst & (align - 1);
+        const size_t body = (size - head) & ~(align - 1);
+        uint8_t *d = dst;
+
+        memset(d, val, head);
+#ifdef VKUTIL_X86
+        if (align == 32)
+            vk_stream_fill_avx2(d + head, val, body);
+        else
+            vk_stream_fill_sse2(d + head, val, body);
+#else
+        vk_stream_fill_stnp(d + head, val, body);
+#endif
+        memset(d + head + body, val, size - head - body);
+        return;
+    }
+#endif
+
+    memset(dst, val, size);
+}
+
+/* Writes to mapped memory.  Streaming stores are several times faster than
+ * memcpy on write-combined or uncached memory, but they evict the data from
+ * host-cached memory and are only used when cached is false.
+ */
+static inline void
+vk_upload(void *dst, const void *src, size_t size, bool cached)
+{
+    if (cached)
+        memcpy(dst, src, size);
+    else
+        vk_stream_copy(dst, src, size);
+}
+
+static inline void
+vk_upload_fill(void *dst, uint8_t val, size_t size, bool cached)
+{
+    if (cached)
+        memset(dst, val, size);
+    else
+        vk_stream_fill(dst, val, size);
+}
+
+/* The memory type is the first one that has mt_flags.  The memory is mapped
+ * only when it is host-visible.
+ */
+static inline struct vk_buffer *
+vk_create_buffer_with_flags(struct vk *vk,
+                            VkDeviceSize size,
+                            VkBufferUsageFlags usage,
+                            VkMemoryPropertyFlags mt_flags)
+{
+    struct vk_buffer *buf = calloc(1, sizeof(*buf));
+    if (!buf)
+        vk_die("failed to alloc buf");
 
     buf->info = (VkBufferCreateInfo){
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -639,14 +1729,15 @@ vk_create_buffer(struct vk *vk, VkDeviceSize size, VkBufferUsageFlags usage)
 
     VkMemoryRequirements reqs;
     vk->GetBufferMemoryRequirements(vk->dev, buf->buf, &reqs);
-    if (!(reqs.memoryTypeBits & (1u << vk->buf_mt_index)))
-        vk_die("failed to meet buf memory reqs: 0x%x", reqs.memoryTypeBits);
+    const uint32_t mt_index = vk_find_memory_type(vk, reqs.memoryTypeBits, mt_flags);
 
-    buf->mem = vk_alloc_memory(vk, reqs.size, vk->buf_mt_index);
+    buf->mem = vk_alloc_memory(vk, reqs.size, mt_index);
     buf->mem_size = reqs.size;
 
-    vk->result = vk->MapMemory(vk->dev, buf->mem, 0, buf->mem_size, 0, &buf->mem_ptr);
-    vk_check(vk, "failed to map buffer memory");
+    if (vk->mem_props.memoryTypes[mt_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vk->result = vk->MapMemory(vk->dev, buf->mem, 0, buf->mem_size, 0, &buf->mem_ptr);
+        vk_check(vk, "failed to map buffer memory");
+    }
 
     vk->result = vk->BindBufferMemory(vk->dev, buf->buf, buf->mem, 0);
     vk_check(vk, "failed to bind buffer memory");
@@ -654,6 +1745,15 @@ vk_create_buffer(struct vk *vk, VkDeviceSize size, VkBufferUsageFlags usage)
     return buf;
 }
 
+/* the buffer is in the memory type of buf_mt_index, or one like it */
+static inline struct vk_buffer *
+vk_create_buffer(struct vk *vk, VkDeviceSize size, VkBufferUsageFlags usage)
+{
+    const VkMemoryPropertyFlags mt_flags =
+        vk->mem_props.memoryTypes[vk->buf_mt_index].propertyFlags;
+    return vk_create_buffer_with_flags(vk, size, usage, mt_flags);
+}
+
 static inline void
 vk_destroy_buffer(struct vk *vk, struct vk_buffer *buf)
 {
@@ -662,6 +1762,177 @@ vk_destroy_buffer(struct vk *vk, struct vk_buffer *buf)
     free(buf);
 }
 
+static inline void
+vk_write_buffer(struct vk *vk,
+                struct vk_buffer *buf,
+                VkDeviceSize offset,
+                const void *data,
+                size_t size)
+{
+    const bool cached = vk_is_memory_type_cached(vk, vk->buf_mt_index);
+    vk_upload((uint8_t *)buf->mem_ptr + offset, data, size, cached);
+}
+
+static inline struct vk_indirect *
+vk_create_indirect(struct vk *vk, uint32_t stride, uint32_t max_count)
+{
+    struct vk_indirect *indirect = calloc(1, sizeof(*indirect));
+    if (!indirect)
+        vk_die("failed to alloc indirect");
+
+    indirect->stride = stride;
+    indirect->max_count = max_count;
+
+    const VkDeviceSize size = VKUTIL_INDIRECT_CMD_OFFSET + (VkDeviceSize)stride * max_count;
+    indirect->buf = vk_create_buffer(vk, size,
+                                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                         VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    memset(indirect->buf->mem_ptr, 0, VKUTIL_INDIRECT_CMD_OFFSET);
+
+    return indirect;
+}
+
+static inline void
+vk_destroy_indirect(struct vk *vk, struct vk_indirect *indirect)
+{
+    vk_destroy_buffer(vk, indirect->buf);
+    free(indirect);
+}
+
+/* Writes commands from the host and sets the draw count to first + count. */
+static inline void
+vk_write_indirect(struct vk *vk,
+                  struct vk_indirect *indirect,
+                  uint32_t first,
+                  const void *cmds,
+                  uint32_t count)
+{
+    if (first + count > indirect->max_count)
+        vk_die("too many indirect commands");
+
+    vk_write_buffer(vk, indirect->buf,
+                    VKUTIL_INDIRECT_CMD_OFFSET + (VkDeviceSize)indirect->stride * first, cmds,
+                    (size_t)indirect->stride * count);
+
+    const uint32_t draw_count = first + count;
+    vk_write_buffer(vk, indirect->buf, 0, &draw_count, sizeof(draw_count));
+}
+
+static inline uint32_t
+vk_read_indirect_count(const struct vk_indirect *indirect)
+{
+    return *(const volatile uint32_t *)indirect->buf->mem_ptr;
+}
+
+/* Resets the draw count before a shader appends commands. */
+static inline void
+vk_cmd_reset_indirect(struct vk *vk,
+                      VkCommandBuffer cmd,
+                      struct vk_indirect *indirect,
+                      VkPipelineStageFlags dst_stage,
+                      VkAccessFlags dst_access)
+{
+    const VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = dst_access,
+        .buffer = indirect->buf->buf,
+        .size = VKUTIL_INDIRECT_CMD_OFFSET,
+    };
+
+    vk->CmdFillBuffer(cmd, indirect->buf->buf, 0, VKUTIL_INDIRECT_CMD_OFFSET, 0);
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stage, 0, 0, NULL, 1,
+                           &barrier, 0, NULL);
+}
+
+/* Makes commands written by the gpu visible to indirect draws and dispatches. */
+static inline void
+vk_cmd_indirect_barrier(struct vk *vk,
+                        VkCommandBuffer cmd,
+                        struct vk_indirect *indirect,
+                        VkPipelineStageFlags src_stage,
+                        VkAccessFlags src_access)
+{
+    const VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = src_access,
+        .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+        .buffer = indirect->buf->buf,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    vk->CmdPipelineBarrier(cmd, src_stage, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0, NULL, 1,
+                           &barrier, 0, NULL);
+}
+
+/* Draws count commands.  Without multiDrawIndirect, each command is drawn
+ * separately.
+ */
+static inline void
+vk_cmd_draw_indirect(struct vk *vk,
+                     VkCommandBuffer cmd,
+                     const struct vk_indirect *indirect,
+                     uint32_t count,
+                     bool indexed)
+{
+    if (count > indirect->max_count)
+        vk_die("too many indirect commands");
+
+    /* maxDrawIndirectCount is 1 without multiDrawIndirect */
+    const uint32_t max_draw_count = vk->features.features.multiDrawIndirect
+                                        ? vk->props.properties.limits.maxDrawIndirectCount
+                                        : 1;
+    uint32_t draw_count;
+    for (uint32_t i = 0; i < count; i += draw_count) {
+        draw_count = count - i < max_draw_count ? count - i : max_draw_count;
+        const VkDeviceSize offset =
+            VKUTIL_INDIRECT_CMD_OFFSET + (VkDeviceSize)indirect->stride * i;
+        if (indexed) {
+            vk->CmdDrawIndexedIndirect(cmd, indirect->buf->buf, offset, draw_count,
+                                       indirect->stride);
+        } else {
+            vk->CmdDrawIndirect(cmd, indirect->buf->buf, offset, draw_count, indirect->stride);
+        }
+    }
+}
+
+/* Draws as many commands as the draw count in the buffer, up to max_count. */
+static inline void
+vk_cmd_draw_indirect_count(struct vk *vk,
+                           VkCommandBuffer cmd,
+                           const struct vk_indirect *indirect,
+                           bool indexed)
+{
+    if (!vk->vulkan_12_features.drawIndirectCount)
+        vk_die("no draw indirect count support");
+    /* the count is in the buffer and the draws cannot be split */
+    if (indirect->max_count > vk->props.properties.limits.maxDrawIndirectCount)
+        vk_die("max count %u exceeds maxDrawIndirectCount", indirect->max_count);
+
+    if (indexed) {
+        vk->CmdDrawIndexedIndirectCount(cmd, indirect->buf->buf, VKUTIL_INDIRECT_CMD_OFFSET,
+                                        indirect->buf->buf, 0, indirect->max_count,
+                                        indirect->stride);
+    } else {
+        vk->CmdDrawIndirectCount(cmd, indirect->buf->buf, VKUTIL_INDIRECT_CMD_OFFSET,
+                                 indirect->buf->buf, 0, indirect->max_count, indirect->stride);
+    }
+}
+
+static inline void
+vk_cmd_dispatch_indirect(struct vk *vk,
+                         VkCommandBuffer cmd,
+                         const struct vk_indirect *indirect,
+                         uint32_t index)
+{
+    if (index >= indirect->max_count)
+        vk_die("bad indirect command index");
+
+    vk->CmdDispatchIndirect(cmd, indirect->buf->buf,
+                            VKUTIL_INDIRECT_CMD_OFFSET + (VkDeviceSize)indirect->stride * index);
+}
+
 static inline void
 vk_validate_image(struct vk *vk, struct vk_image *img)
 {
@@ -702,6 +1973,41 @@ vk_validate_image(struct vk *vk, struct vk_image *img)
         vk_die("image sample count %u is not supported", img->info.samples);
 }
 
+static inline VkImageAspectFlags
+vk_format_aspect_mask(VkFormat format)
+{
+    switch (format) {
+#define FMT_D(fmt)                                                                               \
+    case VK_FORMAT_##fmt:                                                                        \
+        return VK_IMAGE_ASPECT_DEPTH_BIT;
+#define FMT_S(fmt)                                                                               \
+    case VK_FORMAT_##fmt:                                                                        \
+        return VK_IMAGE_ASPECT_STENCIL_BIT;
+#define FMT_DS(fmt)                                                                              \
+    case VK_FORMAT_##fmt:                                                                        \
+        return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+#include "vkutil_formats.inc"
+    default:
+        return VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+static inline void
+vk_init_image_states(struct vk *vk, struct vk_image *img)
+{
+    const VkImageAspectFlags aspect_mask = vk_format_aspect_mask(img->info.format);
+    img->state_aspect_count =
+        aspect_mask == (VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT) ? 2 : 1;
+
+    const uint32_t count = img->state_aspect_count * img->info.mipLevels * img->info.arrayLayers;
+    img->states = calloc(count, sizeof(*img->states));
+    if (!img->states)
+        vk_die("failed to alloc img states");
+
+    for (uint32_t i = 0; i < count; i++)
+        img->states[i].layout = img->info.initialLayout;
+}
+
 static inline void
 vk_init_image(struct vk *vk, struct vk_image *img)
 {
@@ -714,6 +2020,7 @@ vk_init_image(struct vk *vk, struct vk_image *img)
                         : fmt_props.formatProperties.linearTilingFeatures;
 
     vk_validate_image(vk, img);
+    vk_init_image_states(vk, img);
 
     vk->result = vk->CreateImage(vk->dev, &img->info, NULL, &img->img);
     vk_check(vk, "failed to create image");
@@ -721,8 +2028,22 @@ vk_init_image(struct vk *vk, struct vk_image *img)
     VkMemoryRequirements reqs;
     vk->GetImageMemoryRequirements(vk->dev, img->img, &reqs);
 
-    uint32_t mt_index;
-    if (reqs.memoryTypeBits & (1u << vk->buf_mt_index)) {
+    uint32_t mt_index = vk->mem_props.memoryTypeCount;
+    if (img->info.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT) {
+        for (uint32_t i = 0; i < vk->mem_props.memoryTypeCount; i++) {
+            const VkMemoryType *mt = &vk->mem_props.memoryTypes[i];
+            if ((reqs.memoryTypeBits & (1u << i)) &&
+                (mt->propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)) {
+                mt_index = i;
+                break;
+            }
+        }
+    }
+
+    if (mt_index < vk->mem_props.memoryTypeCount) {
+        img->mem_mappable = false;
+        img->mem_lazy = true;
+    } else if (reqs.memoryTypeBits & (1u << vk->buf_mt_index)) {
         mt_index = vk->buf_mt_index;
         img->mem_mappable = true;
     } else {
@@ -773,1088 +2094,4144 @@ vk_create_image(struct vk *vk,
 }
 
 static inline const void *
-vk_parse_ppm(const void *ppm_data, size_t ppm_size, int *width, int *height)
+vk_map_file(const char *filename, size_t *size)
 {
-    if (sscanf(ppm_data, "P6 %d %d 255\n", width, height) != 2)
-        vk_die("invalid ppm header");
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        vk_die("failed to open %s", filename);
 
-    const size_t img_size = *width * *height * 3;
-    if (img_size >= ppm_size)
-        vk_die("bad ppm dimension %dx%d", *width, *height);
+    struct stat st;
+    if (fstat(fd, &st))
+        vk_die("failed to stat %s", filename);
+    if (!st.st_size)
+        vk_die("%s is empty", filename);
 
-    const size_t hdr_size = ppm_size - img_size;
-    if (!isspace(((const char *)ppm_data)[hdr_size - 1]))
-        vk_die("no space at the end of ppm header");
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+        vk_die("failed to map %s", filename);
+    close(fd);
+
+    /* the contents are usually read once from start to end */
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
 
-    return ppm_data + hdr_size;
+    *size = st.st_size;
+    return ptr;
 }
 
 static inline void
-vk_rgb_to_yuv(const uint8_t *rgb, uint8_t *yuv)
+vk_unmap_file(const void *ptr, size_t size)
 {
-    const int tmp[3] = {
-        ((66 * (rgb)[0] + 129 * (rgb)[1] + 25 * (rgb)[2] + 128) >> 8) + 16,
-        ((-38 * (rgb)[0] - 74 * (rgb)[1] + 112 * (rgb)[2] + 128) >> 8) + 128,
-        ((112 * (rgb)[0] - 94 * (rgb)[1] - 18 * (rgb)[2] + 128) >> 8) + 128,
-    };
-
-    for (int i = 0; i < 3; i++) {
-        if (tmp[i] > 255)
-            yuv[i] = 255;
-        else if (tmp[i] < 0)
-            yuv[i] = 0;
-        else
-            yuv[i] = tmp[i];
-    }
+    munmap((void *)ptr, size);
 }
 
-static inline struct vk_image *
-vk_create_image_from_ppm(struct vk *vk, const void *ppm_data, size_t ppm_size, bool planar)
-{
-    int width;
-    int height;
-    const uint8_t *rgb_data = vk_parse_ppm(ppm_data, ppm_size, &width, &height);
-
-    const VkFormat fmt = planar ? VK_FORMAT_G8_B8R8_2PLANE_420_UNORM : VK_FORMAT_B8G8R8A8_UNORM;
+/* "VKFC" */
+#define VK_FORMAT_CAPS_MAGIC 0x43464b56
+#define VK_FORMAT_CAPS_VERSION 2
 
-    struct vk_image *img = calloc(1, sizeof(*img));
-    if (!img)
-        vk_die("failed to alloc img");
+struct vk_format_caps_band {
+    struct vk *vk;
+    bool modifiers;
 
-    img->info = (VkImageCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-            .imageType = VK_IMAGE_TYPE_2D,
-            .format = fmt,
-            .extent = {
-                .width = width,
-                .height = height,
-                .depth = 1,
-            },
-            .mipLevels = 1,
-            .arrayLayers = 1,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .tiling = VK_IMAGE_TILING_LINEAR,
-            .usage = VK_IMAGE_USAGE_SAMPLED_BIT,
-            .initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED,
-    };
+    void *records;
+    uint32_t begin;
+    uint32_t end;
+};
 
-    vk_init_image(vk, img);
+struct vk_format_caps_query {
+    struct vk_format_caps_format format;
+    VkDrmFormatModifierPropertiesEXT *modifiers;
+};
 
-    void *ptr;
-    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
-    vk_check(vk, "failed to map image");
+static inline int
+vk_format_caps_compare_format(const void *a, const void *b)
+{
+    const struct vk_format_caps_format *fmt_a = a;
+    const struct vk_format_caps_format *fmt_b = b;
+    if (fmt_a->format != fmt_b->format)
+        return fmt_a->format < fmt_b->format ? -1 : 1;
+    return 0;
+}
 
-    if (planar) {
-        const VkImageSubresource y_subres = {
-            .aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT,
-        };
-        const VkImageSubresource uv_subres = {
-            .aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT,
-        };
-        VkSubresourceLayout y_layout;
-        VkSubresourceLayout uv_layout;
-        vk->GetImageSubresourceLayout(vk->dev, img->img, &y_subres, &y_layout);
-        vk->GetImageSubresourceLayout(vk->dev, img->img, &uv_subres, &uv_layout);
+/* also compares struct vk_format_caps_image, whose first member is the key */
+static inline int
+vk_image_format_key_compare(const void *a, const void *b)
+{
+    const struct vk_image_format_key *key_a = a;
+    const struct vk_image_format_key *key_b = b;
+    if (key_a->format != key_b->format)
+        return key_a->format < key_b->format ? -1 : 1;
+    if (key_a->tiling != key_b->tiling)
+        return key_a->tiling < key_b->tiling ? -1 : 1;
+    if (key_a->usage != key_b->usage)
+        return key_a->usage < key_b->usage ? -1 : 1;
+    if (key_a->handle != key_b->handle)
+        return key_a->handle < key_b->handle ? -1 : 1;
+    if (key_a->modifier != key_b->modifier)
+        return key_a->modifier < key_b->modifier ? -1 : 1;
+    return 0;
+}
 
-        for (int y = 0; y < height; y++) {
-            uint8_t *y_dst = ptr + y_layout.offset + y_layout.rowPitch * y;
-            uint8_t *uv_dst = ptr + uv_layout.offset + uv_layout.rowPitch * y / 2;
-
-            for (int x = 0; x < width; x++) {
-                uint8_t yuv[3];
-                vk_rgb_to_yuv(rgb_data, yuv);
-                rgb_data += 3;
-
-                y_dst[0] = yuv[0];
-                y_dst++;
-                if (!((x | y) & 1)) {
-                    uv_dst[0] = yuv[1];
-                    uv_dst[1] = yuv[2];
-                    uv_dst += 2;
-                }
-            }
-        }
-    } else {
-        const VkImageSubresource subres = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        };
-        VkSubresourceLayout layout;
-        vk->GetImageSubresourceLayout(vk->dev, img->img, &subres, &layout);
+static inline bool
+vk_has_physical_device_extension(struct vk *vk, const char *name)
+{
+    uint32_t count;
+    vk->result = vk->EnumerateDeviceExtensionProperties(vk->physical_dev, NULL, &count, NULL);
+    vk_check(vk, "failed to enumerate device extensions");
 
-        for (int y = 0; y < height; y++) {
-            uint8_t *dst = ptr + layout.offset + layout.rowPitch * y;
-            for (int x = 0; x < width; x++) {
-                dst[0] = rgb_data[2];
-                dst[1] = rgb_data[1];
-                dst[2] = rgb_data[0];
-                dst[3] = 0xff;
+    VkExtensionProperties *exts = malloc(sizeof(*exts) * count);
+    if (!exts)
+        vk_die("failed to alloc exts");
+    vk->result = vk->EnumerateDeviceExtensionProperties(vk->physical_dev, NULL, &count, exts);
+    vk_check(vk, "failed to enumerate device extensions");
 
-                rgb_data += 3;
-                dst += 4;
-            }
+    bool found = false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!strcmp(exts[i].extensionName, name)) {
+            found = true;
+            break;
         }
     }
+    free(exts);
 
-    vk->UnmapMemory(vk->dev, img->mem);
-
-    return img;
+    return found;
 }
 
 static inline void
-vk_create_image_render_view(struct vk *vk, struct vk_image *img, VkImageAspectFlags aspect_mask)
+vk_query_image_format_caps(struct vk *vk,
+                           const struct vk_image_format_key *key,
+                           struct vk_image_format_caps *caps)
 {
-    const VkImageViewCreateInfo view_info = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-        .image = img->img,
-        .viewType = VK_IMAGE_VIEW_TYPE_2D,
-        .format = img->info.format,
-        .subresourceRange = {
-            .aspectMask = aspect_mask,
-            .levelCount = img->info.mipLevels,
-            .layerCount = img->info.arrayLayers,
-        },
+    const VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+        .drmFormatModifier = key->modifier,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
     };
-    vk->result = vk->CreateImageView(vk->dev, &view_info, NULL, &img->render_view);
-    vk_check(vk, "failed to create image render view");
-}
-
-static inline void
-vk_create_image_ycbcr_conversion(struct vk *vk,
-                                 struct vk_image *img,
-                                 VkChromaLocation chroma_offset,
-                                 VkFilter chroma_filter)
-{
-    if (chroma_offset == VK_CHROMA_LOCATION_MIDPOINT &&
-        !(img->features & VK_FORMAT_FEATURE_MIDPOINT_CHROMA_SAMPLES_BIT))
-        vk_die("image does not support midpoint chroma offset");
-    else if (chroma_offset == VK_CHROMA_LOCATION_COSITED_EVEN &&
-             !(img->features & VK_FORMAT_FEATURE_COSITED_CHROMA_SAMPLES_BIT))
-        vk_die("image does not support cosited chroma offset");
-
-    if (chroma_filter == VK_FILTER_LINEAR &&
-        !(img->features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_YCBCR_CONVERSION_LINEAR_FILTER_BIT))
-        vk_die("image does not support linear chroma offset");
-
-    const VkPhysicalDeviceImageFormatInfo2 fmt_info = {
+    const VkPhysicalDeviceExternalImageFormatInfo external_info = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+        .pNext = key->tiling == VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT ? &mod_info : NULL,
+        .handleType = key->handle,
+    };
+    const VkPhysicalDeviceImageFormatInfo2 info = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
-        .format = img->info.format,
-        .type = img->info.imageType,
-        .tiling = img->info.tiling,
-        .usage = img->info.usage,
+        .pNext = &external_info,
+        .format = key->format,
+        .type = VK_IMAGE_TYPE_2D,
+        .tiling = key->tiling,
+        .usage = key->usage,
+    };
+
+    VkAndroidHardwareBufferUsageANDROID ahb_props = {
+        .sType = VK_STRUCTURE_TYPE_ANDROID_HARDWARE_BUFFER_USAGE_ANDROID,
+    };
+    VkExternalImageFormatProperties external_props = {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
+        .pNext = &ahb_props,
     };
     VkSamplerYcbcrConversionImageFormatProperties ycbcr_props = {
         .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_IMAGE_FORMAT_PROPERTIES,
+        .pNext = &external_props,
     };
-    VkImageFormatProperties2 fmt_props = {
+    VkImageFormatProperties2 props = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
         .pNext = &ycbcr_props,
     };
-    vk->result =
-        vk->GetPhysicalDeviceImageFormatProperties2(vk->physical_dev, &fmt_info, &fmt_props);
-    vk_check(vk, "unsupported VkSamplerYcbcrConversion format");
 
-    const VkSamplerYcbcrConversionCreateInfo conv_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_CREATE_INFO,
-        .format = img->info.format,
-        .ycbcrModel = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_601,
-        .ycbcrRange = VK_SAMPLER_YCBCR_RANGE_ITU_FULL,
-        .xChromaOffset = chroma_offset,
-        .yChromaOffset = chroma_offset,
-        .chromaFilter = chroma_filter,
-        .forceExplicitReconstruction = false,
-    };
+    caps->result = vk->GetPhysicalDeviceImageFormatProperties2(vk->physical_dev, &info, &props);
+    caps->ycbcr_desc_count = ycbcr_props.combinedImageSamplerDescriptorCount;
+    caps->props = props.imageFormatProperties;
+    caps->external_features = external_props.externalMemoryProperties.externalMemoryFeatures;
+    caps->ahb_usage = ahb_props.androidHardwareBufferUsage;
+}
 
-    VkSamplerYcbcrConversion conv;
-    vk->result = vk->CreateSamplerYcbcrConversion(vk->dev, &conv_info, NULL, &conv);
-    vk_check(vk, "failed to create VkSamplerYcbcrConversion");
+static inline void *
+vk_format_caps_query_images(void *arg)
+{
+    const struct vk_format_caps_band *band = arg;
+    struct vk_format_caps_image *images = band->records;
 
-    img->ycbcr_conv = conv;
-    img->ycbcr_conv_desc_count = ycbcr_props.combinedImageSamplerDescriptorCount;
+    for (uint32_t i = band->begin; i < band->end; i++)
+        vk_query_image_format_caps(band->vk, &images[i].key, &images[i].caps);
+
+    return NULL;
 }
 
-static inline void
-vk_create_image_sample_view(struct vk *vk,
-                            struct vk_image *img,
-                            VkImageAspectFlagBits aspect,
-                            VkFilter filter)
+static inline void *
+vk_format_caps_query_formats(void *arg)
 {
-    const VkSamplerYcbcrConversionInfo conv_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_INFO,
-        .conversion = img->ycbcr_conv,
-    };
+    const struct vk_format_caps_band *band = arg;
+    struct vk *vk = band->vk;
+    struct vk_format_caps_query *queries = band->records;
 
-    const VkImageViewCreateInfo view_info = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-        .pNext = img->ycbcr_conv != VK_NULL_HANDLE ? &conv_info : NULL,
-        .image = img->img,
-        .viewType = VK_IMAGE_VIEW_TYPE_2D,
-        .format = img->info.format,
-        .subresourceRange = {
-            .aspectMask = aspect,
-            .levelCount = img->info.mipLevels,
-            .layerCount = img->info.arrayLayers,
-        },
-    };
-    vk->result = vk->CreateImageView(vk->dev, &view_info, NULL, &img->sample_view);
-    vk_check(vk, "failed to create image sample view");
+    for (uint32_t i = band->begin; i < band->end; i++) {
+        struct vk_format_caps_query *query = &queries[i];
 
-    VkClearColorValue custom_border_color = { 0 };
-    VkBorderColor border_color;
-    if (vk->EXT_custom_border_color) {
-        custom_border_color = (VkClearColorValue){
-            .uint32 = { 10, 0, 0, 0 },
+        VkDrmFormatModifierPropertiesListEXT mod_props = {
+            .sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT,
         };
-        border_color = VK_BORDER_COLOR_INT_CUSTOM_EXT;
-    } else {
-        border_color = VK_BORDER_COLOR_INT_OPAQUE_WHITE;
+        VkFormatProperties2 props = {
+            .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+            .pNext = band->modifiers ? &mod_props : NULL,
+        };
+        vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, query->format.format, &props);
+
+        if (mod_props.drmFormatModifierCount) {
+            query->modifiers =
+                malloc(sizeof(*query->modifiers) * mod_props.drmFormatModifierCount);
+            if (!query->modifiers)
+                vk_die("failed to alloc VkDrmFormatModifierPropertiesEXT");
+            mod_props.pDrmFormatModifierProperties = query->modifiers;
+            vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, query->format.format,
+                                                   &props);
+        }
+
+        query->format.props = props.formatProperties;
+        query->format.modifier_count = mod_props.drmFormatModifierCount;
     }
-    const VkSamplerCustomBorderColorCreateInfoEXT border_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CUSTOM_BORDER_COLOR_CREATE_INFO_EXT,
-        .customBorderColor = custom_border_color,
-        .format = img->info.format,
-    };
 
-    const VkSamplerAddressMode addr_mode = img->ycbcr_conv != VK_NULL_HANDLE
-                                               ? VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE
-                                               : VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
-    const VkSamplerCreateInfo sampler_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-        .pNext = img->ycbcr_conv != VK_NULL_HANDLE ? (void *)&conv_info : (void *)&border_info,
-        .magFilter = filter,
-        .minFilter = filter,
-        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
-        .addressModeU = addr_mode,
-        .addressModeV = addr_mode,
-        .addressModeW = addr_mode,
-        .borderColor = border_color,
-    };
-    vk->result = vk->CreateSampler(vk->dev, &sampler_info, NULL, &img->sampler);
-    vk_check(vk, "failed to create sampler");
+    return NULL;
 }
 
+/* Physical device queries need no external synchronization and are split
+ * into bands for threads.
+ */
 static inline void
-vk_destroy_image(struct vk *vk, struct vk_image *img)
+vk_format_caps_run(struct vk *vk,
+                   bool modifiers,
+                   void *records,
+                   uint32_t count,
+                   void *(*func)(void *))
 {
-    vk->DestroySampler(vk->dev, img->sampler, NULL);
-    vk->DestroyImageView(vk->dev, img->sample_view, NULL);
-
-    vk->DestroySamplerYcbcrConversion(vk->dev, img->ycbcr_conv, NULL);
-
-    vk->DestroyImageView(vk->dev, img->render_view, NULL);
+    struct vk_format_caps_band bands[16];
+    pthread_t threads[ARRAY_SIZE(bands)];
+
+    /* threads are not worth it for a few queries */
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t band_count = count < 64 || cpu_count < 1 ? 1 : (uint32_t)cpu_count;
+    if (band_count > ARRAY_SIZE(bands))
+        band_count = ARRAY_SIZE(bands);
+
+    const uint32_t band_size = (count + band_count - 1) / band_count;
+    band_count = band_size ? (count + band_size - 1) / band_size : 0;
+    for (uint32_t i = 0; i < band_count; i++) {
+        const uint32_t end = band_size * (i + 1);
+        bands[i] = (struct vk_format_caps_band){
+            .vk = vk,
+            .modifiers = modifiers,
+            .records = records,
+            .begin = band_size * i,
+            .end = end < count ? end : count,
+        };
+    }
 
-    vk->FreeMemory(vk->dev, img->mem, NULL);
-    vk->DestroyImage(vk->dev, img->img, NULL);
-    free(img);
+    /* the first band is queried by this thread */
+    for (uint32_t i = 1; i < band_count; i++) {
+        if (pthread_create(&threads[i], NULL, func, &bands[i]))
+            vk_die("failed to create thread");
+    }
+    if (band_count)
+        func(&bands[0]);
+    for (uint32_t i = 1; i < band_count; i++)
+        pthread_join(threads[i], NULL);
 }
 
 static inline void
-vk_fill_image(struct vk *vk, struct vk_image *img, uint8_t val)
+vk_init_format_caps_by_query(struct vk *vk,
+                             struct vk_format_caps *caps,
+                             const VkFormat *formats,
+                             uint32_t format_count)
 {
-    if (!img->mem_mappable)
-        vk_die("cannot fill non-mappable image");
+    struct vk_format_caps_query *queries = calloc(format_count, sizeof(*queries));
+    if (!queries)
+        vk_die("failed to alloc format queries");
+    for (uint32_t i = 0; i < format_count; i++)
+        queries[i].format.format = formats[i];
+
+    const bool modifiers =
+        vk_has_physical_device_extension(vk, VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME);
+    vk_format_caps_run(vk, modifiers, queries, format_count, vk_format_caps_query_formats);
+
+    uint32_t modifier_count = 0;
+    for (uint32_t i = 0; i < format_count; i++)
+        modifier_count += queries[i].format.modifier_count;
+
+    const size_t formats_size = sizeof(struct vk_format_caps_format) * format_count;
+    caps->storage =
+        calloc(1, formats_size + sizeof(VkDrmFormatModifierPropertiesEXT) * modifier_count);
+    if (!caps->storage)
+        vk_die("failed to alloc format caps storage");
+
+    struct vk_format_caps_format *fmts = caps->storage;
+    VkDrmFormatModifierPropertiesEXT *mods = (void *)((char *)caps->storage + formats_size);
+    modifier_count = 0;
+    for (uint32_t i = 0; i < format_count; i++) {
+        struct vk_format_caps_query *query = &queries[i];
+
+        fmts[i] = query->format;
+        fmts[i].modifier_offset = modifier_count;
+        if (query->format.modifier_count) {
+            memcpy(mods + modifier_count, query->modifiers,
+                   sizeof(*mods) * query->format.modifier_count);
+            modifier_count += query->format.modifier_count;
+            free(query->modifiers);
+        }
+    }
+    free(queries);
 
-    if (img->info.tiling != VK_IMAGE_TILING_LINEAR)
-        vk_log("filling non-linear image");
+    qsort(fmts, format_count, sizeof(*fmts), vk_format_caps_compare_format);
 
-    void *ptr;
-    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
-    vk_check(vk, "failed to map image");
-    memset(ptr, val, img->mem_size);
-    vk->UnmapMemory(vk->dev, img->mem);
+    caps->header.modifier_count = modifier_count;
+    caps->formats = fmts;
+    caps->modifiers = mods;
+    caps->dirty = true;
 }
 
-static inline void
-vk_write_ppm(const char *filename,
-             const void *data,
-             VkFormat format,
-             uint32_t width,
-             uint32_t height,
-             VkDeviceSize pitch)
+static inline bool
+vk_init_format_caps_from_snapshot(struct vk_format_caps *caps)
 {
-    uint8_t swizzle[3];
-    uint32_t cpp;
-    uint16_t max_val;
-    bool packed;
-    switch (format) {
-    case VK_FORMAT_B8G8R8A8_UNORM:
-        cpp = 4;
-        max_val = 255;
-        packed = false;
-        swizzle[0] = 2;
-        swizzle[1] = 1;
-        swizzle[2] = 0;
-        break;
-    case VK_FORMAT_R5G5B5A1_UNORM_PACK16:
-        cpp = 2;
-        max_val = 31;
-        packed = true;
-        swizzle[0] = 2;
-        swizzle[1] = 1;
-        swizzle[2] = 0;
-        break;
-    case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
-        cpp = 2;
-        max_val = 31;
-        packed = true;
-        swizzle[0] = 2;
-        swizzle[1] = 1;
-        swizzle[2] = 0;
-        break;
-    default:
-        vk_die("cannot write unknown format %d", format);
-        break;
+    if (!caps->filename || access(caps->filename, R_OK))
+        return false;
+
+    size_t size;
+    const void *snapshot = vk_map_file(caps->filename, &size);
+    const struct vk_format_caps_header *header = snapshot;
+
+    /* keyed by everything that can change the caps */
+    const struct vk_format_caps_header *expected = &caps->header;
+    bool valid = size >= sizeof(*header) && header->magic == expected->magic &&
+                 header->version == expected->version &&
+                 !memcmp(header->device_uuid, expected->device_uuid, VK_UUID_SIZE) &&
+                 header->driver_version == expected->driver_version &&
+                 header->vendor_id == expected->vendor_id &&
+                 header->device_id == expected->device_id &&
+                 header->format_count == expected->format_count &&
+                 header->format_hash == expected->format_hash;
+    if (valid) {
+        const size_t expected_size =
+            sizeof(*header) + sizeof(struct vk_format_caps_format) * header->format_count +
+            sizeof(VkDrmFormatModifierPropertiesEXT) * header->modifier_count +
+            sizeof(struct vk_format_caps_image) * header->image_count;
+        valid = size == expected_size;
     }
-
-    FILE *fp = fopen(filename, "w");
-    if (!fp)
-        vk_die("failed to open %s", filename);
-
-    fprintf(fp, "P6 %u %u %u\n", width, height, max_val);
-    for (uint32_t y = 0; y < height; y++) {
-        for (uint32_t x = 0; x < width; x++) {
-            if (packed) {
-                const uint16_t *pixel = data + pitch * y + cpp * x;
-                uint16_t val = *pixel;
-                if (format == VK_FORMAT_R5G5B5A1_UNORM_PACK16)
-                    val >>= 1;
-
-                const uint8_t comps[3] = { val & 0x1f, (val >> 5) & 0x1f, (val >> 10) & 0x1f };
-                const char bytes[3] = { comps[swizzle[0]], comps[swizzle[1]], comps[swizzle[2]] };
-                if (fwrite(bytes, sizeof(bytes), 1, fp) != 1)
-                    vk_die("failed to write pixel (%u, %u)", x, y);
-            } else {
-                const uint8_t *pixel = data + pitch * y + cpp * x;
-                const char bytes[3] = { pixel[swizzle[0]], pixel[swizzle[1]], pixel[swizzle[2]] };
-                if (fwrite(bytes, sizeof(bytes), 1, fp) != 1)
-                    vk_die("failed to write pixel (%u, %u)", x, y);
-            }
-        }
+    if (!valid) {
+        vk_log("ignoring stale %s", caps->filename);
+        vk_unmap_file(snapshot, size);
+        return false;
     }
 
-    fclose(fp);
+    caps->header = *header;
+    caps->formats = (const void *)(header + 1);
+    caps->modifiers = (const void *)(caps->formats + header->format_count);
+    caps->images = (void *)(caps->modifiers + header->modifier_count);
+    caps->snapshot = snapshot;
+    caps->snapshot_size = size;
+
+    return true;
 }
 
-static inline void
-vk_dump_image(struct vk *vk,
-              struct vk_image *img,
-              VkImageAspectFlagBits aspect,
-              const char *filename)
+/* Creates a table of the caps of all formats in vkutil_formats.inc.  When
+ * VK_FORMAT_CAPS_CACHE names a snapshot of the same device and driver, the
+ * snapshot is mapped instead of querying.  Image format caps are added on
+ * demand, and the snapshot is updated by vk_destroy_format_caps.
+ */
+static inline struct vk_format_caps *
+vk_create_format_caps(struct vk *vk)
 {
-    if (!img->mem_mappable)
-        vk_die("cannot dump non-mappable image");
+    static const VkFormat formats[] = {
+#define FMT(fmt) VK_FORMAT_##fmt,
+#include "vkutil_formats.inc"
+    };
 
-    if (img->info.tiling != VK_IMAGE_TILING_LINEAR)
-        vk_log("dumping non-linear image");
+    struct vk_format_caps *caps = calloc(1, sizeof(*caps));
+    if (!caps)
+        vk_die("failed to alloc format caps");
 
-    if (img->info.samples != VK_SAMPLE_COUNT_1_BIT)
-        vk_log("dumping msaa image");
+    /* FNV-1a; a reordered or edited list invalidates snapshots too */
+    uint32_t format_hash = 0x811c9dc5;
+    for (uint32_t i = 0; i < sizeof(formats); i++) {
+        format_hash ^= ((const uint8_t *)formats)[i];
+        format_hash *= 0x01000193;
+    }
 
-    const VkImageSubresource subres = {
-        .aspectMask = aspect,
+    caps->header = (struct vk_format_caps_header){
+        .magic = VK_FORMAT_CAPS_MAGIC,
+        .version = VK_FORMAT_CAPS_VERSION,
+        .driver_version = vk->props.properties.driverVersion,
+        .vendor_id = vk->props.properties.vendorID,
+        .device_id = vk->props.properties.deviceID,
+        .format_count = ARRAY_SIZE(formats),
+        .format_hash = format_hash,
     };
-    VkSubresourceLayout layout;
-    vk->GetImageSubresourceLayout(vk->dev, img->img, &subres, &layout);
-
-    void *ptr;
-    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
-    vk_check(vk, "failed to map image memory");
+    memcpy(caps->header.device_uuid, vk->vulkan_11_props.deviceUUID, VK_UUID_SIZE);
+    caps->filename = getenv("VK_FORMAT_CAPS_CACHE");
 
-    vk_write_ppm(filename, ptr + layout.offset, img->info.format,
-                 img->info.extent.width * img->info.samples, img->info.extent.height,
-                 layout.rowPitch);
+    if (!vk_init_format_caps_from_snapshot(caps))
+        vk_init_format_caps_by_query(vk, caps, formats, ARRAY_SIZE(formats));
 
-    vk->UnmapMemory(vk->dev, img->mem);
+    return caps;
 }
 
 static inline void
-vk_dump_image_raw(struct vk *vk, struct vk_image *img, const char *filename)
+vk_save_format_caps(const struct vk_format_caps *caps)
 {
-    if (!img->mem_mappable)
-        vk_die("cannot dump non-mappable image");
-
-    void *ptr;
-    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
-    vk_check(vk, "failed to map image memory");
-
-    FILE *fp = fopen(filename, "w");
+    /* Write and rename such that concurrent readers never see partial files.
+     * The temporary file is unique even among the threads of a runner.
+     */
+    char tmp[1024];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", caps->filename) >= (int)sizeof(tmp))
+        vk_die("format caps path too long");
+
+    const int fd = mkstemp(tmp);
+    if (fd < 0)
+        vk_die("failed to create %s", tmp);
+    FILE *fp = fdopen(fd, "w");
     if (!fp)
-        vk_die("failed to open %s", filename);
-    if (fwrite(ptr, 1, img->mem_size, fp) != img->mem_size)
-        vk_die("failed to write raw memory");
+        vk_die("failed to open %s", tmp);
+
+    const struct {
+        const void *data;
+        size_t size;
+    } chunks[] = {
+        { &caps->header, sizeof(caps->header) },
+        { caps->formats, sizeof(*caps->formats) * caps->header.format_count },
+        { caps->modifiers, sizeof(*caps->modifiers) * caps->header.modifier_count },
+        { caps->images, sizeof(*caps->images) * caps->header.image_count },
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(chunks); i++) {
+        if (chunks[i].size && fwrite(chunks[i].data, 1, chunks[i].size, fp) != chunks[i].size)
+            vk_die("failed to write %s", tmp);
+    }
     fclose(fp);
 
-    vk->UnmapMemory(vk->dev, img->mem);
+    if (rename(tmp, caps->filename))
+        vk_die("failed to rename %s", tmp);
 }
 
 static inline void
-vk_dump_buffer_raw(struct vk *vk,
-                   struct vk_buffer *buf,
-                   VkDeviceSize offset,
-                   VkDeviceSize size,
-                   const char *filename)
+vk_destroy_format_caps(struct vk *vk, struct vk_format_caps *caps)
 {
-    if (size) {
-        if (offset >= buf->mem_size)
-            vk_die("bad dump offset");
+    if (caps->dirty && caps->filename)
+        vk_save_format_caps(caps);
+
+    if (caps->image_capacity)
+        free(caps->images);
+    free(caps->storage);
+    if (caps->snapshot)
+        vk_unmap_file(caps->snapshot, caps->snapshot_size);
+    free(caps);
+}
 
-        if (size == VK_WHOLE_SIZE)
-            size = buf->mem_size - offset;
+static inline const struct vk_format_caps_format *
+vk_get_format_caps(const struct vk_format_caps *caps, VkFormat format)
+{
+    const struct vk_format_caps_format key = {
+        .format = format,
+    };
+    const struct vk_format_caps_format *fmt =
+        bsearch(&key, caps->formats, caps->header.format_count, sizeof(key),
+                vk_format_caps_compare_format);
+    if (!fmt)
+        vk_die("no caps for format %d", format);
 
-        if (size > buf->mem_size - offset)
-            vk_die("bad dump size");
-    } else {
-        offset = 0;
-    }
+    return fmt;
+}
 
-    FILE *fp = fopen(filename, "w");
-    if (!fp)
-        vk_die("failed to open %s", filename);
-    if (fwrite(buf->mem_ptr + offset, 1, size, fp) != size)
-        vk_die("failed to write raw memory");
-    fclose(fp);
+static inline const VkDrmFormatModifierPropertiesEXT *
+vk_get_format_modifiers(const struct vk_format_caps *caps,
+                        const struct vk_format_caps_format *fmt)
+{
+    return caps->modifiers + fmt->modifier_offset;
 }
 
-static inline struct vk_framebuffer *
-vk_create_framebuffer(struct vk *vk,
-                      struct vk_image *color,
-                      struct vk_image *resolve,
-                      struct vk_image *depth,
-                      VkAttachmentLoadOp load_op,
-                      VkAttachmentStoreOp store_op)
+static inline const struct vk_format_caps_image *
+vk_find_image_format_caps(const struct vk_format_caps *caps,
+                          const struct vk_image_format_key *key)
 {
-    struct vk_framebuffer *fb = calloc(1, sizeof(*fb));
-    if (!fb)
-        vk_die("failed to alloc fb");
+    if (!caps->header.image_count)
+        return NULL;
 
-    VkAttachmentReference color_ref = { .attachment = VK_ATTACHMENT_UNUSED };
-    VkAttachmentReference resolve_ref = { .attachment = VK_ATTACHMENT_UNUSED };
-    VkAttachmentReference depth_ref = { .attachment = VK_ATTACHMENT_UNUSED };
-    VkAttachmentDescription att_descs[3];
-    VkImageView views[3];
-    uint32_t att_count = 0;
+    return bsearch(key, caps->images, caps->header.image_count, sizeof(*caps->images),
+                   vk_image_format_key_compare);
+}
 
-    if (color) {
-        att_descs[att_count] = (VkAttachmentDescription){
-            .format = color->info.format,
-            .samples = color->info.samples,
-            .loadOp = load_op,
-            .storeOp = store_op,
-            .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        };
-        color_ref = (VkAttachmentReference){
-            .attachment = att_count,
-            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+/* Queries the image format caps of the keys that are not in the table yet,
+ * in parallel.
+ */
+static inline void
+vk_fill_image_format_caps(struct vk *vk,
+                          struct vk_format_caps *caps,
+                          const struct vk_image_format_key *keys,
+                          uint32_t count)
+{
+    const uint32_t image_count = caps->header.image_count;
+
+    /* copy the records out of the snapshot on the first addition */
+    if (image_count + count > caps->image_capacity) {
+        uint32_t capacity = caps->image_capacity ? caps->image_capacity * 2 : 64;
+        while (capacity < image_count + count)
+            capacity *= 2;
+
+        struct vk_format_caps_image *images = malloc(sizeof(*images) * capacity);
+        if (!images)
+            vk_die("failed to alloc image format caps");
+        if (image_count)
+            memcpy(images, caps->images, sizeof(*images) * image_count);
+        if (caps->image_capacity)
+            free(caps->images);
+
+        caps->images = images;
+        caps->image_capacity = capacity;
+    }
+
+    struct vk_format_caps_image *added = caps->images + image_count;
+    uint32_t added_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (vk_find_image_format_caps(caps, &keys[i]))
+            continue;
+
+        memset(&added[added_count], 0, sizeof(*added));
+        added[added_count++].key = keys[i];
+    }
+    if (!added_count)
+        return;
+
+    vk_format_caps_run(vk, false, added, added_count, vk_format_caps_query_images);
+
+    /* sort and drop duplicated keys */
+    qsort(caps->images, image_count + added_count, sizeof(*caps->images),
+          vk_image_format_key_compare);
+    uint32_t unique_count = 1;
+    for (uint32_t i = 1; i < image_count + added_count; i++) {
+        if (vk_image_format_key_compare(&caps->images[unique_count - 1], &caps->images[i]))
+            caps->images[unique_count++] = caps->images[i];
+    }
+
+    caps->header.image_count = unique_count;
+    caps->dirty = true;
+}
+
+/* The returned pointer is valid until the next addition to the table. */
+static inline const struct vk_image_format_caps *
+vk_get_image_format_caps(struct vk *vk,
+                         struct vk_format_caps *caps,
+                         const struct vk_image_format_key *key)
+{
+    const struct vk_format_caps_image *image = vk_find_image_format_caps(caps, key);
+    if (!image) {
+        vk_fill_image_format_caps(vk, caps, key, 1);
+        image = vk_find_image_format_caps(caps, key);
+    }
+
+    return &image->caps;
+}
+
+/* Parses the header in place.  The data does not need to be NUL-terminated
+ * and can be followed by trailing bytes.  Samples are 2 bytes when the max
+ * value is greater than 255.
+ */
+static inline const void *
+vk_parse_ppm_header(const void *ppm_data,
+                    size_t ppm_size,
+                    uint32_t *width,
+                    uint32_t *height,
+                    uint32_t *max_val)
+{
+    const char *ptr = ppm_data;
+    const char *end = ptr + ppm_size;
+
+    if (ppm_size < 2 || ptr[0] != 'P' || ptr[1] != '6')
+        vk_die("invalid ppm header");
+    ptr += 2;
+
+    /* width, height, and max value */
+    uint32_t vals[3];
+    for (uint32_t i = 0; i < ARRAY_SIZE(vals); i++) {
+        const char *start = ptr;
+        while (ptr < end && (isspace((unsigned char)*ptr) || *ptr == '#')) {
+            if (*ptr == '#') {
+                while (ptr < end && *ptr != '\n')
+                    ptr++;
+            } else {
+                ptr++;
+            }
+        }
+        if (ptr == start)
+            vk_die("no space in ppm header");
+
+        uint64_t val = 0;
+        start = ptr;
+        while (ptr < end && isdigit((unsigned char)*ptr) && val <= INT32_MAX)
+            val = val * 10 + (*ptr++ - '0');
+        if (ptr == start || !val || val > INT32_MAX)
+            vk_die("invalid ppm header");
+
+        vals[i] = val;
+    }
+
+    if (ptr == end || !isspace((unsigned char)*ptr))
+        vk_die("no space at the end of ppm header");
+    ptr++;
+
+    if (vals[2] > 65535)
+        vk_die("invalid ppm max value %u", vals[2]);
+
+    const uint64_t img_size = (uint64_t)vals[0] * vals[1] * 3 * (vals[2] > 255 ? 2 : 1);
+    if (img_size > (uint64_t)(end - ptr))
+        vk_die("bad ppm dimension %ux%u", vals[0], vals[1]);
+
+    *width = vals[0];
+    *height = vals[1];
+    *max_val = vals[2];
+    return ptr;
+}
+
+static inline const void *
+vk_parse_ppm(const void *ppm_data, size_t ppm_size, int *width, int *height)
+{
+    uint32_t w;
+    uint32_t h;
+    uint32_t max_val;
+    const void *data = vk_parse_ppm_header(ppm_data, ppm_size, &w, &h, &max_val);
+    if (max_val != 255)
+        vk_die("unsupported ppm max value %u", max_val);
+
+    *width = w;
+    *height = h;
+    return data;
+}
+
+static inline void
+vk_rgb_to_yuv(const uint8_t *rgb, uint8_t *yuv)
+{
+    const int tmp[3] = {
+        ((66 * (rgb)[0] + 129 * (rgb)[1] + 25 * (rgb)[2] + 128) >> 8) + 16,
+        ((-38 * (rgb)[0] - 74 * (rgb)[1] + 112 * (rgb)[2] + 128) >> 8) + 128,
+        ((112 * (rgb)[0] - 94 * (rgb)[1] - 18 * (rgb)[2] + 128) >> 8) + 128,
+    };
+
+    for (int i = 0; i < 3; i++) {
+        if (tmp[i] > 255)
+            yuv[i] = 255;
+        else if (tmp[i] < 0)
+            yuv[i] = 0;
+        else
+            yuv[i] = tmp[i];
+    }
+}
+
+static inline void
+vk_rgb_to_bgra_row(uint8_t *dst, const uint8_t *rgb, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x * 4 + 0] = rgb[x * 3 + 2];
+        dst[x * 4 + 1] = rgb[x * 3 + 1];
+        dst[x * 4 + 2] = rgb[x * 3 + 0];
+        dst[x * 4 + 3] = 0xff;
+    }
+}
+
+/* uv_dst is NULL for odd rows, where chroma is not sampled */
+static inline void
+vk_rgb_to_nv12_row(uint8_t *y_dst, uint8_t *uv_dst, const uint8_t *rgb, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        uint8_t yuv[3];
+        vk_rgb_to_yuv(rgb + x * 3, yuv);
+
+        y_dst[x] = yuv[0];
+        if (uv_dst && !(x & 1)) {
+            uv_dst[x + 0] = yuv[1];
+            uv_dst[x + 1] = yuv[2];
+        }
+    }
+}
+
+#ifdef VKUTIL_X86
+
+__attribute__((target("ssse3"))) static inline void
+vk_rgb_to_bgra_row_ssse3(uint8_t *dst, const uint8_t *rgb, uint32_t width)
+{
+    const __m128i shuffle =
+        _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    /* 4 pixels per iteration but 16 bytes are loaded */
+    uint32_t x = 0;
+    for (; x + 6 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(rgb + x * 3));
+        const __m128i bgra = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+        _mm_storeu_si128((__m128i *)(dst + x * 4), bgra);
+    }
+
+    vk_rgb_to_bgra_row(dst + x * 4, rgb + x * 3, width - x);
+}
+
+/* This matches vk_rgb_to_yuv exactly.  The sums fit in 16 bits and the
+ * results never need clamping.
+ */
+__attribute__((target("ssse3"))) static inline void
+vk_rgb_to_nv12_row_ssse3(uint8_t *y_dst, uint8_t *uv_dst, const uint8_t *rgb, uint32_t width)
+{
+    /* deinterleave 8 pixels, loaded as bytes 0..15 and 8..23, to 16-bit lanes */
+    const __m128i r_lo =
+        _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1);
+    const __m128i r_hi =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 10, -1, 13, -1);
+    const __m128i g_lo =
+        _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g_hi =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 8, -1, 11, -1, 14, -1);
+    const __m128i b_lo =
+        _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_hi =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 9, -1, 12, -1, 15, -1);
+    /* pick the (u, v) pairs of the even pixels */
+    const __m128i uv_even =
+        _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i round = _mm_set1_epi16(128);
+
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m128i lo = _mm_loadu_si128((const __m128i *)(rgb + x * 3));
+        const __m128i hi = _mm_loadu_si128((const __m128i *)(rgb + x * 3 + 8));
+        const __m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+        const __m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+        const __m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+
+        __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                                  _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+        y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+        y = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(y, round), 8), _mm_set1_epi16(16));
+        _mm_storel_epi64((__m128i *)(y_dst + x), _mm_packus_epi16(y, y));
+
+        if (!uv_dst)
+            continue;
+
+        __m128i u = _mm_sub_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)),
+                                  _mm_mullo_epi16(r, _mm_set1_epi16(38)));
+        u = _mm_sub_epi16(u, _mm_mullo_epi16(g, _mm_set1_epi16(74)));
+        u = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(u, round), 8), round);
+
+        __m128i v = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+                                  _mm_mullo_epi16(g, _mm_set1_epi16(94)));
+        v = _mm_sub_epi16(v, _mm_mullo_epi16(b, _mm_set1_epi16(18)));
+        v = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(v, round), 8), round);
+
+        const __m128i uv = _mm_or_si128(u, _mm_slli_epi16(v, 8));
+        _mm_storel_epi64((__m128i *)(uv_dst + x), _mm_shuffle_epi8(uv, uv_even));
+    }
+
+    vk_rgb_to_nv12_row(y_dst + x, uv_dst ? uv_dst + x : NULL, rgb + x * 3, width - x);
+}
+
+#endif /* VKUTIL_X86 */
+
+struct vk_rgb_convert {
+    const uint8_t *rgb;
+    uint32_t width;
+    uint32_t height;
+
+    /* BGRA or Y when uv is NULL, and Y otherwise */
+    uint8_t *dst;
+    VkDeviceSize dst_pitch;
+    uint8_t *uv;
+    VkDeviceSize uv_pitch;
+
+    bool simd;
+    uint32_t thread_count;
+};
+
+struct vk_rgb_convert_band {
+    const struct vk_rgb_convert *conv;
+    uint32_t y_begin;
+    uint32_t y_end;
+};
+
+static inline void *
+vk_rgb_convert_band(void *arg)
+{
+    const struct vk_rgb_convert_band *band = arg;
+    const struct vk_rgb_convert *conv = band->conv;
+
+#ifdef VKUTIL_X86
+    const bool ssse3 = conv->simd && __builtin_cpu_supports("ssse3");
+#else
+    const bool ssse3 = false;
+#endif
+
+    for (uint32_t y = band->y_begin; y < band->y_end; y++) {
+        const uint8_t *rgb = conv->rgb + (size_t)conv->width * 3 * y;
+        uint8_t *dst = conv->dst + conv->dst_pitch * y;
+
+        if (conv->uv) {
+            uint8_t *uv = y & 1 ? NULL : conv->uv + conv->uv_pitch * (y / 2);
+#ifdef VKUTIL_X86
+            if (ssse3) {
+                vk_rgb_to_nv12_row_ssse3(dst, uv, rgb, conv->width);
+                continue;
+            }
+#endif
+            vk_rgb_to_nv12_row(dst, uv, rgb, conv->width);
+        } else {
+#ifdef VKUTIL_X86
+            if (ssse3) {
+                vk_rgb_to_bgra_row_ssse3(dst, rgb, conv->width);
+                continue;
+            }
+#endif
+            vk_rgb_to_bgra_row(dst, rgb, conv->width);
+        }
+    }
+
+    return NULL;
+}
+
+/* Converts RGB to BGRA, or to NV12 when conv->uv is set.  The rows are split
+ * into bands that are converted in parallel.
+ */
+static inline void
+vk_rgb_convert(const struct vk_rgb_convert *conv)
+{
+    struct vk_rgb_convert_band bands[16];
+    pthread_t threads[ARRAY_SIZE(bands)];
+
+    if (!conv->width || !conv->height)
+        return;
+
+    uint32_t band_count = conv->thread_count;
+    if (!band_count) {
+        /* threads are not worth it for small images */
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        band_count = (uint64_t)conv->width * conv->height < 256 * 1024 || cpu_count < 1
+                         ? 1
+                         : (uint32_t)cpu_count;
+    }
+    if (band_count > ARRAY_SIZE(bands))
+        band_count = ARRAY_SIZE(bands);
+
+    /* bands are 2-row aligned such that a uv row belongs to one band */
+    const uint32_t band_height = ((conv->height + band_count - 1) / band_count + 1) & ~1u;
+    band_count = (conv->height + band_height - 1) / band_height;
+    for (uint32_t i = 0; i < band_count; i++) {
+        const uint32_t y_end = band_height * (i + 1);
+        bands[i] = (struct vk_rgb_convert_band){
+            .conv = conv,
+            .y_begin = band_height * i,
+            .y_end = y_end < conv->height ? y_end : conv->height,
         };
-        views[att_count] = color->render_view;
-        att_count++;
     }
 
-    if (resolve) {
-        att_descs[att_count] = (VkAttachmentDescription){
-            .format = resolve->info.format,
-            .samples = resolve->info.samples,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-            .storeOp = store_op,
-            .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    /* the first band is converted by this thread */
+    for (uint32_t i = 1; i < band_count; i++) {
+        if (pthread_create(&threads[i], NULL, vk_rgb_convert_band, &bands[i]))
+            vk_die("failed to create thread");
+    }
+    vk_rgb_convert_band(&bands[0]);
+    for (uint32_t i = 1; i < band_count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static inline struct vk_image *
+vk_create_preinitialized_image(struct vk *vk, VkFormat fmt, uint32_t width, uint32_t height)
+{
+    struct vk_image *img = calloc(1, sizeof(*img));
+    if (!img)
+        vk_die("failed to alloc img");
+
+    img->info = (VkImageCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = fmt,
+            .extent = {
+                .width = width,
+                .height = height,
+                .depth = 1,
+            },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_LINEAR,
+            .usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+            .initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED,
+    };
+
+    vk_init_image(vk, img);
+
+    return img;
+}
+
+static inline struct vk_image *
+vk_create_image_from_ppm(struct vk *vk, const void *ppm_data, size_t ppm_size, bool planar)
+{
+    int width;
+    int height;
+    const uint8_t *rgb_data = vk_parse_ppm(ppm_data, ppm_size, &width, &height);
+
+    const VkFormat fmt = planar ? VK_FORMAT_G8_B8R8_2PLANE_420_UNORM : VK_FORMAT_B8G8R8A8_UNORM;
+    struct vk_image *img = vk_create_preinitialized_image(vk, fmt, width, height);
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
+    vk_check(vk, "failed to map image");
+
+    if (planar) {
+        const VkImageSubresource y_subres = {
+            .aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT,
         };
-        resolve_ref = (VkAttachmentReference){
-            .attachment = att_count,
-            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        const VkImageSubresource uv_subres = {
+            .aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT,
         };
-        views[att_count] = resolve->render_view;
-        att_count++;
+        VkSubresourceLayout y_layout;
+        VkSubresourceLayout uv_layout;
+        vk->GetImageSubresourceLayout(vk->dev, img->img, &y_subres, &y_layout);
+        vk->GetImageSubresourceLayout(vk->dev, img->img, &uv_subres, &uv_layout);
+
+        vk_rgb_convert(&(struct vk_rgb_convert){
+            .rgb = rgb_data,
+            .width = width,
+            .height = height,
+            .dst = ptr + y_layout.offset,
+            .dst_pitch = y_layout.rowPitch,
+            .uv = ptr + uv_layout.offset,
+            .uv_pitch = uv_layout.rowPitch,
+            .simd = true,
+        });
+    } else {
+        const VkImageSubresource subres = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        };
+        VkSubresourceLayout layout;
+        vk->GetImageSubresourceLayout(vk->dev, img->img, &subres, &layout);
+
+        vk_rgb_convert(&(struct vk_rgb_convert){
+            .rgb = rgb_data,
+            .width = width,
+            .height = height,
+            .dst = ptr + layout.offset,
+            .dst_pitch = layout.rowPitch,
+            .simd = true,
+        });
     }
 
-    if (depth) {
-        att_descs[att_count] = (VkAttachmentDescription){
-            .format = depth->info.format,
-            .samples = depth->info.samples,
-            .loadOp = load_op,
-            .storeOp = store_op,
-            .stencilLoadOp = load_op,
-            .stencilStoreOp = store_op,
-            .initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-            .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    vk->UnmapMemory(vk->dev, img->mem);
+
+    return img;
+}
+
+/* Creates an image from raw pixels.  The rows of each plane are tightly
+ * packed and the planes are consecutive.
+ */
+static inline struct vk_image *
+vk_create_image_from_raw(struct vk *vk,
+                         const void *data,
+                         size_t size,
+                         VkFormat fmt,
+                         uint32_t width,
+                         uint32_t height)
+{
+    struct {
+        VkImageAspectFlagBits aspect;
+        size_t row_size;
+        uint32_t row_count;
+    } planes[2];
+    uint32_t plane_count;
+    switch (fmt) {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+        planes[0].aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+        planes[0].row_size = (size_t)width * 4;
+        planes[0].row_count = height;
+        plane_count = 1;
+        break;
+    case VK_FORMAT_G8_B8R8_2PLANE_420_UNORM:
+        planes[0].aspect = VK_IMAGE_ASPECT_PLANE_0_BIT;
+        planes[0].row_size = width;
+        planes[0].row_count = height;
+        planes[1].aspect = VK_IMAGE_ASPECT_PLANE_1_BIT;
+        planes[1].row_size = (size_t)(width + 1) / 2 * 2;
+        planes[1].row_count = (height + 1) / 2;
+        plane_count = 2;
+        break;
+    default:
+        vk_die("unsupported raw format %d", fmt);
+        break;
+    }
+
+    if (!width || !height)
+        vk_die("raw data needs a size");
+
+    size_t expected_size = 0;
+    for (uint32_t i = 0; i < plane_count; i++)
+        expected_size += planes[i].row_size * planes[i].row_count;
+    if (size < expected_size)
+        vk_die("raw data of size %zu is too small for %ux%u", size, width, height);
+
+    struct vk_image *img = vk_create_preinitialized_image(vk, fmt, width, height);
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
+    vk_check(vk, "failed to map image");
+
+    const bool cached = vk_is_memory_type_cached(vk, vk->buf_mt_index);
+    const uint8_t *src = data;
+    for (uint32_t i = 0; i < plane_count; i++) {
+        const VkImageSubresource subres = {
+            .aspectMask = planes[i].aspect,
         };
-        depth_ref = (VkAttachmentReference){
-            .attachment = att_count,
-            .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VkSubresourceLayout layout;
+        vk->GetImageSubresourceLayout(vk->dev, img->img, &subres, &layout);
+
+        uint8_t *dst = ptr + layout.offset;
+        if (layout.rowPitch == planes[i].row_size) {
+            vk_upload(dst, src, planes[i].row_size * planes[i].row_count, cached);
+        } else {
+            for (uint32_t y = 0; y < planes[i].row_count; y++) {
+                vk_upload(dst + layout.rowPitch * y, src + planes[i].row_size * y,
+                          planes[i].row_size, cached);
+            }
+        }
+        src += planes[i].row_size * planes[i].row_count;
+    }
+
+    vk->UnmapMemory(vk->dev, img->mem);
+
+    return img;
+}
+
+/* Creates an image from a PPM file, or from a raw NV12 or RGBA file of the
+ * specified size.  The file is mapped and its pixels are written directly to
+ * the image memory.
+ */
+static inline struct vk_image *
+vk_create_image_from_file(struct vk *vk,
+                          const char *filename,
+                          bool planar,
+                          uint32_t width,
+                          uint32_t height)
+{
+    const char *ext = strrchr(filename, '.');
+    if (!ext)
+        vk_die("unknown file type of %s", filename);
+
+    size_t size;
+    const void *data = vk_map_file(filename, &size);
+
+    struct vk_image *img;
+    if (!strcmp(ext, ".ppm"))
+        img = vk_create_image_from_ppm(vk, data, size, planar);
+    else if (!strcmp(ext, ".nv12"))
+        img = vk_create_image_from_raw(vk, data, size, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, width,
+                                       height);
+    else if (!strcmp(ext, ".rgba"))
+        img = vk_create_image_from_raw(vk, data, size, VK_FORMAT_R8G8B8A8_UNORM, width, height);
+    else
+        vk_die("unknown file type of %s", filename);
+
+    vk_unmap_file(data, size);
+
+    return img;
+}
+
+static inline void
+vk_create_image_render_view(struct vk *vk, struct vk_image *img, VkImageAspectFlags aspect_mask)
+{
+    const VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = img->img,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = img->info.format,
+        .subresourceRange = {
+            .aspectMask = aspect_mask,
+            .levelCount = img->info.mipLevels,
+            .layerCount = img->info.arrayLayers,
+        },
+    };
+    vk->result = vk->CreateImageView(vk->dev, &view_info, NULL, &img->render_view);
+    vk_check(vk, "failed to create image render view");
+}
+
+static inline void
+vk_create_image_ycbcr_conversion(struct vk *vk,
+                                 struct vk_image *img,
+                                 VkChromaLocation chroma_offset,
+                                 VkFilter chroma_filter)
+{
+    if (chroma_offset == VK_CHROMA_LOCATION_MIDPOINT &&
+        !(img->features & VK_FORMAT_FEATURE_MIDPOINT_CHROMA_SAMPLES_BIT))
+        vk_die("image does not support midpoint chroma offset");
+    else if (chroma_offset == VK_CHROMA_LOCATION_COSITED_EVEN &&
+             !(img->features & VK_FORMAT_FEATURE_COSITED_CHROMA_SAMPLES_BIT))
+        vk_die("image does not support cosited chroma offset");
+
+    if (chroma_filter == VK_FILTER_LINEAR &&
+        !(img->features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_YCBCR_CONVERSION_LINEAR_FILTER_BIT))
+        vk_die("image does not support linear chroma offset");
+
+    const VkPhysicalDeviceImageFormatInfo2 fmt_info = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+        .format = img->info.format,
+        .type = img->info.imageType,
+        .tiling = img->info.tiling,
+        .usage = img->info.usage,
+    };
+    VkSamplerYcbcrConversionImageFormatProperties ycbcr_props = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_IMAGE_FORMAT_PROPERTIES,
+    };
+    VkImageFormatProperties2 fmt_props = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+        .pNext = &ycbcr_props,
+    };
+    vk->result =
+        vk->GetPhysicalDeviceImageFormatProperties2(vk->physical_dev, &fmt_info, &fmt_props);
+    vk_check(vk, "unsupported VkSamplerYcbcrConversion format");
+
+    const VkSamplerYcbcrConversionCreateInfo conv_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_CREATE_INFO,
+        .format = img->info.format,
+        .ycbcrModel = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_601,
+        .ycbcrRange = VK_SAMPLER_YCBCR_RANGE_ITU_FULL,
+        .xChromaOffset = chroma_offset,
+        .yChromaOffset = chroma_offset,
+        .chromaFilter = chroma_filter,
+        .forceExplicitReconstruction = false,
+    };
+
+    VkSamplerYcbcrConversion conv;
+    vk->result = vk->CreateSamplerYcbcrConversion(vk->dev, &conv_info, NULL, &conv);
+    vk_check(vk, "failed to create VkSamplerYcbcrConversion");
+
+    img->ycbcr_conv = conv;
+    img->ycbcr_conv_desc_count = ycbcr_props.combinedImageSamplerDescriptorCount;
+}
+
+static inline void
+vk_create_image_sample_view(struct vk *vk,
+                            struct vk_image *img,
+                            VkImageAspectFlagBits aspect,
+                            VkFilter filter)
+{
+    const VkSamplerYcbcrConversionInfo conv_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_INFO,
+        .conversion = img->ycbcr_conv,
+    };
+
+    const VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .pNext = img->ycbcr_conv != VK_NULL_HANDLE ? &conv_info : NULL,
+        .image = img->img,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = img->info.format,
+        .subresourceRange = {
+            .aspectMask = aspect,
+            .levelCount = img->info.mipLevels,
+            .layerCount = img->info.arrayLayers,
+        },
+    };
+    vk->result = vk->CreateImageView(vk->dev, &view_info, NULL, &img->sample_view);
+    vk_check(vk, "failed to create image sample view");
+
+    VkClearColorValue custom_border_color = { 0 };
+    VkBorderColor border_color;
+    if (vk->EXT_custom_border_color) {
+        custom_border_color = (VkClearColorValue){
+            .uint32 = { 10, 0, 0, 0 },
+        };
+        border_color = VK_BORDER_COLOR_INT_CUSTOM_EXT;
+    } else {
+        border_color = VK_BORDER_COLOR_INT_OPAQUE_WHITE;
+    }
+    const VkSamplerCustomBorderColorCreateInfoEXT border_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CUSTOM_BORDER_COLOR_CREATE_INFO_EXT,
+        .customBorderColor = custom_border_color,
+        .format = img->info.format,
+    };
+
+    const VkSamplerAddressMode addr_mode = img->ycbcr_conv != VK_NULL_HANDLE
+                                               ? VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE
+                                               : VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    const VkSamplerCreateInfo sampler_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .pNext = img->ycbcr_conv != VK_NULL_HANDLE ? (void *)&conv_info : (void *)&border_info,
+        .magFilter = filter,
+        .minFilter = filter,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = addr_mode,
+        .addressModeV = addr_mode,
+        .addressModeW = addr_mode,
+        .borderColor = border_color,
+    };
+    vk->result = vk->CreateSampler(vk->dev, &sampler_info, NULL, &img->sampler);
+    vk_check(vk, "failed to create sampler");
+}
+
+static inline void
+vk_destroy_image(struct vk *vk, struct vk_image *img)
+{
+    vk->DestroySampler(vk->dev, img->sampler, NULL);
+    vk->DestroyImageView(vk->dev, img->sample_view, NULL);
+
+    vk->DestroySamplerYcbcrConversion(vk->dev, img->ycbcr_conv, NULL);
+
+    vk->DestroyImageView(vk->dev, img->render_view, NULL);
+
+    vk->FreeMemory(vk->dev, img->mem, NULL);
+    vk->DestroyImage(vk->dev, img->img, NULL);
+    free(img->states);
+    free(img);
+}
+
+static inline void
+vk_fill_image(struct vk *vk, struct vk_image *img, uint8_t val)
+{
+    if (!img->mem_mappable)
+        vk_die("cannot fill non-mappable image");
+
+    if (img->info.tiling != VK_IMAGE_TILING_LINEAR)
+        vk_log("filling non-linear image");
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
+    vk_check(vk, "failed to map image");
+    vk_upload_fill(ptr, val, img->mem_size, vk_is_memory_type_cached(vk, vk->buf_mt_index));
+    vk->UnmapMemory(vk->dev, img->mem);
+}
+
+typedef void (*vk_ppm_row_func)(uint8_t *dst, const void *src, uint32_t width);
+
+static inline float
+vk_half_to_float(uint16_t val)
+{
+    const uint32_t exp = (val >> 10) & 0x1f;
+    const uint32_t mant = val & 0x3ff;
+
+    float f;
+    if (!exp)
+        f = ldexpf((float)mant, -24);
+    else if (exp == 0x1f)
+        f = mant ? NAN : INFINITY;
+    else
+        f = ldexpf((float)(mant | 0x400), (int)exp - 25);
+
+    return (val & 0x8000) ? -f : f;
+}
+
+static inline void
+vk_ppm_row_b8g8r8a8(uint8_t *dst, const void *src, uint32_t width)
+{
+    const uint8_t *s = src;
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x * 3 + 0] = s[x * 4 + 2];
+        dst[x * 3 + 1] = s[x * 4 + 1];
+        dst[x * 3 + 2] = s[x * 4 + 0];
+    }
+}
+
+static inline void
+vk_ppm_row_r8g8b8a8(uint8_t *dst, const void *src, uint32_t width)
+{
+    const uint8_t *s = src;
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x * 3 + 0] = s[x * 4 + 0];
+        dst[x * 3 + 1] = s[x * 4 + 1];
+        dst[x * 3 + 2] = s[x * 4 + 2];
+    }
+}
+
+static inline void
+vk_ppm_row_rgb5(uint8_t *dst, const uint16_t *src, uint32_t width, uint32_t shift)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        const uint16_t val = src[x] >> shift;
+        dst[x * 3 + 0] = (val >> 10) & 0x1f;
+        dst[x * 3 + 1] = (val >> 5) & 0x1f;
+        dst[x * 3 + 2] = val & 0x1f;
+    }
+}
+
+static inline void
+vk_ppm_row_r5g5b5a1(uint8_t *dst, const void *src, uint32_t width)
+{
+    vk_ppm_row_rgb5(dst, src, width, 1);
+}
+
+static inline void
+vk_ppm_row_a1r5g5b5(uint8_t *dst, const void *src, uint32_t width)
+{
+    vk_ppm_row_rgb5(dst, src, width, 0);
+}
+
+static inline void
+vk_ppm_row_r16g16b16a16_sfloat(uint8_t *dst, const void *src, uint32_t width)
+{
+    const uint16_t *s = src;
+    for (uint32_t x = 0; x < width; x++) {
+        for (uint32_t c = 0; c < 3; c++) {
+            const float f = vk_half_to_float(s[x * 4 + c]);
+            /* this also maps NaN to 0 */
+            const float clamped = f > 0.0f ? (f < 1.0f ? f : 1.0f) : 0.0f;
+            dst[x * 3 + c] = (uint8_t)(clamped * 255.0f + 0.5f);
+        }
+    }
+}
+
+static inline void
+vk_ppm_row_a2b10g10r10(uint8_t *dst, const void *src, uint32_t width)
+{
+    /* 16-bit samples are big-endian */
+    const uint32_t *s = src;
+    for (uint32_t x = 0; x < width; x++) {
+        const uint32_t val = s[x];
+        for (uint32_t c = 0; c < 3; c++) {
+            const uint16_t comp = (val >> (10 * c)) & 0x3ff;
+            dst[x * 6 + c * 2 + 0] = comp >> 8;
+            dst[x * 6 + c * 2 + 1] = comp & 0xff;
+        }
+    }
+}
+
+#ifdef VKUTIL_X86
+
+/* The SSSE3 kernels store 16 bytes at a time and can write up to 16 bytes
+ * past the end of the row.  The scalar kernels handle the remainders.
+ */
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_rgba8_ssse3(uint8_t *dst, const uint8_t *src, uint32_t width, __m128i shuffle)
+{
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        _mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+
+    for (; x < width; x++) {
+        const uint8_t *pixel = src + x * 4;
+        const uint8_t *rgb = (const uint8_t *)&shuffle;
+        dst[x * 3 + 0] = pixel[rgb[0]];
+        dst[x * 3 + 1] = pixel[rgb[1]];
+        dst[x * 3 + 2] = pixel[rgb[2]];
+    }
+}
+
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_b8g8r8a8_ssse3(uint8_t *dst, const void *src, uint32_t width)
+{
+    const __m128i shuffle =
+        _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    vk_ppm_row_rgba8_ssse3(dst, src, width, shuffle);
+}
+
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_r8g8b8a8_ssse3(uint8_t *dst, const void *src, uint32_t width)
+{
+    const __m128i shuffle =
+        _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    vk_ppm_row_rgba8_ssse3(dst, src, width, shuffle);
+}
+
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_rgb5_ssse3(uint8_t *dst, const uint16_t *src, uint32_t width, int shift)
+{
+    const __m128i mask = _mm_set1_epi16(0x1f);
+    /* interleave 8 (r, g) pairs and 8 b's into 24 bytes */
+    const __m128i rg_lo = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+    const __m128i b_lo = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i rg_hi =
+        _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_hi =
+        _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m128i v = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + x)), shift);
+        const __m128i r = _mm_and_si128(_mm_srli_epi16(v, 10), mask);
+        const __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask);
+        const __m128i b = _mm_packus_epi16(_mm_and_si128(v, mask), _mm_setzero_si128());
+        const __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+
+        const __m128i lo = _mm_or_si128(_mm_shuffle_epi8(rg, rg_lo), _mm_shuffle_epi8(b, b_lo));
+        const __m128i hi = _mm_or_si128(_mm_shuffle_epi8(rg, rg_hi), _mm_shuffle_epi8(b, b_hi));
+        _mm_storeu_si128((__m128i *)(dst + x * 3), lo);
+        _mm_storeu_si128((__m128i *)(dst + x * 3 + 16), hi);
+    }
+
+    vk_ppm_row_rgb5(dst + x * 3, src + x, width - x, shift);
+}
+
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_r5g5b5a1_ssse3(uint8_t *dst, const void *src, uint32_t width)
+{
+    vk_ppm_row_rgb5_ssse3(dst, src, width, 1);
+}
+
+__attribute__((target("ssse3"))) static inline void
+vk_ppm_row_a1r5g5b5_ssse3(uint8_t *dst, const void *src, uint32_t width)
+{
+    vk_ppm_row_rgb5_ssse3(dst, src, width, 0);
+}
+
+#endif /* VKUTIL_X86 */
+
+/* Converts the image data to a ppm in a malloc'ed buffer. */
+static inline void *
+vk_encode_ppm(const void *data,
+              VkFormat format,
+              uint32_t width,
+              uint32_t height,
+              VkDeviceSize pitch,
+              size_t *ppm_size)
+{
+#ifdef VKUTIL_X86
+    const bool ssse3 = __builtin_cpu_supports("ssse3");
+#else
+    const bool ssse3 = false;
+#endif
+
+    vk_ppm_row_func row_func = NULL;
+    vk_ppm_row_func row_func_simd = NULL;
+    uint16_t max_val = 255;
+    switch (format) {
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+        row_func = vk_ppm_row_b8g8r8a8;
+#ifdef VKUTIL_X86
+        row_func_simd = vk_ppm_row_b8g8r8a8_ssse3;
+#endif
+        break;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        row_func = vk_ppm_row_r8g8b8a8;
+#ifdef VKUTIL_X86
+        row_func_simd = vk_ppm_row_r8g8b8a8_ssse3;
+#endif
+        break;
+    case VK_FORMAT_R5G5B5A1_UNORM_PACK16:
+        row_func = vk_ppm_row_r5g5b5a1;
+#ifdef VKUTIL_X86
+        row_func_simd = vk_ppm_row_r5g5b5a1_ssse3;
+#endif
+        max_val = 31;
+        break;
+    case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
+        row_func = vk_ppm_row_a1r5g5b5;
+#ifdef VKUTIL_X86
+        row_func_simd = vk_ppm_row_a1r5g5b5_ssse3;
+#endif
+        max_val = 31;
+        break;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+        row_func = vk_ppm_row_r16g16b16a16_sfloat;
+        break;
+    case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        row_func = vk_ppm_row_a2b10g10r10;
+        max_val = 1023;
+        break;
+    default:
+        vk_die("cannot write unknown format %d", format);
+        break;
+    }
+    if (ssse3 && row_func_simd)
+        row_func = row_func_simd;
+
+    char hdr[64];
+    const int hdr_size = snprintf(hdr, sizeof(hdr), "P6 %u %u %u\n", width, height, max_val);
+    const size_t row_size = (size_t)width * 3 * (max_val > 255 ? 2 : 1);
+    const size_t size = hdr_size + row_size * height;
+
+    /* convert row by row such that everything can be written at once */
+    uint8_t *buf = malloc(size + 16);
+    if (!buf)
+        vk_die("failed to alloc ppm buffer");
+    memcpy(buf, hdr, hdr_size);
+    for (uint32_t y = 0; y < height; y++)
+        row_func(buf + hdr_size + row_size * y, (const uint8_t *)data + pitch * y, width);
+
+    *ppm_size = size;
+    return buf;
+}
+
+static inline void
+vk_write_file(const char *filename, const void *data, size_t size)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        vk_die("failed to open %s", filename);
+    if (fwrite(data, 1, size, fp) != size)
+        vk_die("failed to write %s", filename);
+    fclose(fp);
+}
+
+static inline void
+vk_write_ppm(const char *filename,
+             const void *data,
+             VkFormat format,
+             uint32_t width,
+             uint32_t height,
+             VkDeviceSize pitch)
+{
+    size_t size;
+    void *buf = vk_encode_ppm(data, format, width, height, pitch, &size);
+    vk_write_file(filename, buf, size);
+    free(buf);
+}
+
+struct vk_compare_params {
+    /* pixels whose channels differ by at most this much are considered equal */
+    uint32_t tolerance;
+    /* the comparison fails when more pixels than this differ */
+    uint64_t max_diff_pixels;
+    uint32_t thread_count;
+};
+
+struct vk_compare_result {
+    bool pass;
+    uint64_t diff_pixels;
+    uint32_t max_diff;
+    /* INFINITY when the images are identical */
+    double psnr;
+
+    /* the tile with the most differing pixels */
+    uint32_t worst_x;
+    uint32_t worst_y;
+    uint32_t worst_width;
+    uint32_t worst_height;
+    uint32_t worst_diff_pixels;
+};
+
+#define VK_COMPARE_TILE_SIZE 32
+
+struct vk_compare {
+    const uint8_t *ref;
+    const uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t sample_size;
+    uint32_t tolerance;
+
+    uint32_t tiles_x;
+    uint32_t *tile_diff_pixels;
+};
+
+struct vk_compare_band {
+    const struct vk_compare *cmp;
+    uint32_t y_begin;
+    uint32_t y_end;
+
+    uint64_t diff_pixels;
+    uint32_t max_diff;
+    uint64_t sq_sum;
+};
+
+/* Writes the absolute differences of 8-bit samples to diff and returns the
+ * max difference.
+ */
+static inline uint32_t
+vk_compare_row(uint8_t *diff,
+               const uint8_t *a,
+               const uint8_t *b,
+               size_t size,
+               uint64_t *sq_sum)
+{
+    uint32_t max_diff = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        const uint32_t d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        diff[i] = d;
+        sum += d * d;
+        if (max_diff < d)
+            max_diff = d;
+    }
+
+    *sq_sum += sum;
+    return max_diff;
+}
+
+#ifdef VKUTIL_X86
+
+__attribute__((target("sse2"))) static inline uint32_t
+vk_compare_row_sse2(uint8_t *diff,
+                    const uint8_t *a,
+                    const uint8_t *b,
+                    size_t size,
+                    uint64_t *sq_sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i max = zero;
+    __m128i sum = zero;
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        _mm_storeu_si128((__m128i *)(diff + i), d);
+        max = _mm_max_epu8(max, d);
+
+        /* each 32-bit lane is at most 4 * 255^2 and is widened right away */
+        const __m128i lo = _mm_unpacklo_epi8(d, zero);
+        const __m128i hi = _mm_unpackhi_epi8(d, zero);
+        const __m128i sq = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(sq, zero));
+    }
+
+    max = _mm_max_epu8(max, _mm_srli_si128(max, 8));
+    max = _mm_max_epu8(max, _mm_srli_si128(max, 4));
+    max = _mm_max_epu8(max, _mm_srli_si128(max, 2));
+    max = _mm_max_epu8(max, _mm_srli_si128(max, 1));
+    uint32_t max_diff = _mm_cvtsi128_si32(max) & 0xff;
+
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i *)sums, sum);
+    *sq_sum += sums[0] + sums[1];
+
+    const uint32_t tail_max = vk_compare_row(diff + i, a + i, b + i, size - i, sq_sum);
+    return max_diff > tail_max ? max_diff : tail_max;
+}
+
+#endif /* VKUTIL_X86 */
+
+static inline void
+vk_compare_band_add_pixel(struct vk_compare_band *band, uint32_t x, uint32_t y, uint32_t d)
+{
+    const struct vk_compare *cmp = band->cmp;
+
+    if (band->max_diff < d)
+        band->max_diff = d;
+    if (d <= cmp->tolerance)
+        return;
+
+    band->diff_pixels++;
+    cmp->tile_diff_pixels[cmp->tiles_x * (y / VK_COMPARE_TILE_SIZE) +
+                          x / VK_COMPARE_TILE_SIZE]++;
+}
+
+static inline void *
+vk_compare_band(void *arg)
+{
+    struct vk_compare_band *band = arg;
+    const struct vk_compare *cmp = band->cmp;
+    const size_t row_size = (size_t)cmp->width * 3 * cmp->sample_size;
+
+#ifdef VKUTIL_X86
+    const bool sse2 = __builtin_cpu_supports("sse2");
+#endif
+
+    uint8_t *diff = NULL;
+    if (cmp->sample_size == 1) {
+        diff = malloc(row_size);
+        if (!diff)
+            vk_die("failed to alloc diff row");
+    }
+
+    for (uint32_t y = band->y_begin; y < band->y_end; y++) {
+        const uint8_t *a = cmp->ref + row_size * y;
+        const uint8_t *b = cmp->data + row_size * y;
+
+        /* identical rows are the common case */
+        if (!memcmp(a, b, row_size))
+            continue;
+
+        if (cmp->sample_size == 2) {
+            for (uint32_t x = 0; x < cmp->width; x++) {
+                uint32_t pixel_diff = 0;
+                for (uint32_t c = 0; c < 3; c++) {
+                    const uint32_t offset = (x * 3 + c) * 2;
+                    const int32_t va = a[offset] << 8 | a[offset + 1];
+                    const int32_t vb = b[offset] << 8 | b[offset + 1];
+                    const uint32_t d = va > vb ? va - vb : vb - va;
+                    band->sq_sum += (uint64_t)d * d;
+                    if (pixel_diff < d)
+                        pixel_diff = d;
+                }
+                vk_compare_band_add_pixel(band, x, y, pixel_diff);
+            }
+            continue;
+        }
+
+        uint32_t row_max;
+#ifdef VKUTIL_X86
+        if (sse2)
+            row_max = vk_compare_row_sse2(diff, a, b, row_size, &band->sq_sum);
+        else
+#endif
+            row_max = vk_compare_row(diff, a, b, row_size, &band->sq_sum);
+
+        /* only look at individual pixels when some of them differ too much */
+        if (row_max <= cmp->tolerance) {
+            if (band->max_diff < row_max)
+                band->max_diff = row_max;
+            continue;
+        }
+
+        for (uint32_t x = 0; x < cmp->width; x++) {
+            const uint8_t *d = diff + x * 3;
+            uint32_t pixel_diff = d[0] > d[1] ? d[0] : d[1];
+            if (pixel_diff < d[2])
+                pixel_diff = d[2];
+            vk_compare_band_add_pixel(band, x, y, pixel_diff);
+        }
+    }
+
+    free(diff);
+
+    return NULL;
+}
+
+/* Compares a ppm against a reference ppm.  The rows are split into bands that
+ * are compared in parallel.
+ */
+static inline void
+vk_compare_ppm(const void *ref_ppm,
+               size_t ref_size,
+               const void *ppm,
+               size_t size,
+               const struct vk_compare_params *params,
+               struct vk_compare_result *result)
+{
+    uint32_t ref_width;
+    uint32_t ref_height;
+    uint32_t ref_max_val;
+    const void *ref_data =
+        vk_parse_ppm_header(ref_ppm, ref_size, &ref_width, &ref_height, &ref_max_val);
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t max_val;
+    const void *data = vk_parse_ppm_header(ppm, size, &width, &height, &max_val);
+
+    if (width != ref_width || height != ref_height || max_val != ref_max_val) {
+        /* everything differs */
+        *result = (struct vk_compare_result){
+            .diff_pixels = (uint64_t)width * height,
+            .max_diff = max_val,
+            .psnr = 0.0,
+            .worst_width = width,
+            .worst_height = height,
+            .worst_diff_pixels = width * height,
+        };
+        return;
+    }
+
+    struct vk_compare cmp = {
+        .ref = ref_data,
+        .data = data,
+        .width = width,
+        .height = height,
+        .sample_size = max_val > 255 ? 2 : 1,
+        .tolerance = params->tolerance,
+        .tiles_x = (width + VK_COMPARE_TILE_SIZE - 1) / VK_COMPARE_TILE_SIZE,
+    };
+    const uint32_t tiles_y = (height + VK_COMPARE_TILE_SIZE - 1) / VK_COMPARE_TILE_SIZE;
+    cmp.tile_diff_pixels = calloc((size_t)cmp.tiles_x * tiles_y + 1, sizeof(uint32_t));
+    if (!cmp.tile_diff_pixels)
+        vk_die("failed to alloc tiles");
+
+    struct vk_compare_band bands[16];
+    pthread_t threads[ARRAY_SIZE(bands)];
+
+    uint32_t band_count = params->thread_count;
+    if (!band_count) {
+        /* threads are not worth it for small images */
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        band_count =
+            (uint64_t)width * height < 256 * 1024 || cpu_count < 1 ? 1 : (uint32_t)cpu_count;
+    }
+    if (band_count > ARRAY_SIZE(bands))
+        band_count = ARRAY_SIZE(bands);
+    if (band_count > tiles_y)
+        band_count = tiles_y ? tiles_y : 1;
+
+    /* bands are tile-aligned such that a tile belongs to one band */
+    const uint32_t band_tiles = (tiles_y + band_count - 1) / band_count;
+    const uint32_t band_height = band_tiles * VK_COMPARE_TILE_SIZE;
+    band_count = band_height ? (height + band_height - 1) / band_height : 0;
+    for (uint32_t i = 0; i < band_count; i++) {
+        const uint32_t y_end = band_height * (i + 1);
+        bands[i] = (struct vk_compare_band){
+            .cmp = &cmp,
+            .y_begin = band_height * i,
+            .y_end = y_end < height ? y_end : height,
+        };
+    }
+
+    /* the first band is compared by this thread */
+    for (uint32_t i = 1; i < band_count; i++) {
+        if (pthread_create(&threads[i], NULL, vk_compare_band, &bands[i]))
+            vk_die("failed to create thread");
+    }
+    if (band_count)
+        vk_compare_band(&bands[0]);
+    for (uint32_t i = 1; i < band_count; i++)
+        pthread_join(threads[i], NULL);
+
+    *result = (struct vk_compare_result){ 0 };
+    uint64_t sq_sum = 0;
+    for (uint32_t i = 0; i < band_count; i++) {
+        result->diff_pixels += bands[i].diff_pixels;
+        if (result->max_diff < bands[i].max_diff)
+            result->max_diff = bands[i].max_diff;
+        sq_sum += bands[i].sq_sum;
+    }
+
+    if (sq_sum) {
+        const double mse = (double)sq_sum / ((double)width * height * 3);
+        result->psnr = 10.0 * log10((double)max_val * max_val / mse);
+    } else {
+        result->psnr = INFINITY;
+    }
+
+    for (uint32_t i = 0; i < cmp.tiles_x * tiles_y; i++) {
+        if (result->worst_diff_pixels >= cmp.tile_diff_pixels[i])
+            continue;
+
+        const uint32_t x = i % cmp.tiles_x * VK_COMPARE_TILE_SIZE;
+        const uint32_t y = i / cmp.tiles_x * VK_COMPARE_TILE_SIZE;
+        result->worst_x = x;
+        result->worst_y = y;
+        result->worst_width = width - x < VK_COMPARE_TILE_SIZE ? width - x : VK_COMPARE_TILE_SIZE;
+        result->worst_height =
+            height - y < VK_COMPARE_TILE_SIZE ? height - y : VK_COMPARE_TILE_SIZE;
+        result->worst_diff_pixels = cmp.tile_diff_pixels[i];
+    }
+
+    free(cmp.tile_diff_pixels);
+
+    result->pass = result->diff_pixels <= params->max_diff_pixels;
+}
+
+static inline uint64_t
+vk_getenv_uint(const char *name, uint64_t default_val)
+{
+    const char *str = getenv(name);
+    if (!str || !*str)
+        return default_val;
+
+    char *end;
+    const uint64_t val = strtoull(str, &end, 0);
+    if (*end)
+        vk_die("invalid %s=%s", name, str);
+
+    return val;
+}
+
+/* Compares a ppm against $VK_GOLDEN_DIR/<program>.<filename> when
+ * VK_GOLDEN_DIR is set.  VK_GOLDEN_TOLERANCE and VK_GOLDEN_MAX_DIFF_PIXELS
+ * relax the comparison.  A mismatch is fatal.
+ */
+static inline void
+vk_check_golden_ppm(const char *filename, const void *ppm, size_t size)
+{
+    const char *dir = getenv("VK_GOLDEN_DIR");
+    if (!dir || !*dir)
+        return;
+
+    const char *basename = strrchr(filename, '/');
+    basename = basename ? basename + 1 : filename;
+
+    const char *prog = vk_test_name ? vk_test_name : program_invocation_short_name;
+    char path[1024];
+    if (snprintf(path, sizeof(path), "%s/%s.%s", dir, prog, basename) >= (int)sizeof(path))
+        vk_die("golden path too long");
+
+    const struct vk_compare_params params = {
+        .tolerance = vk_getenv_uint("VK_GOLDEN_TOLERANCE", 0),
+        .max_diff_pixels = vk_getenv_uint("VK_GOLDEN_MAX_DIFF_PIXELS", 0),
+    };
+
+    size_t ref_size;
+    const void *ref = vk_map_file(path, &ref_size);
+    struct vk_compare_result result;
+    vk_compare_ppm(ref, ref_size, ppm, size, &params, &result);
+    vk_unmap_file(ref, ref_size);
+
+    vk_log("%s: %" PRIu64 " differing pixels, max diff %u, psnr %.2f dB", filename,
+           result.diff_pixels, result.max_diff, result.psnr);
+    if (result.diff_pixels) {
+        vk_log("%s: worst region %ux%u+%u+%u with %u differing pixels", filename,
+               result.worst_width, result.worst_height, result.worst_x, result.worst_y,
+               result.worst_diff_pixels);
+    }
+
+    if (!result.pass)
+        vk_die("%s does not match %s", filename, path);
+}
+
+static inline void
+vk_dump_image(struct vk *vk,
+              struct vk_image *img,
+              VkImageAspectFlagBits aspect,
+              const char *filename)
+{
+    if (!img->mem_mappable)
+        vk_die("cannot dump non-mappable image");
+
+    if (img->info.tiling != VK_IMAGE_TILING_LINEAR)
+        vk_log("dumping non-linear image");
+
+    if (img->info.samples != VK_SAMPLE_COUNT_1_BIT)
+        vk_log("dumping msaa image");
+
+    const VkImageSubresource subres = {
+        .aspectMask = aspect,
+    };
+    VkSubresourceLayout layout;
+    vk->GetImageSubresourceLayout(vk->dev, img->img, &subres, &layout);
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
+    vk_check(vk, "failed to map image memory");
+
+    size_t size;
+    void *ppm = vk_encode_ppm(ptr + layout.offset, img->info.format,
+                              img->info.extent.width * img->info.samples,
+                              img->info.extent.height, layout.rowPitch, &size);
+
+    vk->UnmapMemory(vk->dev, img->mem);
+
+    /* tests in one process must not overwrite each other's dumps */
+    if (vk_test_name) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.%s", vk_test_name, filename);
+        vk_write_file(path, ppm, size);
+    } else {
+        vk_write_file(filename, ppm, size);
+    }
+    vk_check_golden_ppm(filename, ppm, size);
+    free(ppm);
+}
+
+static inline void
+vk_dump_image_raw(struct vk *vk, struct vk_image *img, const char *filename)
+{
+    if (!img->mem_mappable)
+        vk_die("cannot dump non-mappable image");
+
+    void *ptr;
+    vk->result = vk->MapMemory(vk->dev, img->mem, 0, img->mem_size, 0, &ptr);
+    vk_check(vk, "failed to map image memory");
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        vk_die("failed to open %s", filename);
+    if (fwrite(ptr, 1, img->mem_size, fp) != img->mem_size)
+        vk_die("failed to write raw memory");
+    fclose(fp);
+
+    vk->UnmapMemory(vk->dev, img->mem);
+}
+
+static inline void
+vk_dump_buffer_raw(struct vk *vk,
+                   struct vk_buffer *buf,
+                   VkDeviceSize offset,
+                   VkDeviceSize size,
+                   const char *filename)
+{
+    if (size) {
+        if (offset >= buf->mem_size)
+            vk_die("bad dump offset");
+
+        if (size == VK_WHOLE_SIZE)
+            size = buf->mem_size - offset;
+
+        if (size > buf->mem_size - offset)
+            vk_die("bad dump size");
+    } else {
+        offset = 0;
+    }
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        vk_die("failed to open %s", filename);
+    if (fwrite(buf->mem_ptr + offset, 1, size, fp) != size)
+        vk_die("failed to write raw memory");
+    fclose(fp);
+}
+
+static inline struct vk_framebuffer *
+vk_create_framebuffer(struct vk *vk,
+                      struct vk_image *color,
+                      struct vk_image *resolve,
+                      struct vk_image *depth,
+                      VkAttachmentLoadOp load_op,
+                      VkAttachmentStoreOp store_op)
+{
+    struct vk_framebuffer *fb = calloc(1, sizeof(*fb));
+    if (!fb)
+        vk_die("failed to alloc fb");
+
+    VkAttachmentReference color_ref = { .attachment = VK_ATTACHMENT_UNUSED };
+    VkAttachmentReference resolve_ref = { .attachment = VK_ATTACHMENT_UNUSED };
+    VkAttachmentReference depth_ref = { .attachment = VK_ATTACHMENT_UNUSED };
+    VkAttachmentDescription att_descs[3];
+    VkImageView views[3];
+    uint32_t att_count = 0;
+
+    /* the contents of transient attachments never outlive the render pass */
+    const VkAttachmentStoreOp color_store_op =
+        color && (color->info.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)
+            ? VK_ATTACHMENT_STORE_OP_DONT_CARE
+            : store_op;
+    const VkAttachmentStoreOp depth_store_op =
+        depth && (depth->info.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)
+            ? VK_ATTACHMENT_STORE_OP_DONT_CARE
+            : store_op;
+
+    if (color) {
+        att_descs[att_count] = (VkAttachmentDescription){
+            .format = color->info.format,
+            .samples = color->info.samples,
+            .loadOp = load_op,
+            .storeOp = color_store_op,
+            .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+        color_ref = (VkAttachmentReference){
+            .attachment = att_count,
+            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+        views[att_count] = color->render_view;
+        att_count++;
+    }
+
+    if (resolve) {
+        att_descs[att_count] = (VkAttachmentDescription){
+            .format = resolve->info.format,
+            .samples = resolve->info.samples,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp = store_op,
+            .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+        resolve_ref = (VkAttachmentReference){
+            .attachment = att_count,
+            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+        views[att_count] = resolve->render_view;
+        att_count++;
+    }
+
+    if (depth) {
+        att_descs[att_count] = (VkAttachmentDescription){
+            .format = depth->info.format,
+            .samples = depth->info.samples,
+            .loadOp = load_op,
+            .storeOp = depth_store_op,
+            .stencilLoadOp = load_op,
+            .stencilStoreOp = depth_store_op,
+            .initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        };
+        depth_ref = (VkAttachmentReference){
+            .attachment = att_count,
+            .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        };
+        views[att_count] = depth->render_view;
+        att_count++;
+    }
+
+    const VkRenderPassCreateInfo pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+        .attachmentCount = att_count,
+        .pAttachments = att_descs,
+        .subpassCount = 1,
+        .pSubpasses =
+            &(VkSubpassDescription){
+                .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+                .colorAttachmentCount = color ? 1 : 0,
+                .pColorAttachments = color ? &color_ref : NULL,
+                .pResolveAttachments = resolve ? &resolve_ref : NULL,
+                .pDepthStencilAttachment = depth ? &depth_ref : NULL,
+            },
+    };
+
+    vk->result = vk->CreateRenderPass(vk->dev, &pass_info, NULL, &fb->pass);
+    vk_check(vk, "failed to create render pass");
+
+    const VkFramebufferCreateInfo fb_info = {
+        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        .renderPass = fb->pass,
+        .attachmentCount = att_count,
+        .pAttachments = views,
+        .width = color ? color->info.extent.width : depth->info.extent.width,
+        .height = color ? color->info.extent.height : depth->info.extent.height,
+        .layers = color ? color->info.arrayLayers : depth->info.arrayLayers,
+    };
+
+    vk->result = vk->CreateFramebuffer(vk->dev, &fb_info, NULL, &fb->fb);
+    vk_check(vk, "failed to create framebuffer");
+
+    fb->width = fb_info.width;
+    fb->height = fb_info.height;
+    fb->samples = color ? color->info.samples : depth->info.samples;
+
+    return fb;
+}
+
+static inline void
+vk_destroy_framebuffer(struct vk *vk, struct vk_framebuffer *fb)
+{
+    vk->DestroyRenderPass(vk->dev, fb->pass, NULL);
+    vk->DestroyFramebuffer(vk->dev, fb->fb, NULL);
+    free(fb);
+}
+
+static inline struct vk_pipeline *
+vk_create_pipeline(struct vk *vk)
+{
+    struct vk_pipeline *pipeline = calloc(1, sizeof(*pipeline));
+    if (!pipeline)
+        vk_die("failed to alloc pipeline");
+
+    return pipeline;
+}
+
+static inline VkShaderModule
+vk_create_shader_module(struct vk *vk, const uint32_t *code, size_t size)
+{
+    const VkShaderModuleCreateInfo mod_info = {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = size,
+        .pCode = code,
+    };
+
+    VkShaderModule mod;
+    vk->result = vk->CreateShaderModule(vk->dev, &mod_info, NULL, &mod);
+    vk_check(vk, "failed to create shader module");
+
+    return mod;
+}
+
+static inline void
+vk_add_pipeline_shader(struct vk *vk,
+                       struct vk_pipeline *pipeline,
+                       VkShaderStageFlagBits stage,
+                       const uint32_t *code,
+                       size_t size)
+{
+    pipeline->stages[pipeline->stage_count++] = (VkPipelineShaderStageCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = stage,
+        .module = vk_create_shader_module(vk, code, size),
+        .pName = "main",
+    };
+}
+
+static inline void
+vk_set_pipeline_vertices(struct vk *vk,
+                         struct vk_pipeline *pipeline,
+                         const uint32_t *comp_counts,
+                         uint32_t attr_count)
+{
+    assert(attr_count < ARRAY_SIZE(pipeline->vi_attrs));
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < attr_count; i++) {
+        VkFormat format;
+        switch (comp_counts[i]) {
+        case 1:
+            format = VK_FORMAT_R32_SFLOAT;
+            break;
+        case 2:
+            format = VK_FORMAT_R32G32_SFLOAT;
+            break;
+        case 3:
+            format = VK_FORMAT_R32G32B32_SFLOAT;
+            break;
+        case 4:
+            format = VK_FORMAT_R32G32B32A32_SFLOAT;
+            break;
+        default:
+            vk_die("unsupported vertex attribute format %d", comp_counts[i]);
+            break;
+        }
+
+        pipeline->vi_attrs[i] = (VkVertexInputAttributeDescription){
+            .location = i,
+            .binding = 0,
+            .format = format,
+            .offset = offset,
+        };
+        offset += sizeof(float) * comp_counts[i];
+    }
+
+    pipeline->vi_attr_count = attr_count;
+
+    pipeline->vi_binding = (VkVertexInputBindingDescription){
+        .binding = 0,
+        .stride = offset,
+    };
+}
+
+static inline void
+vk_set_pipeline_topology(struct vk *vk,
+                         struct vk_pipeline *pipeline,
+                         VkPrimitiveTopology topology)
+{
+    pipeline->ia_info = (VkPipelineInputAssemblyStateCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+        .topology = topology,
+    };
+}
+
+static inline void
+vk_set_pipeline_viewport(struct vk *vk,
+                         struct vk_pipeline *pipeline,
+                         uint32_t width,
+                         uint32_t height)
+{
+    pipeline->viewport = (VkViewport){
+        .width = (float)width,
+        .height = (float)height,
+        .maxDepth = 1.0f,
+    };
+
+    pipeline->scissor = (VkRect2D){
+        .extent = {
+            .width = width,
+            .height = height,
+        },
+    };
+}
+
+static inline void
+vk_set_pipeline_rasterization(struct vk *vk,
+                              struct vk_pipeline *pipeline,
+                              VkPolygonMode poly_mode)
+{
+    pipeline->rast_info = (VkPipelineRasterizationStateCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+        .polygonMode = poly_mode,
+        .lineWidth = 1.0f,
+    };
+}
+
+static inline void
+vk_set_pipeline_tessellation(struct vk *vk, struct vk_pipeline *pipeline, uint32_t cp_count)
+{
+    pipeline->tess_info = (VkPipelineTessellationStateCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO,
+        .patchControlPoints = cp_count,
+    };
+}
+
+static inline void
+vk_set_pipeline_sample_count(struct vk *vk, struct vk_pipeline *pipeline, uint32_t sample_count)
+{
+    pipeline->sample_mask = (1u << sample_count) - 1;
+    pipeline->msaa_info = (VkPipelineMultisampleStateCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        .rasterizationSamples = sample_count,
+        .pSampleMask = &pipeline->sample_mask,
+    };
+}
+
+static inline void
+vk_add_pipeline_set_layout(struct vk *vk,
+                           struct vk_pipeline *pipeline,
+                           VkDescriptorType type,
+                           uint32_t desc_count,
+                           VkShaderStageFlags stages,
+                           const VkSampler *immutable_samplers)
+{
+    assert(pipeline->set_layout_count < ARRAY_SIZE(pipeline->set_layouts));
+
+    const VkDescriptorSetLayoutBinding binding = {
+        .binding = 0,
+        .descriptorType = type,
+        .descriptorCount = desc_count,
+        .stageFlags = stages,
+        .pImmutableSamplers = immutable_samplers,
+    };
+    const VkDescriptorSetLayoutCreateInfo set_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &binding,
+    };
+
+    vk->result = vk->CreateDescriptorSetLayout(
+        vk->dev, &set_layout_info, NULL, &pipeline->set_layouts[pipeline->set_layout_count++]);
+    vk_check(vk, "failed to create descriptor set layout");
+}
+
+static inline void
+vk_set_pipeline_push_const(struct vk *vk,
+                           struct vk_pipeline *pipeline,
+                           VkShaderStageFlags stages,
+                           uint32_t size)
+{
+    pipeline->push_const = (VkPushConstantRange){
+        .stageFlags = stages,
+        .size = size,
+    };
+}
+
+static inline void
+vk_setup_pipeline(struct vk *vk, struct vk_pipeline *pipeline, const struct vk_framebuffer *fb)
+{
+    const VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = pipeline->set_layout_count,
+        .pSetLayouts = pipeline->set_layouts,
+        .pushConstantRangeCount = pipeline->push_const.size ? 1 : 0,
+        .pPushConstantRanges = &pipeline->push_const,
+    };
+    vk->result = vk->CreatePipelineLayout(vk->dev, &pipeline_layout_info, NULL,
+                                          &pipeline->pipeline_layout);
+    vk_check(vk, "failed to create pipeline layout");
+
+    pipeline->depth_info = (VkPipelineDepthStencilStateCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+    };
+
+    pipeline->color_att = (VkPipelineColorBlendAttachmentState){
+        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                          VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+
+    pipeline->rendering_info = (VkPipelineRenderingCreateInfo){
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+    };
+
+    pipeline->fb = fb;
+}
+
+static inline void
+vk_compile_pipeline(struct vk *vk, struct vk_pipeline *pipeline)
+{
+    if (pipeline->stage_count == 1 && pipeline->stages[0].stage == VK_SHADER_STAGE_COMPUTE_BIT) {
+        const VkComputePipelineCreateInfo compute_info = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage = pipeline->stages[0],
+            .layout = pipeline->pipeline_layout,
+        };
+        vk->result = vk->CreateComputePipelines(vk->dev, VK_NULL_HANDLE, 1, &compute_info, NULL,
+                                                &pipeline->pipeline);
+        vk_check(vk, "failed to create compute pipeline");
+        return;
+    }
+
+    const VkPipelineVertexInputStateCreateInfo vi_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        .vertexBindingDescriptionCount = pipeline->vi_attr_count ? 1 : 0,
+        .pVertexBindingDescriptions = &pipeline->vi_binding,
+        .vertexAttributeDescriptionCount = pipeline->vi_attr_count,
+        .pVertexAttributeDescriptions = pipeline->vi_attrs,
+    };
+
+    const VkPipelineViewportStateCreateInfo vp_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        .viewportCount = 1,
+        .pViewports = &pipeline->viewport,
+        .scissorCount = 1,
+        .pScissors = &pipeline->scissor,
+    };
+
+    const VkPipelineColorBlendStateCreateInfo color_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        .attachmentCount = 1,
+        .pAttachments = &pipeline->color_att,
+    };
+
+    const VkGraphicsPipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = pipeline->fb ? NULL : &pipeline->rendering_info,
+        .stageCount = pipeline->stage_count,
+        .pStages = pipeline->stages,
+        .pVertexInputState = &vi_info,
+        .pInputAssemblyState = &pipeline->ia_info,
+        .pTessellationState = &pipeline->tess_info,
+        .pViewportState = &vp_info,
+        .pRasterizationState = &pipeline->rast_info,
+        .pMultisampleState = &pipeline->msaa_info,
+        .pDepthStencilState = &pipeline->depth_info,
+        .pColorBlendState = &color_info,
+        .layout = pipeline->pipeline_layout,
+        .renderPass = pipeline->fb ? pipeline->fb->pass : VK_NULL_HANDLE,
+    };
+
+    vk->result = vk->CreateGraphicsPipelines(vk->dev, VK_NULL_HANDLE, 1, &pipeline_info, NULL,
+                                             &pipeline->pipeline);
+    vk_check(vk, "failed to create graphics pipeline");
+}
+
+static inline void
+vk_destroy_pipeline(struct vk *vk, struct vk_pipeline *pipeline)
+{
+    for (uint32_t i = 0; i < pipeline->stage_count; i++)
+        vk->DestroyShaderModule(vk->dev, pipeline->stages[i].module, NULL);
+
+    for (uint32_t i = 0; i < pipeline->set_layout_count; i++)
+        vk->DestroyDescriptorSetLayout(vk->dev, pipeline->set_layouts[i], NULL);
+
+    vk->DestroyPipelineLayout(vk->dev, pipeline->pipeline_layout, NULL);
+
+    vk->DestroyPipeline(vk->dev, pipeline->pipeline, NULL);
+
+    free(pipeline);
+}
+
+static inline struct vk_descriptor_set *
+vk_create_descriptor_set(struct vk *vk, VkDescriptorSetLayout layout)
+{
+    struct vk_descriptor_set *set = calloc(1, sizeof(*set));
+    if (!set)
+        vk_die("failed to alloc set");
+
+    const VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = vk->desc_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &layout,
+    };
+
+    vk->result = vk->AllocateDescriptorSets(vk->dev, &set_info, &set->set);
+    vk_check(vk, "failed to allocate descriptor set");
+
+    return set;
+}
+
+static inline void
+vk_write_descriptor_set_buffer(struct vk *vk,
+                               struct vk_descriptor_set *set,
+                               VkDescriptorType type,
+                               const struct vk_buffer *buf,
+                               VkDeviceSize size)
+{
+    const VkDescriptorBufferInfo buf_info = {
+        .buffer = buf->buf,
+        .offset = 0,
+        .range = size,
+    };
+    const VkWriteDescriptorSet write_info = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = set->set,
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = type,
+        .pBufferInfo = &buf_info,
+    };
+
+    vk->UpdateDescriptorSets(vk->dev, 1, &write_info, 0, NULL);
+}
+
+static inline void
+vk_write_descriptor_set_image(struct vk *vk,
+                              struct vk_descriptor_set *set,
+                              const struct vk_image *img)
+{
+    const VkDescriptorImageInfo img_info = {
+        .sampler = img->sampler,
+        .imageView = img->sample_view,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    const VkWriteDescriptorSet write_info = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = set->set,
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = &img_info,
+    };
+
+    vk->UpdateDescriptorSets(vk->dev, 1, &write_info, 0, NULL);
+}
+
+static inline void
+vk_write_descriptor_set_storage_image(struct vk *vk,
+                                      struct vk_descriptor_set *set,
+                                      const struct vk_image *img)
+{
+    /* the sample view doubles as the storage view */
+    const VkDescriptorImageInfo img_info = {
+        .imageView = img->sample_view,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+    const VkWriteDescriptorSet write_info = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = set->set,
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .pImageInfo = &img_info,
+    };
+
+    vk->UpdateDescriptorSets(vk->dev, 1, &write_info, 0, NULL);
+}
+
+static inline void
+vk_destroy_descriptor_set(struct vk *vk, struct vk_descriptor_set *set)
+{
+    free(set);
+}
+
+static inline struct vk_event *
+vk_create_event(struct vk *vk)
+{
+    struct vk_event *ev = calloc(1, sizeof(*ev));
+    if (!ev)
+        vk_die("failed to alloc event");
+
+    const VkEventCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO,
+    };
+
+    vk->result = vk->CreateEvent(vk->dev, &info, NULL, &ev->event);
+    vk_check(vk, "failed to create event");
+
+    return ev;
+}
+
+static inline void
+vk_destroy_event(struct vk *vk, struct vk_event *ev)
+{
+    vk->DestroyEvent(vk->dev, ev->event, NULL);
+    free(ev);
+}
+
+/* Polls the event with vk_backoff until it is set. */
+static inline void
+vk_wait_event(struct vk *vk, struct vk_event *ev)
+{
+    struct vk_backoff backoff = { 0 };
+    while (true) {
+        vk->result = vk->GetEventStatus(vk->dev, ev->event);
+        if (vk->result == VK_EVENT_SET)
+            return;
+        if (vk->result < VK_SUCCESS)
+            vk_check(vk, "failed to get event status");
+
+        vk_backoff(&backoff);
+    }
+}
+
+static inline struct vk_query *
+vk_create_query(struct vk *vk, VkQueryType type, uint32_t count)
+{
+    struct vk_query *query = calloc(1, sizeof(*query));
+    if (!query)
+        vk_die("failed to alloc query");
+
+    const VkQueryPoolCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = type,
+        .queryCount = count,
+    };
+
+    vk->result = vk->CreateQueryPool(vk->dev, &info, NULL, &query->pool);
+    vk_check(vk, "failed to create query");
+
+    return query;
+}
+
+static inline void
+vk_destroy_query(struct vk *vk, struct vk_query *query)
+{
+    vk->DestroyQueryPool(vk->dev, query->pool, NULL);
+    free(query);
+}
+
+static inline void
+vk_wait_queue_point(struct vk *vk, const struct vk_queue *queue, uint64_t point)
+{
+    const VkSemaphoreWaitInfo wait_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &queue->submit.timeline,
+        .pValues = &point,
+    };
+    vk->result = vk->WaitSemaphores(vk->dev, &wait_info, UINT64_MAX);
+    vk_check(vk, "failed to wait timeline point %" PRIu64, point);
+}
+
+static inline VkCommandBuffer
+vk_begin_queue_cmd(struct vk *vk, struct vk_queue *queue)
+{
+    VkCommandBuffer *cmd = &queue->submit.cmds[queue->submit.next];
+
+    /* reuse or allocate */
+    if (*cmd) {
+        vk_wait_queue_point(vk, queue, queue->submit.points[queue->submit.next]);
+
+        vk->result = vk->ResetCommandBuffer(*cmd, 0);
+        vk_check(vk, "failed to reset command buffer");
+    } else {
+        const VkCommandBufferAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = queue->cmd_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
         };
-        views[att_count] = depth->render_view;
-        att_count++;
+
+        vk->result = vk->AllocateCommandBuffers(vk->dev, &alloc_info, cmd);
+        vk_check(vk, "failed to allocate command buffer");
     }
 
-    const VkRenderPassCreateInfo pass_info = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = att_count,
-        .pAttachments = att_descs,
-        .subpassCount = 1,
-        .pSubpasses =
-            &(VkSubpassDescription){
-                .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-                .colorAttachmentCount = color ? 1 : 0,
-                .pColorAttachments = color ? &color_ref : NULL,
-                .pResolveAttachments = resolve ? &resolve_ref : NULL,
-                .pDepthStencilAttachment = depth ? &depth_ref : NULL,
-            },
+    const VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
     };
+    vk->result = vk->BeginCommandBuffer(*cmd, &begin_info);
+    vk_check(vk, "failed to begin command buffer");
 
-    vk->result = vk->CreateRenderPass(vk->dev, &pass_info, NULL, &fb->pass);
-    vk_check(vk, "failed to create render pass");
+    return *cmd;
+}
 
-    const VkFramebufferCreateInfo fb_info = {
-        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-        .renderPass = fb->pass,
-        .attachmentCount = att_count,
-        .pAttachments = views,
-        .width = color ? color->info.extent.width : depth->info.extent.width,
-        .height = color ? color->info.extent.height : depth->info.extent.height,
-        .layers = color ? color->info.arrayLayers : depth->info.arrayLayers,
+static inline void
+vk_lock_queues(struct vk *vk)
+{
+    if (vk->queue_mutex)
+        pthread_mutex_lock(vk->queue_mutex);
+}
+
+static inline void
+vk_unlock_queues(struct vk *vk)
+{
+    if (vk->queue_mutex)
+        pthread_mutex_unlock(vk->queue_mutex);
+}
+
+/* Submits the current command buffer of the queue and returns the timeline
+ * point that it signals.  The submission waits for wait_count semaphores
+ * first, and also signals signal_sem when it is not VK_NULL_HANDLE.  Values
+ * of binary semaphores are ignored.
+ */
+static inline uint64_t
+vk_submit_queue_cmd(struct vk *vk,
+                    struct vk_queue *queue,
+                    const VkSemaphore *wait_sems,
+                    const uint64_t *wait_vals,
+                    const VkPipelineStageFlags *wait_stages,
+                    uint32_t wait_count,
+                    VkSemaphore signal_sem)
+{
+    VkCommandBuffer cmd = queue->submit.cmds[queue->submit.next];
+    const uint64_t point = ++queue->submit.point;
+    queue->submit.points[queue->submit.next] = point;
+
+    /* increment */
+    queue->submit.next = (queue->submit.next + 1) % queue->submit.count;
+
+    vk->result = vk->EndCommandBuffer(cmd);
+    vk_check(vk, "failed to end command buffer");
+
+    const VkSemaphore signal_sems[2] = { queue->submit.timeline, signal_sem };
+    const uint64_t signal_vals[2] = { point, 0 };
+    const uint32_t signal_count = signal_sem != VK_NULL_HANDLE ? 2 : 1;
+
+    const VkTimelineSemaphoreSubmitInfo timeline_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = wait_count,
+        .pWaitSemaphoreValues = wait_vals,
+        .signalSemaphoreValueCount = signal_count,
+        .pSignalSemaphoreValues = signal_vals,
+    };
+    const VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timeline_info,
+        .waitSemaphoreCount = wait_count,
+        .pWaitSemaphores = wait_sems,
+        .pWaitDstStageMask = wait_stages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &cmd,
+        .signalSemaphoreCount = signal_count,
+        .pSignalSemaphores = signal_sems,
     };
+    vk_lock_queues(vk);
+    vk->result = vk->QueueSubmit(queue->queue, 1, &submit_info, VK_NULL_HANDLE);
+    vk_unlock_queues(vk);
+    vk_check(vk, "failed to submit command buffer");
 
-    vk->result = vk->CreateFramebuffer(vk->dev, &fb_info, NULL, &fb->fb);
-    vk_check(vk, "failed to create framebuffer");
+    return point;
+}
 
-    fb->width = fb_info.width;
-    fb->height = fb_info.height;
-    fb->samples = color ? color->info.samples : depth->info.samples;
+/* Submits the current command buffer of the queue and returns the timeline
+ * point that it signals.  When wait_queue is not NULL, the submission waits
+ * for wait_point of wait_queue at wait_stage first.
+ */
+static inline uint64_t
+vk_end_queue_cmd(struct vk *vk,
+                 struct vk_queue *queue,
+                 const struct vk_queue *wait_queue,
+                 uint64_t wait_point,
+                 VkPipelineStageFlags wait_stage)
+{
+    return vk_submit_queue_cmd(vk, queue, wait_queue ? &wait_queue->submit.timeline : NULL,
+                               &wait_point, &wait_stage, wait_queue ? 1 : 0, VK_NULL_HANDLE);
+}
 
-    return fb;
+static inline VkCommandBuffer
+vk_begin_cmd(struct vk *vk)
+{
+    return vk_begin_queue_cmd(vk, vk->graphics_queue);
+}
+
+static inline uint64_t
+vk_end_cmd(struct vk *vk)
+{
+    return vk_end_queue_cmd(vk, vk->graphics_queue, NULL, 0, 0);
 }
 
 static inline void
-vk_destroy_framebuffer(struct vk *vk, struct vk_framebuffer *fb)
+vk_wait_point(struct vk *vk, uint64_t point)
 {
-    vk->DestroyRenderPass(vk->dev, fb->pass, NULL);
-    vk->DestroyFramebuffer(vk->dev, fb->fb, NULL);
-    free(fb);
+    vk_wait_queue_point(vk, vk->graphics_queue, point);
 }
 
-static inline struct vk_pipeline *
-vk_create_pipeline(struct vk *vk)
+static inline void
+vk_wait(struct vk *vk)
 {
-    struct vk_pipeline *pipeline = calloc(1, sizeof(*pipeline));
-    if (!pipeline)
-        vk_die("failed to alloc pipeline");
+    VkSemaphore timelines[ARRAY_SIZE(vk->queues)];
+    uint64_t points[ARRAY_SIZE(vk->queues)];
+    for (uint32_t i = 0; i < vk->queue_count; i++) {
+        timelines[i] = vk->queues[i].submit.timeline;
+        points[i] = vk->queues[i].submit.point;
+    }
 
-    return pipeline;
+    const VkSemaphoreWaitInfo wait_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = vk->queue_count,
+        .pSemaphores = timelines,
+        .pValues = points,
+    };
+    vk->result = vk->WaitSemaphores(vk->dev, &wait_info, UINT64_MAX);
+    vk_check(vk, "failed to wait queues");
 }
 
-static inline VkShaderModule
-vk_create_shader_module(struct vk *vk, const uint32_t *code, size_t size)
+static inline VkSemaphore
+vk_create_timeline_semaphore(struct vk *vk, uint64_t initial_val)
 {
-    const VkShaderModuleCreateInfo mod_info = {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .codeSize = size,
-        .pCode = code,
+    const VkSemaphoreTypeCreateInfo type_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = initial_val,
+    };
+    const VkSemaphoreCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &type_info,
     };
 
-    VkShaderModule mod;
-    vk->result = vk->CreateShaderModule(vk->dev, &mod_info, NULL, &mod);
-    vk_check(vk, "failed to create shader module");
+    VkSemaphore sem;
+    vk->result = vk->CreateSemaphore(vk->dev, &info, NULL, &sem);
+    vk_check(vk, "failed to create timeline semaphore");
 
-    return mod;
+    return sem;
 }
 
 static inline void
-vk_add_pipeline_shader(struct vk *vk,
-                       struct vk_pipeline *pipeline,
-                       VkShaderStageFlagBits stage,
-                       const uint32_t *code,
-                       size_t size)
+vk_signal_timeline_semaphore(struct vk *vk, VkSemaphore sem, uint64_t val)
 {
-    pipeline->stages[pipeline->stage_count++] = (VkPipelineShaderStageCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = stage,
-        .module = vk_create_shader_module(vk, code, size),
-        .pName = "main",
+    const VkSemaphoreSignalInfo info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+        .semaphore = sem,
+        .value = val,
     };
+    vk->result = vk->SignalSemaphore(vk->dev, &info);
+    vk_check(vk, "failed to signal timeline semaphore");
 }
 
+/* Waits for a timeline semaphore to reach val.  When spin is set, the
+ * counter is polled with vk_backoff instead of blocking in WaitSemaphores,
+ * which trades CPU time for wakeup latency.
+ */
 static inline void
-vk_set_pipeline_vertices(struct vk *vk,
-                         struct vk_pipeline *pipeline,
-                         const uint32_t *comp_counts,
-                         uint32_t attr_count)
+vk_wait_timeline_semaphore(struct vk *vk, VkSemaphore sem, uint64_t val, bool spin)
 {
-    assert(attr_count < ARRAY_SIZE(pipeline->vi_attrs));
+    if (!spin) {
+        const VkSemaphoreWaitInfo wait_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &sem,
+            .pValues = &val,
+        };
+        vk->result = vk->WaitSemaphores(vk->dev, &wait_info, UINT64_MAX);
+        vk_check(vk, "failed to wait timeline semaphore");
+        return;
+    }
 
-    uint32_t offset = 0;
-    for (uint32_t i = 0; i < attr_count; i++) {
-        VkFormat format;
-        switch (comp_counts[i]) {
-        case 1:
-            format = VK_FORMAT_R32_SFLOAT;
-            break;
-        case 2:
-            format = VK_FORMAT_R32G32_SFLOAT;
-            break;
-        case 3:
-            format = VK_FORMAT_R32G32B32_SFLOAT;
-            break;
-        case 4:
-            format = VK_FORMAT_R32G32B32A32_SFLOAT;
-            break;
-        default:
-            vk_die("unsupported vertex attribute format %d", comp_counts[i]);
-            break;
+    struct vk_backoff backoff = { 0 };
+    while (true) {
+        uint64_t cur;
+        vk->result = vk->GetSemaphoreCounterValue(vk->dev, sem, &cur);
+        vk_check(vk, "failed to get timeline semaphore value");
+        if (cur >= val)
+            return;
+
+        vk_backoff(&backoff);
+    }
+}
+
+static inline int
+vk_bench_compare_samples(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static inline double
+vk_bench_percentile(const double *sorted, uint32_t count, double p)
+{
+    const double pos = p * (double)(count - 1);
+    const uint32_t lo = (uint32_t)pos;
+    if (lo + 1 >= count)
+        return sorted[count - 1];
+
+    return sorted[lo] + (sorted[lo + 1] - sorted[lo]) * (pos - (double)lo);
+}
+
+/* Sorts the samples and computes their stats.  Unless keep_outliers is set,
+ * samples outside of Tukey's fences (1.5 IQR beyond the quartiles) are
+ * rejected first.
+ */
+static inline void
+vk_bench_compute_stats(double *samples,
+                       uint32_t count,
+                       bool keep_outliers,
+                       struct vk_bench_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!count)
+        return;
+
+    qsort(samples, count, sizeof(*samples), vk_bench_compare_samples);
+
+    if (!keep_outliers) {
+        const double q1 = vk_bench_percentile(samples, count, 0.25);
+        const double q3 = vk_bench_percentile(samples, count, 0.75);
+        const double lo = q1 - 1.5 * (q3 - q1);
+        const double hi = q3 + 1.5 * (q3 - q1);
+
+        uint32_t first = 0;
+        while (samples[first] < lo)
+            first++;
+        uint32_t last = count;
+        while (samples[last - 1] > hi)
+            last--;
+
+        stats->rejected_count = count - (last - first);
+        samples += first;
+        count = last - first;
+    }
+
+    double sum = 0.0;
+    for (uint32_t i = 0; i < count; i++)
+        sum += samples[i];
+    const double mean = sum / (double)count;
+
+    double var = 0.0;
+    for (uint32_t i = 0; i < count; i++)
+        var += (samples[i] - mean) * (samples[i] - mean);
+    if (count > 1)
+        var /= (double)(count - 1);
+
+    stats->sample_count = count;
+    stats->min = samples[0];
+    stats->median = vk_bench_percentile(samples, count, 0.50);
+    stats->mean = mean;
+    stats->p95 = vk_bench_percentile(samples, count, 0.95);
+    stats->p99 = vk_bench_percentile(samples, count, 0.99);
+    stats->max = samples[count - 1];
+    stats->stddev = sqrt(var);
+}
+
+/* A benchmark runs a loop such as
+ *
+ *   struct vk_bench *bench = vk_create_bench(vk, &params);
+ *   while (vk_bench_next(vk, bench)) {
+ *       VkCommandBuffer cmd = vk_begin_cmd(vk);
+ *       vk_bench_cmd_begin(vk, bench, cmd);
+ *       ...
+ *       vk_bench_cmd_end(vk, bench, cmd);
+ *       vk_end_cmd(vk);
+ *       vk_wait(vk);
+ *   }
+ *   vk_bench_report(vk, bench);
+ *   vk_destroy_bench(vk, bench);
+ *
+ * The CPU time of an iteration is the wall-clock time between two
+ * vk_bench_next calls.  The GPU time is the delta between the timestamps
+ * written by vk_bench_cmd_begin and vk_bench_cmd_end, which must be recorded
+ * to graphics queue command buffers.  Warmup iterations are not measured.
+ */
+static inline struct vk_bench *
+vk_create_bench(struct vk *vk, const struct vk_bench_params *params)
+{
+    struct vk_bench *bench = calloc(1, sizeof(*bench));
+    if (!bench)
+        vk_die("failed to alloc bench");
+
+    bench->params = *params;
+    if (!bench->params.iterations && !bench->params.duration_ns)
+        bench->params.iterations = 100;
+    if (bench->params.iterations)
+        bench->params.max_samples = bench->params.iterations;
+    else if (!bench->params.max_samples)
+        bench->params.max_samples = 10000;
+
+    const uint32_t max_samples = bench->params.max_samples;
+    bench->cpu_samples = malloc(sizeof(*bench->cpu_samples) * max_samples * 2);
+    if (!bench->cpu_samples)
+        vk_die("failed to alloc bench samples");
+    bench->gpu_samples = bench->cpu_samples + max_samples;
+
+    if (bench->params.gpu) {
+        bench->query = vk_create_query(vk, VK_QUERY_TYPE_TIMESTAMP, max_samples * 2);
+        vk->ResetQueryPool(vk->dev, bench->query->pool, 0, max_samples * 2);
+    }
+
+    return bench;
+}
+
+static inline void
+vk_destroy_bench(struct vk *vk, struct vk_bench *bench)
+{
+    if (bench->query)
+        vk_destroy_query(vk, bench->query);
+    free(bench->cpu_samples);
+    free(bench);
+}
+
+static inline void
+vk_bench_finish(struct vk *vk, struct vk_bench *bench)
+{
+    if (bench->query && bench->sample_count) {
+        vk_wait(vk);
+
+        /* each timestamp is followed by its availability */
+        const uint32_t count = bench->sample_count * 2;
+        uint64_t *ts = malloc(sizeof(*ts) * 2 * count);
+        if (!ts)
+            vk_die("failed to alloc timestamps");
+
+        vk->result = vk->GetQueryPoolResults(
+            vk->dev, bench->query->pool, 0, count, sizeof(*ts) * 2 * count, ts, sizeof(*ts) * 2,
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (vk->result < VK_SUCCESS)
+            vk_check(vk, "failed to get query results");
+
+        const uint32_t valid_bits = vk->graphics_queue->family_props.timestampValidBits;
+        const uint64_t mask = valid_bits < 64 ? (1ull << valid_bits) - 1 : UINT64_MAX;
+        const double period = vk->props.properties.limits.timestampPeriod;
+
+        uint32_t gpu_count = 0;
+        for (uint32_t i = 0; i < bench->sample_count; i++) {
+            const uint64_t *begin = &ts[4 * i];
+            const uint64_t *end = &ts[4 * i + 2];
+            if (!begin[1] || !end[1])
+                continue;
+
+            const uint64_t delta = (end[0] - begin[0]) & mask;
+            bench->gpu_samples[gpu_count++] = (double)delta * period;
+        }
+        free(ts);
+
+        vk_bench_compute_stats(bench->gpu_samples, gpu_count, bench->params.keep_outliers,
+                               &bench->gpu);
+    }
+
+    vk_bench_compute_stats(bench->cpu_samples, bench->sample_count, bench->params.keep_outliers,
+                           &bench->cpu);
+}
+
+/* Returns true until the benchmark is done.  The stats are computed when it
+ * returns false.
+ */
+static inline bool
+vk_bench_next(struct vk *vk, struct vk_bench *bench)
+{
+    const uint32_t warmup = bench->params.warmup_iterations;
+    const uint64_t now = vk_now();
+
+    if (bench->iteration > warmup)
+        bench->cpu_samples[bench->sample_count++] = (double)(now - bench->last);
+    else if (bench->iteration == warmup)
+        bench->begin = now;
+    bench->last = now;
+
+    bool more;
+    if (bench->params.iterations) {
+        more = bench->sample_count < bench->params.iterations;
+    } else {
+        more = bench->iteration <= warmup || (bench->sample_count < bench->params.max_samples &&
+                                              now - bench->begin < bench->params.duration_ns);
+    }
+    bench->iteration++;
+
+    if (!more)
+        vk_bench_finish(vk, bench);
+
+    return more;
+}
+
+/* Restarts the CPU time of the current iteration to exclude its setup. */
+static inline void
+vk_bench_cpu_begin(struct vk_bench *bench)
+{
+    bench->last = vk_now();
+}
+
+static inline void
+vk_bench_cmd_begin(struct vk *vk, struct vk_bench *bench, VkCommandBuffer cmd)
+{
+    if (!bench->query || bench->iteration <= bench->params.warmup_iterations)
+        return;
+
+    vk->CmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, bench->query->pool,
+                          bench->sample_count * 2);
+}
+
+static inline void
+vk_bench_cmd_end(struct vk *vk, struct vk_bench *bench, VkCommandBuffer cmd)
+{
+    if (!bench->query || bench->iteration <= bench->params.warmup_iterations)
+        return;
+
+    vk->CmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, bench->query->pool,
+                          bench->sample_count * 2 + 1);
+}
+
+#define VK_BENCH_STAT_FIELD_COUNT 9
+#define VK_BENCH_STAT_FIELD_MEDIAN 3
+
+static inline const char *
+vk_bench_stat_field(const struct vk_bench_stats *stats, uint32_t index, double *val)
+{
+    switch (index) {
+    case 0:
+        *val = stats->sample_count;
+        return "samples";
+    case 1:
+        *val = stats->rejected_count;
+        return "rejected";
+    case 2:
+        *val = stats->min;
+        return "min_ns";
+    case VK_BENCH_STAT_FIELD_MEDIAN:
+        *val = stats->median;
+        return "median_ns";
+    case 4:
+        *val = stats->mean;
+        return "mean_ns";
+    case 5:
+        *val = stats->p95;
+        return "p95_ns";
+    case 6:
+        *val = stats->p99;
+        return "p99_ns";
+    case 7:
+        *val = stats->max;
+        return "max_ns";
+    case 8:
+        *val = stats->stddev;
+        return "stddev_ns";
+    default:
+        vk_die("bad bench stat field");
+        return NULL;
+    }
+}
+
+static inline void
+vk_bench_write_string(FILE *fp, const char *str, bool json)
+{
+    fputc('"', fp);
+    for (const char *c = str; *c; c++) {
+        if (*c == '"')
+            fputs(json ? "\\\"" : "\"\"", fp);
+        else if (json && *c == '\\')
+            fputs("\\\\", fp);
+        else if (json && (unsigned char)*c < 0x20)
+            fprintf(fp, "\\u%04x", *c);
+        else
+            fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Appends a record to filename, as a JSON line if it ends in .json and as a
+ * CSV row otherwise.  Numeric fields precede the device and driver strings.
+ */
+static inline void
+vk_bench_write(struct vk *vk, const struct vk_bench *bench, const char *filename)
+{
+    const char *suffix = strrchr(filename, '.');
+    const bool json = suffix && !strcmp(suffix, ".json");
+    const struct vk_bench_stats *stats[2] = { &bench->cpu, &bench->gpu };
+    const char *kinds[2] = { "cpu", "gpu" };
+    const VkPhysicalDeviceProperties *props = &vk->props.properties;
+
+    const struct {
+        const char *name;
+        uint32_t val;
+    } ids[] = {
+        { "vendor_id", props->vendorID },
+        { "device_id", props->deviceID },
+        { "driver_version", props->driverVersion },
+    };
+    const struct {
+        const char *name;
+        const char *val;
+    } strs[] = {
+        { "device", props->deviceName },
+        { "driver", vk->vulkan_12_props.driverName },
+        { "driver_info", vk->vulkan_12_props.driverInfo },
+    };
+
+    FILE *fp = fopen(filename, "a");
+    if (!fp)
+        vk_die("failed to open %s", filename);
+
+    if (!json && fseek(fp, 0, SEEK_END) == 0 && !ftell(fp)) {
+        fprintf(fp, "name");
+        for (uint32_t k = 0; k < ARRAY_SIZE(stats); k++) {
+            for (uint32_t i = 0; i < VK_BENCH_STAT_FIELD_COUNT; i++) {
+                double val;
+                fprintf(fp, ",%s_%s", kinds[k], vk_bench_stat_field(stats[k], i, &val));
+            }
+        }
+        for (uint32_t i = 0; i < ARRAY_SIZE(ids); i++)
+            fprintf(fp, ",%s", ids[i].name);
+        for (uint32_t i = 0; i < ARRAY_SIZE(strs); i++)
+            fprintf(fp, ",%s", strs[i].name);
+        fprintf(fp, "\n");
+    }
+
+    if (json)
+        fprintf(fp, "{\"name\":");
+    vk_bench_write_string(fp, bench->params.name, json);
+
+    for (uint32_t k = 0; k < ARRAY_SIZE(stats); k++) {
+        for (uint32_t i = 0; i < VK_BENCH_STAT_FIELD_COUNT; i++) {
+            double val;
+            const char *name = vk_bench_stat_field(stats[k], i, &val);
+            if (json)
+                fprintf(fp, ",\"%s_%s\":", kinds[k], name);
+            else
+                fprintf(fp, ",");
+            fprintf(fp, "%.*f", i < 2 ? 0 : 3, val);
+        }
+    }
+    for (uint32_t i = 0; i < ARRAY_SIZE(ids); i++) {
+        if (json)
+            fprintf(fp, ",\"%s\":%u", ids[i].name, ids[i].val);
+        else
+            fprintf(fp, ",%u", ids[i].val);
+    }
+    for (uint32_t i = 0; i < ARRAY_SIZE(strs); i++) {
+        if (json)
+            fprintf(fp, ",\"%s\":", strs[i].name);
+        else
+            fprintf(fp, ",");
+        vk_bench_write_string(fp, strs[i].val, json);
+    }
+    fprintf(fp, json ? "}\n" : "\n");
+
+    if (fclose(fp))
+        vk_die("failed to write %s", filename);
+}
+
+/* Reads the medians of the last record named after the benchmark.  A median
+ * is 0 when the record lacks it.
+ */
+static inline bool
+vk_bench_read_baseline(const struct vk_bench *bench, const char *filename, double medians[2])
+{
+    const char *kinds[2] = { "cpu", "gpu" };
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        vk_die("failed to open %s", filename);
+
+    char json_name[256];
+    char csv_name[256];
+    snprintf(json_name, sizeof(json_name), "{\"name\":\"%s\",", bench->params.name);
+    snprintf(csv_name, sizeof(csv_name), "\"%s\",", bench->params.name);
+
+    bool found = false;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) >= 0) {
+        const bool json = line[0] == '{';
+        const char *name = json ? json_name : csv_name;
+        if (strncmp(line, name, strlen(name)))
+            continue;
+
+        for (uint32_t k = 0; k < ARRAY_SIZE(kinds); k++) {
+            const char *field;
+            if (json) {
+                char key[64];
+                snprintf(key, sizeof(key), "\"%s_median_ns\":", kinds[k]);
+                field = strstr(line, key);
+                if (field)
+                    field += strlen(key);
+            } else {
+                const uint32_t col =
+                    1 + VK_BENCH_STAT_FIELD_COUNT * k + VK_BENCH_STAT_FIELD_MEDIAN;
+                field = line;
+                for (uint32_t i = 0; i < col && field; i++) {
+                    field = strchr(field, ',');
+                    if (field)
+                        field++;
+                }
+            }
+
+            medians[k] = field ? strtod(field, NULL) : 0.0;
         }
 
-        pipeline->vi_attrs[i] = (VkVertexInputAttributeDescription){
-            .location = i,
-            .binding = 0,
-            .format = format,
-            .offset = offset,
-        };
-        offset += sizeof(float) * comp_counts[i];
+        found = true;
+    }
+
+    free(line);
+    fclose(fp);
+
+    return found;
+}
+
+static inline bool
+vk_bench_compare(const struct vk_bench *bench, const char *filename)
+{
+    const struct vk_bench_stats *stats[2] = { &bench->cpu, &bench->gpu };
+    const char *kinds[2] = { "cpu", "gpu" };
+
+    double baseline[2];
+    if (!vk_bench_read_baseline(bench, filename, baseline)) {
+        vk_log("  no baseline in %s", filename);
+        return true;
     }
 
-    pipeline->vi_attr_count = attr_count;
+    const uint64_t threshold = vk_getenv_uint("VK_BENCH_THRESHOLD", 5);
 
-    pipeline->vi_binding = (VkVertexInputBindingDescription){
-        .binding = 0,
-        .stride = offset,
-    };
+    bool pass = true;
+    for (uint32_t k = 0; k < ARRAY_SIZE(stats); k++) {
+        if (!stats[k]->sample_count || baseline[k] <= 0.0)
+            continue;
+
+        const double change = (stats[k]->median - baseline[k]) / baseline[k] * 100.0;
+        const bool regressed = change > (double)threshold;
+        vk_log("  %s: median %+.1f%% vs baseline %.3f us%s", kinds[k], change,
+               baseline[k] / 1000.0, regressed ? ", REGRESSED" : "");
+
+        if (regressed)
+            pass = false;
+    }
+
+    return pass;
 }
 
 static inline void
-vk_set_pipeline_topology(struct vk *vk,
-                         struct vk_pipeline *pipeline,
-                         VkPrimitiveTopology topology)
+vk_bench_log_stats(const char *kind, const struct vk_bench_stats *stats)
 {
-    pipeline->ia_info = (VkPipelineInputAssemblyStateCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology = topology,
-    };
+    vk_log("  %s: median %.3f us, p95 %.3f us, p99 %.3f us, mean %.3f us, stddev %.3f us", kind,
+           stats->median / 1000.0, stats->p95 / 1000.0, stats->p99 / 1000.0,
+           stats->mean / 1000.0, stats->stddev / 1000.0);
+    vk_log("    min %.3f us, max %.3f us, %u samples, %u rejected", stats->min / 1000.0,
+           stats->max / 1000.0, stats->sample_count, stats->rejected_count);
 }
 
-static inline void
-vk_set_pipeline_viewport(struct vk *vk,
-                         struct vk_pipeline *pipeline,
-                         uint32_t width,
-                         uint32_t height)
+/* Logs the stats of a finished benchmark.  When VK_BENCH_OUTPUT is set, a
+ * record is appended to it.  When VK_BENCH_BASELINE is set, the medians are
+ * compared against the last record of the same name in it, and false is
+ * returned when one regressed by more than VK_BENCH_THRESHOLD percent (5 by
+ * default).
+ */
+static inline bool
+vk_bench_report(struct vk *vk, const struct vk_bench *bench)
 {
-    pipeline->viewport = (VkViewport){
-        .width = (float)width,
-        .height = (float)height,
-        .maxDepth = 1.0f,
-    };
+    vk_log("%s: %u iterations", bench->params.name, bench->sample_count);
+    vk_bench_log_stats("cpu", &bench->cpu);
+    if (bench->gpu.sample_count)
+        vk_bench_log_stats("gpu", &bench->gpu);
 
-    pipeline->scissor = (VkRect2D){
-        .extent = {
-            .width = width,
-            .height = height,
-        },
-    };
+    const char *output = getenv("VK_BENCH_OUTPUT");
+    if (output && *output)
+        vk_bench_write(vk, bench, output);
+
+    const char *baseline = getenv("VK_BENCH_BASELINE");
+    if (baseline && *baseline)
+        return vk_bench_compare(bench, baseline);
+
+    return true;
 }
 
+/* Queue family ownership transfer of a buffer.  The release half is recorded
+ * to a command buffer of src and the acquire half to one of dst, which must
+ * be submitted after the release, usually with vk_end_queue_cmd waiting for
+ * it.  They are no-ops when both queues are from the same family.
+ */
 static inline void
-vk_set_pipeline_rasterization(struct vk *vk,
-                              struct vk_pipeline *pipeline,
-                              VkPolygonMode poly_mode)
+vk_cmd_release_buffer(struct vk *vk,
+                      VkCommandBuffer cmd,
+                      const struct vk_buffer *buf,
+                      const struct vk_queue *src,
+                      const struct vk_queue *dst,
+                      VkPipelineStageFlags src_stage,
+                      VkAccessFlags src_access)
 {
-    pipeline->rast_info = (VkPipelineRasterizationStateCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-        .polygonMode = poly_mode,
-        .lineWidth = 1.0f,
+    if (src->family_index == dst->family_index)
+        return;
+
+    const VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = src_access,
+        .dstAccessMask = 0,
+        .srcQueueFamilyIndex = src->family_index,
+        .dstQueueFamilyIndex = dst->family_index,
+        .buffer = buf->buf,
+        .size = VK_WHOLE_SIZE,
     };
+    vk->CmdPipelineBarrier(cmd, src_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 1,
+                           &barrier, 0, NULL);
 }
 
 static inline void
-vk_set_pipeline_tessellation(struct vk *vk, struct vk_pipeline *pipeline, uint32_t cp_count)
+vk_cmd_acquire_buffer(struct vk *vk,
+                      VkCommandBuffer cmd,
+                      const struct vk_buffer *buf,
+                      const struct vk_queue *src,
+                      const struct vk_queue *dst,
+                      VkPipelineStageFlags dst_stage,
+                      VkAccessFlags dst_access)
 {
-    pipeline->tess_info = (VkPipelineTessellationStateCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO,
-        .patchControlPoints = cp_count,
+    if (src->family_index == dst->family_index)
+        return;
+
+    const VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = dst_access,
+        .srcQueueFamilyIndex = src->family_index,
+        .dstQueueFamilyIndex = dst->family_index,
+        .buffer = buf->buf,
+        .size = VK_WHOLE_SIZE,
     };
+    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dst_stage, 0, 0, NULL, 1,
+                           &barrier, 0, NULL);
 }
 
-static inline void
-vk_set_pipeline_sample_count(struct vk *vk, struct vk_pipeline *pipeline, uint32_t sample_count)
+static inline VkAccessFlags2
+vk_access_writes(VkAccessFlags2 access)
 {
-    pipeline->sample_mask = (1u << sample_count) - 1;
-    pipeline->msaa_info = (VkPipelineMultisampleStateCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-        .rasterizationSamples = sample_count,
-        .pSampleMask = &pipeline->sample_mask,
-    };
+    const VkAccessFlags2 write_mask =
+        VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT |
+        VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT |
+        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    return access & write_mask;
 }
 
-static inline void
-vk_add_pipeline_set_layout(struct vk *vk,
-                           struct vk_pipeline *pipeline,
-                           VkDescriptorType type,
-                           uint32_t desc_count,
-                           VkShaderStageFlags stages,
-                           const VkSampler *immutable_samplers)
+static inline VkPipelineStageFlags
+vk_stage_to_sync1(VkPipelineStageFlags2 stage, VkPipelineStageFlags none)
 {
-    assert(pipeline->set_layout_count < ARRAY_SIZE(pipeline->set_layouts));
+    VkPipelineStageFlags flags = (VkPipelineStageFlags)(stage & 0xffffffffull);
+
+    if (stage & (VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_RESOLVE_BIT |
+                 VK_PIPELINE_STAGE_2_BLIT_BIT | VK_PIPELINE_STAGE_2_CLEAR_BIT))
+        flags |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+    if (stage & (VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT |
+                 VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT))
+        flags |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    if (stage & VK_PIPELINE_STAGE_2_PRE_RASTERIZATION_SHADERS_BIT) {
+        flags |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                 VK_PIPELINE_STAGE_TESSELLATION_CONTROL_SHADER_BIT |
+                 VK_PIPELINE_STAGE_TESSELLATION_EVALUATION_SHADER_BIT |
+                 VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT;
+    }
 
-    const VkDescriptorSetLayoutBinding binding = {
-        .binding = 0,
-        .descriptorType = type,
-        .descriptorCount = desc_count,
-        .stageFlags = stages,
-        .pImmutableSamplers = immutable_samplers,
-    };
-    const VkDescriptorSetLayoutCreateInfo set_layout_info = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = 1,
-        .pBindings = &binding,
-    };
+    return flags ? flags : none;
+}
 
-    vk->result = vk->CreateDescriptorSetLayout(
-        vk->dev, &set_layout_info, NULL, &pipeline->set_layouts[pipeline->set_layout_count++]);
-    vk_check(vk, "failed to create descriptor set layout");
+static inline VkAccessFlags
+vk_access_to_sync1(VkAccessFlags2 access)
+{
+    VkAccessFlags flags = (VkAccessFlags)(access & 0xffffffffull);
+
+    if (access & (VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT))
+        flags |= VK_ACCESS_SHADER_READ_BIT;
+    if (access & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+        flags |= VK_ACCESS_SHADER_WRITE_BIT;
+
+    return flags;
 }
 
 static inline void
-vk_set_pipeline_push_const(struct vk *vk,
-                           struct vk_pipeline *pipeline,
-                           VkShaderStageFlags stages,
-                           uint32_t size)
+vk_cmd_barriers(struct vk *vk,
+                VkCommandBuffer cmd,
+                const VkMemoryBarrier2 *mem_barrier,
+                const VkImageMemoryBarrier2 *barriers,
+                uint32_t count)
 {
-    pipeline->push_const = (VkPushConstantRange){
-        .stageFlags = stages,
-        .size = size,
+    if (vk->params.api_version >= VK_API_VERSION_1_3 && vk->vulkan_13_features.synchronization2) {
+        const VkDependencyInfo dep_info = {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .memoryBarrierCount = mem_barrier ? 1 : 0,
+            .pMemoryBarriers = mem_barrier,
+            .imageMemoryBarrierCount = count,
+            .pImageMemoryBarriers = barriers,
+        };
+        vk->CmdPipelineBarrier2(cmd, &dep_info);
+        return;
+    }
+
+    VkMemoryBarrier sync1_mem_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
     };
+    VkImageMemoryBarrier sync1_barriers[16];
+    VkPipelineStageFlags2 src_stage = 0;
+    VkPipelineStageFlags2 dst_stage = 0;
+    if (mem_barrier) {
+        sync1_mem_barrier.srcAccessMask = vk_access_to_sync1(mem_barrier->srcAccessMask);
+        sync1_mem_barrier.dstAccessMask = vk_access_to_sync1(mem_barrier->dstAccessMask);
+        src_stage |= mem_barrier->srcStageMask;
+        dst_stage |= mem_barrier->dstStageMask;
+    }
+    assert(count <= ARRAY_SIZE(sync1_barriers));
+    for (uint32_t i = 0; i < count; i++) {
+        const VkImageMemoryBarrier2 *b = &barriers[i];
+
+        sync1_barriers[i] = (VkImageMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = vk_access_to_sync1(b->srcAccessMask),
+            .dstAccessMask = vk_access_to_sync1(b->dstAccessMask),
+            .oldLayout = b->oldLayout,
+            .newLayout = b->newLayout,
+            .srcQueueFamilyIndex = b->srcQueueFamilyIndex,
+            .dstQueueFamilyIndex = b->dstQueueFamilyIndex,
+            .image = b->image,
+            .subresourceRange = b->subresourceRange,
+        };
+        src_stage |= b->srcStageMask;
+        dst_stage |= b->dstStageMask;
+    }
+
+    vk->CmdPipelineBarrier(cmd, vk_stage_to_sync1(src_stage, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+                           vk_stage_to_sync1(dst_stage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT), 0,
+                           mem_barrier ? 1 : 0, &sync1_mem_barrier, 0, NULL, count,
+                           sync1_barriers);
 }
 
-static inline void
-vk_setup_pipeline(struct vk *vk, struct vk_pipeline *pipeline, const struct vk_framebuffer *fb)
+static inline bool
+vk_merge_image_barrier(VkImageMemoryBarrier2 *dst, const VkImageMemoryBarrier2 *src)
 {
-    const VkPipelineLayoutCreateInfo pipeline_layout_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = pipeline->set_layout_count,
-        .pSetLayouts = pipeline->set_layouts,
-        .pushConstantRangeCount = pipeline->push_const.size ? 1 : 0,
-        .pPushConstantRanges = &pipeline->push_const,
-    };
-    vk->result = vk->CreatePipelineLayout(vk->dev, &pipeline_layout_info, NULL,
-                                          &pipeline->pipeline_layout);
-    vk_check(vk, "failed to create pipeline layout");
+    if (dst->image != src->image || dst->srcStageMask != src->srcStageMask ||
+        dst->srcAccessMask != src->srcAccessMask || dst->dstStageMask != src->dstStageMask ||
+        dst->dstAccessMask != src->dstAccessMask || dst->oldLayout != src->oldLayout ||
+        dst->newLayout != src->newLayout)
+        return false;
+
+    VkImageSubresourceRange *a = &dst->subresourceRange;
+    const VkImageSubresourceRange *b = &src->subresourceRange;
+    const bool same_levels = a->baseMipLevel == b->baseMipLevel && a->levelCount == b->levelCount;
+    const bool same_layers =
+        a->baseArrayLayer == b->baseArrayLayer && a->layerCount == b->layerCount;
+
+    if (a->aspectMask == b->aspectMask && same_levels &&
+        a->baseArrayLayer + a->layerCount == b->baseArrayLayer) {
+        a->layerCount += b->layerCount;
+        return true;
+    }
+    if (a->aspectMask == b->aspectMask && same_layers &&
+        a->baseMipLevel + a->levelCount == b->baseMipLevel) {
+        a->levelCount += b->levelCount;
+        return true;
+    }
+    if (same_levels && same_layers) {
+        a->aspectMask |= b->aspectMask;
+        return true;
+    }
 
-    pipeline->depth_info = (VkPipelineDepthStencilStateCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
-    };
+    return false;
+}
 
-    pipeline->color_att = (VkPipelineColorBlendAttachmentState){
-        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-                          VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-    };
+/* Builds the image barriers for the transitions and updates the tracked
+ * states.  The current layout, stage, and access of each subresource are
+ * tracked in the images such that only the necessary barriers, with the
+ * narrowest masks, are built.
+ */
+static inline uint32_t
+vk_build_transition_barriers(struct vk *vk,
+                             const struct vk_transition *transitions,
+                             uint32_t count,
+                             VkImageMemoryBarrier2 *barriers,
+                             uint32_t max_barrier_count)
+{
+    uint32_t barrier_count = 0;
 
-    pipeline->rendering_info = (VkPipelineRenderingCreateInfo){
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
-    };
+    for (uint32_t i = 0; i < count; i++) {
+        const struct vk_transition *t = &transitions[i];
+        struct vk_image *img = t->img;
+
+        VkImageAspectFlags aspects = vk_format_aspect_mask(img->info.format);
+        if (img->state_aspect_count > 1 && vk->vulkan_12_features.separateDepthStencilLayouts &&
+            t->range.aspectMask)
+            aspects = t->range.aspectMask;
+
+        const uint32_t level_count =
+            t->range.levelCount && t->range.levelCount != VK_REMAINING_MIP_LEVELS
+                ? t->range.levelCount
+                : img->info.mipLevels - t->range.baseMipLevel;
+        const uint32_t layer_count =
+            t->range.layerCount && t->range.layerCount != VK_REMAINING_ARRAY_LAYERS
+                ? t->range.layerCount
+                : img->info.arrayLayers - t->range.baseArrayLayer;
+
+        for (uint32_t aspect = 0; aspect < img->state_aspect_count; aspect++) {
+            const VkImageAspectFlags aspect_bit =
+                img->state_aspect_count == 1 ? aspects
+                : aspect == 0                ? VK_IMAGE_ASPECT_DEPTH_BIT
+                                             : VK_IMAGE_ASPECT_STENCIL_BIT;
+            if (!(aspects & aspect_bit))
+                continue;
+
+            for (uint32_t level = t->range.baseMipLevel;
+                 level < t->range.baseMipLevel + level_count; level++) {
+                for (uint32_t layer = t->range.baseArrayLayer;
+                     layer < t->range.baseArrayLayer + layer_count; layer++) {
+                    const uint32_t index =
+                        (aspect * img->info.mipLevels + level) * img->info.arrayLayers + layer;
+                    struct vk_image_state *state = &img->states[index];
+
+                    const bool layout_change = t->discard || state->layout != t->layout;
+                    const bool write = vk_access_writes(t->access);
+                    const bool written = state->write_stage || state->write_access;
+                    const bool synced = !(t->stage & ~state->read_stage) &&
+                                        !(t->access & ~state->read_access);
+                    if (!layout_change && !write && (!written || synced)) {
+                        state->read_stage |= t->stage;
+                        state->read_access |= t->access;
+                        continue;
+                    }
+
+                    /* RAW waits for the last write.  WAR, WAW, and layout
+                     * transitions also wait for the synchronized reads, and
+                     * the last write is already available if there are any.
+                     */
+                    const bool raw = !layout_change && !write;
+                    const VkImageMemoryBarrier2 barrier = {
+                        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                        .srcStageMask =
+                            raw ? state->write_stage : state->write_stage | state->read_stage,
+                        .srcAccessMask = raw || !state->read_stage ? state->write_access : 0,
+                        .dstStageMask = t->stage,
+                        .dstAccessMask = t->access,
+                        .oldLayout = t->discard ? VK_IMAGE_LAYOUT_UNDEFINED : state->layout,
+                        .newLayout = t->layout,
+                        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                        .image = img->img,
+                        .subresourceRange = {
+                            .aspectMask = aspect_bit,
+                            .baseMipLevel = level,
+                            .levelCount = 1,
+                            .baseArrayLayer = layer,
+                            .layerCount = 1,
+                        },
+                    };
+
+                    if (raw) {
+                        state->read_stage |= t->stage;
+                        state->read_access |= t->access;
+                    } else {
+                        *state = (struct vk_image_state){
+                            .layout = t->layout,
+                            .write_stage = t->stage,
+                            .write_access = vk_access_writes(t->access),
+                            .read_stage = write ? 0 : t->stage,
+                            .read_access = write ? 0 : t->access,
+                        };
+                    }
+
+                    bool merged = false;
+                    for (uint32_t j = 0; j < barrier_count && !merged; j++)
+                        merged = vk_merge_image_barrier(&barriers[j], &barrier);
+                    if (merged)
+                        continue;
+
+                    if (barrier_count >= max_barrier_count)
+                        vk_die("too many image barriers");
+                    barriers[barrier_count++] = barrier;
+                }
+            }
+        }
+    }
 
-    pipeline->fb = fb;
+    return barrier_count;
 }
 
+/* Transitions images to the specified layouts and usages.  All barriers are
+ * batched into a single pipeline barrier.
+ */
 static inline void
-vk_compile_pipeline(struct vk *vk, struct vk_pipeline *pipeline)
+vk_cmd_transition(struct vk *vk,
+                  VkCommandBuffer cmd,
+                  const struct vk_transition *transitions,
+                  uint32_t count)
 {
-    if (pipeline->stage_count == 1 && pipeline->stages[0].stage == VK_SHADER_STAGE_COMPUTE_BIT) {
-        const VkComputePipelineCreateInfo compute_info = {
-            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-            .stage = pipeline->stages[0],
-            .layout = pipeline->pipeline_layout,
-        };
-        vk->result = vk->CreateComputePipelines(vk->dev, VK_NULL_HANDLE, 1, &compute_info, NULL,
-                                                &pipeline->pipeline);
-        vk_check(vk, "failed to create compute pipeline");
-        return;
-    }
+    VkImageMemoryBarrier2 barriers[16];
+    const uint32_t barrier_count =
+        vk_build_transition_barriers(vk, transitions, count, barriers, ARRAY_SIZE(barriers));
+    if (barrier_count)
+        vk_cmd_barriers(vk, cmd, NULL, barriers, barrier_count);
+}
 
-    const VkPipelineVertexInputStateCreateInfo vi_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = pipeline->vi_attr_count ? 1 : 0,
-        .pVertexBindingDescriptions = &pipeline->vi_binding,
-        .vertexAttributeDescriptionCount = pipeline->vi_attr_count,
-        .pVertexAttributeDescriptions = pipeline->vi_attrs,
-    };
+static inline struct vk_graph *
+vk_create_graph(struct vk *vk)
+{
+    struct vk_graph *graph = calloc(1, sizeof(*graph));
+    if (!graph)
+        vk_die("failed to alloc graph");
 
-    const VkPipelineViewportStateCreateInfo vp_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-        .viewportCount = 1,
-        .pViewports = &pipeline->viewport,
-        .scissorCount = 1,
-        .pScissors = &pipeline->scissor,
-    };
+    return graph;
+}
 
-    const VkPipelineColorBlendStateCreateInfo color_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        .attachmentCount = 1,
-        .pAttachments = &pipeline->color_att,
+static inline void
+vk_destroy_graph(struct vk *vk, struct vk_graph *graph)
+{
+    free(graph);
+}
+
+static inline struct vk_graph_pass *
+vk_add_graph_pass(struct vk *vk, struct vk_graph *graph, vk_graph_record_func record, void *data)
+{
+    if (graph->pass_count >= ARRAY_SIZE(graph->passes))
+        vk_die("too many graph passes");
+
+    struct vk_graph_pass *pass = &graph->passes[graph->pass_count++];
+    *pass = (struct vk_graph_pass){
+        .record = record,
+        .data = data,
     };
 
-    const VkGraphicsPipelineCreateInfo pipeline_info = {
-        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .pNext = pipeline->fb ? NULL : &pipeline->rendering_info,
-        .stageCount = pipeline->stage_count,
-        .pStages = pipeline->stages,
-        .pVertexInputState = &vi_info,
-        .pInputAssemblyState = &pipeline->ia_info,
-        .pTessellationState = &pipeline->tess_info,
-        .pViewportState = &vp_info,
-        .pRasterizationState = &pipeline->rast_info,
-        .pMultisampleState = &pipeline->msaa_info,
-        .pDepthStencilState = &pipeline->depth_info,
-        .pColorBlendState = &color_info,
-        .layout = pipeline->pipeline_layout,
-        .renderPass = pipeline->fb ? pipeline->fb->pass : VK_NULL_HANDLE,
+    return pass;
+}
+
+static inline void
+vk_add_graph_pass_image(struct vk *vk,
+                        struct vk_graph_pass *pass,
+                        const struct vk_transition *use)
+{
+    if (pass->image_count >= ARRAY_SIZE(pass->images))
+        vk_die("too many graph pass images");
+    pass->images[pass->image_count++] = *use;
+}
+
+static inline void
+vk_add_graph_pass_buffer(struct vk *vk,
+                         struct vk_graph_pass *pass,
+                         struct vk_buffer *buf,
+                         VkPipelineStageFlags2 stage,
+                         VkAccessFlags2 access)
+{
+    if (pass->buffer_count >= ARRAY_SIZE(pass->buffers))
+        vk_die("too many graph pass buffers");
+    pass->buffers[pass->buffer_count++] = (struct vk_graph_buffer_use){
+        .buf = buf,
+        .stage = stage,
+        .access = access,
     };
+}
 
-    vk->result = vk->CreateGraphicsPipelines(vk->dev, VK_NULL_HANDLE, 1, &pipeline_info, NULL,
-                                             &pipeline->pipeline);
-    vk_check(vk, "failed to create graphics pipeline");
+static inline void
+vk_add_graph_image_output(struct vk *vk, struct vk_graph *graph, const struct vk_transition *use)
+{
+    if (graph->image_output_count >= ARRAY_SIZE(graph->image_outputs))
+        vk_die("too many graph image outputs");
+    graph->image_outputs[graph->image_output_count++] = *use;
 }
 
 static inline void
-vk_destroy_pipeline(struct vk *vk, struct vk_pipeline *pipeline)
+vk_add_graph_buffer_output(struct vk *vk,
+                           struct vk_graph *graph,
+                           struct vk_buffer *buf,
+                           VkPipelineStageFlags2 stage,
+                           VkAccessFlags2 access)
 {
-    for (uint32_t i = 0; i < pipeline->stage_count; i++)
-        vk->DestroyShaderModule(vk->dev, pipeline->stages[i].module, NULL);
+    if (graph->buffer_output_count >= ARRAY_SIZE(graph->buffer_outputs))
+        vk_die("too many graph buffer outputs");
+    graph->buffer_outputs[graph->buffer_output_count++] = (struct vk_graph_buffer_use){
+        .buf = buf,
+        .stage = stage,
+        .access = access,
+    };
+}
 
-    for (uint32_t i = 0; i < pipeline->set_layout_count; i++)
-        vk->DestroyDescriptorSetLayout(vk->dev, pipeline->set_layouts[i], NULL);
+static inline bool
+vk_graph_passes_conflict(const struct vk_graph_pass *a, const struct vk_graph_pass *b)
+{
+    for (uint32_t i = 0; i < a->image_count; i++) {
+        const struct vk_transition *x = &a->images[i];
+        for (uint32_t j = 0; j < b->image_count; j++) {
+            const struct vk_transition *y = &b->images[j];
+            if (x->img == y->img &&
+                (x->discard || y->discard || x->layout != y->layout ||
+                 vk_access_writes(x->access) || vk_access_writes(y->access)))
+                return true;
+        }
+    }
 
-    vk->DestroyPipelineLayout(vk->dev, pipeline->pipeline_layout, NULL);
+    for (uint32_t i = 0; i < a->buffer_count; i++) {
+        const struct vk_graph_buffer_use *x = &a->buffers[i];
+        for (uint32_t j = 0; j < b->buffer_count; j++) {
+            const struct vk_graph_buffer_use *y = &b->buffers[j];
+            if (x->buf == y->buf && (vk_access_writes(x->access) || vk_access_writes(y->access)))
+                return true;
+        }
+    }
 
-    vk->DestroyPipeline(vk->dev, pipeline->pipeline, NULL);
+    return false;
+}
 
-    free(pipeline);
+static inline bool
+vk_graph_find_resource(const void *const *resources, uint32_t count, const void *res)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (resources[i] == res)
+            return true;
+    }
+    return false;
 }
 
-static inline struct vk_descriptor_set *
-vk_create_descriptor_set(struct vk *vk, VkDescriptorSetLayout layout)
+/* Culls the passes whose writes are never consumed, by a later pass or by
+ * the graph outputs, and assigns dependency levels to the remaining passes.
+ * Passes on the same level are independent and share a pipeline barrier.
+ */
+static inline uint32_t
+vk_compile_graph(struct vk *vk, struct vk_graph *graph)
 {
-    struct vk_descriptor_set *set = calloc(1, sizeof(*set));
-    if (!set)
-        vk_die("failed to alloc set");
+    const void *needed[32];
+    uint32_t needed_count = 0;
+
+    for (uint32_t i = 0; i < graph->image_output_count; i++) {
+        if (!vk_graph_find_resource(needed, needed_count, graph->image_outputs[i].img))
+            needed[needed_count++] = graph->image_outputs[i].img;
+    }
+    for (uint32_t i = 0; i < graph->buffer_output_count; i++)
+        needed[needed_count++] = graph->buffer_outputs[i].buf;
+
+    for (uint32_t i = graph->pass_count; i-- > 0;) {
+        struct vk_graph_pass *pass = &graph->passes[i];
+
+        pass->live = false;
+        for (uint32_t j = 0; j < pass->image_count; j++) {
+            const struct vk_transition *use = &pass->images[j];
+            if ((use->discard || vk_access_writes(use->access)) &&
+                vk_graph_find_resource(needed, needed_count, use->img))
+                pass->live = true;
+        }
+        for (uint32_t j = 0; j < pass->buffer_count; j++) {
+            const struct vk_graph_buffer_use *use = &pass->buffers[j];
+            if (vk_access_writes(use->access) &&
+                vk_graph_find_resource(needed, needed_count, use->buf))
+                pass->live = true;
+        }
+        if (!pass->live)
+            continue;
+
+        /* a discarded image does not need the earlier writes */
+        for (uint32_t j = 0; j < pass->image_count; j++) {
+            const struct vk_transition *use = &pass->images[j];
+            for (uint32_t k = 0; use->discard && k < needed_count; k++) {
+                if (needed[k] == use->img) {
+                    needed[k] = needed[--needed_count];
+                    break;
+                }
+            }
+        }
+        for (uint32_t j = 0; j < pass->image_count; j++) {
+            const struct vk_transition *use = &pass->images[j];
+            if (!use->discard && !vk_graph_find_resource(needed, needed_count, use->img)) {
+                if (needed_count >= ARRAY_SIZE(needed))
+                    vk_die("too many graph resources");
+                needed[needed_count++] = use->img;
+            }
+        }
+        for (uint32_t j = 0; j < pass->buffer_count; j++) {
+            const struct vk_graph_buffer_use *use = &pass->buffers[j];
+            if (!vk_graph_find_resource(needed, needed_count, use->buf)) {
+                if (needed_count >= ARRAY_SIZE(needed))
+                    vk_die("too many graph resources");
+                needed[needed_count++] = use->buf;
+            }
+        }
+    }
 
-    const VkDescriptorSetAllocateInfo set_info = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool = vk->desc_pool,
-        .descriptorSetCount = 1,
-        .pSetLayouts = &layout,
-    };
+    uint32_t level_count = 0;
+    for (uint32_t i = 0; i < graph->pass_count; i++) {
+        struct vk_graph_pass *pass = &graph->passes[i];
+        if (!pass->live)
+            continue;
+
+        pass->level = 0;
+        for (uint32_t j = 0; j < i; j++) {
+            const struct vk_graph_pass *prev = &graph->passes[j];
+            if (prev->live && prev->level >= pass->level && vk_graph_passes_conflict(prev, pass))
+                pass->level = prev->level + 1;
+        }
 
-    vk->result = vk->AllocateDescriptorSets(vk->dev, &set_info, &set->set);
-    vk_check(vk, "failed to allocate descriptor set");
+        if (level_count < pass->level + 1)
+            level_count = pass->level + 1;
+    }
 
-    return set;
+    return level_count;
 }
 
+/* Adds the dependency of the buffer use on all live passes before the level
+ * to the memory barrier.
+ */
 static inline void
-vk_write_descriptor_set_buffer(struct vk *vk,
-                               struct vk_descriptor_set *set,
-                               VkDescriptorType type,
-                               const struct vk_buffer *buf,
-                               VkDeviceSize size)
+vk_graph_add_buffer_barrier(const struct vk_graph *graph,
+                            uint32_t level,
+                            const struct vk_graph_buffer_use *use,
+                            VkMemoryBarrier2 *barrier)
 {
-    const VkDescriptorBufferInfo buf_info = {
-        .buffer = buf->buf,
-        .offset = 0,
-        .range = size,
-    };
-    const VkWriteDescriptorSet write_info = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = set->set,
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = type,
-        .pBufferInfo = &buf_info,
-    };
-
-    vk->UpdateDescriptorSets(vk->dev, 1, &write_info, 0, NULL);
+    for (uint32_t i = 0; i < graph->pass_count; i++) {
+        const struct vk_graph_pass *pass = &graph->passes[i];
+        if (!pass->live || pass->level >= level)
+            continue;
+
+        for (uint32_t j = 0; j < pass->buffer_count; j++) {
+            const struct vk_graph_buffer_use *prev = &pass->buffers[j];
+            if (prev->buf != use->buf)
+                continue;
+
+            if (vk_access_writes(prev->access)) {
+                barrier->srcStageMask |= prev->stage;
+                barrier->srcAccessMask |= vk_access_writes(prev->access);
+                barrier->dstStageMask |= use->stage;
+                barrier->dstAccessMask |= use->access;
+            } else if (vk_access_writes(use->access)) {
+                barrier->srcStageMask |= prev->stage;
+                barrier->dstStageMask |= use->stage;
+            }
+        }
+    }
 }
 
 static inline void
-vk_write_descriptor_set_image(struct vk *vk,
-                              struct vk_descriptor_set *set,
-                              const struct vk_image *img)
+vk_graph_add_image_transition(struct vk_transition *transitions,
+                              uint32_t *count,
+                              uint32_t max_count,
+                              const struct vk_transition *use)
 {
-    const VkDescriptorImageInfo img_info = {
-        .sampler = img->sampler,
-        .imageView = img->sample_view,
-        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-    };
-    const VkWriteDescriptorSet write_info = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .dstSet = set->set,
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .pImageInfo = &img_info,
-    };
+    /* merge the uses of the same subresources by independent passes */
+    for (uint32_t i = 0; i < *count; i++) {
+        struct vk_transition *t = &transitions[i];
+        if (t->img == use->img && t->layout == use->layout &&
+            !memcmp(&t->range, &use->range, sizeof(t->range))) {
+            t->discard &= use->discard;
+            t->stage |= use->stage;
+            t->access |= use->access;
+            return;
+        }
+    }
 
-    vk->UpdateDescriptorSets(vk->dev, 1, &write_info, 0, NULL);
+    if (*count >= max_count)
+        vk_die("too many graph transitions");
+    transitions[(*count)++] = *use;
 }
 
 static inline void
-vk_destroy_descriptor_set(struct vk *vk, struct vk_descriptor_set *set)
+vk_graph_cmd_barrier(struct vk *vk,
+                     VkCommandBuffer cmd,
+                     const struct vk_transition *transitions,
+                     uint32_t transition_count,
+                     const VkMemoryBarrier2 *mem_barrier)
 {
-    free(set);
+    VkImageMemoryBarrier2 barriers[16];
+    const uint32_t barrier_count = vk_build_transition_barriers(
+        vk, transitions, transition_count, barriers, ARRAY_SIZE(barriers));
+    const bool has_mem_barrier = mem_barrier->srcStageMask || mem_barrier->dstStageMask;
+
+    if (barrier_count || has_mem_barrier)
+        vk_cmd_barriers(vk, cmd, has_mem_barrier ? mem_barrier : NULL, barriers, barrier_count);
 }
 
-static inline struct vk_event *
-vk_create_event(struct vk *vk)
+/* Records the live passes into the command buffer.  Passes are recorded
+ * level by level, and each level is preceded by one pipeline barrier that
+ * covers all of its passes.  A final pipeline barrier makes the outputs
+ * available to their declared uses.
+ */
+static inline void
+vk_record_graph(struct vk *vk, struct vk_graph *graph, VkCommandBuffer cmd)
 {
-    struct vk_event *ev = calloc(1, sizeof(*ev));
-    if (!ev)
-        vk_die("failed to alloc event");
+    const uint32_t level_count = vk_compile_graph(vk, graph);
 
-    const VkEventCreateInfo info = {
-        .sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO,
-    };
+    for (uint32_t level = 0; level <= level_count; level++) {
+        struct vk_transition transitions[16];
+        uint32_t transition_count = 0;
+        VkMemoryBarrier2 mem_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        };
 
-    vk->result = vk->CreateEvent(vk->dev, &info, NULL, &ev->event);
-    vk_check(vk, "failed to create event");
+        if (level < level_count) {
+            for (uint32_t i = 0; i < graph->pass_count; i++) {
+                const struct vk_graph_pass *pass = &graph->passes[i];
+                if (!pass->live || pass->level != level)
+                    continue;
 
-    return ev;
-}
+                for (uint32_t j = 0; j < pass->image_count; j++) {
+                    vk_graph_add_image_transition(transitions, &transition_count,
+                                                  ARRAY_SIZE(transitions), &pass->images[j]);
+                }
+                for (uint32_t j = 0; j < pass->buffer_count; j++)
+                    vk_graph_add_buffer_barrier(graph, level, &pass->buffers[j], &mem_barrier);
+            }
+        } else {
+            for (uint32_t i = 0; i < graph->image_output_count; i++) {
+                vk_graph_add_image_transition(transitions, &transition_count,
+                                              ARRAY_SIZE(transitions), &graph->image_outputs[i]);
+            }
+            for (uint32_t i = 0; i < graph->buffer_output_count; i++) {
+                vk_graph_add_buffer_barrier(graph, level, &graph->buffer_outputs[i],
+                                            &mem_barrier);
+            }
+        }
 
-static inline void
-vk_destroy_event(struct vk *vk, struct vk_event *ev)
-{
-    vk->DestroyEvent(vk->dev, ev->event, NULL);
-    free(ev);
+        vk_graph_cmd_barrier(vk, cmd, transitions, transition_count, &mem_barrier);
+
+        for (uint32_t i = 0; i < graph->pass_count; i++) {
+            const struct vk_graph_pass *pass = &graph->passes[i];
+            if (pass->live && pass->level == level)
+                pass->record(vk, cmd, pass->data);
+        }
+    }
 }
 
-static inline struct vk_query *
-vk_create_query(struct vk *vk, VkQueryType type, uint32_t count)
+static inline struct vk_image_hash *
+vk_create_image_hash(struct vk *vk, uint32_t width, uint32_t height)
 {
-    struct vk_query *query = calloc(1, sizeof(*query));
-    if (!query)
-        vk_die("failed to alloc query");
-
-    const VkQueryPoolCreateInfo info = {
-        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-        .queryType = type,
-        .queryCount = count,
+    static const uint32_t image_hash_cs[] = {
+#include "vkutil_image_hash.comp.inc"
     };
 
-    vk->result = vk->CreateQueryPool(vk->dev, &info, NULL, &query->pool);
-    vk_check(vk, "failed to create query");
-
-    return query;
+    struct vk_image_hash *hash = calloc(1, sizeof(*hash));
+    if (!hash)
+        vk_die("failed to alloc image hash");
+
+    hash->width = width;
+    hash->height = height;
+    hash->tiles_x = (width + VKUTIL_IMAGE_HASH_TILE_SIZE - 1) / VKUTIL_IMAGE_HASH_TILE_SIZE;
+    hash->tiles_y = (height + VKUTIL_IMAGE_HASH_TILE_SIZE - 1) / VKUTIL_IMAGE_HASH_TILE_SIZE;
+
+    hash->pipeline = vk_create_pipeline(vk);
+    vk_add_pipeline_shader(vk, hash->pipeline, VK_SHADER_STAGE_COMPUTE_BIT, image_hash_cs,
+                           sizeof(image_hash_cs));
+    for (uint32_t i = 0; i < 2; i++) {
+        vk_add_pipeline_set_layout(vk, hash->pipeline, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+                                   VK_SHADER_STAGE_COMPUTE_BIT, NULL);
+    }
+    for (uint32_t i = 0; i < 2; i++) {
+        vk_add_pipeline_set_layout(vk, hash->pipeline, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                                   VK_SHADER_STAGE_COMPUTE_BIT, NULL);
+    }
+    vk_set_pipeline_push_const(vk, hash->pipeline, VK_SHADER_STAGE_COMPUTE_BIT,
+                               sizeof(uint32_t));
+    vk_setup_pipeline(vk, hash->pipeline, NULL);
+    vk_compile_pipeline(vk, hash->pipeline);
+
+    hash->result =
+        vk_create_buffer(vk, sizeof(uint32_t[2]), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    hash->tiles = vk_create_buffer_with_flags(
+        vk, sizeof(uint32_t[2]) * hash->tiles_x * hash->tiles_y,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    /* the image sets are written by vk_hash_image */
+    hash->img_set = vk_create_descriptor_set(vk, hash->pipeline->set_layouts[0]);
+    hash->ref_set = vk_create_descriptor_set(vk, hash->pipeline->set_layouts[1]);
+    hash->result_set = vk_create_descriptor_set(vk, hash->pipeline->set_layouts[2]);
+    vk_write_descriptor_set_buffer(vk, hash->result_set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                   hash->result, VK_WHOLE_SIZE);
+    hash->tiles_set = vk_create_descriptor_set(vk, hash->pipeline->set_layouts[3]);
+    vk_write_descriptor_set_buffer(vk, hash->tiles_set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                   hash->tiles, VK_WHOLE_SIZE);
+
+    hash->query = vk_create_query(vk, VK_QUERY_TYPE_TIMESTAMP, 2);
+
+    return hash;
 }
 
 static inline void
-vk_destroy_query(struct vk *vk, struct vk_query *query)
+vk_destroy_image_hash(struct vk *vk, struct vk_image_hash *hash)
 {
-    vk->DestroyQueryPool(vk->dev, query->pool, NULL);
-    free(query);
+    vk_destroy_query(vk, hash->query);
+    vk_destroy_descriptor_set(vk, hash->tiles_set);
+    vk_destroy_descriptor_set(vk, hash->result_set);
+    vk_destroy_descriptor_set(vk, hash->ref_set);
+    vk_destroy_descriptor_set(vk, hash->img_set);
+    vk_destroy_buffer(vk, hash->tiles);
+    vk_destroy_buffer(vk, hash->result);
+    vk_destroy_pipeline(vk, hash->pipeline);
+    free(hash);
 }
 
-static inline VkCommandBuffer
-vk_begin_cmd(struct vk *vk)
+/* Hashes img and, when ref is not NULL, counts the pixels that differ from
+ * ref.  Both images must be R8G8B8A8_UNORM with storage usage and a sample
+ * view, and they are transitioned to the general layout.  Only the hash and
+ * the count are read back; see vk_read_image_hash_tiles for the tiles.
+ */
+static inline void
+vk_hash_image(struct vk *vk,
+              struct vk_image_hash *hash,
+              struct vk_image *img,
+              struct vk_image *ref,
+              uint32_t *out_hash,
+              uint32_t *out_mismatch_count)
 {
-    VkCommandBuffer *cmd = &vk->submit.cmds[vk->submit.next];
-    VkFence *fence = &vk->submit.fences[vk->submit.next];
+    struct vk_image *imgs[2] = { img, ref ? ref : img };
+    struct vk_transition transitions[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        if (imgs[i]->info.format != VK_FORMAT_R8G8B8A8_UNORM ||
+            imgs[i]->info.extent.width != hash->width ||
+            imgs[i]->info.extent.height != hash->height)
+            vk_die("image cannot be hashed");
+
+        transitions[i] = (struct vk_transition){
+            .img = imgs[i],
+            .layout = VK_IMAGE_LAYOUT_GENERAL,
+            .stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+        };
+    }
 
-    /* reuse or allocate */
-    if (*cmd) {
-        vk->result = vk->WaitForFences(vk->dev, 1, fence, true, UINT64_MAX);
-        vk_check(vk, "failed to wait fence");
+    /* an unused ref is still bound, but the shader does not read it */
+    vk_write_descriptor_set_storage_image(vk, hash->img_set, imgs[0]);
+    vk_write_descriptor_set_storage_image(vk, hash->ref_set, imgs[1]);
 
-        vk->result = vk->ResetCommandBuffer(*cmd, 0);
-        vk_check(vk, "failed to reset command buffer");
+    uint32_t *result = hash->result->mem_ptr;
+    result[0] = 0;
+    result[1] = 0;
 
-        vk->result = vk->ResetFences(vk->dev, 1, fence);
-        vk_check(vk, "failed to reset fence");
-    } else {
-        const VkCommandBufferAllocateInfo alloc_info = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .commandPool = vk->cmd_pool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1,
-        };
+    vk->ResetQueryPool(vk->dev, hash->query->pool, 0, 2);
 
-        vk->result = vk->AllocateCommandBuffers(vk->dev, &alloc_info, cmd);
-        vk_check(vk, "failed to allocate command buffer");
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+    vk_cmd_transition(vk, cmd, transitions, ref ? 2 : 1);
 
-        const VkFenceCreateInfo fence_info = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        };
-        vk->result = vk->CreateFence(vk->dev, &fence_info, NULL, fence);
-        vk_check(vk, "failed to create fence");
-    }
+    vk->CmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, hash->query->pool, 0);
 
-    const VkCommandBufferBeginInfo begin_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, hash->pipeline->pipeline);
+    const VkDescriptorSet sets[] = {
+        hash->img_set->set,
+        hash->ref_set->set,
+        hash->result_set->set,
+        hash->tiles_set->set,
     };
-    vk->result = vk->BeginCommandBuffer(*cmd, &begin_info);
-    vk_check(vk, "failed to begin command buffer");
+    vk->CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              hash->pipeline->pipeline_layout, 0, ARRAY_SIZE(sets), sets, 0,
+                              NULL);
+    const uint32_t compare = ref != NULL;
+    vk->CmdPushConstants(cmd, hash->pipeline->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(compare), &compare);
+    vk->CmdDispatch(cmd, hash->tiles_x, hash->tiles_y, 1);
+
+    vk->CmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, hash->query->pool, 1);
+
+    const VkMemoryBarrier2 mem_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+        .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+    };
+    vk_cmd_barriers(vk, cmd, &mem_barrier, NULL, 0);
 
-    return *cmd;
+    vk_end_cmd(vk);
+    vk_wait(vk);
+
+    uint64_t ts[2];
+    vk->result = vk->GetQueryPoolResults(vk->dev, hash->query->pool, 0, 2, sizeof(ts), ts,
+                                         sizeof(ts[0]),
+                                         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    vk_check(vk, "failed to get query results");
+
+    const uint32_t valid_bits = vk->graphics_queue->family_props.timestampValidBits;
+    const uint64_t mask = valid_bits < 64 ? (1ull << valid_bits) - 1 : UINT64_MAX;
+    hash->duration = (uint64_t)((double)((ts[1] - ts[0]) & mask) *
+                                vk->props.properties.limits.timestampPeriod);
+
+    *out_hash = result[0];
+    if (out_mismatch_count)
+        *out_mismatch_count = result[1];
 }
 
+/* Copies the per-tile hashes and mismatch counts of the last vk_hash_image
+ * out of device memory.  tiles must have room for tiles_x * tiles_y pairs.
+ */
 static inline void
-vk_end_cmd(struct vk *vk)
+vk_read_image_hash_tiles(struct vk *vk, struct vk_image_hash *hash, uint32_t (*tiles)[2])
 {
-    VkCommandBuffer cmd = vk->submit.cmds[vk->submit.next];
-    VkFence fence = vk->submit.fences[vk->submit.next];
+    const VkDeviceSize size = sizeof(uint32_t[2]) * hash->tiles_x * hash->tiles_y;
+    struct vk_buffer *staging = vk_create_buffer(vk, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+
+    /* the dispatch of vk_hash_image only made the tiles visible to the host */
+    const VkMemoryBarrier2 shader_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+    };
+    vk_cmd_barriers(vk, cmd, &shader_barrier, NULL, 0);
 
-    /* increment */
-    vk->submit.next = (vk->submit.next + 1) % vk->submit.count;
+    const VkBufferCopy region = {
+        .size = size,
+    };
+    vk->CmdCopyBuffer(cmd, hash->tiles->buf, staging->buf, 1, &region);
+
+    const VkMemoryBarrier2 copy_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+        .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+    };
+    vk_cmd_barriers(vk, cmd, &copy_barrier, NULL, 0);
 
-    vk->result = vk->EndCommandBuffer(cmd);
-    vk_check(vk, "failed to end command buffer");
+    vk_end_cmd(vk);
+    vk_wait(vk);
 
-    const VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &cmd,
+    memcpy(tiles, staging->mem_ptr, size);
+    vk_destroy_buffer(vk, staging);
+}
+
+/* Creates a surface that is not backed by a display.  VK_KHR_surface and
+ * VK_EXT_headless_surface must be enabled.
+ */
+static inline VkSurfaceKHR
+vk_create_headless_surface(struct vk *vk)
+{
+    const VkHeadlessSurfaceCreateInfoEXT info = {
+        .sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT,
     };
-    vk->result = vk->QueueSubmit(vk->queue, 1, &submit_info, fence);
-    vk_check(vk, "failed to submit command buffer");
+
+    VkSurfaceKHR surf;
+    vk->result = vk->CreateHeadlessSurfaceEXT(vk->instance, &info, NULL, &surf);
+    vk_check(vk, "failed to create headless surface");
+
+    return surf;
 }
 
 static inline void
-vk_wait(struct vk *vk)
+vk_query_swapchain_caps(struct vk *vk, struct vk_swapchain *swapchain)
 {
-    vk->result = vk->QueueWaitIdle(vk->queue);
-    vk_check(vk, "failed to wait queue");
+    vk->result = vk->GetPhysicalDeviceSurfaceCapabilitiesKHR(
+        vk->physical_dev, swapchain->info.surface, &swapchain->caps);
+    vk_check(vk, "failed to get surface caps");
 }
 
 static inline void
-vk_validate_swapchain(struct vk *vk, const struct vk_swapchain *swapchain)
+vk_validate_swapchain_surface(struct vk *vk, const struct vk_swapchain *swapchain)
 {
-    if (!vk->KHR_swapchain)
-        vk_die("VK_KHR_swapchain is disabled");
-
     /* check support */
     VkBool32 supported;
-    vk->result = vk->GetPhysicalDeviceSurfaceSupportKHR(vk->physical_dev, vk->queue_family_index,
-                                                        swapchain->info.surface, &supported);
+    vk->result = vk->GetPhysicalDeviceSurfaceSupportKHR(
+        vk->physical_dev, vk->graphics_queue->family_index, swapchain->info.surface, &supported);
     vk_check(vk, "failed to get surface support");
     if (!supported)
         vk_die("surface is unsupported");
 
-    /* check caps */
-    VkSurfaceCapabilitiesKHR caps;
-    vk->result = vk->GetPhysicalDeviceSurfaceCapabilitiesKHR(vk->physical_dev,
-                                                             swapchain->info.surface, &caps);
-    vk_check(vk, "failed to get surface caps");
-    if (swapchain->info.imageExtent.width < caps.minImageExtent.width ||
-        swapchain->info.imageExtent.width > caps.maxImageExtent.width ||
-        swapchain->info.imageExtent.height < caps.minImageExtent.height ||
-        swapchain->info.imageExtent.height > caps.maxImageExtent.height) {
-        vk_die("bad swapchain extent: req %dx%d min %dx%d max %dx%d",
-               swapchain->info.imageExtent.width, swapchain->info.imageExtent.height,
-               caps.minImageExtent.width, caps.minImageExtent.height, caps.maxImageExtent.width,
-               caps.maxImageExtent.height);
-    }
-
-    if (swapchain->info.minImageCount < caps.minImageCount ||
-        swapchain->info.minImageCount < caps.maxImageCount)
-        vk_die("swapchain min image count %d is invalid", swapchain->info.minImageCount);
-
     /* check format */
     VkSurfaceFormatKHR fmts[8];
     uint32_t count = ARRAY_SIZE(fmts);
@@ -1891,6 +6268,103 @@ vk_validate_swapchain(struct vk *vk, const struct vk_swapchain *swapchain)
         vk_die("%d is invalid present mode", swapchain->info.presentMode);
 }
 
+static inline bool
+vk_swapchain_extent_in_caps(const struct vk_swapchain *swapchain)
+{
+    const VkExtent2D *extent = &swapchain->info.imageExtent;
+    const VkSurfaceCapabilitiesKHR *caps = &swapchain->caps;
+    return extent->width >= caps->minImageExtent.width &&
+           extent->width <= caps->maxImageExtent.width &&
+           extent->height >= caps->minImageExtent.height &&
+           extent->height <= caps->maxImageExtent.height;
+}
+
+static inline void
+vk_validate_swapchain(struct vk *vk, struct vk_swapchain *swapchain)
+{
+    if (!vk->KHR_swapchain)
+        vk_die("VK_KHR_swapchain is disabled");
+
+    /* support, formats, and present modes do not change */
+    if (swapchain->swapchain == VK_NULL_HANDLE)
+        vk_validate_swapchain_surface(vk, swapchain);
+
+    /* check caps */
+    if (!vk_swapchain_extent_in_caps(swapchain))
+        vk_query_swapchain_caps(vk, swapchain);
+
+    const VkSurfaceCapabilitiesKHR *caps = &swapchain->caps;
+    if (!vk_swapchain_extent_in_caps(swapchain)) {
+        vk_die("bad swapchain extent: req %dx%d min %dx%d max %dx%d",
+               swapchain->info.imageExtent.width, swapchain->info.imageExtent.height,
+               caps->minImageExtent.width, caps->minImageExtent.height,
+               caps->maxImageExtent.width, caps->maxImageExtent.height);
+    }
+
+    if (swapchain->info.minImageCount < caps->minImageCount ||
+        (caps->maxImageCount && swapchain->info.minImageCount > caps->maxImageCount))
+        vk_die("swapchain min image count %d is invalid", swapchain->info.minImageCount);
+}
+
+/* Destroys retired swapchains that are no longer used by pending presents.
+ * When wait is true, all of them are destroyed after waiting for the graphics
+ * queue.
+ */
+static inline void
+vk_collect_retired_swapchains(struct vk *vk, struct vk_swapchain *swapchain, bool wait)
+{
+    if (!swapchain->retired_count)
+        return;
+
+    uint64_t completed;
+    if (wait) {
+        vk_lock_queues(vk);
+        vk->result = vk->QueueWaitIdle(vk->graphics_queue->queue);
+        vk_unlock_queues(vk);
+        vk_check(vk, "failed to wait for graphics queue");
+        completed = UINT64_MAX;
+    } else {
+        vk->result = vk->GetSemaphoreCounterValue(vk->dev, vk->graphics_queue->submit.timeline,
+                                                  &completed);
+        vk_check(vk, "failed to get timeline value");
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < swapchain->retired_count; i++) {
+        struct vk_swapchain_retired *retired = &swapchain->retired[i];
+        if (retired->point > completed) {
+            swapchain->retired[count++] = *retired;
+            continue;
+        }
+
+        vk->DestroySwapchainKHR(vk->dev, retired->swapchain, NULL);
+        for (uint32_t j = 0; j < retired->present_sem_count; j++)
+            vk->DestroySemaphore(vk->dev, retired->present_sems[j], NULL);
+        free(retired->present_sems);
+    }
+    swapchain->retired_count = count;
+}
+
+/* Retires an old swapchain along with the current present semaphores.
+ * Presents to it are queued before the next submission to the graphics queue,
+ * which is used to tell when they are done.
+ */
+static inline void
+vk_retire_swapchain(struct vk *vk, struct vk_swapchain *swapchain, VkSwapchainKHR old)
+{
+    vk_collect_retired_swapchains(vk, swapchain, false);
+    if (swapchain->retired_count == ARRAY_SIZE(swapchain->retired))
+        vk_collect_retired_swapchains(vk, swapchain, true);
+
+    swapchain->retired[swapchain->retired_count++] = (struct vk_swapchain_retired){
+        .swapchain = old,
+        .present_sems = swapchain->present_sems,
+        .present_sem_count = swapchain->img_count,
+        .point = vk->graphics_queue->submit.point + 1,
+    };
+    swapchain->present_sems = NULL;
+}
+
 static inline void
 vk_recreate_swapchain(struct vk *vk,
                       struct vk_swapchain *swapchain,
@@ -1908,59 +6382,80 @@ vk_recreate_swapchain(struct vk *vk,
     vk->result = vk->CreateSwapchainKHR(vk->dev, &swapchain->info, NULL, &swapchain->swapchain);
     vk_check(vk, "failed to create swapchain");
 
+    /* the old swapchain is destroyed once pending presents are done */
     if (swapchain->info.oldSwapchain != VK_NULL_HANDLE) {
-        vk->DestroySwapchainKHR(vk->dev, swapchain->info.oldSwapchain, NULL);
-        free(swapchain->img_handles);
-        free(swapchain->imgs);
+        vk_retire_swapchain(vk, swapchain, swapchain->info.oldSwapchain);
+        swapchain->info.oldSwapchain = VK_NULL_HANDLE;
+
+        for (uint32_t i = 0; i < swapchain->img_count; i++)
+            free(swapchain->imgs[i].states);
     }
 
-    vk->result =
-        vk->GetSwapchainImagesKHR(vk->dev, swapchain->swapchain, &swapchain->img_count, NULL);
+    uint32_t img_count;
+    vk->result = vk->GetSwapchainImagesKHR(vk->dev, swapchain->swapchain, &img_count, NULL);
     vk_check(vk, "failed to get swapchain image count");
 
-    swapchain->img_handles = calloc(swapchain->img_count, sizeof(*swapchain->img_handles));
-    swapchain->imgs = calloc(swapchain->img_count, sizeof(*swapchain->imgs));
-    if (!swapchain->img_handles || !swapchain->imgs)
-        vk_die("failed to alloc swapchain imgs");
+    /* reuse the arrays when the image count is unchanged */
+    if (img_count != swapchain->img_count) {
+        free(swapchain->img_handles);
+        free(swapchain->imgs);
+        swapchain->img_handles = calloc(img_count, sizeof(*swapchain->img_handles));
+        swapchain->imgs = calloc(img_count, sizeof(*swapchain->imgs));
+        if (!swapchain->img_handles || !swapchain->imgs)
+            vk_die("failed to alloc swapchain imgs");
+        swapchain->img_count = img_count;
+    }
+    swapchain->present_sems = calloc(img_count, sizeof(*swapchain->present_sems));
+    if (!swapchain->present_sems)
+        vk_die("failed to alloc swapchain semaphores");
 
     vk->result = vk->GetSwapchainImagesKHR(vk->dev, swapchain->swapchain, &swapchain->img_count,
                                            swapchain->img_handles);
     vk_check(vk, "failed to get swapchain images");
 
+    VkFormatProperties2 fmt_props = {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+    };
+    vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, swapchain->info.imageFormat,
+                                           &fmt_props);
+
     for (uint32_t i = 0; i < swapchain->img_count; i++) {
         struct vk_image *img = &swapchain->imgs[i];
 
-        img->info = (VkImageCreateInfo){
-            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-            .imageType = VK_IMAGE_TYPE_2D,
-            .format = swapchain->info.imageFormat,
-            .extent = {
-                .width = swapchain->info.imageExtent.width,
-                .height = swapchain->info.imageExtent.height,
-                .depth = 1,
+        *img = (struct vk_image){
+            .info = {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                .imageType = VK_IMAGE_TYPE_2D,
+                .format = swapchain->info.imageFormat,
+                .extent = {
+                    .width = swapchain->info.imageExtent.width,
+                    .height = swapchain->info.imageExtent.height,
+                    .depth = 1,
+                },
+                .mipLevels = 1,
+                .arrayLayers = swapchain->info.imageArrayLayers,
+                .samples = VK_SAMPLE_COUNT_1_BIT,
+                .tiling = VK_IMAGE_TILING_OPTIMAL,
+                .usage = swapchain->info.imageUsage,
+                .sharingMode = swapchain->info.imageSharingMode,
+                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
             },
-            .mipLevels = 1,
-            .arrayLayers = swapchain->info.imageArrayLayers,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .tiling = VK_IMAGE_TILING_OPTIMAL,
-            .usage = swapchain->info.imageUsage,
-            .sharingMode = swapchain->info.imageSharingMode,
-            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        };
-
-        VkFormatProperties2 fmt_props = {
-            .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+            .features = fmt_props.formatProperties.optimalTilingFeatures,
         };
-        vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, img->info.format, &fmt_props);
-        img->features = img->info.tiling == VK_IMAGE_TILING_OPTIMAL
-                            ? fmt_props.formatProperties.optimalTilingFeatures
-                            : fmt_props.formatProperties.linearTilingFeatures;
         vk_validate_image(vk, img);
+        vk_init_image_states(vk, img);
 
         img->img = swapchain->img_handles[i];
+
+        const VkSemaphoreCreateInfo sem_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+        vk->result = vk->CreateSemaphore(vk->dev, &sem_info, NULL, &swapchain->present_sems[i]);
+        vk_check(vk, "failed to create present semaphore");
     }
 }
 
+/* Creates a swapchain with up to frame_count frames in flight. */
 static inline struct vk_swapchain *
 vk_create_swapchain(struct vk *vk,
                     VkSurfaceKHR surf,
@@ -1968,20 +6463,23 @@ vk_create_swapchain(struct vk *vk,
                     uint32_t width,
                     uint32_t height,
                     VkPresentModeKHR mode,
-                    VkImageUsageFlags usage)
+                    VkImageUsageFlags usage,
+                    uint32_t frame_count)
 {
-    VkSurfaceCapabilitiesKHR surf_caps;
-    vk->result = vk->GetPhysicalDeviceSurfaceCapabilitiesKHR(vk->physical_dev, surf, &surf_caps);
-    vk_check(vk, "failed to get surface caps");
-
     struct vk_swapchain *swapchain = calloc(1, sizeof(*swapchain));
     if (!swapchain)
         vk_die("failed to alloc swapchain");
 
+    if (!frame_count || frame_count > ARRAY_SIZE(swapchain->frames))
+        vk_die("bad swapchain frame count %u", frame_count);
+
+    swapchain->info.surface = surf;
+    vk_query_swapchain_caps(vk, swapchain);
+
     swapchain->info = (VkSwapchainCreateInfoKHR){
         .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
         .surface = surf,
-        .minImageCount = surf_caps.minImageCount,
+        .minImageCount = swapchain->caps.minImageCount,
         .imageFormat = format,
         .imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
         .imageExtent.width = width,
@@ -1997,23 +6495,40 @@ vk_create_swapchain(struct vk *vk,
     };
     vk_recreate_swapchain(vk, swapchain, width, height);
 
-    const VkFenceCreateInfo fence_create_info = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    };
-    vk->result = vk->CreateFence(vk->dev, &fence_create_info, NULL, &swapchain->fence);
-    vk_check(vk, "failed to create swapchain fence");
+    swapchain->wait_stage = usage == VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                                ? VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    swapchain->frame_count = frame_count;
+    for (uint32_t i = 0; i < frame_count; i++) {
+        const VkSemaphoreCreateInfo sem_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+        vk->result =
+            vk->CreateSemaphore(vk->dev, &sem_info, NULL, &swapchain->frames[i].acquire_sem);
+        vk_check(vk, "failed to create acquire semaphore");
+    }
 
     return swapchain;
 }
 
+/* Acquires the next image.  This blocks only when frame_count frames are
+ * already in flight.  A successful acquisition must be followed by
+ * vk_end_swapchain_cmd and vk_present_swapchain_image.
+ */
 static inline struct vk_image *
 vk_acquire_swapchain_image(struct vk *vk, struct vk_swapchain *swapchain)
 {
+    const struct vk_swapchain_frame *frame = &swapchain->frames[swapchain->frame_cur];
+    vk_wait_point(vk, frame->point);
+
+    vk_collect_retired_swapchains(vk, swapchain, false);
+
     const VkAcquireNextImageInfoKHR info = {
         .sType = VK_STRUCTURE_TYPE_ACQUIRE_NEXT_IMAGE_INFO_KHR,
         .swapchain = swapchain->swapchain,
         .timeout = UINT64_MAX,
-        .fence = swapchain->fence,
+        .semaphore = frame->acquire_sem,
         .deviceMask = 0x1,
     };
     vk->result = vk->AcquireNextImage2KHR(vk->dev, &info, &swapchain->img_cur);
@@ -2021,16 +6536,43 @@ vk_acquire_swapchain_image(struct vk *vk, struct vk_swapchain *swapchain)
     switch (vk->result) {
     case VK_SUCCESS:
     case VK_SUBOPTIMAL_KHR:
-        vk->result = vk->WaitForFences(vk->dev, 1, &swapchain->fence, true, UINT64_MAX);
-        vk_check(vk, "failed to wait for swapchain img");
-        vk->result = vk->ResetFences(vk->dev, 1, &swapchain->fence);
-        vk_check(vk, "failed to reset for swapchain img");
-        return &swapchain->imgs[swapchain->img_cur];
+        break;
     case VK_ERROR_OUT_OF_DATE_KHR:
         return NULL;
     default:
         vk_die("failed to acquire swapchain img");
     }
+
+    /* make the first barrier wait for the acquisition */
+    struct vk_image *img = &swapchain->imgs[swapchain->img_cur];
+    const uint32_t state_count =
+        img->state_aspect_count * img->info.mipLevels * img->info.arrayLayers;
+    for (uint32_t i = 0; i < state_count; i++) {
+        struct vk_image_state *state = &img->states[i];
+        state->write_stage = swapchain->wait_stage;
+        state->write_access = 0;
+        state->read_stage = 0;
+        state->read_access = 0;
+    }
+
+    return img;
+}
+
+/* Submits the current graphics command buffer, which renders to the acquired
+ * image.  The submission waits for the acquisition and signals the semaphore
+ * that the presentation waits for.
+ */
+static inline uint64_t
+vk_end_swapchain_cmd(struct vk *vk, struct vk_swapchain *swapchain)
+{
+    struct vk_swapchain_frame *frame = &swapchain->frames[swapchain->frame_cur];
+    const uint64_t wait_val = 0;
+
+    frame->point = vk_submit_queue_cmd(vk, vk->graphics_queue, &frame->acquire_sem, &wait_val,
+                                       &swapchain->wait_stage, 1,
+                                       swapchain->present_sems[swapchain->img_cur]);
+
+    return frame->point;
 }
 
 static inline VkResult
@@ -2038,11 +6580,17 @@ vk_present_swapchain_image(struct vk *vk, struct vk_swapchain *swapchain)
 {
     const VkPresentInfoKHR present_info = {
         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &swapchain->present_sems[swapchain->img_cur],
         .swapchainCount = 1,
         .pSwapchains = &swapchain->swapchain,
         .pImageIndices = &swapchain->img_cur,
     };
-    vk->result = vk->QueuePresentKHR(vk->queue, &present_info);
+    vk_lock_queues(vk);
+    vk->result = vk->QueuePresentKHR(vk->graphics_queue->queue, &present_info);
+    vk_unlock_queues(vk);
+
+    swapchain->frame_cur = (swapchain->frame_cur + 1) % swapchain->frame_count;
 
     switch (vk->result) {
     case VK_SUCCESS:
@@ -2057,9 +6605,15 @@ vk_present_swapchain_image(struct vk *vk, struct vk_swapchain *swapchain)
 static inline void
 vk_destroy_swapchain(struct vk *vk, struct vk_swapchain *swapchain)
 {
-    vk->DestroyFence(vk->dev, swapchain->fence, NULL);
-    vk->DestroySwapchainKHR(vk->dev, swapchain->swapchain, NULL);
+    /* this also waits for the graphics queue */
+    vk_retire_swapchain(vk, swapchain, swapchain->swapchain);
+    vk_collect_retired_swapchains(vk, swapchain, true);
+
+    for (uint32_t i = 0; i < swapchain->frame_count; i++)
+        vk->DestroySemaphore(vk->dev, swapchain->frames[i].acquire_sem, NULL);
 
+    for (uint32_t i = 0; i < swapchain->img_count; i++)
+        free(swapchain->imgs[i].states);
     free(swapchain->img_handles);
     free(swapchain->imgs);
     free(swapchain);
@@ -13,11 +13,21 @@ struct xfer_test {
     uint32_t img_width;
     uint32_t img_height;
 
+    bool bench;
+    VkDeviceSize bench_min_size;
+    VkDeviceSize bench_max_size;
+    uint32_t bench_iterations;
+    bool bench_host_mem;
+    bool bench_regressed;
+
+    struct vk_queue *queue;
     VkCommandBuffer cmd;
     struct vk_buffer *bufs[4];
     uint32_t buf_count;
     struct vk_image *imgs[4];
     uint32_t img_count;
+    struct vk_transition transitions[4];
+    uint32_t transition_count;
 };
 
 struct xfer_test_format {
@@ -31,7 +41,7 @@ struct xfer_test_format {
     bool ycbcr;
     uint32_t plane_count;
 
-    VkFormatProperties2 props;
+    VkFormatProperties props;
 };
 
 static struct xfer_test_format xfer_test_formats[] = {
@@ -100,12 +110,12 @@ xfer_test_init_formats(struct xfer_test *test)
 {
     struct vk *vk = &test->vk;
 
+    struct vk_format_caps *caps = vk_create_format_caps(vk);
     for (uint32_t i = 0; i < ARRAY_SIZE(xfer_test_formats); i++) {
         struct xfer_test_format *fmt = &xfer_test_formats[i];
-
-        fmt->props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        vk->GetPhysicalDeviceFormatProperties2(vk->physical_dev, fmt->format, &fmt->props);
+        fmt->props = vk_get_format_caps(caps, fmt->format)->props;
     }
+    vk_destroy_format_caps(vk, caps);
 }
 
 static void
@@ -125,11 +135,34 @@ xfer_test_cleanup(struct xfer_test *test)
     vk_cleanup(vk);
 }
 
+static struct vk_queue *
+xfer_test_get_copy_queue(struct xfer_test *test, const struct xfer_test_format *fmt)
+{
+    struct vk *vk = &test->vk;
+    const VkExtent3D *granularity = &vk->transfer_queue->family_props.minImageTransferGranularity;
+
+    /* VUID-vkCmdCopyBufferToImage-commandBuffer-07739
+     * If the queue family used to create the VkCommandPool which
+     * commandBuffer was allocated from does not support
+     * VK_QUEUE_GRAPHICS_BIT, for each element of pRegions, the aspectMask
+     * member of imageSubresource must not be VK_IMAGE_ASPECT_DEPTH_BIT or
+     * VK_IMAGE_ASPECT_STENCIL_BIT
+     *
+     * We also copy partial images, which requires a granularity of 1x1x1.
+     */
+    if (fmt->depth || fmt->stencil || granularity->width != 1 || granularity->height != 1 ||
+        granularity->depth != 1)
+        return vk->graphics_queue;
+
+    return vk->transfer_queue;
+}
+
 static VkCommandBuffer
-xfer_test_begin_cmd(struct xfer_test *test)
+xfer_test_begin_cmd(struct xfer_test *test, struct vk_queue *queue)
 {
     struct vk *vk = &test->vk;
-    test->cmd = vk_begin_cmd(vk);
+    test->queue = queue;
+    test->cmd = vk_begin_queue_cmd(vk, queue);
     return test->cmd;
 }
 
@@ -144,7 +177,14 @@ xfer_test_begin_buffer(struct xfer_test *test, VkBufferUsageFlags usage)
     if (test->buf_count >= ARRAY_SIZE(test->bufs))
         vk_die("too many buffers");
 
-    struct vk_buffer *buf = vk_create_buffer(vk, test->buf_size, usage);
+    /* benchmarked buffers live in device memory unless asked otherwise */
+    struct vk_buffer *buf;
+    if (test->bench && !test->bench_host_mem) {
+        buf = vk_create_buffer_with_flags(vk, test->buf_size, usage,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    } else {
+        buf = vk_create_buffer(vk, test->buf_size, usage);
+    }
     test->bufs[test->buf_count++] = buf;
     return buf;
 }
@@ -155,7 +195,8 @@ xfer_test_begin_image(struct xfer_test *test,
                       VkSampleCountFlagBits samples,
                       VkImageTiling tiling,
                       VkImageUsageFlags usage,
-                      VkImageLayout layout)
+                      VkImageLayout layout,
+                      VkPipelineStageFlags2 stage)
 {
     struct vk *vk = &test->vk;
 
@@ -168,43 +209,45 @@ xfer_test_begin_image(struct xfer_test *test,
     struct vk_image *img = vk_create_image(vk, fmt->format, test->img_width, test->img_height,
                                            samples, tiling, usage);
 
-    VkImageAspectFlags aspect_mask = 0;
-    if (fmt->color)
-        aspect_mask |= VK_IMAGE_ASPECT_COLOR_BIT;
-    if (fmt->depth)
-        aspect_mask |= VK_IMAGE_ASPECT_DEPTH_BIT;
-    if (fmt->stencil)
-        aspect_mask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-
-    const VkImageMemoryBarrier barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = 0,
-        .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = layout,
-        .image = img->img,
-        .subresourceRange = {
-            .aspectMask = aspect_mask,
-            .levelCount = 1,
-            .layerCount = 1,
-        },
+    /* batched by xfer_test_transition_images */
+    test->transitions[test->transition_count++] = (struct vk_transition){
+        .img = img,
+        .discard = true,
+        .layout = layout,
+        .stage = stage,
+        .access = layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL ? VK_ACCESS_2_TRANSFER_READ_BIT
+                                                                 : VK_ACCESS_2_TRANSFER_WRITE_BIT,
     };
-    vk->CmdPipelineBarrier(test->cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                           VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
 
     test->imgs[test->img_count++] = img;
     return img;
 }
 
 static void
-xfer_test_end_all(struct xfer_test *test)
+xfer_test_transition_images(struct xfer_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    vk_cmd_transition(vk, test->cmd, test->transitions, test->transition_count);
+    test->transition_count = 0;
+}
+
+static void
+xfer_test_end_cmd(struct xfer_test *test)
 {
     struct vk *vk = &test->vk;
 
-    vk_end_cmd(vk);
-    vk_wait(vk);
+    const uint64_t point = vk_end_queue_cmd(vk, test->queue, NULL, 0, 0);
+    vk_wait_queue_point(vk, test->queue, point);
 
+    test->queue = NULL;
     test->cmd = NULL;
+}
+
+static void
+xfer_test_destroy_all(struct xfer_test *test)
+{
+    struct vk *vk = &test->vk;
 
     for (uint32_t i = 0; i < test->buf_count; i++)
         vk_destroy_buffer(vk, test->bufs[i]);
@@ -215,12 +258,19 @@ xfer_test_end_all(struct xfer_test *test)
     test->img_count = 0;
 }
 
+static void
+xfer_test_end_all(struct xfer_test *test)
+{
+    xfer_test_end_cmd(test);
+    xfer_test_destroy_all(test);
+}
+
 static void
 xfer_test_draw_fill_buffer(struct xfer_test *test)
 {
     struct vk *vk = &test->vk;
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->transfer_queue);
     struct vk_buffer *buf = xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
     vk->CmdFillBuffer(cmd, buf->buf, 0, VK_WHOLE_SIZE, 0x37);
@@ -234,7 +284,7 @@ xfer_test_draw_update_buffer(struct xfer_test *test)
     struct vk *vk = &test->vk;
     const uint32_t data[] = { 0x37, 0x38, 0x39, 0x40 };
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->transfer_queue);
     struct vk_buffer *buf = xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
     vk->CmdUpdateBuffer(cmd, buf->buf, 0, ARRAY_SIZE(data), data);
@@ -247,7 +297,7 @@ xfer_test_draw_copy_buffer(struct xfer_test *test)
 {
     struct vk *vk = &test->vk;
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->transfer_queue);
     struct vk_buffer *buf = xfer_test_begin_buffer(
         test, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
@@ -418,12 +468,15 @@ xfer_test_draw_copy_image_to_buffer(struct xfer_test *test,
     VkBufferImageCopy regions[4];
     const uint32_t region_count = xfer_test_get_buffer_image_copy(test, fmt, regions);
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, xfer_test_get_copy_queue(test, fmt));
     struct vk_image *img = xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling,
                                                  VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                                                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+                                                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                                 VK_PIPELINE_STAGE_2_COPY_BIT);
     struct vk_buffer *buf = xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
 
+    xfer_test_transition_images(test);
+
     vk->CmdCopyImageToBuffer(cmd, img->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buf->buf,
                              region_count, regions);
 
@@ -443,11 +496,14 @@ xfer_test_draw_copy_buffer_to_image(struct xfer_test *test,
     VkBufferImageCopy regions[4];
     const uint32_t region_count = xfer_test_get_buffer_image_copy(test, fmt, regions);
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, xfer_test_get_copy_queue(test, fmt));
     struct vk_buffer *buf = xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
     struct vk_image *img = xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling,
                                                  VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                 VK_PIPELINE_STAGE_2_COPY_BIT);
+
+    xfer_test_transition_images(test);
 
     vk->CmdCopyBufferToImage(cmd, buf->buf, img->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                              region_count, regions);
@@ -487,10 +543,13 @@ xfer_test_draw_clear_color_image(struct xfer_test *test,
 
     const VkClearColorValue clear = { 0 };
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->compute_queue);
     struct vk_image *img = xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling,
                                                  VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                 VK_PIPELINE_STAGE_2_CLEAR_BIT);
+
+    xfer_test_transition_images(test);
 
     vk->CmdClearColorImage(cmd, img->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear, 1,
                            &region);
@@ -553,10 +612,13 @@ xfer_test_draw_clear_depth_stencil_image(struct xfer_test *test,
         .stencil = 0,
     };
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->graphics_queue);
     struct vk_image *img = xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling,
                                                  VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                 VK_PIPELINE_STAGE_2_CLEAR_BIT);
+
+    xfer_test_transition_images(test);
 
     vk->CmdClearDepthStencilImage(cmd, img->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear,
                                   region_count, regions);
@@ -678,13 +740,17 @@ xfer_test_draw_copy_image(struct xfer_test *test,
                dst_tiling ? "linear" : "optimal");
     }
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, xfer_test_get_copy_queue(test, src_fmt));
     struct vk_image *src_img = xfer_test_begin_image(test, src_fmt, VK_SAMPLE_COUNT_1_BIT,
                                                      src_tiling, VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                                                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+                                                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                                     VK_PIPELINE_STAGE_2_COPY_BIT);
     struct vk_image *dst_img = xfer_test_begin_image(test, dst_fmt, VK_SAMPLE_COUNT_1_BIT,
                                                      dst_tiling, VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                     VK_PIPELINE_STAGE_2_COPY_BIT);
+
+    xfer_test_transition_images(test);
 
     vk->CmdCopyImage(cmd, src_img->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst_img->img,
                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, region_count, regions);
@@ -829,13 +895,17 @@ xfer_test_draw_blit_image(struct xfer_test *test,
      */
     const VkFilter filter = VK_FILTER_NEAREST;
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->graphics_queue);
     struct vk_image *src_img = xfer_test_begin_image(test, src_fmt, VK_SAMPLE_COUNT_1_BIT,
                                                      src_tiling, VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                                                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+                                                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                                     VK_PIPELINE_STAGE_2_BLIT_BIT);
     struct vk_image *dst_img = xfer_test_begin_image(test, dst_fmt, VK_SAMPLE_COUNT_1_BIT,
                                                      dst_tiling, VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                     VK_PIPELINE_STAGE_2_BLIT_BIT);
+
+    xfer_test_transition_images(test);
 
     vk->CmdBlitImage(cmd, src_img->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst_img->img,
                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, region_count, regions, filter);
@@ -862,13 +932,15 @@ xfer_test_draw_resolve_image(struct xfer_test *test,
     if (test->verbose)
         vk_log("  resolve %s image", tiling ? "linear" : "optimal");
 
-    VkCommandBuffer cmd = xfer_test_begin_cmd(test);
+    VkCommandBuffer cmd = xfer_test_begin_cmd(test, vk->graphics_queue);
     struct vk_image *src_img =
         xfer_test_begin_image(test, fmt, samples, tiling, VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                              VK_PIPELINE_STAGE_2_RESOLVE_BIT);
     struct vk_image *dst_img = xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling,
                                                      VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+                                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                     VK_PIPELINE_STAGE_2_RESOLVE_BIT);
 
     /* VUID-VkImageResolve-aspectMask-00266
      * The aspectMask member of srcSubresource and dstSubresource must only
@@ -890,6 +962,8 @@ xfer_test_draw_resolve_image(struct xfer_test *test,
         },
     };
 
+    xfer_test_transition_images(test);
+
     vk->CmdResolveImage(cmd, src_img->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst_img->img,
                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
 
@@ -908,8 +982,8 @@ xfer_test_draw(struct xfer_test *test)
 
     for (uint32_t i = 0; i < ARRAY_SIZE(xfer_test_formats); i++) {
         const struct xfer_test_format *fmt = &xfer_test_formats[i];
-        const VkFormatFeatureFlags linear = fmt->props.formatProperties.linearTilingFeatures;
-        const VkFormatFeatureFlags optimal = fmt->props.formatProperties.optimalTilingFeatures;
+        const VkFormatFeatureFlags linear = fmt->props.linearTilingFeatures;
+        const VkFormatFeatureFlags optimal = fmt->props.optimalTilingFeatures;
         const uint32_t xfer_bits =
             VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
             VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
@@ -947,10 +1021,8 @@ xfer_test_draw(struct xfer_test *test)
         if ((linear | optimal) & VK_FORMAT_FEATURE_TRANSFER_SRC_BIT) {
             for (uint32_t j = 0; j < ARRAY_SIZE(xfer_test_formats); j++) {
                 const struct xfer_test_format *dst_fmt = &xfer_test_formats[j];
-                const VkFormatFeatureFlags dst_linear =
-                    dst_fmt->props.formatProperties.linearTilingFeatures;
-                const VkFormatFeatureFlags dst_optimal =
-                    dst_fmt->props.formatProperties.optimalTilingFeatures;
+                const VkFormatFeatureFlags dst_linear = dst_fmt->props.linearTilingFeatures;
+                const VkFormatFeatureFlags dst_optimal = dst_fmt->props.optimalTilingFeatures;
 
                 if (linear & VK_FORMAT_FEATURE_TRANSFER_SRC_BIT) {
                     if (dst_linear & VK_FORMAT_FEATURE_TRANSFER_DST_BIT) {
@@ -980,10 +1052,8 @@ xfer_test_draw(struct xfer_test *test)
         if ((linear | optimal) & VK_FORMAT_FEATURE_BLIT_SRC_BIT) {
             for (uint32_t j = 0; j < ARRAY_SIZE(xfer_test_formats); j++) {
                 const struct xfer_test_format *dst_fmt = &xfer_test_formats[j];
-                const VkFormatFeatureFlags dst_linear =
-                    dst_fmt->props.formatProperties.linearTilingFeatures;
-                const VkFormatFeatureFlags dst_optimal =
-                    dst_fmt->props.formatProperties.optimalTilingFeatures;
+                const VkFormatFeatureFlags dst_linear = dst_fmt->props.linearTilingFeatures;
+                const VkFormatFeatureFlags dst_optimal = dst_fmt->props.optimalTilingFeatures;
 
                 if (linear & VK_FORMAT_FEATURE_BLIT_SRC_BIT) {
                     if (dst_linear & VK_FORMAT_FEATURE_BLIT_DST_BIT) {
@@ -1037,19 +1107,327 @@ xfer_test_draw(struct xfer_test *test)
     }
 }
 
+enum xfer_test_bench_op {
+    XFER_TEST_BENCH_FILL_BUFFER,
+    XFER_TEST_BENCH_COPY_BUFFER,
+    XFER_TEST_BENCH_COPY_BUFFER_TO_IMAGE,
+    XFER_TEST_BENCH_COPY_IMAGE_TO_BUFFER,
+    XFER_TEST_BENCH_COPY_IMAGE,
+    XFER_TEST_BENCH_BLIT_IMAGE,
+};
+
+static const char *const xfer_test_bench_op_names[] = {
+    [XFER_TEST_BENCH_FILL_BUFFER] = "fill_buffer",
+    [XFER_TEST_BENCH_COPY_BUFFER] = "copy_buffer",
+    [XFER_TEST_BENCH_COPY_BUFFER_TO_IMAGE] = "copy_buffer_to_image",
+    [XFER_TEST_BENCH_COPY_IMAGE_TO_BUFFER] = "copy_image_to_buffer",
+    [XFER_TEST_BENCH_COPY_IMAGE] = "copy_image",
+    [XFER_TEST_BENCH_BLIT_IMAGE] = "blit_image",
+};
+
+static const struct {
+    VkFormat format;
+    uint32_t texel_size;
+} xfer_test_bench_formats[] = {
+    { VK_FORMAT_R8_UNORM, 1 },
+    { VK_FORMAT_R8G8B8A8_UNORM, 4 },
+    { VK_FORMAT_R16G16B16A16_SFLOAT, 8 },
+    { VK_FORMAT_R32G32B32A32_SFLOAT, 16 },
+    { VK_FORMAT_D32_SFLOAT, 4 },
+};
+
+static const struct xfer_test_format *
+xfer_test_find_format(VkFormat format)
+{
+    for (uint32_t i = 0; i < ARRAY_SIZE(xfer_test_formats); i++) {
+        if (xfer_test_formats[i].format == format)
+            return &xfer_test_formats[i];
+    }
+
+    vk_die("unknown format %d", format);
+    return NULL;
+}
+
+static bool
+xfer_test_bench_image_supported(struct xfer_test *test,
+                                const struct xfer_test_format *fmt,
+                                VkImageTiling tiling,
+                                VkFormatFeatureFlags features,
+                                VkImageUsageFlags usage)
+{
+    struct vk *vk = &test->vk;
+
+    const VkFormatFeatureFlags supported = tiling == VK_IMAGE_TILING_LINEAR
+                                               ? fmt->props.linearTilingFeatures
+                                               : fmt->props.optimalTilingFeatures;
+    if ((supported & features) != features)
+        return false;
+
+    VkImageFormatProperties img_props;
+    const VkResult result = vk->GetPhysicalDeviceImageFormatProperties(
+        vk->physical_dev, fmt->format, VK_IMAGE_TYPE_2D, tiling, usage, 0, &img_props);
+
+    return result == VK_SUCCESS && img_props.maxExtent.width >= test->img_width &&
+           img_props.maxExtent.height >= test->img_height &&
+           img_props.maxResourceSize >= test->buf_size;
+}
+
+/* Creates the resources of an op in their final layouts.  Returns false when
+ * the format and tiling do not support the op at the current size.
+ */
+static bool
+xfer_test_bench_setup(struct xfer_test *test,
+                      enum xfer_test_bench_op op,
+                      const struct xfer_test_format *fmt,
+                      VkImageTiling tiling)
+{
+    struct vk *vk = &test->vk;
+    const VkImageUsageFlags usage =
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+    /* images are created with both transfer usages */
+    VkFormatFeatureFlags features =
+        VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    if (op == XFER_TEST_BENCH_BLIT_IMAGE)
+        features |= VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+    if (fmt && !xfer_test_bench_image_supported(test, fmt, tiling, features, usage))
+        return false;
+
+    xfer_test_begin_cmd(test, vk->graphics_queue);
+
+    switch (op) {
+    case XFER_TEST_BENCH_FILL_BUFFER:
+        xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        break;
+    case XFER_TEST_BENCH_COPY_BUFFER:
+        xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+        xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        break;
+    case XFER_TEST_BENCH_COPY_BUFFER_TO_IMAGE:
+        xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+        xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling, usage,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_COPY_BIT);
+        break;
+    case XFER_TEST_BENCH_COPY_IMAGE_TO_BUFFER:
+        xfer_test_begin_buffer(test, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling, usage,
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_2_COPY_BIT);
+        break;
+    case XFER_TEST_BENCH_COPY_IMAGE:
+    case XFER_TEST_BENCH_BLIT_IMAGE: {
+        const VkPipelineStageFlags2 stage = op == XFER_TEST_BENCH_COPY_IMAGE
+                                                ? VK_PIPELINE_STAGE_2_COPY_BIT
+                                                : VK_PIPELINE_STAGE_2_BLIT_BIT;
+        xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling, usage,
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, stage);
+        xfer_test_begin_image(test, fmt, VK_SAMPLE_COUNT_1_BIT, tiling, usage,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, stage);
+    } break;
+    }
+
+    xfer_test_transition_images(test);
+    xfer_test_end_cmd(test);
+
+    return true;
+}
+
+static void
+xfer_test_bench_record(struct xfer_test *test,
+                       enum xfer_test_bench_op op,
+                       const struct xfer_test_format *fmt,
+                       VkCommandBuffer cmd)
+{
+    struct vk *vk = &test->vk;
+
+    const VkImageSubresourceLayers subres = {
+        .aspectMask = fmt && fmt->depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT,
+        .layerCount = 1,
+    };
+    const VkExtent3D extent = {
+        .width = test->img_width,
+        .height = test->img_height,
+        .depth = 1,
+    };
+    const VkBufferImageCopy buf_img_copy = {
+        .imageSubresource = subres,
+        .imageExtent = extent,
+    };
+
+    switch (op) {
+    case XFER_TEST_BENCH_FILL_BUFFER:
+        vk->CmdFillBuffer(cmd, test->bufs[0]->buf, 0, VK_WHOLE_SIZE, 0x37);
+        break;
+    case XFER_TEST_BENCH_COPY_BUFFER: {
+        const VkBufferCopy region = {
+            .size = test->buf_size,
+        };
+        vk->CmdCopyBuffer(cmd, test->bufs[0]->buf, test->bufs[1]->buf, 1, &region);
+    } break;
+    case XFER_TEST_BENCH_COPY_BUFFER_TO_IMAGE:
+        vk->CmdCopyBufferToImage(cmd, test->bufs[0]->buf, test->imgs[0]->img,
+                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &buf_img_copy);
+        break;
+    case XFER_TEST_BENCH_COPY_IMAGE_TO_BUFFER:
+        vk->CmdCopyImageToBuffer(cmd, test->imgs[0]->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                 test->bufs[0]->buf, 1, &buf_img_copy);
+        break;
+    case XFER_TEST_BENCH_COPY_IMAGE: {
+        const VkImageCopy region = {
+            .srcSubresource = subres,
+            .dstSubresource = subres,
+            .extent = extent,
+        };
+        vk->CmdCopyImage(cmd, test->imgs[0]->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         test->imgs[1]->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    } break;
+    case XFER_TEST_BENCH_BLIT_IMAGE: {
+        const VkImageBlit region = {
+            .srcSubresource = subres,
+            .srcOffsets[1] = { (int32_t)extent.width, (int32_t)extent.height, 1 },
+            .dstSubresource = subres,
+            .dstOffsets[1] = { (int32_t)extent.width, (int32_t)extent.height, 1 },
+        };
+        vk->CmdBlitImage(cmd, test->imgs[0]->img, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         test->imgs[1]->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                         VK_FILTER_NEAREST);
+    } break;
+    }
+}
+
+/* Each iteration submits a single command to the graphics queue and waits for
+ * it.  The throughput is derived from the median GPU time, and the overhead
+ * is how much longer the submission took on the CPU.
+ */
+static void
+xfer_test_bench_op(struct xfer_test *test,
+                   enum xfer_test_bench_op op,
+                   const struct xfer_test_format *fmt,
+                   VkImageTiling tiling)
+{
+    struct vk *vk = &test->vk;
+
+    if (!xfer_test_bench_setup(test, op, fmt, tiling))
+        return;
+
+    /* the buffer memory is part of the name; host and device numbers differ wildly */
+    const char *mem = test->bench_host_mem ? "host" : "device";
+    char name[128];
+    if (fmt) {
+        snprintf(name, sizeof(name), "xfer.%s.%s.%s.%s.%" PRIu64, xfer_test_bench_op_names[op],
+                 mem, fmt->name, tiling == VK_IMAGE_TILING_LINEAR ? "linear" : "optimal",
+                 (uint64_t)test->buf_size);
+    } else {
+        snprintf(name, sizeof(name), "xfer.%s.%s.%" PRIu64, xfer_test_bench_op_names[op], mem,
+                 (uint64_t)test->buf_size);
+    }
+
+    const struct vk_bench_params params = {
+        .name = name,
+        .warmup_iterations = 2,
+        .iterations = test->bench_iterations,
+        .gpu = true,
+    };
+    struct vk_bench *bench = vk_create_bench(vk, &params);
+    while (vk_bench_next(vk, bench)) {
+        VkCommandBuffer cmd = vk_begin_cmd(vk);
+        vk_bench_cmd_begin(vk, bench, cmd);
+        xfer_test_bench_record(test, op, fmt, cmd);
+        vk_bench_cmd_end(vk, bench, cmd);
+        vk_end_cmd(vk);
+        vk_wait(vk);
+    }
+
+    if (!vk_bench_report(vk, bench))
+        test->bench_regressed = true;
+
+    /* bytes per ns is GB/s */
+    const double gpu_ns = bench->gpu.median;
+    if (gpu_ns > 0.0) {
+        vk_log("  %.2f GB/s, %.1f us overhead", (double)test->buf_size / gpu_ns,
+               (bench->cpu.median - gpu_ns) / 1000.0);
+    }
+
+    vk_destroy_bench(vk, bench);
+    xfer_test_destroy_all(test);
+}
+
+static void
+xfer_test_bench(struct xfer_test *test)
+{
+    for (VkDeviceSize size = test->bench_min_size; size <= test->bench_max_size; size *= 4) {
+        test->buf_size = size;
+
+        xfer_test_bench_op(test, XFER_TEST_BENCH_FILL_BUFFER, NULL, VK_IMAGE_TILING_OPTIMAL);
+        xfer_test_bench_op(test, XFER_TEST_BENCH_COPY_BUFFER, NULL, VK_IMAGE_TILING_OPTIMAL);
+
+        for (uint32_t i = 0; i < ARRAY_SIZE(xfer_test_bench_formats); i++) {
+            const struct xfer_test_format *fmt =
+                xfer_test_find_format(xfer_test_bench_formats[i].format);
+            const VkDeviceSize texel_count = size / xfer_test_bench_formats[i].texel_size;
+            if (!texel_count)
+                continue;
+
+            /* the sizes are powers of two; make the image as square as possible */
+            const uint32_t texel_bits = (uint32_t)__builtin_ctzll(texel_count);
+            test->img_width = 1u << ((texel_bits + 1) / 2);
+            test->img_height = 1u << (texel_bits / 2);
+
+            const VkImageTiling tilings[] = { VK_IMAGE_TILING_LINEAR, VK_IMAGE_TILING_OPTIMAL };
+            for (uint32_t j = 0; j < ARRAY_SIZE(tilings); j++) {
+                xfer_test_bench_op(test, XFER_TEST_BENCH_COPY_BUFFER_TO_IMAGE, fmt, tilings[j]);
+                xfer_test_bench_op(test, XFER_TEST_BENCH_COPY_IMAGE_TO_BUFFER, fmt, tilings[j]);
+                xfer_test_bench_op(test, XFER_TEST_BENCH_COPY_IMAGE, fmt, tilings[j]);
+                xfer_test_bench_op(test, XFER_TEST_BENCH_BLIT_IMAGE, fmt, tilings[j]);
+            }
+        }
+    }
+}
+
 int
-main(void)
+main(int argc, const char **argv)
 {
     struct xfer_test test = {
         .verbose = true,
         .buf_size = 4096,
         .img_width = 32,
         .img_height = 32,
+
+        .bench_min_size = 4 * 1024,
+        .bench_max_size = 256 * 1024 * 1024,
+        .bench_iterations = 20,
     };
 
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "bench")) {
+            test.bench = true;
+        } else if (!strncmp(argv[i], "min_size=", 9)) {
+            test.bench_min_size = strtoull(argv[i] + 9, NULL, 0);
+        } else if (!strncmp(argv[i], "max_size=", 9)) {
+            test.bench_max_size = strtoull(argv[i] + 9, NULL, 0);
+        } else if (!strncmp(argv[i], "iterations=", 11)) {
+            test.bench_iterations = atoi(argv[i] + 11);
+            if (!test.bench_iterations)
+                vk_die("invalid iteration count %s", argv[i] + 11);
+        } else if (!strcmp(argv[i], "mem=host")) {
+            test.bench_host_mem = true;
+        } else if (!strcmp(argv[i], "mem=device")) {
+            test.bench_host_mem = false;
+        } else {
+            vk_die("unknown option %s", argv[i]);
+        }
+    }
+
+    if (!test.bench_min_size || (test.bench_min_size & (test.bench_min_size - 1)))
+        vk_die("min_size must be a power of two");
+    if (test.bench_max_size < test.bench_min_size)
+        vk_die("max_size must not be below min_size");
+
     xfer_test_init(&test);
-    xfer_test_draw(&test);
+    if (test.bench)
+        xfer_test_bench(&test);
+    else
+        xfer_test_draw(&test);
     xfer_test_cleanup(&test);
 
-    return 0;
+    return test.bench_regressed;
 }
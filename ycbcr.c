@@ -13,6 +13,10 @@ static const uint32_t ycbcr_test_fs[] = {
 #include "ycbcr_test.frag.inc"
 };
 
+static const uint32_t ycbcr_test_cs[] = {
+#include "ycbcr_test.comp.inc"
+};
+
 /* for ycbcr_test_ppm */
 #include "ycbcr_test.ppm.inc"
 
@@ -27,7 +31,16 @@ struct ycbcr_test {
     VkFormat color_format;
     uint32_t width;
     uint32_t height;
+    /* PPM, NV12, or RGBA file; the embedded PPM is used when NULL */
+    const char *input;
+    uint32_t input_width;
+    uint32_t input_height;
+    /* NV12 or RGBA inputs need no conversion */
+    bool input_raw;
     bool planar;
+    bool gpu_convert;
+    /* time both conversions; gpu_convert picks the one that is drawn */
+    bool convert_both;
     VkFilter minmag_filter;
     VkChromaLocation chroma_loc;
     VkFilter chroma_filter;
@@ -95,13 +108,192 @@ ycbcr_test_init_framebuffer(struct ycbcr_test *test)
                                      VK_ATTACHMENT_STORE_OP_STORE);
 }
 
+static struct vk_pipeline *
+ycbcr_test_create_convert_pipeline(struct ycbcr_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    struct vk_pipeline *pipeline = vk_create_pipeline(vk);
+    vk_add_pipeline_shader(vk, pipeline, VK_SHADER_STAGE_COMPUTE_BIT, ycbcr_test_cs,
+                           sizeof(ycbcr_test_cs));
+    vk_add_pipeline_set_layout(vk, pipeline, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                               VK_SHADER_STAGE_COMPUTE_BIT, NULL);
+    vk_set_pipeline_push_const(vk, pipeline, VK_SHADER_STAGE_COMPUTE_BIT, sizeof(uint32_t) * 4);
+    vk_setup_pipeline(vk, pipeline, NULL);
+    vk_compile_pipeline(vk, pipeline);
+
+    return pipeline;
+}
+
+/* Uploads the RGB data and converts it to NV12 with a compute shader.  The
+ * planes are written to a buffer and copied to an optimal image.
+ */
+static struct vk_image *
+ycbcr_test_convert_ppm_on_gpu(struct ycbcr_test *test, struct vk_pipeline *pipeline)
+{
+    struct vk *vk = &test->vk;
+
+    const void *ppm_data = ycbcr_test_ppm;
+    size_t ppm_size = ARRAY_SIZE(ycbcr_test_ppm);
+    if (test->input)
+        ppm_data = vk_map_file(test->input, &ppm_size);
+
+    int width;
+    int height;
+    const uint8_t *rgb_data = vk_parse_ppm(ppm_data, ppm_size, &width, &height);
+    if (width % 4 || height % 2)
+        vk_die("gpu conversion requires 4x2-aligned images");
+
+    const VkDeviceSize rgb_size = (VkDeviceSize)width * height * 3;
+    const VkDeviceSize y_size = (VkDeviceSize)width * height;
+    const VkDeviceSize uv_size = y_size / 2;
+    struct vk_buffer *buf =
+        vk_create_buffer(vk, rgb_size + y_size + uv_size,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    vk_write_buffer(vk, buf, 0, rgb_data, rgb_size);
+    if (test->input)
+        vk_unmap_file(ppm_data, ppm_size);
+
+    struct vk_image *img =
+        vk_create_image(vk, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, width, height,
+                        VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL,
+                        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+
+    struct vk_descriptor_set *set = vk_create_descriptor_set(vk, pipeline->set_layouts[0]);
+    vk_write_descriptor_set_buffer(vk, set, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, buf,
+                                   VK_WHOLE_SIZE);
+
+    VkCommandBuffer cmd = vk_begin_cmd(vk);
+
+    const uint32_t consts[4] = {
+        width,
+        height,
+        rgb_size / 4,
+        (rgb_size + y_size) / 4,
+    };
+    vk->CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
+    vk->CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline_layout, 0,
+                              1, &set->set, 0, NULL);
+    vk->CmdPushConstants(cmd, pipeline->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(consts), consts);
+    vk->CmdDispatch(cmd, (width / 4 + 7) / 8, (height / 2 + 7) / 8, 1);
+
+    /* make the planes available to the copies and prepare the image */
+    const VkMemoryBarrier2 mem_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+    };
+    const struct vk_transition transition = {
+        .img = img,
+        .discard = true,
+        .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .stage = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .access = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+    };
+    VkImageMemoryBarrier2 img_barrier;
+    const uint32_t img_barrier_count =
+        vk_build_transition_barriers(vk, &transition, 1, &img_barrier, 1);
+    vk_cmd_barriers(vk, cmd, &mem_barrier, &img_barrier, img_barrier_count);
+
+    const VkBufferImageCopy regions[2] = {
+        [0] = {
+            .bufferOffset = rgb_size,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT,
+                .layerCount = 1,
+            },
+            .imageExtent = {
+                .width = width,
+                .height = height,
+                .depth = 1,
+            },
+        },
+        [1] = {
+            .bufferOffset = rgb_size + y_size,
+            .imageSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT,
+                .layerCount = 1,
+            },
+            .imageExtent = {
+                .width = width / 2,
+                .height = height / 2,
+                .depth = 1,
+            },
+        },
+    };
+    vk->CmdCopyBufferToImage(cmd, buf->buf, img->img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                             ARRAY_SIZE(regions), regions);
+
+    vk_end_cmd(vk);
+    vk_wait(vk);
+
+    vk_destroy_descriptor_set(vk, set);
+    vk_destroy_buffer(vk, buf);
+
+    return img;
+}
+
+static struct vk_image *
+ycbcr_test_convert_ppm_on_cpu(struct ycbcr_test *test)
+{
+    struct vk *vk = &test->vk;
+
+    if (test->input)
+        return vk_create_image_from_file(vk, test->input, test->planar, 0, 0);
+
+    return vk_create_image_from_ppm(vk, ycbcr_test_ppm, ARRAY_SIZE(ycbcr_test_ppm),
+                                    test->planar);
+}
+
+/* The times include the image creation and the upload.  The GPU conversion
+ * excludes the pipeline creation, which is logged on its own.
+ */
 static void
 ycbcr_test_init_texture(struct ycbcr_test *test)
 {
     struct vk *vk = &test->vk;
 
-    test->tex =
-        vk_create_image_from_ppm(vk, ycbcr_test_ppm, ARRAY_SIZE(ycbcr_test_ppm), test->planar);
+    if (test->input_raw) {
+        const uint64_t begin = vk_now();
+        test->tex = vk_create_image_from_file(vk, test->input, test->planar, test->input_width,
+                                              test->input_height);
+        vk_log("raw upload took %.3f ms", (double)(vk_now() - begin) / 1000000.0);
+    } else {
+        struct vk_image *cpu_tex = NULL;
+        if (!test->gpu_convert || test->convert_both) {
+            const uint64_t begin = vk_now();
+            cpu_tex = ycbcr_test_convert_ppm_on_cpu(test);
+            vk_log("cpu conversion took %.3f ms", (double)(vk_now() - begin) / 1000000.0);
+        }
+
+        struct vk_image *gpu_tex = NULL;
+        if (test->gpu_convert || test->convert_both) {
+            uint64_t begin = vk_now();
+            struct vk_pipeline *pipeline = ycbcr_test_create_convert_pipeline(test);
+            vk_log("gpu conversion pipeline took %.3f ms",
+                   (double)(vk_now() - begin) / 1000000.0);
+
+            begin = vk_now();
+            gpu_tex = ycbcr_test_convert_ppm_on_gpu(test, pipeline);
+            vk_log("gpu conversion took %.3f ms", (double)(vk_now() - begin) / 1000000.0);
+
+            vk_destroy_pipeline(vk, pipeline);
+        }
+
+        if (test->gpu_convert) {
+            test->tex = gpu_tex;
+            if (cpu_tex)
+                vk_destroy_image(vk, cpu_tex);
+        } else {
+            test->tex = cpu_tex;
+            if (gpu_tex)
+                vk_destroy_image(vk, gpu_tex);
+        }
+    }
+
     if (test->planar) {
         if (test->chroma_filter != test->minmag_filter &&
             !(test->tex->features &
@@ -120,7 +312,7 @@ ycbcr_test_init_vb(struct ycbcr_test *test)
 
     test->vb =
         vk_create_buffer(vk, sizeof(ycbcr_test_vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
-    memcpy(test->vb->mem_ptr, ycbcr_test_vertices, sizeof(ycbcr_test_vertices));
+    vk_write_buffer(vk, test->vb, 0, ycbcr_test_vertices, sizeof(ycbcr_test_vertices));
 }
 
 static void
@@ -226,23 +418,15 @@ ycbcr_test_draw_prep_texture(struct ycbcr_test *test, VkCommandBuffer cmd)
 {
     struct vk *vk = &test->vk;
 
-    const VkImageSubresourceRange subres_range = {
-        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-        .levelCount = 1,
-        .layerCount = 1,
-    };
-    const VkImageMemoryBarrier barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_PREINITIALIZED,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .image = test->tex->img,
-        .subresourceRange = subres_range,
-    };
-
-    vk->CmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                           0, 0, NULL, 0, NULL, 1, &barrier);
+    /* from PREINITIALIZED or TRANSFER_DST_OPTIMAL, depending on the conversion */
+    vk_cmd_transition(vk, cmd,
+                      &(struct vk_transition){
+                          .img = test->tex,
+                          .layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                          .stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                          .access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                      },
+                      1);
 }
 
 static void
@@ -279,6 +463,18 @@ main(int argc, const char **argv)
             test.planar = true;
         else if (!strcmp(argv[i], "rgb"))
             test.planar = false;
+        else if (!strcmp(argv[i], "cpu_convert"))
+            test.gpu_convert = false;
+        else if (!strcmp(argv[i], "gpu_convert"))
+            test.gpu_convert = true;
+        else if (!strcmp(argv[i], "convert_both"))
+            test.convert_both = true;
+        else if (!strncmp(argv[i], "input=", 6))
+            test.input = argv[i] + 6;
+        else if (!strncmp(argv[i], "input_size=", 11)) {
+            if (sscanf(argv[i] + 11, "%ux%u", &test.input_width, &test.input_height) != 2)
+                vk_die("invalid input size %s", argv[i] + 11);
+        }
         else if (!strcmp(argv[i], "minmag_nearest"))
             test.minmag_filter = VK_FILTER_NEAREST;
         else if (!strcmp(argv[i], "minmag_linear"))
@@ -295,6 +491,28 @@ main(int argc, const char **argv)
             vk_die("unknown option %s", argv[i]);
     }
 
+    /* raw inputs determine the format */
+    const char *ext = test.input ? strrchr(test.input, '.') : NULL;
+    if (ext && !strcmp(ext, ".nv12")) {
+        test.planar = true;
+        test.input_raw = true;
+    } else if (ext && !strcmp(ext, ".rgba")) {
+        test.planar = false;
+        test.input_raw = true;
+    } else if (test.input && (!ext || strcmp(ext, ".ppm"))) {
+        vk_die("unknown file type of %s", test.input);
+    }
+
+    /* raw files have no header */
+    if (test.input_raw && (!test.input_width || !test.input_height))
+        vk_die("%s requires input_size=<width>x<height>", test.input);
+    if (test.input_raw && (test.gpu_convert || test.convert_both))
+        vk_die("%s is already converted; gpu_convert takes only PPM input", test.input);
+
+    /* the compute shader only converts to NV12 */
+    if ((test.gpu_convert || test.convert_both) && !test.planar)
+        vk_die("gpu conversion requires a planar format");
+
     ycbcr_test_init(&test);
     ycbcr_test_draw(&test);
     ycbcr_test_cleanup(&test);